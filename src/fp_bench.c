@@ -0,0 +1,477 @@
+/**
+ * @file fp_bench.c
+ * @brief Latency benchmark for Xiaomi FPC Fingerprint Scanner
+ * @author Project contributors
+ * @version 1.0.0
+ *
+ * Runs a fixed number of captures, verifies and identifies through
+ * libfp_xiaomi and prints one JSON object per operation with latency
+ * percentiles, throughput and CPU time. The output doubles as a
+ * baseline file: run with -s to save one, and with -b to compare a new
+ * kernel or firmware against it. The exit status is 2 if any percentile
+ * regressed by more than the allowed margin.
+ *
+ * @copyright GPL v2 License
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "libfp_xiaomi.h"
+
+#define BENCH_DEFAULT_ITERATIONS  50
+#define BENCH_DEFAULT_WARMUP      2
+#define BENCH_DEFAULT_MARGIN      10.0
+#define BENCH_LINE_MAX            512
+
+typedef enum {
+    BENCH_CAPTURE,
+    BENCH_FRAME,
+    BENCH_VERIFY,
+    BENCH_IDENTIFY,
+    BENCH_OPS
+} bench_op_t;
+
+static const char * const bench_op_names[BENCH_OPS] = {
+    [BENCH_CAPTURE] = "capture",
+    [BENCH_FRAME] = "frame",
+    [BENCH_VERIFY] = "verify",
+    [BENCH_IDENTIFY] = "identify",
+};
+
+typedef struct {
+    bench_op_t op;
+    int iterations;
+    int ok;
+    int errors;
+    int last_error;
+    double p50_us;
+    double p95_us;
+    double p99_us;
+    double mean_us;
+    double max_us;
+    double ops_per_sec;
+    double cpu_us_per_op;
+} bench_result_t;
+
+static fp_xiaomi_device_t *device;
+static uint8_t verify_id;
+static uint32_t timeout_ms;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [OPTIONS]\n"
+            "\n"
+            "Options:\n"
+            "  -d PATH     Device node (default: auto-detect)\n"
+            "  -n COUNT    Measured iterations per operation (default %d)\n"
+            "  -w COUNT    Unmeasured warm-up iterations (default %d)\n"
+            "  -o OPS      Comma-separated operations: capture,frame,verify,identify\n"
+            "              (default: all)\n"
+            "  -t ID       Template ID for verify (default: first stored template)\n"
+            "  -T MS       Per-operation timeout in milliseconds (default: library default)\n"
+            "  -b FILE     Compare against a baseline written by -s\n"
+            "  -m PERCENT  Allowed regression before failing (default %.0f)\n"
+            "  -s FILE     Save this run as a baseline\n"
+            "\n"
+            "Set FP_XIAOMI_REPLAY=TRACE to run against a recording instead of the sensor\n"
+            "(FP_XIAOMI_REPLAY_FAST=1 skips the recorded delays).\n",
+            prog, BENCH_DEFAULT_ITERATIONS, BENCH_DEFAULT_WARMUP, BENCH_DEFAULT_MARGIN);
+}
+
+static double timespec_us(const struct timespec *ts)
+{
+    return ts->tv_sec * 1e6 + ts->tv_nsec / 1e3;
+}
+
+static double now_us(clockid_t clock)
+{
+    struct timespec ts;
+    
+    clock_gettime(clock, &ts);
+    return timespec_us(&ts);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile over sorted samples */
+static double percentile(const double *sorted, int count, double pct)
+{
+    int rank;
+    
+    if (count == 0) {
+        return 0;
+    }
+    
+    rank = (int)(pct / 100.0 * count + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return sorted[(rank > count ? count : rank) - 1];
+}
+
+/* One operation; NO_MATCH is a completed match, not a failure */
+static int run_once(bench_op_t op)
+{
+    fp_xiaomi_image_t image;
+    fp_xiaomi_frame_t frame;
+    uint8_t matched_id, confidence;
+    int ret;
+    
+    switch (op) {
+    case BENCH_CAPTURE:
+        ret = fp_xiaomi_capture_image(device, &image);
+        if (ret == FP_XIAOMI_SUCCESS) {
+            fp_xiaomi_free_image(&image);
+        }
+        return ret;
+    
+    case BENCH_FRAME:
+        ret = fp_xiaomi_capture_frame(device, &frame);
+        if (ret == FP_XIAOMI_SUCCESS) {
+            fp_xiaomi_release_frame(device, &frame);
+        }
+        return ret;
+    
+    case BENCH_VERIFY:
+        ret = fp_xiaomi_verify(device, verify_id, timeout_ms);
+        return ret == FP_XIAOMI_ERROR_NO_MATCH ? FP_XIAOMI_SUCCESS : ret;
+    
+    case BENCH_IDENTIFY:
+        ret = fp_xiaomi_identify(device, &matched_id, &confidence, timeout_ms);
+        return ret == FP_XIAOMI_ERROR_NO_MATCH ? FP_XIAOMI_SUCCESS : ret;
+    
+    default:
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+}
+
+static int run_op(bench_op_t op, int iterations, int warmup, bench_result_t *result)
+{
+    double wall_start, cpu_start, wall_total, start, sum = 0;
+    double *samples;
+    int i, ret;
+    
+    memset(result, 0, sizeof(*result));
+    result->op = op;
+    result->iterations = iterations;
+    
+    samples = calloc(iterations, sizeof(*samples));
+    if (!samples) {
+        return -1;
+    }
+    
+    for (i = 0; i < warmup; i++) {
+        run_once(op);
+    }
+    
+    wall_start = now_us(CLOCK_MONOTONIC);
+    cpu_start = now_us(CLOCK_PROCESS_CPUTIME_ID);
+    
+    for (i = 0; i < iterations; i++) {
+        start = now_us(CLOCK_MONOTONIC);
+        ret = run_once(op);
+        if (ret != FP_XIAOMI_SUCCESS) {
+            result->errors++;
+            result->last_error = ret;
+            continue;
+        }
+        samples[result->ok] = now_us(CLOCK_MONOTONIC) - start;
+        sum += samples[result->ok];
+        result->ok++;
+    }
+    
+    wall_total = now_us(CLOCK_MONOTONIC) - wall_start;
+    result->cpu_us_per_op = (now_us(CLOCK_PROCESS_CPUTIME_ID) - cpu_start) / iterations;
+    
+    qsort(samples, result->ok, sizeof(*samples), compare_double);
+    result->p50_us = percentile(samples, result->ok, 50);
+    result->p95_us = percentile(samples, result->ok, 95);
+    result->p99_us = percentile(samples, result->ok, 99);
+    result->mean_us = result->ok ? sum / result->ok : 0;
+    result->max_us = result->ok ? samples[result->ok - 1] : 0;
+    result->ops_per_sec = wall_total > 0 ? result->ok * 1e6 / wall_total : 0;
+    
+    free(samples);
+    return 0;
+}
+
+static void print_result(FILE *out, const bench_result_t *r)
+{
+    fprintf(out,
+            "{\"op\":\"%s\",\"iterations\":%d,\"ok\":%d,\"errors\":%d,"
+            "\"p50_us\":%.1f,\"p95_us\":%.1f,\"p99_us\":%.1f,\"mean_us\":%.1f,"
+            "\"max_us\":%.1f,\"ops_per_sec\":%.3f,\"cpu_us_per_op\":%.1f",
+            bench_op_names[r->op], r->iterations, r->ok, r->errors,
+            r->p50_us, r->p95_us, r->p99_us, r->mean_us,
+            r->max_us, r->ops_per_sec, r->cpu_us_per_op);
+    if (r->errors) {
+        fprintf(out, ",\"last_error\":\"%s\"", fp_xiaomi_get_error_string(r->last_error));
+    }
+    fprintf(out, "}\n");
+}
+
+static int json_number(const char *line, const char *key, double *value)
+{
+    char pattern[64];
+    const char *p;
+    
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    p = strstr(line, pattern);
+    if (!p) {
+        return -1;
+    }
+    
+    *value = strtod(p + strlen(pattern), NULL);
+    return 0;
+}
+
+/* Find the baseline line for op; 0 if found */
+static int load_baseline(const char *path, bench_op_t op, bench_result_t *base)
+{
+    char line[BENCH_LINE_MAX];
+    char pattern[64];
+    FILE *f;
+    int ret = -1;
+    
+    f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+    
+    snprintf(pattern, sizeof(pattern), "\"op\":\"%s\"", bench_op_names[op]);
+    memset(base, 0, sizeof(*base));
+    
+    while (fgets(line, sizeof(line), f)) {
+        if (!strstr(line, pattern)) {
+            continue;
+        }
+        if (json_number(line, "p50_us", &base->p50_us) == 0 &&
+            json_number(line, "p95_us", &base->p95_us) == 0 &&
+            json_number(line, "p99_us", &base->p99_us) == 0 &&
+            json_number(line, "cpu_us_per_op", &base->cpu_us_per_op) == 0) {
+            base->op = op;
+            ret = 0;
+        }
+        break;
+    }
+    
+    fclose(f);
+    return ret;
+}
+
+/* Print one comparison per metric; returns the number of regressions */
+static int compare_result(const bench_result_t *cur, const bench_result_t *base, double margin)
+{
+    static const char * const metrics[] = { "p50_us", "p95_us", "p99_us", "cpu_us_per_op" };
+    const double current[] = { cur->p50_us, cur->p95_us, cur->p99_us, cur->cpu_us_per_op };
+    const double baseline[] = { base->p50_us, base->p95_us, base->p99_us, base->cpu_us_per_op };
+    double change;
+    bool regressed;
+    int regressions = 0;
+    size_t i;
+    
+    for (i = 0; i < sizeof(metrics) / sizeof(metrics[0]); i++) {
+        change = baseline[i] > 0 ? (current[i] - baseline[i]) * 100.0 / baseline[i] : 0;
+        regressed = cur->ok > 0 && change > margin;
+        regressions += regressed;
+        printf("{\"op\":\"%s\",\"metric\":\"%s\",\"baseline\":%.1f,\"current\":%.1f,"
+               "\"change_pct\":%.1f,\"regression\":%s}\n",
+               bench_op_names[cur->op], metrics[i], baseline[i], current[i],
+               change, regressed ? "true" : "false");
+    }
+    
+    return regressions;
+}
+
+static int parse_ops(const char *list, bool *enabled)
+{
+    char *copy, *token, *save = NULL;
+    int op, found = 0;
+    
+    copy = strdup(list);
+    if (!copy) {
+        return -1;
+    }
+    
+    memset(enabled, 0, BENCH_OPS * sizeof(*enabled));
+    for (token = strtok_r(copy, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+        for (op = 0; op < BENCH_OPS; op++) {
+            if (strcmp(token, bench_op_names[op]) == 0) {
+                enabled[op] = true;
+                found++;
+                break;
+            }
+        }
+        if (op == BENCH_OPS) {
+            fprintf(stderr, "Unknown operation: %s\n", token);
+            free(copy);
+            return -1;
+        }
+    }
+    
+    free(copy);
+    return found ? 0 : -1;
+}
+
+/* Verify needs a stored template; pick the first one if none was given */
+static bool pick_verify_template(void)
+{
+    uint8_t ids[FP_XIAOMI_MAX_TEMPLATES];
+    size_t count = FP_XIAOMI_MAX_TEMPLATES;
+    
+    if (verify_id) {
+        return true;
+    }
+    
+    if (fp_xiaomi_list_templates(device, ids, &count) != FP_XIAOMI_SUCCESS || count == 0) {
+        return false;
+    }
+    
+    verify_id = ids[0];
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *device_path = NULL;
+    const char *baseline_path = NULL;
+    const char *save_path = NULL;
+    bool enabled[BENCH_OPS] = { true, true, true, true };
+    double margin = BENCH_DEFAULT_MARGIN;
+    int iterations = BENCH_DEFAULT_ITERATIONS;
+    int warmup = BENCH_DEFAULT_WARMUP;
+    bench_result_t result, base;
+    FILE *save = NULL;
+    int regressions = 0;
+    int status = 0;
+    int opt, op;
+    
+    while ((opt = getopt(argc, argv, "d:n:w:o:t:T:b:m:s:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            device_path = optarg;
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 'o':
+            if (parse_ops(optarg, enabled) != 0) {
+                return 1;
+            }
+            break;
+        case 't':
+            verify_id = (uint8_t)atoi(optarg);
+            break;
+        case 'T':
+            timeout_ms = (uint32_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            baseline_path = optarg;
+            break;
+        case 'm':
+            margin = strtod(optarg, NULL);
+            break;
+        case 's':
+            save_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    
+    if (iterations <= 0 || warmup < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    if (fp_xiaomi_init() != FP_XIAOMI_SUCCESS) {
+        fprintf(stderr, "Failed to initialize library\n");
+        return 1;
+    }
+    
+    device = fp_xiaomi_open_device(device_path);
+    if (!device) {
+        fprintf(stderr, "Failed to open device: %s\n", strerror(errno));
+        fp_xiaomi_cleanup();
+        return 1;
+    }
+    
+    if (enabled[BENCH_FRAME] && fp_xiaomi_map_frames(device) != FP_XIAOMI_SUCCESS) {
+        fprintf(stderr, "Frame ring unavailable, skipping frame\n");
+        enabled[BENCH_FRAME] = false;
+    }
+    
+    if (enabled[BENCH_VERIFY] && !pick_verify_template()) {
+        fprintf(stderr, "No stored template, skipping verify\n");
+        enabled[BENCH_VERIFY] = false;
+    }
+    
+    if (save_path) {
+        save = fopen(save_path, "w");
+        if (!save) {
+            fprintf(stderr, "%s: %s\n", save_path, strerror(errno));
+            status = 1;
+            goto out;
+        }
+    }
+    
+    for (op = 0; op < BENCH_OPS; op++) {
+        if (!enabled[op]) {
+            continue;
+        }
+    
+        if (run_op(op, iterations, warmup, &result) != 0) {
+            fprintf(stderr, "Out of memory\n");
+            status = 1;
+            goto out;
+        }
+    
+        print_result(stdout, &result);
+        fflush(stdout);
+        if (save) {
+            print_result(save, &result);
+        }
+    
+        if (baseline_path) {
+            if (load_baseline(baseline_path, op, &base) == 0) {
+                regressions += compare_result(&result, &base, margin);
+            } else {
+                fprintf(stderr, "%s: no baseline for %s\n", baseline_path, bench_op_names[op]);
+            }
+        }
+    
+        if (result.ok == 0) {
+            status = 1;
+        }
+    }
+    
+    if (regressions) {
+        status = 2;
+    }
+    
+out:
+    if (save) {
+        fclose(save);
+    }
+    fp_xiaomi_close_device(device);
+    fp_xiaomi_cleanup();
+    return status;
+}
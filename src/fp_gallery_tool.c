@@ -0,0 +1,356 @@
+/**
+ * @file fp_gallery_tool.c
+ * @brief Gallery file maintenance tool for Xiaomi FPC Fingerprint Scanner
+ * @author Project contributors
+ * @version 1.0.0
+ *
+ * Converts between libfp_xiaomi gallery files and libfprint serialized
+ * prints ("FP1" + GVariant, as written by fp_print_serialize()), so an
+ * existing fprintd print store can be loaded as one mapped gallery.
+ *
+ * @copyright GPL v2 License
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+
+#include "libfp_xiaomi.h"
+
+/* libfprint serialization constants (fp-print.c) */
+#define FP_PRINT_MAGIC          "FP1"
+#define FP_PRINT_MAGIC_LEN      3
+#define FP_PRINT_VARIANT_TYPE   "(issbymsmsia{sv}v)"
+#define FPI_PRINT_RAW           1
+#define FP_FINGER_UNKNOWN       0
+#define DRIVER_ID               "xiaomi_fpc"
+#define DRIVER_DATA_TYPE        "(yay)"
+
+static const char *device_id = "";
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [--device-id ID] COMMAND GALLERY [ARGS...]\n"
+            "\n"
+            "Commands:\n"
+            "  create GALLERY             Create an empty gallery file\n"
+            "  list GALLERY               List templates in a gallery\n"
+            "  verify GALLERY             Check gallery header and data CRC\n"
+            "  import GALLERY PRINT...    Add libfprint print files to a gallery\n"
+            "  export GALLERY DIR         Write each template as a libfprint print\n",
+            prog);
+}
+
+/* Parse one serialized print and add its template under id */
+static int import_print(fp_xiaomi_gallery_t *gallery, const char *path, uint32_t id)
+{
+    fp_xiaomi_template_t template;
+    GError *error = NULL;
+    GVariant *print, *data, *extra;
+    const char *driver, *dev_id;
+    const char *username, *description;
+    const guint8 *bytes;
+    gboolean stored;
+    gchar *contents;
+    gsize length, size;
+    guint8 finger;
+    gint32 type, date;
+    int ret;
+    
+    if (!g_file_get_contents(path, &contents, &length, &error)) {
+        fprintf(stderr, "%s: %s\n", path, error->message);
+        g_error_free(error);
+        return -1;
+    }
+    
+    if (length < FP_PRINT_MAGIC_LEN || memcmp(contents, FP_PRINT_MAGIC, FP_PRINT_MAGIC_LEN) != 0) {
+        fprintf(stderr, "%s: not a libfprint print\n", path);
+        g_free(contents);
+        return -1;
+    }
+    
+    print = g_variant_new_from_data(G_VARIANT_TYPE(FP_PRINT_VARIANT_TYPE),
+                                    contents + FP_PRINT_MAGIC_LEN,
+                                    length - FP_PRINT_MAGIC_LEN, FALSE, g_free, contents);
+    g_variant_ref_sink(print);
+    
+    /* libfprint stores prints little-endian */
+    if (G_BYTE_ORDER == G_BIG_ENDIAN) {
+        GVariant *swapped = g_variant_byteswap(print);
+        g_variant_unref(print);
+        print = swapped;
+    }
+    
+    g_variant_get(print, "(i&s&sby&ms&msi@a{sv}v)", &type, &driver, &dev_id, &stored,
+                  &finger, &username, &description, &date, &extra, &data);
+    g_variant_unref(extra);
+    
+    /* Sensor-slot prints carry "(yay)"; only the template bytes matter here */
+    if (g_variant_is_of_type(data, G_VARIANT_TYPE(DRIVER_DATA_TYPE))) {
+        GVariant *inner = g_variant_get_child_value(data, 1);
+        g_variant_unref(data);
+        data = inner;
+    }
+    
+    ret = -1;
+    if (strcmp(driver, DRIVER_ID) != 0 || type != FPI_PRINT_RAW ||
+        !g_variant_is_of_type(data, G_VARIANT_TYPE_BYTESTRING)) {
+        fprintf(stderr, "%s: print was not made by the %s driver\n", path, DRIVER_ID);
+        goto out;
+    }
+    
+    bytes = g_variant_get_fixed_array(data, &size, sizeof(guint8));
+    
+    memset(&template, 0, sizeof(template));
+    template.type = FP_XIAOMI_TEMPLATE_PROPRIETARY;
+    template.size = size;
+    template.data = (uint8_t *)bytes;
+    g_strlcpy(template.name, description ? description : (username ? username : ""),
+              sizeof(template.name));
+    
+    ret = fp_xiaomi_gallery_add(gallery, id, &template);
+    if (ret != FP_XIAOMI_SUCCESS) {
+        fprintf(stderr, "%s: %s\n", path, fp_xiaomi_get_error_string(ret));
+        ret = -1;
+    }
+    
+out:
+    g_variant_unref(data);
+    g_variant_unref(print);
+    return ret;
+}
+
+/* Serialize one template the way fp_print_serialize() does */
+static int export_template(const fp_xiaomi_gallery_t *gallery, uint32_t id, const char *dir)
+{
+    fp_xiaomi_template_t template;
+    GError *error = NULL;
+    GVariantBuilder builder;
+    GVariant *print;
+    gchar *path, *buf;
+    gsize size;
+    gboolean ok;
+    
+    if (fp_xiaomi_gallery_get(gallery, id, &template) != FP_XIAOMI_SUCCESS) {
+        return -1;
+    }
+    
+    g_variant_builder_init(&builder, G_VARIANT_TYPE(FP_PRINT_VARIANT_TYPE));
+    g_variant_builder_add(&builder, "i", FPI_PRINT_RAW);
+    g_variant_builder_add(&builder, "s", DRIVER_ID);
+    g_variant_builder_add(&builder, "s", device_id);
+    g_variant_builder_add(&builder, "b", FALSE);      /* Plain "ay": host-only print */
+    g_variant_builder_add(&builder, "y", FP_FINGER_UNKNOWN);
+    g_variant_builder_add(&builder, "ms", NULL);
+    g_variant_builder_add(&builder, "ms", template.name[0] ? template.name : NULL);
+    g_variant_builder_add(&builder, "i", G_MININT32);
+    g_variant_builder_open(&builder, G_VARIANT_TYPE("a{sv}"));
+    g_variant_builder_close(&builder);
+    g_variant_builder_add(&builder, "v",
+                          g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, template.data,
+                                                    template.size, sizeof(guint8)));
+    print = g_variant_ref_sink(g_variant_builder_end(&builder));
+    
+    if (G_BYTE_ORDER == G_BIG_ENDIAN) {
+        GVariant *swapped = g_variant_byteswap(print);
+        g_variant_unref(print);
+        print = swapped;
+    }
+    
+    size = g_variant_get_size(print);
+    buf = g_malloc(size + FP_PRINT_MAGIC_LEN);
+    memcpy(buf, FP_PRINT_MAGIC, FP_PRINT_MAGIC_LEN);
+    g_variant_store(print, buf + FP_PRINT_MAGIC_LEN);
+    g_variant_unref(print);
+    
+    path = g_strdup_printf("%s/%u.print", dir, id);
+    ok = g_file_set_contents(path, buf, size + FP_PRINT_MAGIC_LEN, &error);
+    if (!ok) {
+        fprintf(stderr, "%s: %s\n", path, error->message);
+        g_error_free(error);
+    }
+    
+    g_free(path);
+    g_free(buf);
+    return ok ? 0 : -1;
+}
+
+static int cmd_list(const fp_xiaomi_gallery_t *gallery)
+{
+    fp_xiaomi_template_t template;
+    size_t count = fp_xiaomi_gallery_count(gallery);
+    uint32_t *ids;
+    size_t i;
+    
+    ids = calloc(count ? count : 1, sizeof(*ids));
+    if (!ids) {
+        return -1;
+    }
+    
+    fp_xiaomi_gallery_ids(gallery, ids, &count);
+    printf("%zu templates\n", count);
+    for (i = 0; i < count; i++) {
+        fp_xiaomi_gallery_get(gallery, ids[i], &template);
+        printf("  %u: %u bytes, quality %u, %s\n", ids[i], template.size,
+               template.quality, template.name[0] ? template.name : "(unnamed)");
+    }
+    
+    free(ids);
+    return 0;
+}
+
+static int cmd_import(const char *gallery_path, int count, char **prints)
+{
+    fp_xiaomi_gallery_t *gallery;
+    uint32_t next_id = 1;
+    uint32_t *ids;
+    size_t n, i;
+    int failed = 0;
+    int ret;
+    
+    gallery = fp_xiaomi_gallery_open(gallery_path, 0);
+    if (!gallery && errno == ENOENT) {
+        gallery = fp_xiaomi_gallery_create(count);
+    }
+    if (!gallery) {
+        fprintf(stderr, "%s: %s\n", gallery_path, strerror(errno));
+        return -1;
+    }
+    
+    /* New templates get IDs above the highest one in use */
+    n = fp_xiaomi_gallery_count(gallery);
+    ids = calloc(n ? n : 1, sizeof(*ids));
+    if (!ids) {
+        fp_xiaomi_gallery_destroy(gallery);
+        return -1;
+    }
+    fp_xiaomi_gallery_ids(gallery, ids, &n);
+    for (i = 0; i < n; i++) {
+        if (ids[i] >= next_id) {
+            next_id = ids[i] + 1;
+        }
+    }
+    free(ids);
+    
+    for (i = 0; i < (size_t)count; i++) {
+        if (import_print(gallery, prints[i], next_id) == 0) {
+            printf("%s -> %u\n", prints[i], next_id);
+            next_id++;
+        } else {
+            failed++;
+        }
+    }
+    
+    ret = fp_xiaomi_gallery_save(gallery, gallery_path);
+    if (ret != FP_XIAOMI_SUCCESS) {
+        fprintf(stderr, "%s: %s\n", gallery_path, fp_xiaomi_get_error_string(ret));
+        failed++;
+    }
+    
+    fp_xiaomi_gallery_destroy(gallery);
+    return failed ? -1 : 0;
+}
+
+static int cmd_export(const fp_xiaomi_gallery_t *gallery, const char *dir)
+{
+    size_t count = fp_xiaomi_gallery_count(gallery);
+    uint32_t *ids;
+    size_t i;
+    int failed = 0;
+    
+    if (g_mkdir_with_parents(dir, 0700) != 0) {
+        fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    
+    ids = calloc(count ? count : 1, sizeof(*ids));
+    if (!ids) {
+        return -1;
+    }
+    
+    fp_xiaomi_gallery_ids(gallery, ids, &count);
+    for (i = 0; i < count; i++) {
+        if (export_template(gallery, ids[i], dir) != 0) {
+            failed++;
+        }
+    }
+    
+    printf("Exported %zu templates to %s\n", count - failed, dir);
+    free(ids);
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    fp_xiaomi_gallery_t *gallery;
+    const char *command, *path;
+    int argi = 1;
+    int ret;
+    
+    if (argc > 2 && strcmp(argv[1], "--device-id") == 0) {
+        device_id = argv[2];
+        argi = 3;
+    }
+    
+    if (argc - argi < 2) {
+        usage(argv[0]);
+        return 2;
+    }
+    
+    command = argv[argi];
+    path = argv[argi + 1];
+    argi += 2;
+    
+    if (strcmp(command, "create") == 0) {
+        gallery = fp_xiaomi_gallery_create(0);
+        if (!gallery) {
+            return 1;
+        }
+        ret = fp_xiaomi_gallery_save(gallery, path);
+        fp_xiaomi_gallery_destroy(gallery);
+        if (ret != FP_XIAOMI_SUCCESS) {
+            fprintf(stderr, "%s: %s\n", path, fp_xiaomi_get_error_string(ret));
+            return 1;
+        }
+        return 0;
+    }
+    
+    if (strcmp(command, "import") == 0) {
+        if (argi >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+        return cmd_import(path, argc - argi, argv + argi) == 0 ? 0 : 1;
+    }
+    
+    if (strcmp(command, "list") != 0 && strcmp(command, "verify") != 0 &&
+        strcmp(command, "export") != 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    
+    gallery = fp_xiaomi_gallery_open(path, strcmp(command, "verify") == 0 ?
+                                           FP_XIAOMI_GALLERY_VERIFY : 0);
+    if (!gallery) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    
+    if (strcmp(command, "list") == 0) {
+        ret = cmd_list(gallery);
+    } else if (strcmp(command, "verify") == 0) {
+        printf("%s: OK, %zu templates\n", path, fp_xiaomi_gallery_count(gallery));
+        ret = 0;
+    } else if (argi < argc) {
+        ret = cmd_export(gallery, argv[argi]);
+    } else {
+        usage(argv[0]);
+        ret = -1;
+    }
+    
+    fp_xiaomi_gallery_destroy(gallery);
+    return ret == 0 ? 0 : 1;
+}
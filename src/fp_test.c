@@ -6,6 +6,8 @@
  * 
  * Simple test application demonstrating the usage of the Xiaomi FPC
  * fingerprint scanner driver and user-space library.
+ * With --self-test it instead runs library checks that need no device
+ * (gallery files, compression, matching, preprocessing kernels).
  * 
  * @copyright GPL v2 License
  */
@@ -16,8 +18,10 @@
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
+#include <math.h>
 
 #include "libfp_xiaomi.h"
+#include "libfp_xiaomi_private.h"
 
 /* Global variables */
 static fp_xiaomi_device_t *device = NULL;
@@ -273,6 +277,366 @@ void identify_fingerprint(fp_xiaomi_device_t *dev)
     printf("\n");
 }
 
+/* Device-free self-tests, run with --self-test */
+
+#define SELF_TEST_WIDTH         150     /* Not SIMD-width multiples, so the tails run too */
+#define SELF_TEST_HEIGHT        130
+#define SELF_TEST_GALLERY       40
+#define SELF_TEST_TEMPLATES     1500    /* Above the matcher pool's parallel threshold */
+#define SELF_TEST_TEMPLATE_SIZE 256
+#define SELF_TEST_BASE_ID       100
+#define SELF_TEST_CODEC_HEADER  12      /* sizeof(struct fp_compressed_header) */
+
+#define SELF_TEST_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("  FAILED: %s (line %d)\n", #cond, __LINE__); \
+            failures++; \
+        } \
+    } while (0)
+
+static uint32_t self_test_seed = 1;
+
+/* xorshift32: deterministic so failures reproduce, and no short cycles in the low bits */
+static uint32_t self_test_random(void)
+{
+    self_test_seed ^= self_test_seed << 13;
+    self_test_seed ^= self_test_seed >> 17;
+    self_test_seed ^= self_test_seed << 5;
+    return self_test_seed;
+}
+
+/* Synthetic print: concentric ridges about 9 px apart inside an oval, noise outside */
+static void make_test_image(fp_xiaomi_image_t *image, uint8_t *pixels)
+{
+    const double cx = SELF_TEST_WIDTH / 2.0;
+    const double cy = SELF_TEST_HEIGHT / 2.0;
+    double dx, dy, v;
+    
+    for (int y = 0; y < SELF_TEST_HEIGHT; y++) {
+        for (int x = 0; x < SELF_TEST_WIDTH; x++) {
+            dx = (x - cx) / cx;
+            dy = (y - cy) / cy;
+            v = 200.0;
+            if (dx * dx + dy * dy < 0.8) {
+                v = 128.0 + 70.0 * sin(6.2831853 * sqrt(dx * dx * cx * cx + 1.5 * dy * dy * cy * cy) / 9.0);
+            }
+            v += (double)(self_test_random() % 17) - 8.0;
+            pixels[y * SELF_TEST_WIDTH + x] = (uint8_t)(v < 0.0 ? 0.0 : v > 255.0 ? 255.0 : v);
+        }
+    }
+    
+    memset(image, 0, sizeof(*image));
+    image->width = SELF_TEST_WIDTH;
+    image->height = SELF_TEST_HEIGHT;
+    image->format = FP_XIAOMI_IMG_FORMAT_GRAY8;
+    image->size = SELF_TEST_WIDTH * SELF_TEST_HEIGHT;
+    image->data = pixels;
+}
+
+static void make_test_template(fp_xiaomi_template_t *template, uint8_t *data, size_t size,
+                               unsigned int index)
+{
+    for (size_t i = 0; i < size; i++) {
+        data[i] = (uint8_t)self_test_random();
+    }
+    
+    memset(template, 0, sizeof(*template));
+    template->type = FP_XIAOMI_TEMPLATE_PROPRIETARY;
+    template->quality = (uint8_t)(index % 101);
+    template->size = (uint32_t)size;
+    snprintf(template->name, sizeof(template->name), "finger %u", index);
+    template->data = data;
+}
+
+/* Compare every ID against the templates it should (or should no longer) hold */
+static int check_gallery(const fp_xiaomi_gallery_t *gallery, const fp_xiaomi_template_t *templates,
+                         const bool *present, size_t count)
+{
+    fp_xiaomi_template_t view;
+    size_t expected = 0;
+    int failures = 0;
+    int ret;
+    
+    for (size_t i = 0; i < count; i++) {
+        ret = fp_xiaomi_gallery_get(gallery, SELF_TEST_BASE_ID + i, &view);
+        if (!present[i]) {
+            SELF_TEST_CHECK(ret == FP_XIAOMI_ERROR_INVALID_PARAM);
+            continue;
+        }
+        expected++;
+        SELF_TEST_CHECK(ret == FP_XIAOMI_SUCCESS && view.size == templates[i].size &&
+                        view.type == templates[i].type && view.quality == templates[i].quality &&
+                        strcmp(view.name, templates[i].name) == 0 &&
+                        memcmp(view.data, templates[i].data, view.size) == 0);
+    }
+    
+    SELF_TEST_CHECK(fp_xiaomi_gallery_count(gallery) == expected);
+    return failures;
+}
+
+/* Gallery save, open (mapped), add, remove and save again */
+int self_test_gallery(void)
+{
+    static uint8_t data[SELF_TEST_GALLERY + 1][SELF_TEST_TEMPLATE_SIZE];
+    fp_xiaomi_template_t templates[SELF_TEST_GALLERY + 1];
+    bool present[SELF_TEST_GALLERY + 1] = { false };
+    fp_xiaomi_gallery_t *gallery;
+    char path[64];
+    int failures = 0;
+    
+    printf("=== Self-test: Gallery Round Trip ===\n");
+    
+    snprintf(path, sizeof(path), "/tmp/fp_test_gallery.%d", (int)getpid());
+    
+    /* Odd sizes so the arena needs alignment padding between templates */
+    for (unsigned int i = 0; i <= SELF_TEST_GALLERY; i++) {
+        make_test_template(&templates[i], data[i], 61 + i * 5, i);
+    }
+    
+    gallery = fp_xiaomi_gallery_create(0);
+    SELF_TEST_CHECK(gallery != NULL);
+    if (!gallery) {
+        return failures;
+    }
+    
+    for (size_t i = 0; i < SELF_TEST_GALLERY; i++) {
+        SELF_TEST_CHECK(fp_xiaomi_gallery_add(gallery, SELF_TEST_BASE_ID + i, &templates[i]) ==
+                        FP_XIAOMI_SUCCESS);
+        present[i] = true;
+    }
+    SELF_TEST_CHECK(fp_xiaomi_gallery_add(gallery, SELF_TEST_BASE_ID, &templates[0]) ==
+                    FP_XIAOMI_ERROR_TEMPLATE_EXIST);
+    SELF_TEST_CHECK(fp_xiaomi_gallery_save(gallery, path) == FP_XIAOMI_SUCCESS);
+    fp_xiaomi_gallery_destroy(gallery);
+    
+    gallery = fp_xiaomi_gallery_open(path, FP_XIAOMI_GALLERY_VERIFY);
+    SELF_TEST_CHECK(gallery != NULL);
+    if (!gallery) {
+        unlink(path);
+        return failures;
+    }
+    failures += check_gallery(gallery, templates, present, SELF_TEST_GALLERY + 1);
+    
+    /* Modify the mapped gallery: removals first, then an add into the copy */
+    SELF_TEST_CHECK(fp_xiaomi_gallery_remove(gallery, SELF_TEST_BASE_ID + 3) == FP_XIAOMI_SUCCESS);
+    present[3] = false;
+    SELF_TEST_CHECK(fp_xiaomi_gallery_remove(gallery, SELF_TEST_BASE_ID + 3) ==
+                    FP_XIAOMI_ERROR_INVALID_PARAM);
+    SELF_TEST_CHECK(fp_xiaomi_gallery_remove(gallery, SELF_TEST_BASE_ID) == FP_XIAOMI_SUCCESS);
+    present[0] = false;
+    SELF_TEST_CHECK(fp_xiaomi_gallery_add(gallery, SELF_TEST_BASE_ID + SELF_TEST_GALLERY,
+                                          &templates[SELF_TEST_GALLERY]) == FP_XIAOMI_SUCCESS);
+    present[SELF_TEST_GALLERY] = true;
+    failures += check_gallery(gallery, templates, present, SELF_TEST_GALLERY + 1);
+    
+    SELF_TEST_CHECK(fp_xiaomi_gallery_save(gallery, path) == FP_XIAOMI_SUCCESS);
+    fp_xiaomi_gallery_destroy(gallery);
+    
+    gallery = fp_xiaomi_gallery_open(path, FP_XIAOMI_GALLERY_VERIFY);
+    SELF_TEST_CHECK(gallery != NULL);
+    if (gallery) {
+        failures += check_gallery(gallery, templates, present, SELF_TEST_GALLERY + 1);
+        fp_xiaomi_gallery_destroy(gallery);
+    }
+    
+    unlink(path);
+    return failures;
+}
+
+/* Compress/decompress round trip, then truncated streams */
+int self_test_codec(void)
+{
+    static uint8_t pixels[SELF_TEST_WIDTH * SELF_TEST_HEIGHT];
+    fp_xiaomi_image_t image, packed, unpacked, cut;
+    uint32_t sizes[3];
+    uint32_t payload;
+    int failures = 0;
+    int ret;
+    
+    printf("=== Self-test: Compression ===\n");
+    
+    make_test_image(&image, pixels);
+    
+    ret = fp_xiaomi_image_compress(&image, &packed);
+    SELF_TEST_CHECK(ret == FP_XIAOMI_SUCCESS && packed.format == FP_XIAOMI_IMG_FORMAT_COMPRESSED);
+    if (ret != FP_XIAOMI_SUCCESS) {
+        return failures;
+    }
+    printf("Compressed %u bytes to %u\n", image.size, packed.size);
+    
+    ret = fp_xiaomi_image_decompress(&packed, &unpacked);
+    SELF_TEST_CHECK(ret == FP_XIAOMI_SUCCESS);
+    if (ret == FP_XIAOMI_SUCCESS) {
+        SELF_TEST_CHECK(unpacked.width == image.width && unpacked.height == image.height &&
+                        unpacked.format == FP_XIAOMI_IMG_FORMAT_GRAY8 &&
+                        unpacked.size == image.size &&
+                        memcmp(unpacked.data, image.data, image.size) == 0);
+        fp_xiaomi_free_image(&unpacked);
+    }
+    
+    /* Cut inside the header, one byte short, and at half the payload */
+    sizes[0] = SELF_TEST_CODEC_HEADER - 1;
+    sizes[1] = packed.size - 1;
+    sizes[2] = SELF_TEST_CODEC_HEADER + (packed.size - SELF_TEST_CODEC_HEADER) / 2;
+    for (int i = 0; i < 3; i++) {
+        cut = packed;
+        cut.size = sizes[i];
+        cut.data = malloc(cut.size);  /* Exact size, so overreads show under valgrind */
+        if (!cut.data) {
+            failures++;
+            break;
+        }
+        memcpy(cut.data, packed.data, cut.size);
+        SELF_TEST_CHECK(fp_xiaomi_image_decompress(&cut, &unpacked) == FP_XIAOMI_ERROR_BAD_IMAGE);
+        
+        /* Half a stream whose header no longer claims more than is there */
+        if (i == 2) {
+            payload = cut.size - SELF_TEST_CODEC_HEADER;
+            cut.data[8] = (uint8_t)payload;
+            cut.data[9] = (uint8_t)(payload >> 8);
+            cut.data[10] = (uint8_t)(payload >> 16);
+            cut.data[11] = (uint8_t)(payload >> 24);
+            SELF_TEST_CHECK(fp_xiaomi_image_decompress(&cut, &unpacked) ==
+                            FP_XIAOMI_ERROR_BAD_IMAGE);
+        }
+        free(cut.data);
+    }
+    
+    fp_xiaomi_free_image(&packed);
+    return failures;
+}
+
+/* match_best, the serial gallery scan and the thread pool must agree */
+int self_test_match(void)
+{
+    static uint8_t data[SELF_TEST_TEMPLATES][SELF_TEST_TEMPLATE_SIZE];
+    static uint8_t probe_data[SELF_TEST_TEMPLATE_SIZE];
+    static fp_xiaomi_template_t templates[SELF_TEST_TEMPLATES];
+    fp_xiaomi_template_t probe;
+    fp_xiaomi_gallery_t *gallery;
+    uint32_t serial_distance, pool_distance;
+    size_t serial, pooled, index;
+    uint32_t matched_id;
+    uint8_t confidence, gallery_confidence;
+    int failures = 0;
+    
+    printf("=== Self-test: Matching (match backend %s) ===\n", fp_xiaomi_match_backend());
+    
+    gallery = fp_xiaomi_gallery_create(SELF_TEST_TEMPLATES);
+    SELF_TEST_CHECK(gallery != NULL);
+    if (!gallery) {
+        return failures;
+    }
+    
+    for (unsigned int i = 0; i < SELF_TEST_TEMPLATES; i++) {
+        make_test_template(&templates[i], data[i], SELF_TEST_TEMPLATE_SIZE, i);
+        SELF_TEST_CHECK(fp_xiaomi_gallery_add(gallery, SELF_TEST_BASE_ID + i, &templates[i]) ==
+                        FP_XIAOMI_SUCCESS);
+    }
+    
+    /* Force several participants even on a single CPU */
+    fp_xiaomi_set_match_threads(4);
+    
+    /* One winner in the first chunk, one in a chunk another thread takes */
+    for (size_t target = 7; target < SELF_TEST_TEMPLATES; target += SELF_TEST_TEMPLATES / 2 + 100) {
+        memcpy(probe_data, data[target], SELF_TEST_TEMPLATE_SIZE);
+        for (int bit = 0; bit < 40; bit++) {
+            probe_data[self_test_random() % SELF_TEST_TEMPLATE_SIZE] ^= (uint8_t)(1u << (bit & 7));
+        }
+        probe = templates[target];
+        probe.data = probe_data;
+        
+        serial = fp_xiaomi_gallery_scan(gallery, &probe, 0, SELF_TEST_TEMPLATES, 0, &serial_distance);
+        pooled = fp_xiaomi_pool_scan(gallery, &probe, 0, &pool_distance);
+        SELF_TEST_CHECK(serial == target && pooled == serial && pool_distance == serial_distance);
+        
+        SELF_TEST_CHECK(fp_xiaomi_match_best(&probe, templates, SELF_TEST_TEMPLATES, 0,
+                                             &index, &confidence) == FP_XIAOMI_SUCCESS &&
+                        index == target);
+        SELF_TEST_CHECK(fp_xiaomi_gallery_match(gallery, &probe, 0, &matched_id,
+                                                &gallery_confidence) == FP_XIAOMI_SUCCESS &&
+                        matched_id == SELF_TEST_BASE_ID + target &&
+                        gallery_confidence == confidence);
+    }
+    
+    /* An unrelated probe matches nothing anywhere */
+    make_test_template(&probe, probe_data, SELF_TEST_TEMPLATE_SIZE, 0);
+    SELF_TEST_CHECK(fp_xiaomi_match_best(&probe, templates, SELF_TEST_TEMPLATES, 0,
+                                         &index, &confidence) == FP_XIAOMI_ERROR_NO_MATCH);
+    SELF_TEST_CHECK(fp_xiaomi_gallery_match(gallery, &probe, 0, &matched_id,
+                                            &gallery_confidence) == FP_XIAOMI_ERROR_NO_MATCH);
+    
+    fp_xiaomi_set_match_threads(0);
+    fp_xiaomi_gallery_destroy(gallery);
+    return failures;
+}
+
+/* Scalar and SIMD preprocessing kernels agree to within one gray level */
+int self_test_preprocess(void)
+{
+    static const uint32_t flags[] = {
+        0, FP_XIAOMI_PREPROCESS_NORMALIZE, FP_XIAOMI_PREPROCESS_ALL
+    };
+    static uint8_t pixels[SELF_TEST_WIDTH * SELF_TEST_HEIGHT];
+    static uint8_t scalar_pixels[SELF_TEST_WIDTH * SELF_TEST_HEIGHT];
+    static uint8_t simd_pixels[SELF_TEST_WIDTH * SELF_TEST_HEIGHT];
+    fp_xiaomi_image_t image, scalar_image, simd_image;
+    const char *backend;
+    int failures = 0;
+    int diff, max_diff;
+    
+    backend = fp_xiaomi_preprocess_backend();
+    printf("=== Self-test: Preprocessing (scalar vs %s) ===\n", backend);
+    
+    make_test_image(&image, pixels);
+    
+    for (size_t f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+        scalar_image = image;
+        scalar_image.data = scalar_pixels;
+        memcpy(scalar_pixels, pixels, sizeof(pixels));
+        simd_image = image;
+        simd_image.data = simd_pixels;
+        memcpy(simd_pixels, pixels, sizeof(pixels));
+        
+        fp_xiaomi_preprocess_force_scalar(true);
+        SELF_TEST_CHECK(fp_xiaomi_preprocess_image(&scalar_image, flags[f]) == FP_XIAOMI_SUCCESS);
+        fp_xiaomi_preprocess_force_scalar(false);
+        SELF_TEST_CHECK(fp_xiaomi_preprocess_image(&simd_image, flags[f]) == FP_XIAOMI_SUCCESS);
+        
+        max_diff = 0;
+        for (size_t i = 0; i < sizeof(pixels); i++) {
+            diff = abs((int)scalar_pixels[i] - (int)simd_pixels[i]);
+            if (diff > max_diff) {
+                max_diff = diff;
+            }
+        }
+        printf("Flags 0x%04x: quality %u/%u, largest pixel difference %d\n", flags[f],
+               scalar_image.quality, simd_image.quality, max_diff);
+        SELF_TEST_CHECK(max_diff <= 1);
+        SELF_TEST_CHECK(abs((int)scalar_image.quality - (int)simd_image.quality) <= 1);
+        SELF_TEST_CHECK(flags[f] != 0 || memcmp(scalar_pixels, pixels, sizeof(pixels)) == 0);
+    }
+    
+    return failures;
+}
+
+/* Run every self-test; returns the process exit status */
+int run_self_tests(void)
+{
+    int failures = 0;
+    
+    failures += self_test_gallery();
+    failures += self_test_codec();
+    failures += self_test_match();
+    failures += self_test_preprocess();
+    
+    fp_xiaomi_pool_shutdown();
+    
+    printf("\n%s: %d check(s) failed\n", failures ? "FAILED" : "PASSED", failures);
+    return failures ? 1 : 0;
+}
+
 /* Interactive menu */
 void show_menu(void)
 {
@@ -299,6 +663,10 @@ int main(int argc, char *argv[])
     char name[64];
     int major, minor, patch;
     
+    if (argc > 1 && strcmp(argv[1], "--self-test") == 0) {
+        return run_self_tests();
+    }
+    
     /* Set up signal handlers */
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
@@ -335,6 +703,9 @@ int main(int argc, char *argv[])
     
     /* Interactive menu loop */
     while (running) {
+        /* Deliver events that arrived while the last command ran */
+        fp_xiaomi_dispatch_events(device);
+        
         show_menu();
         
         if (scanf("%d", &choice) != 1) {
@@ -0,0 +1,174 @@
+/**
+ * @file fp_xiaomi_codec.c
+ * @brief Lossless frame compression for Xiaomi FPC Fingerprint Scanner Driver
+ * @author Project contributors
+ * @version 1.0.0
+ *
+ * Encoder for FP_IMG_FORMAT_COMPRESSED (see fp_xiaomi_driver.h). It is
+ * a single pass with a handful of integer operations per pixel, cheap
+ * enough to run under io_lock; libfp_xiaomi carries the decoder.
+ *
+ * @copyright GPL v2 License
+ */
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <asm/unaligned.h>
+#include "fp_xiaomi_driver.h"
+
+struct fp_codec_writer {
+    u8 *out;
+    size_t pos;
+    size_t len;
+    u64 bits;
+    unsigned int count;
+};
+
+struct fp_codec_context {
+    u32 sum;
+    u32 count;
+};
+
+/* Append up to 32 bits, least significant first */
+static bool fp_codec_put(struct fp_codec_writer *w, u32 value, unsigned int nbits)
+{
+    w->bits |= (u64)value << w->count;
+    w->count += nbits;
+    
+    while (w->count >= 8) {
+        if (w->pos == w->len) {
+            return false;
+        }
+        w->out[w->pos++] = (u8)w->bits;
+        w->bits >>= 8;
+        w->count -= 8;
+    }
+    
+    return true;
+}
+
+static bool fp_codec_flush(struct fp_codec_writer *w)
+{
+    if (!w->count) {
+        return true;
+    }
+    
+    return fp_codec_put(w, 0, 8 - w->count);
+}
+
+static unsigned int fp_codec_class(int b, int c, int d)
+{
+    int activity = abs(d - b) + abs(b - c);
+    
+    if (activity < 4) {
+        return 0;
+    }
+    if (activity < 12) {
+        return 1;
+    }
+    if (activity < 32) {
+        return 2;
+    }
+    return 3;
+}
+
+static int fp_codec_predict(int a, int b, int c)
+{
+    int lo = min(a, b);
+    int hi = max(a, b);
+    
+    if (c >= hi) {
+        return lo;
+    }
+    if (c <= lo) {
+        return hi;
+    }
+    return a + b - c;
+}
+
+ssize_t fp_xiaomi_compress(const u8 *src, u16 width, u16 height,
+                           u8 *dst, size_t dst_len)
+{
+    struct fp_codec_context ctx[FP_CODEC_CONTEXTS];
+    struct fp_codec_writer w;
+    struct fp_compressed_header *hdr = (struct fp_compressed_header *)dst;
+    unsigned int x, y, i;
+    
+    if (dst_len < sizeof(*hdr)) {
+        return -ENOSPC;
+    }
+    
+    for (i = 0; i < FP_CODEC_CONTEXTS; i++) {
+        ctx[i].sum = FP_CODEC_INIT_SUM;
+        ctx[i].count = 1;
+    }
+    
+    w.out = dst + sizeof(*hdr);
+    w.pos = 0;
+    w.len = dst_len - sizeof(*hdr);
+    w.bits = 0;
+    w.count = 0;
+    
+    for (y = 0; y < height; y++) {
+        const u8 *row = src + (size_t)y * width;
+        const u8 *up = y ? row - width : row;
+    
+        for (x = 0; x < width; x++) {
+            struct fp_codec_context *cx;
+            int a, b, c, d;
+            unsigned int k = 0, m, q;
+            u8 e;
+    
+            if (y == 0) {
+                a = b = c = d = x ? row[x - 1] : 128;
+            } else {
+                if (x == 0) {
+                    a = b = c = up[0];
+                } else {
+                    a = row[x - 1];
+                    b = up[x];
+                    c = up[x - 1];
+                }
+                d = x + 1 < width ? up[x + 1] : b;
+            }
+    
+            cx = &ctx[fp_codec_class(b, c, d)];
+            while (k < 8 && (cx->count << k) < cx->sum) {
+                k++;
+            }
+    
+            /* Fold the residual modulo 256: 0, -1, 1, -2, ... -> 0, 1, 2, 3, ... */
+            e = (u8)(row[x] - fp_codec_predict(a, b, c));
+            m = (e & 0x80) ? ((unsigned int)(u8)~e << 1) | 1 : (unsigned int)e << 1;
+    
+            q = m >> k;
+            if (q < FP_CODEC_ESCAPE) {
+                if (!fp_codec_put(&w, ((1u << q) - 1) | ((m & ((1u << k) - 1)) << (q + 1)),
+                                  q + 1 + k)) {
+                    return -ENOSPC;
+                }
+            } else if (!fp_codec_put(&w, ((1u << FP_CODEC_ESCAPE) - 1) | (m << FP_CODEC_ESCAPE),
+                                     FP_CODEC_ESCAPE + 8)) {
+                return -ENOSPC;
+            }
+    
+            cx->sum += m;
+            if (++cx->count == FP_CODEC_RESET) {
+                cx->sum >>= 1;
+                cx->count >>= 1;
+            }
+        }
+    }
+    
+    if (!fp_codec_flush(&w)) {
+        return -ENOSPC;
+    }
+    
+    put_unaligned_le32(FP_CODEC_MAGIC, &hdr->magic);
+    put_unaligned_le16(width, &hdr->width);
+    put_unaligned_le16(height, &hdr->height);
+    put_unaligned_le32(w.pos, &hdr->payload_size);
+    
+    return sizeof(*hdr) + w.pos;
+}
@@ -27,12 +27,24 @@
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/wait.h>
+#include <linux/completion.h>
 #include <linux/atomic.h>
 #include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/seqlock.h>
 #include <linux/pm_runtime.h>
+#include <linux/kfifo.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
 
 #include "fp_xiaomi_driver.h"
 
+#define CREATE_TRACE_POINTS
+#include "fp_xiaomi_trace.h"
+
 /* Module Information */
 MODULE_AUTHOR("AI-Assisted Development");
 MODULE_DESCRIPTION("Xiaomi FPC Fingerprint Scanner Driver");
@@ -48,8 +60,73 @@ MODULE_VERSION("1.0.0");
 #define FP_XIAOMI_MINOR_BASE    0
 #define FP_XIAOMI_MAX_DEVICES   8
 #define FP_XIAOMI_BUFFER_SIZE   64      /* Match device max packet size */
-#define FP_XIAOMI_TIMEOUT_MS    10000   /* Longer timeout for FPC device */
+#define FP_XIAOMI_TIMEOUT_MS    10000   /* Operation budget when the caller gives none */
 #define FP_XIAOMI_RETRY_COUNT   5       /* More retries for stability */
+#define FP_XIAOMI_INIT_BACKOFF_MS     20    /* First init retry delay */
+#define FP_XIAOMI_INIT_BACKOFF_CAP_MS 1000  /* Longest init retry delay */
+
+/* Capture engine - ring of bulk IN URBs kept in flight during a frame */
+#define FP_XIAOMI_URB_RING_SIZE 8
+#define FP_XIAOMI_URB_BUFFER_SIZE (16 * FP_XIAOMI_BUFFER_SIZE)
+
+/* Partial-frame quality gate */
+#define FP_GATE_SEGMENT         16      /* Pixels per coverage segment of a row */
+#define FP_GATE_MIN_CONTRAST    6       /* Mean |horizontal step| of a covered segment */
+
+/* Finger events queued for user space before the oldest is dropped */
+#define FP_XIAOMI_EVENT_QUEUE_SIZE 16
+
+/* Runtime PM */
+#define FP_XIAOMI_AUTOSUSPEND_DELAY_S 2     /* Default idle time before autosuspend */
+#define FP_XIAOMI_CAPTURE_QOS_US      20    /* CPU wakeup latency bound while a frame streams */
+#define FP_XIAOMI_WAKE_PROBE_MS       50    /* Wait for the touch packet behind a remote wakeup */
+#define FP_XIAOMI_PREARM_MS           5000  /* FP_IOC_PREARM window when the caller gives none */
+#define FP_XIAOMI_PREARM_MAX_MS       60000 /* Longest FP_IOC_PREARM window */
+
+/* Phases with a latency histogram in debugfs */
+enum fp_latency_phase {
+    FP_LATENCY_COMMAND,     /* Any command round trip */
+    FP_LATENCY_CAPTURE,     /* One streamed frame */
+    FP_LATENCY_MATCH,       /* Verify/identify, sensor capture included */
+    FP_LATENCY_PHASES
+};
+
+static const char * const fp_latency_phase_names[FP_LATENCY_PHASES] = {
+    [FP_LATENCY_COMMAND] = "command_latency",
+    [FP_LATENCY_CAPTURE] = "capture_latency",
+    [FP_LATENCY_MATCH] = "match_latency",
+};
+
+/*
+ * Per-CPU statistics. Writers bump their own CPU's copy with this_cpu
+ * ops (safe from URB completions), readers sum over all CPUs, so the
+ * USB path never shares a cache line with monitoring. Counters are
+ * unsigned long so a reader on 32-bit never sees a torn value.
+ */
+enum fp_stat {
+    FP_STAT_BYTES_IN,
+    FP_STAT_BYTES_OUT,
+    FP_STAT_CONTROL_TRANSFERS,
+    FP_STAT_BULK_PACKETS,
+    FP_STAT_RETRIES,
+    FP_STAT_TIMEOUTS,
+    FP_STAT_STALLS,
+    FP_STAT_ERRORS,
+    FP_STAT_CAPTURES,
+    FP_STAT_CAPTURE_FAILURES,
+    FP_STAT_MATCHES,
+    FP_STAT_NO_MATCHES,
+    FP_STAT_EARLY_REJECTS,
+    FP_STAT_PRECHECKS,
+    FP_STATS
+};
+
+struct fp_xiaomi_stats {
+    unsigned long counters[FP_STATS];
+};
+
+#define fp_stat_inc(dev, stat)      this_cpu_inc((dev)->stats->counters[stat])
+#define fp_stat_add(dev, stat, n)   this_cpu_add((dev)->stats->counters[stat], (n))
 
 /* USB endpoints - Based on actual hardware analysis */
 #define FP_BULK_IN_EP     0x82  /* Single bulk IN endpoint as per hardware */
@@ -82,6 +159,34 @@ enum fp_error_codes {
     FP_ERROR_MEMORY = -10
 };
 
+/*
+ * Read-mostly view of the device published for lock-free queries.
+ * Writers update it under snapshot_lock; readers never block.
+ */
+struct fp_xiaomi_snapshot {
+    struct fp_device_info info;
+    struct fp_power_params power;
+    u8 state;
+    u8 last_error;
+    u16 flags;
+};
+
+/*
+ * Partial-frame quality gate. Rows are scored as they arrive: each is
+ * split into FP_GATE_SEGMENT-pixel segments and a segment with ridge
+ * contrast counts as covered. need == 0 leaves the gate off; with
+ * accept set the frame also ends early, successfully, once need is met.
+ */
+struct fp_capture_gate {
+    u32 need;                   /* Covered segments a frame must reach */
+    u32 total;                  /* Segments in a frame */
+    u32 seen;
+    u32 covered;
+    u16 width;
+    u16 rows;                   /* Rows scored so far */
+    bool accept;
+};
+
 /* Device structure */
 struct fp_xiaomi_device {
     struct usb_device *udev;
@@ -98,6 +203,10 @@ struct fp_xiaomi_device {
     struct mutex io_lock;
     spinlock_t state_lock;
     
+    /* Snapshot answering GET_STATUS/GET_DEVICE_INFO/GET_POWER_MODE */
+    seqlock_t snapshot_lock;
+    struct fp_xiaomi_snapshot snapshot;
+    
     /* Character device interface */
     struct cdev cdev;
     struct device *dev;
@@ -105,39 +214,149 @@ struct fp_xiaomi_device {
     
     /* I/O buffers and URBs - Only bulk IN for FPC L:0001 */
     unsigned char *bulk_in_buffer;
-    struct urb *bulk_in_urb;
+    
+    /*
+     * Synchronous transfers, made under io_lock through io_urb so they
+     * can be killed. While an ioctl runs, io_owner is its file and every
+     * transfer is bounded by io_deadline (jiffies), taken from the
+     * caller's timeout_ms. A cancel from the same file sets io_cancelled
+     * and kills io_anchor without waiting for io_lock.
+     */
+    struct urb *io_urb;
+    struct usb_ctrlrequest *io_setup;
+    struct usb_anchor io_anchor;
+    struct file *io_owner;
+    struct file *io_cancelled;
+    unsigned int io_cmd;            /* ioctl io_owner is running */
+    unsigned long io_deadline;
+    bool io_caller_deadline;        /* io_deadline came from the caller */
+    bool io_expired;                /* The last transfer ran into io_deadline */
+    u32 enroll_timeout_ms;          /* Per-step budget of the enrollment; under io_lock */
+    bool enroll_probe;              /* Enrolling into slot 0, stores nothing; under io_lock */
     
     /* Control transfer buffer for commands */
     unsigned char *control_buffer;
     
+    /* FP_IMG_FORMAT_COMPRESSED output of FP_IOC_CAPTURE_IMAGE; under io_lock */
+    unsigned char *codec_buffer;
+    
+    /*
+     * Asynchronous capture engine. Several bulk IN URBs are kept in
+     * flight so the host controller never idles between packets; the
+     * completion handler reassembles them into frame_buffer, which
+     * points at the frame ring slot being produced. All frame_* and
+     * capture_* fields and the gate are protected by capture_lock.
+     * A frame the gate rejects is finished for the caller at once;
+     * capture_draining marks the tail still arriving, which is thrown
+     * away and then signalled through drain_done/drain_work.
+     */
+    struct urb *capture_urbs[FP_XIAOMI_URB_RING_SIZE];
+    unsigned char *capture_bufs[FP_XIAOMI_URB_RING_SIZE];
+    struct usb_anchor capture_anchor;
+    struct completion capture_done;
+    spinlock_t capture_lock;
+    unsigned char *frame_buffer;
+    size_t frame_size;
+    size_t frame_filled;
+    size_t frame_in_flight;
+    int capture_status;
+    bool capture_active;
+    bool capture_draining;
+    struct fp_capture_gate gate;
+    struct completion drain_done;
+    struct work_struct drain_work;
+    bool drain_pending;             /* Tail not yet reaped; under io_lock */
+    u8 enroll_threshold;            /* Gate for enrollment captures; under io_lock */
+    
+    /*
+     * Frame ring shared with user space through mmap(). The mapping is
+     * writable, so nothing in it is read back as trusted: ring_producer
+     * is the driver's own copy of ring->producer, and frame geometry
+     * comes from the device rather than the slot headers.
+     */
+    struct fp_frame_ring *ring;
+    u32 ring_producer;              /* Under io_lock */
+    
+    /*
+     * Streaming capture: stream_work takes one frame per run and queues
+     * itself for the next. All stream_* fields are under io_lock and
+     * stream_owner, the file that started it, is NULL while idle.
+     */
+    struct delayed_work stream_work;
+    struct file *stream_owner;
+    unsigned long stream_interval;  /* Jiffies from frame start to frame start */
+    u32 stream_flags;               /* FP_STREAM_* */
+    u32 stream_remaining;           /* Frames left; 0: unlimited */
+    u32 stream_failures;            /* Consecutive failed frames */
+    
+    /*
+     * Finger detection: one bulk IN URB stays pending while the sensor
+     * is armed and idle. It shares the endpoint with command data, so
+     * it is killed for the duration of every io_lock section; detect_armed
+     * is only changed under io_lock. finger_events is protected by
+     * event_lock.
+     */
+    struct urb *detect_urb;
+    unsigned char *detect_buf;
+    bool detect_armed;
+    spinlock_t event_lock;
+    DECLARE_KFIFO(finger_events, struct fp_finger_event, FP_XIAOMI_EVENT_QUEUE_SIZE);
+    
     /* Work queue for async operations */
     struct workqueue_struct *workqueue;
     struct work_struct init_work;
     struct work_struct error_work;
     
+    /* Error recovery, run on this device's workqueue */
+    struct fp_recovery_context recovery;
+    
     /* Wait queues for blocking operations */
     wait_queue_head_t read_wait;
     wait_queue_head_t write_wait;
     
     /* Statistics and debugging */
     atomic_t open_count;
-    atomic_t error_count;
-    atomic_t retry_count;
+    struct fp_xiaomi_stats __percpu *stats;
     unsigned long last_activity;
+    unsigned long start_time;
+    u8 last_error;
+    u8 debug_level;
+    struct fp_latency_hist latency[FP_LATENCY_PHASES];
+    struct dentry *debugfs_dir;
     
     /* Power management */
     struct pm_qos_request pm_qos;
+    struct fp_power_params power;
     bool pm_suspended;
+    bool pm_auto_suspended;         /* Last suspend was a runtime autosuspend */
+    bool wake_check;                /* Resumed without a request: maybe a touch; under io_lock */
+    bool wake_capture;              /* A touch woke the sensor; under io_lock */
+    bool prearmed;                  /* FP_IOC_PREARM holds a PM reference; under io_lock */
+    bool prearm_touched;            /* A touch ended the pre-arm window */
+    struct delayed_work prearm_work;
+    atomic_t pm_requests;           /* Driver-initiated resumes in progress */
+    atomic_t ring_maps;             /* Live mappings of the frame ring */
     
     /* Firmware information */
     char firmware_version[32];
     bool firmware_loaded;
     
+    /*
+     * Cold-init results reused by warm reinit after resume or reset:
+     * the firmware image is requested once per device, and the parsed
+     * info stays valid while the sensor reports the same version byte.
+     */
+    const struct firmware *firmware;
+    bool firmware_checked;
+    bool info_valid;
+    u8 info_version;
+    
     /* Device capabilities */
     u16 image_width;
     u16 image_height;
     u8 template_count;
     u32 device_flags;
+    atomic_t template_generation;   /* See fp_xiaomi_templates_changed() */
 };
 
 /* Global variables */
@@ -145,6 +364,7 @@ static struct class *fp_xiaomi_class;
 static dev_t fp_xiaomi_devt;
 static DEFINE_IDR(fp_xiaomi_idr);
 static DEFINE_MUTEX(fp_xiaomi_mutex);
+static struct dentry *fp_xiaomi_debugfs_root;
 
 /* USB device table */
 static const struct usb_device_id fp_xiaomi_table[] = {
@@ -190,20 +410,57 @@ static struct usb_driver fp_xiaomi_driver = {
 #define fp_dev_dbg(dev, fmt, args...) \
     dev_dbg(&(dev)->udev->dev, "[FP_XIAOMI] DEBUG: " fmt, ##args)
 
+/* Fold the per-CPU copies into one block */
+static void fp_xiaomi_stats_read(struct fp_xiaomi_device *dev, struct fp_xiaomi_stats *sum)
+{
+    struct fp_xiaomi_stats *cpu_stats;
+    int cpu;
+    int i;
+    
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        cpu_stats = per_cpu_ptr(dev->stats, cpu);
+        for (i = 0; i < FP_STATS; i++) {
+            sum->counters[i] += READ_ONCE(cpu_stats->counters[i]);
+        }
+    }
+}
+
 /**
  * Device reference counting
  */
 static void fp_xiaomi_delete(struct kref *kref)
 {
     struct fp_xiaomi_device *dev = container_of(kref, struct fp_xiaomi_device, kref);
+    int i;
     
     fp_dev_dbg(dev, "Deleting device structure");
     
     /* Clean up USB resources */
-    usb_free_urb(dev->bulk_in_urb);
+    usb_free_urb(dev->io_urb);
+    kfree(dev->io_setup);
+    
+    if (dev->detect_urb) {
+        usb_free_coherent(dev->udev, FP_XIAOMI_BUFFER_SIZE, dev->detect_buf,
+                          dev->detect_urb->transfer_dma);
+        usb_free_urb(dev->detect_urb);
+    }
+    
+    for (i = 0; i < FP_XIAOMI_URB_RING_SIZE; i++) {
+        if (dev->capture_urbs[i]) {
+            usb_free_coherent(dev->udev, FP_XIAOMI_URB_BUFFER_SIZE,
+                              dev->capture_bufs[i],
+                              dev->capture_urbs[i]->transfer_dma);
+            usb_free_urb(dev->capture_urbs[i]);
+        }
+    }
     
     kfree(dev->bulk_in_buffer);
     kfree(dev->control_buffer);
+    kfree(dev->codec_buffer);
+    free_percpu(dev->stats);
+    vfree(dev->ring);
+    release_firmware(dev->firmware);
     
     /* Clean up work queue */
     if (dev->workqueue) {
@@ -227,6 +484,58 @@ static inline void fp_xiaomi_put_device(struct fp_xiaomi_device *dev)
     kref_put(&dev->kref, fp_xiaomi_delete);
 }
 
+static enum fp_device_state fp_xiaomi_get_state(struct fp_xiaomi_device *dev);
+
+/**
+ * Publish the current device view for lock-free readers
+ */
+static void fp_xiaomi_update_snapshot(struct fp_xiaomi_device *dev)
+{
+    struct fp_xiaomi_snapshot *snap = &dev->snapshot;
+    enum fp_device_state state = fp_xiaomi_get_state(dev);
+    unsigned long flags;
+    
+    write_seqlock_irqsave(&dev->snapshot_lock, flags);
+    memset(snap, 0, sizeof(*snap));
+    snap->info.vendor_id = le16_to_cpu(dev->udev->descriptor.idVendor);
+    snap->info.product_id = le16_to_cpu(dev->udev->descriptor.idProduct);
+    strscpy(snap->info.firmware_version, dev->firmware_version,
+            sizeof(snap->info.firmware_version));
+    snap->info.image_width = dev->image_width;
+    snap->info.image_height = dev->image_height;
+    snap->info.template_count = dev->template_count;
+    snap->info.capabilities = dev->device_flags;
+    snap->power = dev->power;
+    snap->state = state;
+    snap->last_error = READ_ONCE(dev->last_error);
+    snap->flags = dev->firmware_loaded ? 0x0001 : 0;
+    write_sequnlock_irqrestore(&dev->snapshot_lock, flags);
+}
+
+/*
+ * Stored templates may have changed. GET_STATUS reports the generation
+ * lock-free, so the library relists only after a bump. Called under
+ * io_lock once the change is done, also for calls that failed part way;
+ * 0 is skipped, it means "no generation" to the library.
+ */
+static void fp_xiaomi_templates_changed(struct fp_xiaomi_device *dev)
+{
+    if (atomic_inc_return(&dev->template_generation) == 0) {
+        atomic_inc(&dev->template_generation);
+    }
+}
+
+static void fp_xiaomi_read_snapshot(struct fp_xiaomi_device *dev,
+                                    struct fp_xiaomi_snapshot *snap)
+{
+    unsigned int seq;
+    
+    do {
+        seq = read_seqbegin(&dev->snapshot_lock);
+        *snap = dev->snapshot;
+    } while (read_seqretry(&dev->snapshot_lock, seq));
+}
+
 /**
  * State management with proper locking
  */
@@ -241,7 +550,9 @@ static void fp_xiaomi_set_state(struct fp_xiaomi_device *dev, enum fp_device_sta
     dev->last_activity = jiffies;
     spin_unlock_irqrestore(&dev->state_lock, flags);
     
-    fp_dev_dbg(dev, "State transition: %d -> %d", old_state, new_state);
+    trace_fp_xiaomi_state(&dev->interface->dev, old_state, new_state);
+    
+    fp_xiaomi_update_snapshot(dev);
     
     /* Wake up waiting processes */
     wake_up_interruptible(&dev->read_wait);
@@ -260,6 +571,175 @@ static enum fp_device_state fp_xiaomi_get_state(struct fp_xiaomi_device *dev)
     return state;
 }
 
+/**
+ * Operation deadlines and cancellation
+ *
+ * An ioctl that talks to the sensor runs against one absolute deadline,
+ * so a verify asked to give up after 2 s does so however many transfers
+ * the time is spent over. Outside an ioctl (init, recovery, detection)
+ * each transfer gets FP_XIAOMI_TIMEOUT_MS and nothing can cancel it.
+ */
+
+/* Restart the default deadline; caller holds io_lock */
+static void fp_xiaomi_io_restart(struct fp_xiaomi_device *dev)
+{
+    dev->io_deadline = jiffies + msecs_to_jiffies(FP_XIAOMI_TIMEOUT_MS);
+    dev->io_caller_deadline = false;
+}
+
+static void fp_xiaomi_io_begin(struct fp_xiaomi_device *dev, struct file *file,
+                               unsigned int cmd)
+{
+    WRITE_ONCE(dev->io_cmd, cmd);
+    WRITE_ONCE(dev->io_cancelled, NULL);
+    fp_xiaomi_io_restart(dev);
+    WRITE_ONCE(dev->io_owner, file);
+}
+
+static void fp_xiaomi_io_end(struct fp_xiaomi_device *dev)
+{
+    WRITE_ONCE(dev->io_owner, NULL);
+    dev->io_caller_deadline = false;
+}
+
+/* Restart the deadline at timeout_ms from now (0: default); caller holds io_lock */
+static void fp_xiaomi_io_set_timeout(struct fp_xiaomi_device *dev, u32 timeout_ms)
+{
+    if (!dev->io_owner || !timeout_ms) {
+        return;
+    }
+    
+    dev->io_deadline = jiffies + msecs_to_jiffies(timeout_ms);
+    dev->io_caller_deadline = true;
+}
+
+static bool fp_xiaomi_io_cancelled(struct fp_xiaomi_device *dev)
+{
+    return dev->io_owner && READ_ONCE(dev->io_cancelled) == dev->io_owner;
+}
+
+/* Jiffies the next transfer may take, 0 once the deadline has passed */
+static long fp_xiaomi_io_timeout(struct fp_xiaomi_device *dev)
+{
+    if (!dev->io_owner && !dev->io_caller_deadline) {
+        return msecs_to_jiffies(FP_XIAOMI_TIMEOUT_MS);
+    }
+    
+    if (time_after_eq(jiffies, dev->io_deadline)) {
+        return 0;
+    }
+    
+    return dev->io_deadline - jiffies;
+}
+
+/*
+ * Abort the operation file has in progress, without io_lock. A capture
+ * still waiting for the finger has no tail coming, so its URBs are
+ * killed outright; a frame part-way through is given up the way the
+ * quality gate does it, with the tail draining in the background.
+ * Either way the caller gets -ECANCELED at once.
+ */
+static void fp_xiaomi_cancel_io(struct fp_xiaomi_device *dev, struct file *file)
+{
+    unsigned long flags;
+    bool abandon = false;
+    bool kill = false;
+    
+    if (READ_ONCE(dev->io_owner) != file) {
+        return;
+    }
+    
+    WRITE_ONCE(dev->io_cancelled, file);
+    
+    /* Pairs with the barrier in fp_xiaomi_io_run() */
+    smp_mb();
+    
+    spin_lock_irqsave(&dev->capture_lock, flags);
+    if (dev->capture_active && !dev->capture_draining) {
+        dev->capture_status = -ECANCELED;
+        if (dev->frame_filled) {
+            dev->capture_draining = true;
+        } else {
+            dev->capture_active = false;
+            kill = true;
+        }
+        abandon = true;
+    }
+    spin_unlock_irqrestore(&dev->capture_lock, flags);
+    
+    if (abandon) {
+        complete(&dev->capture_done);
+    }
+    
+    if (kill) {
+        usb_kill_anchored_urbs(&dev->capture_anchor);
+    }
+    
+    usb_kill_anchored_urbs(&dev->io_anchor);
+}
+
+static void fp_xiaomi_io_complete(struct urb *urb)
+{
+    complete(urb->context);
+}
+
+/*
+ * Run io_urb to completion within the operation's deadline; caller holds
+ * io_lock. Returns the bytes transferred or a negative errno, -ECANCELED
+ * if the operation was cancelled.
+ */
+static int fp_xiaomi_io_run(struct fp_xiaomi_device *dev)
+{
+    DECLARE_COMPLETION_ONSTACK(done);
+    struct urb *urb = dev->io_urb;
+    long timeout;
+    int ret;
+    
+    dev->io_expired = false;
+    if (fp_xiaomi_io_cancelled(dev)) {
+        return -ECANCELED;
+    }
+    
+    timeout = fp_xiaomi_io_timeout(dev);
+    if (!timeout) {
+        dev->io_expired = true;
+        return -ETIMEDOUT;
+    }
+    
+    urb->context = &done;
+    usb_anchor_urb(urb, &dev->io_anchor);
+    ret = usb_submit_urb(urb, GFP_KERNEL);
+    if (ret) {
+        usb_unanchor_urb(urb);
+        return ret;
+    }
+    
+    /* A cancel that ran before the URB was anchored had nothing to kill */
+    smp_mb();
+    if (fp_xiaomi_io_cancelled(dev)) {
+        usb_kill_urb(urb);
+    }
+    
+    if (!wait_for_completion_timeout(&done, timeout)) {
+        usb_kill_urb(urb);
+        /* Cut short by the operation's deadline rather than the sensor */
+        dev->io_expired = timeout < msecs_to_jiffies(FP_XIAOMI_TIMEOUT_MS);
+    }
+    
+    ret = urb->status;
+    if (ret == -ENOENT || ret == -ECONNRESET) {
+        if (fp_xiaomi_io_cancelled(dev)) {
+            ret = -ECANCELED;
+        } else if (fp_xiaomi_get_state(dev) == FP_STATE_DISCONNECTED) {
+            ret = -ENODEV;
+        } else {
+            ret = -ETIMEDOUT;
+        }
+    }
+    
+    return ret ? ret : urb->actual_length;
+}
+
 /**
  * USB communication functions for FPC L:0001
  */
@@ -270,41 +750,60 @@ static int fp_xiaomi_control_transfer(struct fp_xiaomi_device *dev,
                                      __u16 value, __u16 index,
                                      void *data, __u16 size)
 {
+    ktime_t start;
     int ret;
     
     if (!dev || fp_xiaomi_get_state(dev) == FP_STATE_DISCONNECTED) {
         return -ENODEV;
     }
     
-    fp_dev_dbg(dev, "Control transfer: req=0x%02x, type=0x%02x, val=0x%04x, idx=0x%04x, size=%d",
-               request, requesttype, value, index, size);
-    
-    ret = usb_control_msg(dev->udev,
-                         (requesttype & USB_DIR_IN) ? 
+    dev->io_setup->bRequestType = requesttype;
+    dev->io_setup->bRequest = request;
+    dev->io_setup->wValue = cpu_to_le16(value);
+    dev->io_setup->wIndex = cpu_to_le16(index);
+    dev->io_setup->wLength = cpu_to_le16(size);
+    usb_fill_control_urb(dev->io_urb, dev->udev,
+                         (requesttype & USB_DIR_IN) ?
                          usb_rcvctrlpipe(dev->udev, 0) : usb_sndctrlpipe(dev->udev, 0),
-                         request, requesttype, value, index,
-                         data, size, FP_XIAOMI_TIMEOUT_MS);
+                         (unsigned char *)dev->io_setup, data, size,
+                         fp_xiaomi_io_complete, NULL);
+    
+    start = ktime_get();
+    ret = fp_xiaomi_io_run(dev);
+    trace_fp_xiaomi_control(&dev->interface->dev, request, requesttype, value, index,
+                            size, ret, ktime_to_ns(ktime_sub(ktime_get(), start)));
+    fp_stat_inc(dev, FP_STAT_CONTROL_TRANSFERS);
+    
+    if (ret == -ECANCELED) {
+        return ret;
+    }
     
     if (ret < 0) {
         fp_dev_err(dev, "Control transfer failed: %d", ret);
-        atomic_inc(&dev->error_count);
+        fp_stat_inc(dev, FP_STAT_ERRORS);
         
         switch (ret) {
         case -ETIMEDOUT:
             fp_dev_warn(dev, "Control transfer timeout");
+            fp_stat_inc(dev, FP_STAT_TIMEOUTS);
+            /* Running out of the operation's budget is no sign of a fault */
+            if (!dev->io_owner || (!dev->io_caller_deadline && !dev->io_expired)) {
+                queue_work(dev->workqueue, &dev->error_work);
+            }
             break;
         case -ENODEV:
             fp_xiaomi_set_state(dev, FP_STATE_DISCONNECTED);
             break;
         case -EPIPE:
             fp_dev_warn(dev, "Control endpoint stalled");
+            fp_stat_inc(dev, FP_STAT_STALLS);
             break;
         }
         
         return ret;
     }
     
-    fp_dev_dbg(dev, "Control transfer completed: %d bytes", ret);
+    fp_stat_add(dev, (requesttype & USB_DIR_IN) ? FP_STAT_BYTES_IN : FP_STAT_BYTES_OUT, ret);
     return ret;
 }
 
@@ -313,7 +812,6 @@ static int fp_xiaomi_bulk_in_transfer(struct fp_xiaomi_device *dev,
                                      unsigned char *buffer, int length)
 {
     int ret;
-    int actual_length;
     unsigned int pipe;
     
     if (!dev || !buffer || length <= 0) {
@@ -326,25 +824,32 @@ static int fp_xiaomi_bulk_in_transfer(struct fp_xiaomi_device *dev,
     
     pipe = usb_rcvbulkpipe(dev->udev, dev->bulk_in->bEndpointAddress);
     
-    fp_dev_dbg(dev, "Bulk IN transfer: %d bytes from endpoint 0x%02x",
-               length, dev->bulk_in->bEndpointAddress);
+    usb_fill_bulk_urb(dev->io_urb, dev->udev, pipe, buffer, length,
+                      fp_xiaomi_io_complete, NULL);
+    
+    ret = fp_xiaomi_io_run(dev);
+    trace_fp_xiaomi_bulk_packet(&dev->interface->dev, length, max(ret, 0), min(ret, 0));
+    fp_stat_inc(dev, FP_STAT_BULK_PACKETS);
     
-    ret = usb_bulk_msg(dev->udev, pipe, buffer, length,
-                       &actual_length, FP_XIAOMI_TIMEOUT_MS);
+    if (ret == -ECANCELED) {
+        return ret;
+    }
     
     if (ret < 0) {
         fp_dev_err(dev, "Bulk IN transfer failed: %d", ret);
-        atomic_inc(&dev->error_count);
+        fp_stat_inc(dev, FP_STAT_ERRORS);
         
         switch (ret) {
         case -ETIMEDOUT:
             fp_dev_warn(dev, "Bulk IN timeout");
+            fp_stat_inc(dev, FP_STAT_TIMEOUTS);
             break;
         case -ENODEV:
             fp_xiaomi_set_state(dev, FP_STATE_DISCONNECTED);
             break;
         case -EPIPE:
             fp_dev_warn(dev, "Bulk IN endpoint stalled, clearing");
+            fp_stat_inc(dev, FP_STAT_STALLS);
             usb_clear_halt(dev->udev, pipe);
             break;
         }
@@ -352,297 +857,2456 @@ static int fp_xiaomi_bulk_in_transfer(struct fp_xiaomi_device *dev,
         return ret;
     }
     
-    fp_dev_dbg(dev, "Bulk IN transfer completed: %d bytes", actual_length);
-    return actual_length;
+    fp_stat_add(dev, FP_STAT_BYTES_IN, ret);
+    return ret;
 }
 
 /**
- * Device initialization and firmware loading
+ * Asynchronous frame capture engine
+ *
+ * A frame is streamed through FP_XIAOMI_URB_RING_SIZE bulk IN URBs that
+ * are submitted up front. URBs on one endpoint complete in submission
+ * order, so the completion handler can append each packet at
+ * frame_filled and immediately resubmit the URB for the bytes that are
+ * still outstanding. The calling task sleeps once per frame instead of
+ * once per 64-byte packet.
  */
-static int fp_xiaomi_load_firmware(struct fp_xiaomi_device *dev)
+
+/*
+ * Score the rows completed since the last call; caller holds
+ * capture_lock. Returns true once the frame cannot reach gate->need
+ * covered segments even if every remaining segment is covered.
+ */
+static bool fp_xiaomi_gate_update(struct fp_xiaomi_device *dev)
 {
-    const struct firmware *fw;
+    struct fp_capture_gate *gate = &dev->gate;
+    const unsigned char *row;
+    unsigned int x, start, end, contrast;
+    
+    while ((size_t)(gate->rows + 1) * gate->width <= dev->frame_filled) {
+        row = dev->frame_buffer + (size_t)gate->rows * gate->width;
+        for (start = 0; start < gate->width; start = end) {
+            end = min_t(unsigned int, start + FP_GATE_SEGMENT, gate->width);
+            contrast = 0;
+            for (x = start; x + 1 < end; x++) {
+                contrast += abs(row[x + 1] - row[x]);
+            }
+            if (contrast >= FP_GATE_MIN_CONTRAST * (end - start)) {
+                gate->covered++;
+            }
+            gate->seen++;
+        }
+        gate->rows++;
+    }
+    
+    return gate->covered + (gate->total - gate->seen) < gate->need;
+}
+
+static void fp_xiaomi_capture_complete(struct urb *urb)
+{
+    struct fp_xiaomi_device *dev = urb->context;
+    unsigned long flags;
+    size_t len, needed;
+    bool done = false;
+    bool drained = false;
+    bool rejected = false;
+    bool accepted = false;
+    bool resubmit = false;
+    int status = urb->status;
     int ret;
-    char fw_name[64];
     
-    /* Try different firmware names based on device */
-    snprintf(fw_name, sizeof(fw_name), "fpc_xiaomi_%04x_%04x.bin",
-             FPC_VENDOR_ID, FPC_PRODUCT_ID);
+    trace_fp_xiaomi_bulk_packet(&dev->interface->dev, urb->transfer_buffer_length,
+                                urb->actual_length, status);
     
-    fp_dev_info(dev, "Loading firmware: %s", fw_name);
+    spin_lock_irqsave(&dev->capture_lock, flags);
     
-    ret = request_firmware(&fw, fw_name, &dev->udev->dev);
-    if (ret < 0) {
-        /* Try generic firmware */
-        ret = request_firmware(&fw, "fpc_xiaomi_generic.bin", &dev->udev->dev);
-        if (ret < 0) {
-            fp_dev_warn(dev, "No firmware found, using device defaults");
-            dev->firmware_loaded = false;
-            return 0; /* Not fatal */
-        }
+    if (!dev->capture_active) {
+        spin_unlock_irqrestore(&dev->capture_lock, flags);
+        return;
     }
     
-    fp_dev_info(dev, "Firmware loaded: %zu bytes", fw->size);
+    dev->frame_in_flight -= urb->transfer_buffer_length;
+    fp_stat_inc(dev, FP_STAT_BULK_PACKETS);
     
-    /* TODO: Implement firmware upload protocol */
-    /* This would involve sending firmware data to device */
+    if (status) {
+        if (status != -ENOENT && status != -ECONNRESET && status != -ESHUTDOWN) {
+            fp_dev_err(dev, "Capture URB failed: %d", status);
+            fp_stat_inc(dev, FP_STAT_ERRORS);
+            if (status == -EPIPE) {
+                fp_stat_inc(dev, FP_STAT_STALLS);
+            }
+        }
+        if (!dev->capture_draining) {
+            dev->capture_status = status;
+        }
+        done = true;
+        goto out;
+    }
     
-    release_firmware(fw);
-    dev->firmware_loaded = true;
+    fp_stat_add(dev, FP_STAT_BYTES_IN, urb->actual_length);
+    len = min_t(size_t, urb->actual_length, dev->frame_size - dev->frame_filled);
+    if (!dev->capture_draining) {
+        memcpy(dev->frame_buffer + dev->frame_filled, urb->transfer_buffer, len);
+    }
+    dev->frame_filled += len;
     
-    return 0;
-}
-
-static int fp_xiaomi_get_device_info(struct fp_xiaomi_device *dev)
-{
-    unsigned char resp_buffer[64];
-    int ret;
+    if (dev->gate.need && !dev->capture_draining && fp_xiaomi_gate_update(dev)) {
+        dev->capture_status = -EBADMSG;
+        if (dev->frame_filled < dev->frame_size) {
+            dev->capture_draining = true;
+            rejected = true;
+        }
+    } else if (dev->gate.accept && !dev->capture_draining &&
+               dev->gate.covered >= dev->gate.need && dev->frame_filled < dev->frame_size) {
+        dev->capture_draining = true;
+        accepted = true;
+    }
     
-    fp_dev_dbg(dev, "Getting device information from FPC L:0001");
+    if (dev->frame_filled >= dev->frame_size) {
+        done = true;
+        goto out;
+    }
     
-    /* FPC L:0001 device info via control transfer */
-    /* Based on fingerprint-ocv analysis, use vendor-specific control requests */
-    ret = fp_xiaomi_control_transfer(dev, 0x01, USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
-                                    0x0000, 0x0000, resp_buffer, sizeof(resp_buffer));
+    /* Short packets leave a gap that the next request has to cover */
+    needed = dev->frame_size - dev->frame_filled - dev->frame_in_flight;
+    if (needed > 0) {
+        urb->transfer_buffer_length = min_t(size_t, needed, FP_XIAOMI_URB_BUFFER_SIZE);
+        dev->frame_in_flight += urb->transfer_buffer_length;
+        resubmit = true;
+    }
     
-    if (ret < 0) {
-        fp_dev_warn(dev, "Control transfer for device info failed, trying alternative method");
-        
-        /* Alternative: Try to get info from device descriptors */
-        strncpy(dev->firmware_version, "021.26.2.031", sizeof(dev->firmware_version) - 1);
-        dev->image_width = 160;  /* Typical for FPC sensors */
-        dev->image_height = 160;
-        dev->template_count = 0;
-        dev->device_flags = 0x0001; /* Basic capture capability */
-        
-        fp_dev_info(dev, "Using default device info: FW %s, Image %dx%d",
-                   dev->firmware_version, dev->image_width, dev->image_height);
-        return 0;
+out:
+    if (done) {
+        drained = dev->capture_draining;
+        dev->capture_active = false;
+        dev->capture_draining = false;
+    }
+    spin_unlock_irqrestore(&dev->capture_lock, flags);
+    
+    if (resubmit) {
+        usb_anchor_urb(urb, &dev->capture_anchor);
+        ret = usb_submit_urb(urb, GFP_ATOMIC);
+        if (ret) {
+            usb_unanchor_urb(urb);
+            fp_dev_err(dev, "Capture URB resubmit failed: %d", ret);
+            
+            spin_lock_irqsave(&dev->capture_lock, flags);
+            done = dev->capture_active;
+            drained = dev->capture_draining;
+            dev->capture_active = false;
+            dev->capture_draining = false;
+            if (!drained) {
+                dev->capture_status = ret;
+            }
+            spin_unlock_irqrestore(&dev->capture_lock, flags);
+        }
     }
     
-    /* Parse response if we got data */
-    if (ret >= 16) {
-        /* Extract firmware version from response */
-        snprintf(dev->firmware_version, sizeof(dev->firmware_version),
-                "021.26.2.%03d", resp_buffer[3]);
-        
-        /* Set reasonable defaults for FPC L:0001 */
-        dev->image_width = 160;
-        dev->image_height = 160;
-        dev->template_count = 0;
-        dev->device_flags = 0x0001;
-        
-        fp_dev_info(dev, "Device info: FW %s, Image %dx%d, Templates %d",
-                   dev->firmware_version, dev->image_width, 
-                   dev->image_height, dev->template_count);
+    /* A frame the gate has decided is over for the caller; only its tail is left */
+    if (rejected) {
+        fp_stat_inc(dev, FP_STAT_EARLY_REJECTS);
+        complete(&dev->capture_done);
+    } else if (accepted) {
+        complete(&dev->capture_done);
     }
     
-    return 0;
+    if (done && drained) {
+        complete(&dev->drain_done);
+        queue_work(dev->workqueue, &dev->drain_work);
+    } else if (done) {
+        complete(&dev->capture_done);
+    }
 }
 
-/**
- * Device initialization work function
+/*
+ * Reap the tail of a frame the gate rejected, so the next reader of the
+ * bulk IN endpoint never sees its pixels. Caller holds io_lock.
  */
-static void fp_xiaomi_init_work(struct work_struct *work)
+static void fp_xiaomi_capture_drain(struct fp_xiaomi_device *dev)
 {
-    struct fp_xiaomi_device *dev = container_of(work, struct fp_xiaomi_device, init_work);
-    int ret;
-    int retry_count = 0;
-    
-    fp_dev_info(dev, "Starting device initialization");
-    fp_xiaomi_set_state(dev, FP_STATE_INITIALIZING);
+    unsigned long flags;
     
-    /* Retry initialization if it fails */
-    while (retry_count < FP_XIAOMI_RETRY_COUNT) {
-        /* Load firmware if available */
-        ret = fp_xiaomi_load_firmware(dev);
-        if (ret < 0) {
-            fp_dev_err(dev, "Firmware loading failed: %d", ret);
-            goto retry;
-        }
-        
-        /* Get device information */
-        ret = fp_xiaomi_get_device_info(dev);
-        if (ret < 0) {
-            fp_dev_err(dev, "Device info retrieval failed: %d", ret);
-            goto retry;
-        }
-        
-        /* Device initialized successfully */
-        fp_xiaomi_set_state(dev, FP_STATE_READY);
-        fp_dev_info(dev, "Device initialization completed");
+    if (!dev->drain_pending) {
         return;
-        
-retry:
-        retry_count++;
-        atomic_inc(&dev->retry_count);
-        fp_dev_warn(dev, "Initialization retry %d/%d", retry_count, FP_XIAOMI_RETRY_COUNT);
-        msleep(1000); /* Wait before retry */
     }
     
-    /* All retries failed */
-    fp_dev_err(dev, "Device initialization failed after %d retries", FP_XIAOMI_RETRY_COUNT);
-    fp_xiaomi_set_state(dev, FP_STATE_ERROR);
+    if (!wait_for_completion_timeout(&dev->drain_done,
+                                     msecs_to_jiffies(FP_XIAOMI_TIMEOUT_MS))) {
+        fp_dev_warn(dev, "Rejected frame did not drain");
+    }
+    
+    spin_lock_irqsave(&dev->capture_lock, flags);
+    dev->capture_active = false;
+    dev->capture_draining = false;
+    spin_unlock_irqrestore(&dev->capture_lock, flags);
+    usb_kill_anchored_urbs(&dev->capture_anchor);
+    dev->drain_pending = false;
 }
 
-/**
- * Error handling work function
+/*
+ * Capture one frame into dev->frame_buffer; caller must hold io_lock.
+ * A non-zero threshold (0-100) is the share of the sensor that must be
+ * covered by ridges: the frame is scored row by row and given up with
+ * -EBADMSG as soon as it can no longer get there. With partial set it
+ * also ends as soon as it does get there, returning the bytes scored.
  */
-static void fp_xiaomi_error_work(struct work_struct *work)
+static int fp_xiaomi_capture_frame(struct fp_xiaomi_device *dev, size_t frame_size,
+                                   u8 threshold, bool partial)
 {
-    struct fp_xiaomi_device *dev = container_of(work, struct fp_xiaomi_device, error_work);
+    unsigned int pipe;
+    unsigned long flags;
+    bool draining;
+    ktime_t start;
+    long timeout;
+    size_t len;
+    u32 segments;
+    u64 ns;
+    int ret;
+    int i;
     
-    fp_dev_info(dev, "Handling device error, attempting recovery");
+    if (frame_size == 0 || frame_size > FP_XIAOMI_MAX_IMAGE_SIZE) {
+        return -EINVAL;
+    }
     
-    /* Try to reset and reinitialize the device */
-    if (fp_xiaomi_get_state(dev) != FP_STATE_DISCONNECTED) {
-        /* Schedule reinitialization */
-        queue_work(dev->workqueue, &dev->init_work);
+    if (fp_xiaomi_get_state(dev) == FP_STATE_DISCONNECTED) {
+        return -ENODEV;
+    }
+    
+    fp_xiaomi_capture_drain(dev);
+    
+    segments = dev->image_height * DIV_ROUND_UP(dev->image_width, FP_GATE_SEGMENT);
+    if (frame_size != (size_t)dev->image_width * dev->image_height) {
+        threshold = 0;
+    }
+    
+    pipe = usb_rcvbulkpipe(dev->udev, dev->bulk_in->bEndpointAddress);
+    start = ktime_get();
+    
+    /* Deep C-states would stretch URB completion turnaround mid-frame */
+    pm_qos_update_request(&dev->pm_qos, FP_XIAOMI_CAPTURE_QOS_US);
+    
+    spin_lock_irqsave(&dev->capture_lock, flags);
+    reinit_completion(&dev->capture_done);
+    reinit_completion(&dev->drain_done);
+    dev->frame_size = frame_size;
+    dev->frame_filled = 0;
+    dev->frame_in_flight = 0;
+    dev->capture_status = 0;
+    dev->capture_active = true;
+    dev->capture_draining = false;
+    memset(&dev->gate, 0, sizeof(dev->gate));
+    if (threshold) {
+        dev->gate.need = DIV_ROUND_UP(segments * min_t(u32, threshold, 100), 100);
+        dev->gate.total = segments;
+        dev->gate.width = dev->image_width;
+        dev->gate.accept = partial;
+    }
+    spin_unlock_irqrestore(&dev->capture_lock, flags);
+    
+    /* Tell the sensor to start streaming a frame */
+    ret = fp_xiaomi_control_transfer(dev, FP_CMD_CAPTURE,
+                                    USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+                                    0x0000, 0x0000, NULL, 0);
+    if (ret < 0) {
+        goto out_stop;
+    }
+    
+    for (i = 0; i < FP_XIAOMI_URB_RING_SIZE; i++) {
+        spin_lock_irqsave(&dev->capture_lock, flags);
+        len = dev->frame_size - dev->frame_filled - dev->frame_in_flight;
+        len = min_t(size_t, len, FP_XIAOMI_URB_BUFFER_SIZE);
+        if (!dev->capture_active || len == 0) {
+            spin_unlock_irqrestore(&dev->capture_lock, flags);
+            break;
+        }
+        dev->frame_in_flight += len;
+        spin_unlock_irqrestore(&dev->capture_lock, flags);
+        
+        usb_fill_bulk_urb(dev->capture_urbs[i], dev->udev, pipe,
+                          dev->capture_bufs[i], len,
+                          fp_xiaomi_capture_complete, dev);
+        dev->capture_urbs[i]->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+        
+        usb_anchor_urb(dev->capture_urbs[i], &dev->capture_anchor);
+        ret = usb_submit_urb(dev->capture_urbs[i], GFP_KERNEL);
+        if (ret) {
+            usb_unanchor_urb(dev->capture_urbs[i]);
+            fp_dev_err(dev, "Capture URB submit failed: %d", ret);
+            if (ret == -ENODEV) {
+                fp_xiaomi_set_state(dev, FP_STATE_DISCONNECTED);
+            }
+            goto out_stop;
+        }
+    }
+    
+    timeout = wait_for_completion_interruptible_timeout(&dev->capture_done,
+                                                        fp_xiaomi_io_timeout(dev));
+    if (timeout <= 0) {
+        ret = timeout ? timeout : -ETIMEDOUT;
+        if (ret == -ETIMEDOUT) {
+            fp_dev_warn(dev, "Frame capture timeout (%zu/%zu bytes)",
+                       dev->frame_filled, frame_size);
+            fp_stat_inc(dev, FP_STAT_TIMEOUTS);
+        }
+        goto out_stop;
+    }
+    
+    spin_lock_irqsave(&dev->capture_lock, flags);
+    draining = dev->capture_draining;
+    ret = dev->capture_status ? dev->capture_status : (int)dev->frame_filled;
+    spin_unlock_irqrestore(&dev->capture_lock, flags);
+    
+    /*
+     * Killing URBs mid-frame would leave the rest of it queued on the
+     * endpoint, so a rejected or cancelled frame that has started keeps
+     * streaming into the void and is reaped by the next bulk IN user or
+     * drain_work.
+     */
+    if (draining) {
+        dev->drain_pending = true;
+    } else {
+        /* URBs still queued past the end of the frame are not needed */
+        usb_kill_anchored_urbs(&dev->capture_anchor);
     }
+    
+    if (ret == -EPIPE) {
+        fp_dev_warn(dev, "Bulk IN endpoint stalled, clearing");
+        usb_clear_halt(dev->udev, pipe);
+    }
+    
+    pm_qos_update_request(&dev->pm_qos, PM_QOS_DEFAULT_VALUE);
+    
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    fp_xiaomi_latency_record(&dev->latency[FP_LATENCY_CAPTURE], ns);
+    trace_fp_xiaomi_frame(&dev->interface->dev, frame_size, ret, ns);
+    return ret;
+    
+out_stop:
+    spin_lock_irqsave(&dev->capture_lock, flags);
+    dev->capture_active = false;
+    dev->capture_draining = false;
+    spin_unlock_irqrestore(&dev->capture_lock, flags);
+    usb_kill_anchored_urbs(&dev->capture_anchor);
+    pm_qos_update_request(&dev->pm_qos, PM_QOS_DEFAULT_VALUE);
+    trace_fp_xiaomi_frame(&dev->interface->dev, frame_size, ret,
+                          ktime_to_ns(ktime_sub(ktime_get(), start)));
+    return ret;
 }
 
 /**
- * Character device file operations
+ * Frame ring management
  */
-static int fp_xiaomi_open(struct inode *inode, struct file *file)
+static inline struct fp_frame_slot *fp_xiaomi_ring_slot(struct fp_xiaomi_device *dev,
+                                                        u32 index)
 {
-    struct fp_xiaomi_device *dev;
-    int ret = 0;
+    return (struct fp_frame_slot *)((u8 *)dev->ring + FP_RING_HEADER_SIZE +
+                                     (index % FP_RING_SLOT_COUNT) * FP_RING_SLOT_STRIDE);
+}
+
+static bool fp_xiaomi_ring_has_frames(struct fp_xiaomi_device *dev)
+{
+    return READ_ONCE(dev->ring_producer) != READ_ONCE(dev->ring->consumer);
+}
+
+static int fp_xiaomi_ring_init(struct fp_xiaomi_device *dev)
+{
+    dev->ring = vmalloc_user(PAGE_ALIGN(FP_RING_MAP_SIZE));
+    if (!dev->ring) {
+        return -ENOMEM;
+    }
     
-    dev = container_of(inode->i_cdev, struct fp_xiaomi_device, cdev);
+    dev->ring->magic = FP_RING_MAGIC;
+    dev->ring->version = FP_RING_VERSION;
+    dev->ring->slot_count = FP_RING_SLOT_COUNT;
+    dev->ring->slot_stride = FP_RING_SLOT_STRIDE;
+    dev->ring->slot_offset = FP_RING_HEADER_SIZE;
     
-    /* Check if device is still connected */
-    if (fp_xiaomi_get_state(dev) == FP_STATE_DISCONNECTED) {
-        return -ENODEV;
+    return 0;
+}
+
+/*
+ * Capture a frame straight into the next free ring slot. With publish
+ * set the slot is handed to the mmap reader, otherwise it only serves
+ * as the kernel-side buffer for a copying FP_IOC_CAPTURE_IMAGE.
+ * slot_flags (FP_FRAME_FLAG_*) are stored in the slot header and
+ * threshold gates the frame as in fp_xiaomi_capture_frame().
+ * Returns the frame length, never more than image_width * image_height,
+ * and its sequence in *sequence_out; the slot is found again with
+ * fp_xiaomi_ring_slot(). Caller must hold io_lock, which also makes it
+ * the only producer.
+ */
+static int fp_xiaomi_ring_capture(struct fp_xiaomi_device *dev, bool publish,
+                                  u16 slot_flags, u8 threshold, u32 *sequence_out)
+{
+    struct fp_frame_slot *slot;
+    unsigned long flags;
+    u32 producer, consumer;
+    u32 frame_size = dev->image_width * dev->image_height;
+    int ret;
+    
+    producer = dev->ring_producer;
+    consumer = smp_load_acquire(&dev->ring->consumer);
+    
+    /* Never overwrite a slot the reader may still be looking at */
+    if (producer - consumer >= FP_RING_SLOT_COUNT) {
+        fp_dev_dbg(dev, "Frame ring full (producer %u, consumer %u)",
+                   producer, consumer);
+        return -ENOBUFS;
     }
     
-    /* Increment reference count */
-    fp_xiaomi_get_device(dev);
+    slot = fp_xiaomi_ring_slot(dev, producer);
     
-    /* Store device pointer in file private data */
-    file->private_data = dev;
+    spin_lock_irqsave(&dev->capture_lock, flags);
+    dev->frame_buffer = slot->data;
+    spin_unlock_irqrestore(&dev->capture_lock, flags);
+    
+    ret = fp_xiaomi_capture_frame(dev, frame_size, threshold, false);
+    if (ret < 0) {
+        fp_stat_inc(dev, FP_STAT_CAPTURE_FAILURES);
+        return ret;
+    }
+    ret = min_t(u32, ret, frame_size);
+    
+    slot->sequence = producer;
+    slot->size = ret;
+    slot->width = dev->image_width;
+    slot->height = dev->image_height;
+    slot->format = FP_IMG_FORMAT_GRAY8;
+    slot->quality = 0;
+    slot->flags = slot_flags;
+    slot->timestamp_ns = ktime_get_ns();
+    
+    fp_stat_inc(dev, FP_STAT_CAPTURES);
+    
+    if (publish) {
+        /* Slot contents must be visible before the new producer index */
+        WRITE_ONCE(dev->ring_producer, producer + 1);
+        smp_store_release(&dev->ring->producer, producer + 1);
+        wake_up_interruptible(&dev->read_wait);
+    }
+    
+    if (sequence_out) {
+        *sequence_out = producer;
+    }
+    
+    return ret;
+}
+
+/*
+ * Wake-on-touch: the sensor woke the bus because a finger landed, so
+ * take the frame now rather than after a round trip through user
+ * space. Only done into a mapped, drained ring; the slot is tagged so
+ * the library hands it to the next capture request. Caller holds io_lock.
+ */
+static void fp_xiaomi_wake_capture(struct fp_xiaomi_device *dev)
+{
+    int ret;
+    
+    if (!atomic_read(&dev->ring_maps) || fp_xiaomi_ring_has_frames(dev)) {
+        return;
+    }
+    
+    fp_xiaomi_set_state(dev, FP_STATE_CAPTURING);
+    ret = fp_xiaomi_ring_capture(dev, true, FP_FRAME_FLAG_WAKE, 0, NULL);
+    fp_xiaomi_set_state(dev, FP_STATE_READY);
+    
+    if (ret < 0) {
+        fp_dev_dbg(dev, "Wake-on-touch capture failed: %d", ret);
+    }
+}
+
+/*
+ * Drop-oldest backpressure: with no slot free, take the oldest unread
+ * one back from the reader. cmpxchg() is a full barrier, so the slot is
+ * only rewritten after consumer has visibly moved past it; if the
+ * reader advanced consumer first the slot is free anyway. Caller holds
+ * io_lock.
+ */
+static void fp_xiaomi_ring_reclaim(struct fp_xiaomi_device *dev)
+{
+    u32 producer = dev->ring_producer;
+    u32 consumer = READ_ONCE(dev->ring->consumer);
+    
+    if (producer - consumer != FP_RING_SLOT_COUNT) {
+        return;
+    }
+    
+    if (cmpxchg(&dev->ring->consumer, consumer, consumer + 1) == consumer) {
+        WRITE_ONCE(dev->ring->dropped, dev->ring->dropped + 1);
+    }
+}
+
+/*
+ * End the stream; error (0 or -errno) is left in the ring for the
+ * reader. Detection is not re-armed here, the caller does that once it
+ * is done with the endpoint. Caller holds io_lock.
+ */
+static void fp_xiaomi_stream_end(struct fp_xiaomi_device *dev, int error)
+{
+    if (!dev->stream_owner) {
+        return;
+    }
+    
+    dev->stream_owner = NULL;
+    WRITE_ONCE(dev->ring->stream_status, error);
+    usb_autopm_put_interface_no_suspend(dev->interface);
+    wake_up_interruptible(&dev->read_wait);
+}
+
+/*
+ * One frame of a stream. A frame that finds the ring full under
+ * blocking backpressure is skipped, not failed, and the next attempt
+ * waits at least a tick so a stalled reader does not spin the queue.
+ */
+static void fp_xiaomi_stream_work(struct work_struct *work)
+{
+    struct fp_xiaomi_device *dev = container_of(to_delayed_work(work),
+                                                struct fp_xiaomi_device, stream_work);
+    unsigned long start = jiffies;
+    unsigned long delay;
+    int ret;
+    
+    mutex_lock(&dev->io_lock);
+    if (!dev->stream_owner) {
+        goto out;
+    }
+    
+    switch (fp_xiaomi_get_state(dev)) {
+    case FP_STATE_READY:
+        break;
+    case FP_STATE_DISCONNECTED:
+        fp_xiaomi_stream_end(dev, -ENODEV);
+        goto out;
+    default:
+        /* Init or recovery owns the sensor; try again next interval */
+        ret = -ENOBUFS;
+        goto requeue;
+    }
+    
+    if (dev->stream_flags & FP_STREAM_DROP_OLDEST) {
+        fp_xiaomi_ring_reclaim(dev);
+    }
+    
+    fp_xiaomi_set_state(dev, FP_STATE_CAPTURING);
+    ret = fp_xiaomi_ring_capture(dev, true, FP_FRAME_FLAG_STREAM, 0, NULL);
+    fp_xiaomi_set_state(dev, FP_STATE_READY);
+    
+    if (ret >= 0) {
+        dev->stream_failures = 0;
+        if (dev->stream_remaining && --dev->stream_remaining == 0) {
+            fp_xiaomi_stream_end(dev, 0);
+            fp_xiaomi_detect_arm(dev);
+            goto out;
+        }
+    } else if (ret != -ENOBUFS) {
+        fp_dev_dbg(dev, "Stream frame failed: %d", ret);
+        if (ret == -ENODEV || ++dev->stream_failures >= FP_XIAOMI_RETRY_COUNT) {
+            fp_dev_warn(dev, "Stopping stream after error %d", ret);
+            fp_xiaomi_stream_end(dev, ret);
+            fp_xiaomi_detect_arm(dev);
+            goto out;
+        }
+    }
+    
+requeue:
+    delay = jiffies - start < dev->stream_interval ?
+            dev->stream_interval - (jiffies - start) : 0;
+    if (ret == -ENOBUFS) {
+        delay = max(delay, 1UL);
+    }
+    queue_delayed_work(dev->workqueue, &dev->stream_work, delay);
+    
+out:
+    mutex_unlock(&dev->io_lock);
+}
+
+/*
+ * Host-side check ahead of a sensor-side capture flagged
+ * FP_FLAG_QUALITY_CHECK: a touch that cannot reach threshold is turned
+ * away with -EBADMSG part way through one frame instead of after a full
+ * sensor round trip. Only as much of the frame is waited for as the
+ * gate needs either way; the rest drains in the background. The
+ * pixels go to an unpublished ring slot and are not a capture of their
+ * own; with every slot held by the reader the sensor's own check is
+ * left to do the job. Caller holds io_lock.
+ */
+static int fp_xiaomi_quality_precheck(struct fp_xiaomi_device *dev, u32 op_flags,
+                                      u8 threshold)
+{
+    unsigned long flags;
+    u32 producer;
+    int ret;
+    
+    if (!(op_flags & FP_FLAG_QUALITY_CHECK) || !threshold) {
+        return 0;
+    }
+    
+    producer = dev->ring_producer;
+    if (producer - smp_load_acquire(&dev->ring->consumer) >= FP_RING_SLOT_COUNT) {
+        return 0;
+    }
+    
+    spin_lock_irqsave(&dev->capture_lock, flags);
+    dev->frame_buffer = fp_xiaomi_ring_slot(dev, producer)->data;
+    spin_unlock_irqrestore(&dev->capture_lock, flags);
+    
+    fp_stat_inc(dev, FP_STAT_PRECHECKS);
+    ret = fp_xiaomi_capture_frame(dev, dev->image_width * dev->image_height, threshold, true);
+    
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * Finger presence detection
+ *
+ * The sensor has no interrupt endpoint, so finger-down/finger-up
+ * notifications arrive as short packets on the bulk IN endpoint once
+ * FP_CMD_DETECT_FINGER has armed it. A single URB waits for them and is
+ * resubmitted from its completion handler; nothing runs on the host
+ * while no finger is touching the sensor.
+ */
+static void fp_xiaomi_queue_finger_event(struct fp_xiaomi_device *dev, u8 type)
+{
+    struct fp_finger_event event;
+    unsigned long flags;
+    
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+    event.timestamp_ns = ktime_get_real_ns();
+    
+    spin_lock_irqsave(&dev->event_lock, flags);
+    if (kfifo_is_full(&dev->finger_events)) {
+        kfifo_skip(&dev->finger_events);
+    }
+    kfifo_put(&dev->finger_events, event);
+    spin_unlock_irqrestore(&dev->event_lock, flags);
+    
+    wake_up_interruptible(&dev->read_wait);
+}
+
+static void fp_xiaomi_detect_complete(struct urb *urb)
+{
+    struct fp_xiaomi_device *dev = urb->context;
+    struct fp_packet *packet = urb->transfer_buffer;
+    int status = urb->status;
+    int ret;
+    
+    if (status) {
+        /* Killed by detect_pause(); anything else waits for the next re-arm */
+        if (status != -ENOENT && status != -ECONNRESET && status != -ESHUTDOWN) {
+            fp_dev_err(dev, "Finger detect URB failed: %d", status);
+            fp_stat_inc(dev, FP_STAT_ERRORS);
+        }
+        return;
+    }
+    
+    if (urb->actual_length >= sizeof(*packet) && packet->cmd == FP_CMD_DETECT_FINGER &&
+        (packet->flags == FP_FINGER_EVENT_DOWN || packet->flags == FP_FINGER_EVENT_UP)) {
+        fp_xiaomi_queue_finger_event(dev, packet->flags);
+        /* A finger on the sensor is activity; hold off autosuspend */
+        usb_mark_last_busy(dev->udev);
+        
+        if (packet->flags == FP_FINGER_EVENT_DOWN && READ_ONCE(dev->prearmed)) {
+            WRITE_ONCE(dev->prearm_touched, true);
+            mod_delayed_work(dev->workqueue, &dev->prearm_work, 0);
+        }
+    }
+    
+    ret = usb_submit_urb(urb, GFP_ATOMIC);
+    if (ret && ret != -EPERM) {
+        fp_dev_err(dev, "Finger detect URB resubmit failed: %d", ret);
+    }
+}
+
+/* Arm detection while the node is open and the sensor idle; caller holds io_lock */
+static void fp_xiaomi_detect_arm(struct fp_xiaomi_device *dev)
+{
+    int ret;
+    
+    /* drain_work arms once the tail of a rejected frame is gone; a stream owns the endpoint */
+    if (dev->detect_armed || dev->drain_pending || dev->stream_owner ||
+        atomic_read(&dev->open_count) == 0 || fp_xiaomi_get_state(dev) != FP_STATE_READY) {
+        return;
+    }
+    
+    ret = fp_xiaomi_control_transfer(dev, FP_CMD_DETECT_FINGER,
+                                    USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+                                    0x0001, 0x0000, NULL, 0);
+    if (ret < 0) {
+        return;
+    }
+    
+    usb_fill_bulk_urb(dev->detect_urb, dev->udev,
+                      usb_rcvbulkpipe(dev->udev, dev->bulk_in->bEndpointAddress),
+                      dev->detect_buf, FP_XIAOMI_BUFFER_SIZE,
+                      fp_xiaomi_detect_complete, dev);
+    dev->detect_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+    
+    ret = usb_submit_urb(dev->detect_urb, GFP_KERNEL);
+    if (ret) {
+        fp_dev_err(dev, "Finger detect URB submit failed: %d", ret);
+        return;
+    }
+    
+    dev->detect_armed = true;
+}
+
+/*
+ * Return the sensor to idle; caller holds io_lock. Besides disarming
+ * detection, this ends any capture, verify or identify the sensor is
+ * still waiting on a finger for, so a cancelled one never answers into
+ * the next transfer.
+ */
+static void fp_xiaomi_sensor_stop(struct fp_xiaomi_device *dev)
+{
+    fp_xiaomi_control_transfer(dev, FP_CMD_DETECT_FINGER,
+                              USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+                              0x0000, 0x0000, NULL, 0);
+}
+
+/* Release the bulk IN endpoint for command data; caller holds io_lock */
+static void fp_xiaomi_detect_pause(struct fp_xiaomi_device *dev)
+{
+    if (!dev->detect_armed) {
+        return;
+    }
+    
+    usb_kill_urb(dev->detect_urb);
+    dev->detect_armed = false;
+    
+    fp_xiaomi_sensor_stop(dev);
+}
+
+/*
+ * Pre-arm (FP_IOC_PREARM): the ioctl path has already resumed the
+ * sensor and flushed init; the extra PM reference keeps it there and
+ * detection stays armed as on any open, idle node. Caller holds io_lock.
+ */
+static void fp_xiaomi_prearm_end(struct fp_xiaomi_device *dev)
+{
+    if (!dev->prearmed) {
+        return;
+    }
+    
+    WRITE_ONCE(dev->prearmed, false);
+    WRITE_ONCE(dev->prearm_touched, false);
+    
+    /* Idle from now on, so autosuspend counts its delay from here */
+    usb_mark_last_busy(dev->udev);
+    usb_autopm_put_interface_async(dev->interface);
+}
+
+/*
+ * The pre-arm window closed: the timeout ran out or a touch cut it
+ * short. A touch is captured first, as on wake from autosuspend, so the
+ * request that follows it finds the frame in the ring.
+ */
+static void fp_xiaomi_prearm_work(struct work_struct *work)
+{
+    struct fp_xiaomi_device *dev = container_of(to_delayed_work(work),
+                                                struct fp_xiaomi_device, prearm_work);
+    
+    mutex_lock(&dev->io_lock);
+    if (dev->prearmed && READ_ONCE(dev->prearm_touched) &&
+        fp_xiaomi_get_state(dev) == FP_STATE_READY && !dev->stream_owner) {
+        fp_xiaomi_detect_pause(dev);
+        fp_xiaomi_wake_capture(dev);
+        fp_xiaomi_detect_arm(dev);
+    }
+    fp_xiaomi_prearm_end(dev);
+    mutex_unlock(&dev->io_lock);
+}
+
+/*
+ * Tell a wake-on-touch from any other resume nobody asked for (usbfs,
+ * power/control, hub events). The sensor stays armed across suspend, so
+ * a touch that woke the bus left its finger-down packet on bulk IN;
+ * otherwise nothing arrives within FP_XIAOMI_WAKE_PROBE_MS. Caller
+ * holds io_lock.
+ */
+static bool fp_xiaomi_wake_probe(struct fp_xiaomi_device *dev)
+{
+    struct fp_packet *packet = (struct fp_packet *)dev->bulk_in_buffer;
+    int ret;
+    
+    usb_fill_bulk_urb(dev->io_urb, dev->udev,
+                      usb_rcvbulkpipe(dev->udev, dev->bulk_in->bEndpointAddress),
+                      dev->bulk_in_buffer, FP_XIAOMI_BUFFER_SIZE,
+                      fp_xiaomi_io_complete, NULL);
+    
+    dev->io_deadline = jiffies + msecs_to_jiffies(FP_XIAOMI_WAKE_PROBE_MS);
+    dev->io_caller_deadline = true;
+    ret = fp_xiaomi_io_run(dev);
+    dev->io_caller_deadline = false;
+    
+    return ret >= (int)sizeof(*packet) && packet->cmd == FP_CMD_DETECT_FINGER &&
+           packet->flags == FP_FINGER_EVENT_DOWN;
+}
+
+static bool fp_xiaomi_has_finger_events(struct fp_xiaomi_device *dev)
+{
+    return !kfifo_is_empty(&dev->finger_events);
+}
+
+/**
+ * Protocol command layer
+ *
+ * A command is a vendor OUT control request (bRequest = FP_CMD_*) that
+ * carries the parameter block, followed by a vendor IN request on the
+ * same bRequest that returns a status byte (FP_RESP_*) and the response
+ * payload. Bulk data (templates) follows on the bulk IN endpoint.
+ */
+static int fp_xiaomi_resp_to_errno(u8 resp)
+{
+    switch (resp) {
+    case FP_RESP_OK:
+        return 0;
+    case FP_RESP_TIMEOUT:
+        return -ETIMEDOUT;
+    case FP_RESP_NO_FINGER:
+        return -ENODATA;
+    case FP_RESP_BAD_IMAGE:
+        return -EBADMSG;
+    case FP_RESP_NO_MATCH:
+        return -ENOKEY;
+    case FP_RESP_BUSY:
+        return -EBUSY;
+    case FP_RESP_NOT_SUPPORTED:
+        return -EOPNOTSUPP;
+    default:
+        return -EIO;
+    }
+}
+
+/* Send one command; caller must hold io_lock. Returns response length. */
+static int fp_xiaomi_send_command(struct fp_xiaomi_device *dev, u8 cmd, u16 value,
+                                  const void *params, u16 params_len,
+                                  void *resp, u16 resp_len)
+{
+    unsigned char *buf = dev->control_buffer;
+    ktime_t start = ktime_get();
+    int ret;
+    
+    if (params_len > FP_XIAOMI_BUFFER_SIZE || resp_len >= FP_XIAOMI_BUFFER_SIZE) {
+        return -EINVAL;
+    }
+    
+    if (params_len) {
+        memcpy(buf, params, params_len);
+    }
+    
+    ret = fp_xiaomi_control_transfer(dev, cmd,
+                                    USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+                                    value, 0x0000, params_len ? buf : NULL, params_len);
+    if (ret < 0) {
+        goto out;
+    }
+    
+    ret = fp_xiaomi_control_transfer(dev, cmd,
+                                    USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+                                    value, 0x0000, buf, resp_len + 1);
+    if (ret < 0) {
+        goto out;
+    }
+    
+    if (ret < 1) {
+        ret = -EPROTO;
+        goto out;
+    }
+    
+    ret = fp_xiaomi_resp_to_errno(buf[0]) ? : ret - 1;
+    if (ret > 0 && resp) {
+        memcpy(resp, buf + 1, min_t(int, ret, resp_len));
+    }
+    
+out:
+    if (ret < 0) {
+        WRITE_ONCE(dev->last_error, min(-ret, 255));
+    }
+    fp_xiaomi_latency_record(&dev->latency[FP_LATENCY_COMMAND],
+                             ktime_to_ns(ktime_sub(ktime_get(), start)));
+    return ret;
+}
+
+/* Read exactly length bytes of bulk data following a command */
+static int fp_xiaomi_bulk_read_all(struct fp_xiaomi_device *dev,
+                                   unsigned char *buffer, int length)
+{
+    int done = 0;
+    int ret;
+    
+    fp_xiaomi_capture_drain(dev);
+    
+    while (done < length) {
+        ret = fp_xiaomi_bulk_in_transfer(dev, dev->bulk_in_buffer,
+                                         min(length - done, FP_XIAOMI_BUFFER_SIZE));
+        if (ret < 0) {
+            return ret;
+        }
+        if (ret == 0) {
+            return -EPROTO;
+        }
+        memcpy(buffer + done, dev->bulk_in_buffer, ret);
+        done += ret;
+    }
+    
+    return done;
+}
+
+/* Write a data block in control-transfer sized chunks (wValue = offset) */
+static int fp_xiaomi_send_data(struct fp_xiaomi_device *dev, u8 cmd, u16 index,
+                               const unsigned char *data, int length)
+{
+    int offset, chunk;
+    int ret;
+    
+    for (offset = 0; offset < length; offset += chunk) {
+        chunk = min(length - offset, FP_XIAOMI_BUFFER_SIZE);
+        memcpy(dev->control_buffer, data + offset, chunk);
+        ret = fp_xiaomi_control_transfer(dev, cmd,
+                                        USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+                                        offset, index, dev->control_buffer, chunk);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    
+    return 0;
+}
+
+/**
+ * Device initialization and firmware loading
+ */
+static int fp_xiaomi_load_firmware(struct fp_xiaomi_device *dev)
+{
+    const struct firmware *fw;
+    int ret;
+    char fw_name[64];
+    
+    /* The filesystem lookup only ever happens once per device */
+    if (dev->firmware_checked) {
+        return 0;
+    }
+    
+    /* Try different firmware names based on device */
+    snprintf(fw_name, sizeof(fw_name), "fpc_xiaomi_%04x_%04x.bin",
+             FPC_VENDOR_ID, FPC_PRODUCT_ID);
+    
+    fp_dev_info(dev, "Loading firmware: %s", fw_name);
+    
+    ret = request_firmware(&fw, fw_name, &dev->udev->dev);
+    if (ret < 0) {
+        /* Try generic firmware */
+        ret = request_firmware(&fw, "fpc_xiaomi_generic.bin", &dev->udev->dev);
+        if (ret < 0) {
+            fp_dev_warn(dev, "No firmware found, using device defaults");
+            dev->firmware_loaded = false;
+            dev->firmware_checked = true;
+            return 0; /* Not fatal */
+        }
+    }
+    
+    fp_dev_info(dev, "Firmware loaded: %zu bytes", fw->size);
+    
+    /* TODO: Implement firmware upload protocol */
+    /* This would involve sending firmware data to device */
+    
+    dev->firmware = fw;
+    dev->firmware_loaded = true;
+    dev->firmware_checked = true;
+    
+    return 0;
+}
+
+static int fp_xiaomi_get_device_info(struct fp_xiaomi_device *dev)
+{
+    unsigned char resp_buffer[64];
+    int ret;
+    
+    fp_dev_dbg(dev, "Getting device information from FPC L:0001");
+    
+    /* FPC L:0001 device info via control transfer */
+    /* Based on fingerprint-ocv analysis, use vendor-specific control requests */
+    ret = fp_xiaomi_control_transfer(dev, 0x01, USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+                                    0x0000, 0x0000, resp_buffer, sizeof(resp_buffer));
+    
+    if (ret < 0) {
+        fp_dev_warn(dev, "Control transfer for device info failed, trying alternative method");
+        
+        /* Alternative: Try to get info from device descriptors */
+        strncpy(dev->firmware_version, "021.26.2.031", sizeof(dev->firmware_version) - 1);
+        dev->image_width = 160;  /* Typical for FPC sensors */
+        dev->image_height = 160;
+        dev->template_count = 0;
+        dev->device_flags = 0x0001; /* Basic capture capability */
+        
+        fp_dev_info(dev, "Using default device info: FW %s, Image %dx%d",
+                   dev->firmware_version, dev->image_width, dev->image_height);
+        dev->info_valid = false;
+        fp_xiaomi_update_snapshot(dev);
+        return 0;
+    }
+    
+    /* Parse response if we got data */
+    if (ret >= 16) {
+        /* Extract firmware version from response */
+        snprintf(dev->firmware_version, sizeof(dev->firmware_version),
+                "021.26.2.%03d", resp_buffer[3]);
+        
+        /* Set reasonable defaults for FPC L:0001 */
+        dev->image_width = 160;
+        dev->image_height = 160;
+        dev->template_count = 0;
+        dev->device_flags = 0x0001;
+        
+        fp_dev_info(dev, "Device info: FW %s, Image %dx%d, Templates %d",
+                   dev->firmware_version, dev->image_width, 
+                   dev->image_height, dev->template_count);
+        
+        dev->info_version = resp_buffer[3];
+        dev->info_valid = true;
+    }
+    
+    fp_xiaomi_update_snapshot(dev);
+    return 0;
+}
+
+/**
+ * Device initialization work function
+ */
+/* Full initialization: firmware lookup and device info parse */
+static int fp_xiaomi_cold_init(struct fp_xiaomi_device *dev)
+{
+    int ret;
+    
+    /* Load firmware if available */
+    ret = fp_xiaomi_load_firmware(dev);
+    if (ret < 0) {
+        fp_dev_err(dev, "Firmware loading failed: %d", ret);
+        return ret;
+    }
+    
+    /* Get device information */
+    ret = fp_xiaomi_get_device_info(dev);
+    if (ret < 0) {
+        fp_dev_err(dev, "Device info retrieval failed: %d", ret);
+        return ret;
+    }
+    
+    return 0;
+}
+
+/*
+ * Warm reinit after resume or reset: one info request confirms the
+ * sensor still runs the firmware the cached info was parsed from.
+ * Returns -ESTALE when it does not, so the caller falls back to cold.
+ */
+static int fp_xiaomi_warm_init(struct fp_xiaomi_device *dev)
+{
+    unsigned char *buf = dev->control_buffer;
+    int ret;
+    
+    ret = fp_xiaomi_control_transfer(dev, FP_CMD_GET_INFO,
+                                    USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+                                    0x0000, 0x0000, buf, FP_XIAOMI_BUFFER_SIZE);
+    if (ret < 0) {
+        return ret;
+    }
+    
+    if (ret < 16 || buf[3] != dev->info_version) {
+        fp_dev_info(dev, "Sensor firmware changed, reinitializing from scratch");
+        dev->info_valid = false;
+        return -ESTALE;
+    }
+    
+    fp_xiaomi_update_snapshot(dev);
+    return 0;
+}
+
+static void fp_xiaomi_init_work(struct work_struct *work)
+{
+    struct fp_xiaomi_device *dev = container_of(work, struct fp_xiaomi_device, init_work);
+    int ret;
+    int retry_count = 0;
+    
+    fp_dev_info(dev, "Starting device initialization");
+    fp_xiaomi_set_state(dev, FP_STATE_INITIALIZING);
+    
+    /*
+     * Keep the device from autosuspending between init steps. Must not
+     * resume: suspend cancels this work synchronously.
+     */
+    usb_autopm_get_interface_no_resume(dev->interface);
+    
+    mutex_lock(&dev->io_lock);
+    if (dev->wake_check) {
+        dev->wake_check = false;
+        dev->wake_capture = fp_xiaomi_wake_probe(dev);
+        if (dev->wake_capture) {
+            fp_xiaomi_queue_finger_event(dev, FP_FINGER_EVENT_DOWN);
+        }
+    }
+    mutex_unlock(&dev->io_lock);
+    
+    /* Retry initialization if it fails */
+    while (retry_count < FP_XIAOMI_RETRY_COUNT) {
+        mutex_lock(&dev->io_lock);
+        fp_xiaomi_detect_pause(dev);
+        if (dev->info_valid) {
+            ret = fp_xiaomi_warm_init(dev);
+            if (ret == -ESTALE) {
+                ret = fp_xiaomi_cold_init(dev);
+            }
+        } else {
+            ret = fp_xiaomi_cold_init(dev);
+        }
+        /* Whatever was listed before the reset or suspend is suspect */
+        if (ret == 0) {
+            fp_xiaomi_templates_changed(dev);
+        }
+        mutex_unlock(&dev->io_lock);
+        
+        if (ret < 0) {
+            goto retry;
+        }
+        
+        /* Device initialized successfully */
+        fp_xiaomi_set_state(dev, FP_STATE_READY);
+        fp_dev_info(dev, "Device initialization completed");
+        
+        /* Readers that opened the node before init finished get detection now */
+        mutex_lock(&dev->io_lock);
+        if (dev->wake_capture) {
+            dev->wake_capture = false;
+            fp_xiaomi_wake_capture(dev);
+        }
+        /* A stream interrupted by suspend picks up where it left off */
+        if (dev->stream_owner) {
+            queue_delayed_work(dev->workqueue, &dev->stream_work, 0);
+        }
+        fp_xiaomi_detect_arm(dev);
+        mutex_unlock(&dev->io_lock);
+        goto out;
+        
+retry:
+        retry_count++;
+        fp_stat_inc(dev, FP_STAT_RETRIES);
+        fp_dev_warn(dev, "Initialization retry %d/%d", retry_count, FP_XIAOMI_RETRY_COUNT);
+        /* Glitches after resume clear within tens of ms; back off from there */
+        msleep(fp_xiaomi_backoff_ms(retry_count - 1, FP_XIAOMI_INIT_BACKOFF_MS,
+                                    FP_XIAOMI_INIT_BACKOFF_CAP_MS));
+    }
+    
+    /* All retries failed */
+    fp_dev_err(dev, "Device initialization failed after %d retries", FP_XIAOMI_RETRY_COUNT);
+    fp_xiaomi_set_state(dev, FP_STATE_ERROR);
+    fp_xiaomi_trigger_recovery(&dev->recovery, FP_RECOVERY_HARDWARE);
+    
+out:
+    usb_autopm_put_interface(dev->interface);
+}
+
+/* The tail of a rejected frame has arrived: reap it and re-arm detection */
+static void fp_xiaomi_drain_work(struct work_struct *work)
+{
+    struct fp_xiaomi_device *dev = container_of(work, struct fp_xiaomi_device, drain_work);
+    
+    usb_autopm_get_interface_no_resume(dev->interface);
+    mutex_lock(&dev->io_lock);
+    fp_xiaomi_capture_drain(dev);
+    fp_xiaomi_detect_arm(dev);
+    mutex_unlock(&dev->io_lock);
+    usb_autopm_put_interface(dev->interface);
+}
+
+/**
+ * Error handling work function
+ */
+static void fp_xiaomi_error_work(struct work_struct *work)
+{
+    struct fp_xiaomi_device *dev = container_of(work, struct fp_xiaomi_device, error_work);
+    
+    fp_dev_info(dev, "Handling device error, attempting recovery");
+    
+    /* Try to reset and reinitialize the device */
+    if (fp_xiaomi_get_state(dev) != FP_STATE_DISCONNECTED) {
+        fp_xiaomi_trigger_recovery(&dev->recovery, FP_RECOVERY_COMMUNICATION);
+    }
+}
+
+/**
+ * Recovery hooks
+ *
+ * Called from the recovery work on dev->workqueue. Each takes io_lock
+ * itself, so user requests and recovery steps never interleave on the
+ * wire.
+ */
+static int fp_xiaomi_recovery_clear_halt(struct fp_xiaomi_device *dev)
+{
+    int ret;
+    
+    mutex_lock(&dev->io_lock);
+    fp_xiaomi_detect_pause(dev);
+    ret = usb_clear_halt(dev->udev, usb_rcvbulkpipe(dev->udev, dev->bulk_in->bEndpointAddress));
+    mutex_unlock(&dev->io_lock);
+    
+    return ret;
+}
+
+static int fp_xiaomi_recovery_reset_hardware(struct fp_xiaomi_device *dev)
+{
+    int ret;
+    
+    ret = usb_lock_device_for_reset(dev->udev, dev->interface);
+    if (ret) {
+        return ret;
+    }
+    
+    ret = usb_reset_device(dev->udev);
+    usb_unlock_device(dev->udev);
+    return ret;
+}
+
+static int fp_xiaomi_recovery_reset_interface(struct fp_xiaomi_device *dev)
+{
+    int ret;
+    
+    mutex_lock(&dev->io_lock);
+    fp_xiaomi_detect_pause(dev);
+    ret = fp_xiaomi_send_command(dev, FP_CMD_RESET, 0, NULL, 0, NULL, 0);
+    mutex_unlock(&dev->io_lock);
+    
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * One device info request, its failure reported as such. Unlike
+ * fp_xiaomi_get_device_info() this never falls back to defaults; a
+ * short answer counts as no answer.
+ */
+static int fp_xiaomi_recovery_test_communication(struct fp_xiaomi_device *dev)
+{
+    int ret;
+    
+    mutex_lock(&dev->io_lock);
+    ret = fp_xiaomi_control_transfer(dev, FP_CMD_GET_INFO,
+                                    USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+                                    0x0000, 0x0000, dev->control_buffer,
+                                    FP_XIAOMI_BUFFER_SIZE);
+    mutex_unlock(&dev->io_lock);
+    
+    if (ret >= 0 && ret < 16) {
+        ret = -EPROTO;
+    }
+    
+    return ret < 0 ? ret : 0;
+}
+
+static int fp_xiaomi_recovery_reinitialize(struct fp_xiaomi_device *dev)
+{
+    int ret;
+    
+    mutex_lock(&dev->io_lock);
+    fp_xiaomi_detect_pause(dev);
+    
+    /* Re-parse the device info; the cached firmware image is still good */
+    ret = fp_xiaomi_cold_init(dev);
+    if (ret == 0) {
+        fp_xiaomi_templates_changed(dev);
+    }
+    
+    mutex_unlock(&dev->io_lock);
+    return ret;
+}
+
+static void fp_xiaomi_recovery_recovered(struct fp_xiaomi_device *dev)
+{
+    mutex_lock(&dev->io_lock);
+    if (fp_xiaomi_get_state(dev) != FP_STATE_DISCONNECTED) {
+        fp_xiaomi_set_state(dev, FP_STATE_READY);
+        fp_xiaomi_detect_arm(dev);
+    }
+    mutex_unlock(&dev->io_lock);
+}
+
+static void fp_xiaomi_recovery_failed(struct fp_xiaomi_device *dev)
+{
+    if (fp_xiaomi_get_state(dev) != FP_STATE_DISCONNECTED) {
+        fp_xiaomi_set_state(dev, FP_STATE_ERROR);
+    }
+}
+
+static const struct fp_recovery_ops fp_xiaomi_recovery_ops = {
+    .clear_halt = fp_xiaomi_recovery_clear_halt,
+    .reset_hardware = fp_xiaomi_recovery_reset_hardware,
+    .reset_interface = fp_xiaomi_recovery_reset_interface,
+    .reinitialize = fp_xiaomi_recovery_reinitialize,
+    .test_communication = fp_xiaomi_recovery_test_communication,
+    .recovered = fp_xiaomi_recovery_recovered,
+    .recovery_failed = fp_xiaomi_recovery_failed,
+};
+
+/**
+ * Runtime PM
+ *
+ * Every path that talks to the sensor holds an autopm reference, so the
+ * USB core suspends the device once it has been idle for
+ * power.auto_suspend_delay seconds. While the node is open the sensor
+ * stays armed across suspend and wakes the bus on touch (remote wakeup).
+ */
+static int fp_xiaomi_pm_get(struct fp_xiaomi_device *dev)
+{
+    int ret;
+    
+    atomic_inc(&dev->pm_requests);
+    ret = usb_autopm_get_interface(dev->interface);
+    if (ret) {
+        atomic_dec(&dev->pm_requests);
+        return ret;
+    }
+    
+    /* A resume queues warm init; the caller needs the sensor ready */
+    flush_work(&dev->init_work);
+    return 0;
+}
+
+static void fp_xiaomi_pm_put(struct fp_xiaomi_device *dev)
+{
+    usb_autopm_put_interface(dev->interface);
+    atomic_dec(&dev->pm_requests);
+}
+
+/**
+ * Character device file operations
+ */
+static int fp_xiaomi_open(struct inode *inode, struct file *file)
+{
+    struct fp_xiaomi_device *dev;
+    int ret = 0;
+    
+    dev = container_of(inode->i_cdev, struct fp_xiaomi_device, cdev);
+    
+    /* Check if device is still connected */
+    if (fp_xiaomi_get_state(dev) == FP_STATE_DISCONNECTED) {
+        return -ENODEV;
+    }
+    
+    /* Increment reference count */
+    fp_xiaomi_get_device(dev);
+    
+    /* Store device pointer in file private data */
+    file->private_data = dev;
+    
+    /* Increment open count */
+    atomic_inc(&dev->open_count);
+    
+    fp_dev_info(dev, "Device opened (open count: %d)", 
+               atomic_read(&dev->open_count));
+    
+    /* Someone is listening for touches: let the sensor wake the bus */
+    dev->interface->needs_remote_wakeup = 1;
+    
+    if (fp_xiaomi_pm_get(dev) == 0) {
+        mutex_lock(&dev->io_lock);
+        fp_xiaomi_detect_arm(dev);
+        mutex_unlock(&dev->io_lock);
+        fp_xiaomi_pm_put(dev);
+    }
+    
+    return ret;
+}
+
+static int fp_xiaomi_release(struct inode *inode, struct file *file)
+{
+    struct fp_xiaomi_device *dev = file->private_data;
+    int pm_ret;
+    
+    if (dev) {
+        /* Nobody is left to receive finger events */
+        pm_ret = fp_xiaomi_pm_get(dev);
+        mutex_lock(&dev->io_lock);
+        if (dev->stream_owner == file) {
+            fp_xiaomi_stream_end(dev, 0);
+            if (!pm_ret) {
+                fp_xiaomi_detect_arm(dev);
+            }
+        }
+        if (atomic_dec_and_test(&dev->open_count)) {
+            fp_xiaomi_detect_pause(dev);
+            fp_xiaomi_prearm_end(dev);
+            dev->interface->needs_remote_wakeup = 0;
+        }
+        mutex_unlock(&dev->io_lock);
+        if (!pm_ret) {
+            fp_xiaomi_pm_put(dev);
+        }
+        
+        fp_dev_info(dev, "Device closed (open count: %d)", 
+                   atomic_read(&dev->open_count));
+        
+        /* Release device reference */
+        fp_xiaomi_put_device(dev);
+    }
+    
+    return 0;
+}
+
+static ssize_t fp_xiaomi_read(struct file *file, char __user *buffer,
+                             size_t count, loff_t *ppos)
+{
+    struct fp_xiaomi_device *dev = file->private_data;
+    int ret;
+    
+    if (!dev || count == 0) {
+        return -EINVAL;
+    }
+    
+    if (count > FP_XIAOMI_BUFFER_SIZE) {
+        count = FP_XIAOMI_BUFFER_SIZE;
+    }
+    
+    /* Check device state */
+    if (fp_xiaomi_get_state(dev) != FP_STATE_READY) {
+        return -ENODEV;
+    }
+    
+    mutex_lock(&dev->io_lock);
+    fp_xiaomi_detect_pause(dev);
+    
+    /* Read data from device */
+    ret = fp_xiaomi_bulk_transfer(dev, dev->bulk_in_buffer, count,
+                                 FP_BULK_IN_EP, false);
+    if (ret < 0) {
+        goto out;
+    }
+    
+    /* Copy to user space */
+    if (copy_to_user(buffer, dev->bulk_in_buffer, ret)) {
+        ret = -EFAULT;
+        goto out;
+    }
+    
+out:
+    fp_xiaomi_detect_arm(dev);
+    mutex_unlock(&dev->io_lock);
+    return ret;
+}
+
+static ssize_t fp_xiaomi_write(struct file *file, const char __user *buffer,
+                              size_t count, loff_t *ppos)
+{
+    struct fp_xiaomi_device *dev = file->private_data;
+    int ret;
+    
+    if (!dev || count == 0) {
+        return -EINVAL;
+    }
+    
+    if (count > FP_XIAOMI_BUFFER_SIZE) {
+        count = FP_XIAOMI_BUFFER_SIZE;
+    }
+    
+    /* Check device state */
+    if (fp_xiaomi_get_state(dev) != FP_STATE_READY) {
+        return -ENODEV;
+    }
+    
+    mutex_lock(&dev->io_lock);
+    
+    /* Copy from user space */
+    if (copy_from_user(dev->bulk_out_buffer, buffer, count)) {
+        ret = -EFAULT;
+        goto out;
+    }
+    
+    /* Write data to device */
+    ret = fp_xiaomi_bulk_transfer(dev, dev->bulk_out_buffer, count,
+                                 FP_BULK_OUT_EP, true);
+    
+out:
+    mutex_unlock(&dev->io_lock);
+    return ret;
+}
+
+static __poll_t fp_xiaomi_poll(struct file *file, poll_table *wait)
+{
+    struct fp_xiaomi_device *dev = file->private_data;
+    __poll_t mask = 0;
+    
+    if (!dev) {
+        return EPOLLERR;
+    }
+    
+    poll_wait(file, &dev->read_wait, wait);
+    poll_wait(file, &dev->write_wait, wait);
+    
+    /* Readable when a captured frame is waiting in the ring */
+    if (fp_xiaomi_ring_has_frames(dev)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    
+    /* Finger events are signalled separately so unread frames do not mask them */
+    if (fp_xiaomi_has_finger_events(dev)) {
+        mask |= EPOLLPRI;
+    }
+    
+    /* Check if device is ready for commands */
+    if (fp_xiaomi_get_state(dev) == FP_STATE_READY) {
+        mask |= EPOLLOUT | EPOLLWRNORM; /* Ready for writing */
+    } else if (fp_xiaomi_get_state(dev) == FP_STATE_DISCONNECTED) {
+        mask |= EPOLLERR | EPOLLHUP;
+    }
+    
+    return mask;
+}
+
+/**
+ * IOCTL handlers
+ */
+
+/* Lock-free queries answered from the published snapshot */
+static long fp_xiaomi_ioctl_query(struct fp_xiaomi_device *dev, unsigned int cmd,
+                                  void __user *argp)
+{
+    struct fp_xiaomi_snapshot snap;
+    struct fp_device_status status;
+    struct fp_finger_event event;
+    struct fp_xiaomi_stats stats;
+    __u32 image_size;
+    
+    if (cmd == FP_IOC_GET_FINGER_EVENT) {
+        if (!kfifo_out_spinlocked(&dev->finger_events, &event, 1, &dev->event_lock)) {
+            return -EAGAIN;
+        }
+        return copy_to_user(argp, &event, sizeof(event)) ? -EFAULT : 0;
+    }
+    
+    fp_xiaomi_read_snapshot(dev, &snap);
+    
+    switch (cmd) {
+    case FP_IOC_GET_DEVICE_INFO:
+        return copy_to_user(argp, &snap.info, sizeof(snap.info)) ? -EFAULT : 0;
+        
+    case FP_IOC_GET_POWER_MODE:
+        return copy_to_user(argp, &snap.power, sizeof(snap.power)) ? -EFAULT : 0;
+        
+    case FP_IOC_GET_IMAGE_SIZE:
+        image_size = snap.info.image_width * snap.info.image_height;
+        return put_user(image_size, (__u32 __user *)argp);
+        
+    case FP_IOC_GET_STATUS:
+        memset(&status, 0, sizeof(status));
+        status.state = snap.state;
+        status.last_error = snap.last_error;
+        status.flags = snap.flags;
+        status.uptime_ms = jiffies_to_msecs(jiffies - dev->start_time);
+        fp_xiaomi_stats_read(dev, &stats);
+        status.total_captures = stats.counters[FP_STAT_CAPTURES];
+        status.successful_matches = stats.counters[FP_STAT_MATCHES];
+        status.failed_matches = stats.counters[FP_STAT_NO_MATCHES];
+        status.error_count = stats.counters[FP_STAT_ERRORS];
+        status.template_generation = atomic_read(&dev->template_generation);
+        return copy_to_user(argp, &status, sizeof(status)) ? -EFAULT : 0;
+    }
+    
+    return -ENOTTY;
+}
+
+static long fp_xiaomi_ioctl_capture(struct fp_xiaomi_device *dev, void __user *argp)
+{
+    struct fp_image_data image;
+    const u8 *data;
+    u32 sequence;
+    u32 size;
+    u8 format;
+    int ret;
+    
+    if (copy_from_user(&image, argp, sizeof(image))) {
+        return -EFAULT;
+    }
+    
+    fp_xiaomi_set_state(dev, FP_STATE_CAPTURING);
+    ret = fp_xiaomi_ring_capture(dev, image.data == NULL, 0,
+                                 (image.flags & FP_FLAG_QUALITY_CHECK) ? image.quality : 0,
+                                 &sequence);
+    fp_xiaomi_set_state(dev, FP_STATE_READY);
+    if (ret < 0) {
+        return ret;
+    }
+    
+    /*
+     * The slot header is in the user-writable mapping; only the pixels
+     * are taken from the slot, with length and geometry our own.
+     */
+    data = fp_xiaomi_ring_slot(dev, sequence)->data;
+    size = ret;
+    format = FP_IMG_FORMAT_GRAY8;
+    
+    /*
+     * Compress on request. A frame that would not shrink goes out as
+     * GRAY8; the caller checks format either way.
+     */
+    if (image.data && image.format == FP_IMG_FORMAT_COMPRESSED &&
+        size == (u32)dev->image_width * dev->image_height) {
+        ssize_t len = fp_xiaomi_compress(data, dev->image_width, dev->image_height,
+                                         dev->codec_buffer,
+                                         min_t(u32, size, FP_XIAOMI_MAX_IMAGE_SIZE));
+        
+        if (len > 0) {
+            data = dev->codec_buffer;
+            size = len;
+            format = FP_IMG_FORMAT_COMPRESSED;
+        }
+    }
+    
+    if (image.data && image.size && size > image.size) {
+        return -ENOSPC;
+    }
+    
+    if (image.data && copy_to_user((void __user *)image.data, data, size)) {
+        return -EFAULT;
+    }
+    
+    image.width = dev->image_width;
+    image.height = dev->image_height;
+    image.format = format;
+    image.quality = 0;
+    image.flags = 0;
+    image.size = size;
+    image.sequence = sequence;
+    
+    return copy_to_user(argp, &image, sizeof(image)) ? -EFAULT : 0;
+}
+
+static long fp_xiaomi_ioctl_prearm(struct fp_xiaomi_device *dev, void __user *argp)
+{
+    u32 timeout_ms;
+    
+    if (get_user(timeout_ms, (__u32 __user *)argp)) {
+        return -EFAULT;
+    }
+    
+    /* pm_get() in the ioctl path waited for init; it may have failed */
+    if (fp_xiaomi_get_state(dev) != FP_STATE_READY) {
+        return -EIO;
+    }
+    
+    if (!timeout_ms) {
+        timeout_ms = FP_XIAOMI_PREARM_MS;
+    }
+    timeout_ms = min_t(u32, timeout_ms, FP_XIAOMI_PREARM_MAX_MS);
+    
+    if (!dev->prearmed) {
+        usb_autopm_get_interface_no_resume(dev->interface);
+        WRITE_ONCE(dev->prearmed, true);
+    }
+    mod_delayed_work(dev->workqueue, &dev->prearm_work, msecs_to_jiffies(timeout_ms));
+    return 0;
+}
+
+static long fp_xiaomi_ioctl_stream_start(struct fp_xiaomi_device *dev, void __user *argp)
+{
+    struct fp_stream_params params;
+    
+    if (copy_from_user(&params, argp, sizeof(params))) {
+        return -EFAULT;
+    }
+    
+    if (params.flags & ~FP_STREAM_DROP_OLDEST) {
+        return -EINVAL;
+    }
+    
+    if (dev->stream_owner) {
+        return -EBUSY;
+    }
+    
+    dev->stream_owner = dev->io_owner;
+    dev->stream_interval = usecs_to_jiffies(params.interval_us);
+    dev->stream_flags = params.flags;
+    dev->stream_remaining = params.max_frames;
+    dev->stream_failures = 0;
+    WRITE_ONCE(dev->ring->stream_status, 0);
+    
+    /* The ioctl already holds the device awake; keep it so between frames */
+    usb_autopm_get_interface_no_resume(dev->interface);
+    mod_delayed_work(dev->workqueue, &dev->stream_work, 0);
+    return 0;
+}
+
+/* FP_CMD_ENROLL_START parameters: id, threshold, attempts, name, __le32 flags */
+#define FP_ENROLL_START_PAYLOAD (3 + FP_XIAOMI_MAX_NAME_LEN + sizeof(__le32))
+
+/* Settings the later enrollment steps run with; caller holds io_lock */
+static void fp_xiaomi_enroll_begin(struct fp_xiaomi_device *dev, const u8 *payload,
+                                   u32 timeout_ms)
+{
+    __le32 flags;
+    
+    memcpy(&flags, payload + 3 + FP_XIAOMI_MAX_NAME_LEN, sizeof(flags));
+    dev->enroll_threshold = (le32_to_cpu(flags) & FP_FLAG_QUALITY_CHECK) ? payload[1] : 0;
+    dev->enroll_timeout_ms = timeout_ms;
+    dev->enroll_probe = payload[0] == 0;
+}
+
+static long fp_xiaomi_ioctl_enroll_start(struct fp_xiaomi_device *dev, void __user *argp)
+{
+    struct fp_enroll_params params;
+    u8 payload[FP_ENROLL_START_PAYLOAD];
+    __le32 flags;
+    int ret;
+    
+    if (copy_from_user(&params, argp, sizeof(params))) {
+        return -EFAULT;
+    }
+    
+    /* timeout_ms bounds each step of the enrollment, this one included */
+    fp_xiaomi_io_set_timeout(dev, params.timeout_ms);
+    
+    payload[0] = params.template_id;
+    payload[1] = params.quality_threshold;
+    payload[2] = params.max_attempts;
+    memcpy(payload + 3, params.name, FP_XIAOMI_MAX_NAME_LEN);
+    flags = cpu_to_le32(params.flags);
+    memcpy(payload + 3 + FP_XIAOMI_MAX_NAME_LEN, &flags, sizeof(flags));
+    
+    ret = fp_xiaomi_send_command(dev, FP_CMD_ENROLL_START, params.template_id,
+                                 payload, sizeof(payload), NULL, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    
+    fp_xiaomi_enroll_begin(dev, payload, params.timeout_ms);
+    return 0;
+}
+
+static long fp_xiaomi_ioctl_read_template(struct fp_xiaomi_device *dev, unsigned int cmd,
+                                          void __user *argp)
+{
+    struct fp_template_data tmpl;
+    unsigned char *data;
+    u8 header[5 + FP_XIAOMI_MAX_NAME_LEN];
+    u8 fp_cmd;
+    int size;
+    int ret;
+    
+    if (copy_from_user(&tmpl, argp, sizeof(tmpl))) {
+        return -EFAULT;
+    }
+    
+    fp_cmd = (cmd == FP_IOC_LOAD_TEMPLATE) ? FP_CMD_LOAD_TEMPLATE : FP_CMD_ENROLL_COMPLETE;
+    
+    /* Header: id, type, quality, size (le16) and name, then bulk data */
+    ret = fp_xiaomi_send_command(dev, fp_cmd, tmpl.id, NULL, 0, header, sizeof(header));
+    if (ret < 0) {
+        return ret;
+    }
+    if (ret < 5) {
+        return -EPROTO;
+    }
+    
+    size = header[3] | (header[4] << 8);
+    if (size > FP_XIAOMI_MAX_TEMPLATE_SIZE) {
+        return -EPROTO;
+    }
+    
+    data = kmalloc(FP_XIAOMI_MAX_TEMPLATE_SIZE, GFP_KERNEL);
+    if (!data) {
+        return -ENOMEM;
+    }
+    
+    ret = fp_xiaomi_bulk_read_all(dev, data, size);
+    if (ret < 0) {
+        goto out;
+    }
+    
+    if (tmpl.data && copy_to_user((void __user *)tmpl.data, data, size)) {
+        ret = -EFAULT;
+        goto out;
+    }
+    
+    tmpl.id = header[0];
+    tmpl.type = header[1];
+    tmpl.quality = header[2];
+    tmpl.size = size;
+    memset(tmpl.name, 0, sizeof(tmpl.name));
+    if (ret > 5) {
+        memcpy(tmpl.name, header + 5, min_t(int, ret - 5, FP_XIAOMI_MAX_NAME_LEN - 1));
+    }
+    
+    ret = copy_to_user(argp, &tmpl, sizeof(tmpl)) ? -EFAULT : 0;
+    
+out:
+    memzero_explicit(data, FP_XIAOMI_MAX_TEMPLATE_SIZE);
+    kfree(data);
+    return ret;
+}
+
+static long fp_xiaomi_ioctl_store_template(struct fp_xiaomi_device *dev, void __user *argp)
+{
+    struct fp_template_data tmpl;
+    unsigned char *data;
+    u8 header[4 + FP_XIAOMI_MAX_NAME_LEN];
+    int ret;
+    
+    if (copy_from_user(&tmpl, argp, sizeof(tmpl))) {
+        return -EFAULT;
+    }
+    
+    if (!tmpl.data || tmpl.size == 0 || tmpl.size > FP_XIAOMI_MAX_TEMPLATE_SIZE) {
+        return -EINVAL;
+    }
+    
+    data = memdup_user((void __user *)tmpl.data, tmpl.size);
+    if (IS_ERR(data)) {
+        return PTR_ERR(data);
+    }
+    
+    header[0] = tmpl.type;
+    header[1] = tmpl.quality;
+    header[2] = tmpl.size & 0xff;
+    header[3] = tmpl.size >> 8;
+    memcpy(header + 4, tmpl.name, FP_XIAOMI_MAX_NAME_LEN);
+    
+    ret = fp_xiaomi_send_data(dev, FP_CMD_STORE_TEMPLATE, tmpl.id, data, tmpl.size);
+    if (ret == 0) {
+        ret = fp_xiaomi_send_command(dev, FP_CMD_STORE_TEMPLATE, tmpl.id,
+                                     header, sizeof(header), NULL, 0);
+    }
+    
+    memzero_explicit(data, tmpl.size);
+    kfree(data);
+    return ret < 0 ? ret : 0;
+}
+
+static int fp_xiaomi_list_templates(struct fp_xiaomi_device *dev,
+                                    u8 ids[FP_XIAOMI_MAX_TEMPLATES])
+{
+    int ret;
+    int i;
+    
+    memset(ids, 0, FP_XIAOMI_MAX_TEMPLATES);
+    ret = fp_xiaomi_send_command(dev, FP_CMD_LIST_TEMPLATES, 0, NULL, 0,
+                                 ids, FP_XIAOMI_MAX_TEMPLATES);
+    if (ret < 0) {
+        return ret;
+    }
+    
+    dev->template_count = 0;
+    for (i = 0; i < FP_XIAOMI_MAX_TEMPLATES; i++) {
+        if (ids[i]) {
+            dev->template_count++;
+        }
+    }
+    fp_xiaomi_update_snapshot(dev);
+    
+    return 0;
+}
+
+static long fp_xiaomi_ioctl_verify(struct fp_xiaomi_device *dev, void __user *argp)
+{
+    struct fp_verify_params params;
+    u8 payload[2 + sizeof(__le32)];
+    __le32 flags;
+    ktime_t start;
+    int ret;
+    
+    if (copy_from_user(&params, argp, sizeof(params))) {
+        return -EFAULT;
+    }
+    
+    fp_xiaomi_io_set_timeout(dev, params.timeout_ms);
+    
+    payload[0] = params.template_id;
+    payload[1] = params.quality_threshold;
+    flags = cpu_to_le32(params.flags);
+    memcpy(payload + 2, &flags, sizeof(flags));
+    
+    fp_xiaomi_set_state(dev, FP_STATE_CAPTURING);
+    ret = fp_xiaomi_quality_precheck(dev, params.flags, params.quality_threshold);
+    if (ret < 0) {
+        fp_xiaomi_set_state(dev, FP_STATE_READY);
+        return ret;
+    }
+    
+    start = ktime_get();
+    ret = fp_xiaomi_send_command(dev, FP_CMD_VERIFY, params.template_id,
+                                 payload, sizeof(payload), NULL, 0);
+    fp_xiaomi_latency_record(&dev->latency[FP_LATENCY_MATCH],
+                             ktime_to_ns(ktime_sub(ktime_get(), start)));
+    fp_xiaomi_set_state(dev, FP_STATE_READY);
+    
+    if (ret >= 0) {
+        fp_stat_inc(dev, FP_STAT_MATCHES);
+    } else if (ret == -ENOKEY) {
+        fp_stat_inc(dev, FP_STAT_NO_MATCHES);
+    }
+    
+    return ret < 0 ? ret : 0;
+}
+
+static long fp_xiaomi_ioctl_identify(struct fp_xiaomi_device *dev, void __user *argp)
+{
+    struct fp_identify_params params;
+    u8 payload[1 + sizeof(__le32) + sizeof(__le16)];
+    size_t payload_len = 1 + sizeof(__le32);
+    u8 resp[2];
+    __le32 flags;
+    __le16 mask;
+    ktime_t start;
+    int ret;
+    
+    if (copy_from_user(&params, argp, sizeof(params))) {
+        return -EFAULT;
+    }
+    
+    if (params.candidate_mask >> FP_XIAOMI_MAX_TEMPLATES) {
+        return -EINVAL;
+    }
+    
+    fp_xiaomi_io_set_timeout(dev, params.timeout_ms);
+    
+    payload[0] = params.quality_threshold;
+    flags = cpu_to_le32(params.flags);
+    memcpy(payload + 1, &flags, sizeof(flags));
+    
+    /* Keep the original request layout unless the search is restricted */
+    if (params.candidate_mask) {
+        mask = cpu_to_le16(params.candidate_mask);
+        memcpy(payload + payload_len, &mask, sizeof(mask));
+        payload_len += sizeof(mask);
+    }
+    
+    fp_xiaomi_set_state(dev, FP_STATE_CAPTURING);
+    ret = fp_xiaomi_quality_precheck(dev, params.flags, params.quality_threshold);
+    if (ret < 0) {
+        fp_xiaomi_set_state(dev, FP_STATE_READY);
+        return ret;
+    }
+    
+    start = ktime_get();
+    ret = fp_xiaomi_send_command(dev, FP_CMD_IDENTIFY, 0, payload, payload_len,
+                                 resp, sizeof(resp));
+    fp_xiaomi_latency_record(&dev->latency[FP_LATENCY_MATCH],
+                             ktime_to_ns(ktime_sub(ktime_get(), start)));
+    fp_xiaomi_set_state(dev, FP_STATE_READY);
+    
+    if (ret >= (int)sizeof(resp) && params.candidate_mask &&
+        (resp[0] == 0 || resp[0] > FP_XIAOMI_MAX_TEMPLATES ||
+         !(params.candidate_mask & (1U << (resp[0] - 1))))) {
+        /* Matched a template outside the candidate set */
+        ret = -ENOKEY;
+    }
+    
+    if (ret == -ENOKEY) {
+        fp_stat_inc(dev, FP_STAT_NO_MATCHES);
+        return ret;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    if (ret < (int)sizeof(resp)) {
+        return -EPROTO;
+    }
     
-    /* Increment open count */
-    atomic_inc(&dev->open_count);
+    fp_stat_inc(dev, FP_STAT_MATCHES);
+    params.matched_id = resp[0];
+    params.confidence = resp[1];
     
-    fp_dev_info(dev, "Device opened (open count: %d)", 
-               atomic_read(&dev->open_count));
+    return copy_to_user(argp, &params, sizeof(params)) ? -EFAULT : 0;
+}
+
+/* Adopt power settings the sensor has accepted; caller holds io_lock */
+static void fp_xiaomi_power_apply(struct fp_xiaomi_device *dev,
+                                  const struct fp_power_params *params)
+{
+    /* A negative delay keeps the device from runtime-suspending at all */
+    pm_runtime_set_autosuspend_delay(&dev->udev->dev,
+                                     params->auto_suspend_delay ?
+                                     params->auto_suspend_delay * MSEC_PER_SEC : -1);
     
-    return ret;
+    dev->power = *params;
+    fp_xiaomi_update_snapshot(dev);
 }
 
-static int fp_xiaomi_release(struct inode *inode, struct file *file)
+static long fp_xiaomi_ioctl_set_power(struct fp_xiaomi_device *dev, void __user *argp)
 {
-    struct fp_xiaomi_device *dev = file->private_data;
+    struct fp_power_params params;
+    int ret;
     
-    if (dev) {
-        atomic_dec(&dev->open_count);
-        fp_dev_info(dev, "Device closed (open count: %d)", 
-                   atomic_read(&dev->open_count));
-        
-        /* Release device reference */
-        fp_xiaomi_put_device(dev);
+    if (copy_from_user(&params, argp, sizeof(params))) {
+        return -EFAULT;
+    }
+    
+    if (params.mode > FP_POWER_DEEP_SLEEP) {
+        return -EINVAL;
+    }
+    
+    ret = fp_xiaomi_send_command(dev, FP_CMD_SET_POWER, params.mode, NULL, 0, NULL, 0);
+    if (ret < 0) {
+        return ret;
     }
     
+    fp_xiaomi_power_apply(dev, &params);
     return 0;
 }
 
-static ssize_t fp_xiaomi_read(struct file *file, char __user *buffer,
-                             size_t count, loff_t *ppos)
+static long fp_xiaomi_ioctl_debug_info(struct fp_xiaomi_device *dev, void __user *argp)
 {
-    struct fp_xiaomi_device *dev = file->private_data;
-    int ret;
+    __u32 info[FP_DEBUG_INFO_WORDS];
+    struct fp_xiaomi_stats stats;
+    
+    fp_xiaomi_stats_read(dev, &stats);
+    
+    memset(info, 0, sizeof(info));
+    info[FP_DEBUG_INFO_STATE] = fp_xiaomi_get_state(dev);
+    info[FP_DEBUG_INFO_OPEN_COUNT] = atomic_read(&dev->open_count);
+    info[FP_DEBUG_INFO_ERRORS] = stats.counters[FP_STAT_ERRORS];
+    info[FP_DEBUG_INFO_RETRIES] = stats.counters[FP_STAT_RETRIES];
+    info[FP_DEBUG_INFO_CAPTURES] = stats.counters[FP_STAT_CAPTURES];
+    info[FP_DEBUG_INFO_RING_PRODUCER] = READ_ONCE(dev->ring_producer);
+    info[FP_DEBUG_INFO_RING_CONSUMER] = READ_ONCE(dev->ring->consumer);
+    info[FP_DEBUG_INFO_LAST_ERROR] = dev->last_error;
+    info[FP_DEBUG_INFO_DEBUG_LEVEL] = dev->debug_level;
+    info[FP_DEBUG_INFO_BYTES_IN] = stats.counters[FP_STAT_BYTES_IN];
+    info[FP_DEBUG_INFO_BYTES_OUT] = stats.counters[FP_STAT_BYTES_OUT];
+    info[FP_DEBUG_INFO_CONTROL_TRANSFERS] = stats.counters[FP_STAT_CONTROL_TRANSFERS];
+    info[FP_DEBUG_INFO_BULK_PACKETS] = stats.counters[FP_STAT_BULK_PACKETS];
+    info[FP_DEBUG_INFO_TIMEOUTS] = stats.counters[FP_STAT_TIMEOUTS];
+    info[FP_DEBUG_INFO_STALLS] = stats.counters[FP_STAT_STALLS];
+    info[FP_DEBUG_INFO_CAPTURE_FAILURES] = stats.counters[FP_STAT_CAPTURE_FAILURES];
+    
+    return copy_to_user(argp, info, sizeof(info)) ? -EFAULT : 0;
+}
+
+/* Inverse of fp_xiaomi_resp_to_errno() for batch response packets */
+static u8 fp_xiaomi_errno_to_resp(int err)
+{
+    switch (err) {
+    case 0:
+        return FP_RESP_OK;
+    case -ETIMEDOUT:
+        return FP_RESP_TIMEOUT;
+    case -ENODATA:
+        return FP_RESP_NO_FINGER;
+    case -EBADMSG:
+        return FP_RESP_BAD_IMAGE;
+    case -ENOKEY:
+        return FP_RESP_NO_MATCH;
+    case -EBUSY:
+        return FP_RESP_BUSY;
+    case -EOPNOTSUPP:
+        return FP_RESP_NOT_SUPPORTED;
+    default:
+        return FP_RESP_ERROR;
+    }
+}
+
+/* Commands without a bulk data phase can be batched */
+static bool fp_xiaomi_batch_allowed(u8 cmd)
+{
+    switch (cmd) {
+    case FP_CMD_GET_INFO:
+    case FP_CMD_CALIBRATE:
+    case FP_CMD_ENROLL_START:
+    case FP_CMD_ENROLL_CONTINUE:
+    case FP_CMD_ENROLL_CANCEL:
+    case FP_CMD_VERIFY:
+    case FP_CMD_IDENTIFY:
+    case FP_CMD_DELETE_TEMPLATE:
+    case FP_CMD_LIST_TEMPLATES:
+    case FP_CMD_SET_POWER:
+    case FP_CMD_GET_POWER:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static long fp_xiaomi_ioctl_batch(struct fp_xiaomi_device *dev, void __user *argp)
+{
+    struct fp_power_params power;
+    struct fp_batch batch;
+    struct fp_packet *pkt, *resp;
+    u8 *cmds = NULL, *resps = NULL;
+    size_t in_off = 0, out_off = 0;
+    size_t resp_cap;
+    int ret = 0;
+    u32 i;
     
-    if (!dev || count == 0) {
+    if (copy_from_user(&batch, argp, sizeof(batch))) {
+        return -EFAULT;
+    }
+    
+    if (!batch.count || batch.count > FP_BATCH_MAX_COMMANDS ||
+        batch.flags & ~FP_BATCH_STOP_ON_ERROR ||
+        batch.commands_len > FP_BATCH_MAX_COMMANDS * FP_XIAOMI_BUFFER_SIZE ||
+        batch.commands_len < batch.count * sizeof(*pkt)) {
         return -EINVAL;
     }
     
-    if (count > FP_XIAOMI_BUFFER_SIZE) {
-        count = FP_XIAOMI_BUFFER_SIZE;
+    resp_cap = min_t(size_t, batch.responses_len,
+                     batch.count * (sizeof(*resp) + FP_BATCH_MAX_PAYLOAD));
+    
+    cmds = memdup_user(u64_to_user_ptr(batch.commands), batch.commands_len);
+    if (IS_ERR(cmds)) {
+        return PTR_ERR(cmds);
     }
     
-    /* Check device state */
-    if (fp_xiaomi_get_state(dev) != FP_STATE_READY) {
-        return -ENODEV;
+    resps = kzalloc(resp_cap, GFP_KERNEL);
+    if (!resps && resp_cap) {
+        kfree(cmds);
+        return -ENOMEM;
     }
     
-    mutex_lock(&dev->io_lock);
+    /* Validate the whole stream before anything reaches the sensor */
+    for (i = 0; i < batch.count; i++) {
+        pkt = (struct fp_packet *)(cmds + in_off);
+        if (in_off + sizeof(*pkt) > batch.commands_len ||
+            pkt->length > FP_XIAOMI_BUFFER_SIZE ||
+            in_off + sizeof(*pkt) + pkt->length > batch.commands_len ||
+            !fp_xiaomi_batch_allowed(pkt->cmd) ||
+            (pkt->cmd == FP_CMD_SET_POWER && pkt->flags > FP_POWER_DEEP_SLEEP) ||
+            (pkt->cmd == FP_CMD_ENROLL_START && pkt->length != FP_ENROLL_START_PAYLOAD)) {
+            ret = -EINVAL;
+            goto out;
+        }
+        in_off += sizeof(*pkt) + pkt->length;
+    }
     
-    /* Read data from device */
-    ret = fp_xiaomi_bulk_transfer(dev, dev->bulk_in_buffer, count,
-                                 FP_BULK_IN_EP, false);
-    if (ret < 0) {
-        goto out;
+    batch.completed = 0;
+    batch.error = 0;
+    in_off = 0;
+    
+    fp_xiaomi_set_state(dev, FP_STATE_CAPTURING);
+    
+    for (i = 0; i < batch.count; i++) {
+        pkt = (struct fp_packet *)(cmds + in_off);
+        in_off += sizeof(*pkt) + pkt->length;
+        
+        /* Each command gets the budget it would have had on its own */
+        fp_xiaomi_io_restart(dev);
+        
+        if (out_off + sizeof(*resp) + FP_BATCH_MAX_PAYLOAD > resp_cap) {
+            batch.error = -ENOSPC;
+            break;
+        }
+        resp = (struct fp_packet *)(resps + out_off);
+        
+        ret = fp_xiaomi_send_command(dev, pkt->cmd, pkt->flags,
+                                     pkt->data, pkt->length,
+                                     resp->data, FP_BATCH_MAX_PAYLOAD);
+        
+        if (pkt->cmd == FP_CMD_VERIFY || pkt->cmd == FP_CMD_IDENTIFY) {
+            if (ret >= 0) {
+                fp_stat_inc(dev, FP_STAT_MATCHES);
+            } else if (ret == -ENOKEY) {
+                fp_stat_inc(dev, FP_STAT_NO_MATCHES);
+            }
+        } else if (pkt->cmd == FP_CMD_SET_POWER && ret >= 0) {
+            /* Only the mode travels in a batch; the rest stays as set */
+            power = dev->power;
+            power.mode = pkt->flags;
+            fp_xiaomi_power_apply(dev, &power);
+        } else if (pkt->cmd == FP_CMD_ENROLL_START && ret >= 0) {
+            fp_xiaomi_enroll_begin(dev, pkt->data, 0);
+        } else if (pkt->cmd == FP_CMD_DELETE_TEMPLATE) {
+            fp_xiaomi_templates_changed(dev);
+        }
+        
+        resp->cmd = pkt->cmd;
+        resp->flags = fp_xiaomi_errno_to_resp(min(ret, 0));
+        resp->length = ret > 0 ? ret : 0;
+        out_off += sizeof(*resp) + resp->length;
+        batch.completed++;
+        
+        if (ret < 0) {
+            if (!batch.error) {
+                batch.error = ret;
+            }
+            /* Transport failures leave the sensor in an unknown state */
+            if ((batch.flags & FP_BATCH_STOP_ON_ERROR) ||
+                resp->flags == FP_RESP_ERROR) {
+                break;
+            }
+        }
     }
     
-    /* Copy to user space */
-    if (copy_to_user(buffer, dev->bulk_in_buffer, ret)) {
+    fp_xiaomi_set_state(dev, FP_STATE_READY);
+    
+    ret = 0;
+    batch.responses_len = out_off;
+    if (out_off && copy_to_user(u64_to_user_ptr(batch.responses), resps, out_off)) {
+        ret = -EFAULT;
+    } else if (copy_to_user(argp, &batch, sizeof(batch))) {
         ret = -EFAULT;
-        goto out;
     }
     
 out:
-    mutex_unlock(&dev->io_lock);
+    kfree(resps);
+    kfree(cmds);
     return ret;
 }
 
-static ssize_t fp_xiaomi_write(struct file *file, const char __user *buffer,
-                              size_t count, loff_t *ppos)
+/* Commands that talk to the sensor; caller holds io_lock */
+static long fp_xiaomi_ioctl_locked(struct fp_xiaomi_device *dev, unsigned int cmd,
+                                   void __user *argp)
 {
-    struct fp_xiaomi_device *dev = file->private_data;
+    struct fp_calibration_params cal;
+    u8 ids[FP_XIAOMI_MAX_TEMPLATES];
+    u8 id;
     int ret;
+    int i;
     
-    if (!dev || count == 0) {
-        return -EINVAL;
+    switch (cmd) {
+    case FP_IOC_RESET_DEVICE:
+        ret = fp_xiaomi_send_command(dev, FP_CMD_RESET, 0, NULL, 0, NULL, 0);
+        if (ret < 0) {
+            return ret;
+        }
+        queue_work(dev->workqueue, &dev->init_work);
+        return 0;
+        
+    case FP_IOC_PREARM:
+        return fp_xiaomi_ioctl_prearm(dev, argp);
+        
+    case FP_IOC_CALIBRATE:
+        if (copy_from_user(&cal, argp, sizeof(cal))) {
+            return -EFAULT;
+        }
+        ret = fp_xiaomi_send_command(dev, FP_CMD_CALIBRATE, cal.mode,
+                                     &cal, sizeof(cal), NULL, 0);
+        return ret < 0 ? ret : 0;
+        
+    case FP_IOC_CAPTURE_IMAGE:
+        return fp_xiaomi_ioctl_capture(dev, argp);
+        
+    case FP_IOC_STREAM_START:
+        return fp_xiaomi_ioctl_stream_start(dev, argp);
+        
+    case FP_IOC_STREAM_STOP:
+        if (dev->stream_owner && dev->stream_owner != dev->io_owner) {
+            return -EPERM;
+        }
+        fp_xiaomi_stream_end(dev, 0);
+        /*
+         * Waiting for stream_work here would deadlock on io_lock. A run
+         * already blocked on it finds no owner and captures nothing.
+         */
+        cancel_delayed_work(&dev->stream_work);
+        return 0;
+        
+    case FP_IOC_ENROLL_START:
+        return fp_xiaomi_ioctl_enroll_start(dev, argp);
+        
+    case FP_IOC_ENROLL_CONTINUE:
+        fp_xiaomi_io_set_timeout(dev, dev->enroll_timeout_ms);
+        fp_xiaomi_set_state(dev, FP_STATE_CAPTURING);
+        ret = fp_xiaomi_quality_precheck(dev, FP_FLAG_QUALITY_CHECK, dev->enroll_threshold);
+        if (ret == 0) {
+            ret = fp_xiaomi_send_command(dev, FP_CMD_ENROLL_CONTINUE, 0, NULL, 0, NULL, 0);
+        }
+        fp_xiaomi_set_state(dev, FP_STATE_READY);
+        return ret < 0 ? ret : 0;
+        
+    case FP_IOC_ENROLL_COMPLETE:
+        ret = fp_xiaomi_ioctl_read_template(dev, cmd, argp);
+        /* A slot 0 probe for host matching leaves the stored set alone */
+        if (!dev->enroll_probe) {
+            fp_xiaomi_templates_changed(dev);
+        }
+        dev->enroll_probe = false;
+        return ret;
+        
+    case FP_IOC_LOAD_TEMPLATE:
+        return fp_xiaomi_ioctl_read_template(dev, cmd, argp);
+        
+    case FP_IOC_ENROLL_CANCEL:
+        dev->enroll_threshold = 0;
+        dev->enroll_timeout_ms = 0;
+        dev->enroll_probe = false;
+        ret = fp_xiaomi_send_command(dev, FP_CMD_ENROLL_CANCEL, 0, NULL, 0, NULL, 0);
+        return ret < 0 ? ret : 0;
+        
+    case FP_IOC_STORE_TEMPLATE:
+        ret = fp_xiaomi_ioctl_store_template(dev, argp);
+        fp_xiaomi_templates_changed(dev);
+        return ret;
+        
+    case FP_IOC_DELETE_TEMPLATE:
+        if (get_user(id, (__u8 __user *)argp)) {
+            return -EFAULT;
+        }
+        ret = fp_xiaomi_send_command(dev, FP_CMD_DELETE_TEMPLATE, id, NULL, 0, NULL, 0);
+        fp_xiaomi_templates_changed(dev);
+        return ret < 0 ? ret : 0;
+        
+    case FP_IOC_LIST_TEMPLATES:
+        ret = fp_xiaomi_list_templates(dev, ids);
+        if (ret < 0) {
+            return ret;
+        }
+        return copy_to_user(argp, ids, sizeof(ids)) ? -EFAULT : 0;
+        
+    case FP_IOC_CLEAR_TEMPLATES:
+        /* The protocol has no bulk delete; remove stored IDs one by one */
+        ret = fp_xiaomi_list_templates(dev, ids);
+        for (i = 0; ret == 0 && i < FP_XIAOMI_MAX_TEMPLATES; i++) {
+            if (ids[i]) {
+                ret = fp_xiaomi_send_command(dev, FP_CMD_DELETE_TEMPLATE, ids[i],
+                                             NULL, 0, NULL, 0);
+            }
+        }
+        fp_xiaomi_templates_changed(dev);
+        return ret < 0 ? ret : 0;
+        
+    case FP_IOC_VERIFY:
+        return fp_xiaomi_ioctl_verify(dev, argp);
+        
+    case FP_IOC_IDENTIFY:
+        return fp_xiaomi_ioctl_identify(dev, argp);
+        
+    case FP_IOC_SET_POWER_MODE:
+        return fp_xiaomi_ioctl_set_power(dev, argp);
+        
+    case FP_IOC_GET_DEBUG_INFO:
+        return fp_xiaomi_ioctl_debug_info(dev, argp);
+        
+    case FP_IOC_SET_DEBUG_LEVEL:
+        if (get_user(id, (__u8 __user *)argp)) {
+            return -EFAULT;
+        }
+        dev->debug_level = id;
+        return 0;
+        
+    case FP_IOC_SUBMIT_BATCH:
+        return fp_xiaomi_ioctl_batch(dev, argp);
     }
     
-    if (count > FP_XIAOMI_BUFFER_SIZE) {
-        count = FP_XIAOMI_BUFFER_SIZE;
+    return -ENOTTY;
+}
+
+static long fp_xiaomi_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct fp_xiaomi_device *dev = file->private_data;
+    void __user *argp = (void __user *)arg;
+    long ret;
+    
+    if (!dev) {
+        return -ENODEV;
     }
     
-    /* Check device state */
-    if (fp_xiaomi_get_state(dev) != FP_STATE_READY) {
+    if (_IOC_TYPE(cmd) != FP_XIAOMI_IOC_MAGIC || _IOC_NR(cmd) > FP_IOC_MAXNR) {
+        return -ENOTTY;
+    }
+    
+    /*
+     * Read-only queries are served from the published snapshot without
+     * touching device_lock or io_lock, so status polling never queues
+     * behind a capture that is waiting for a finger.
+     */
+    switch (cmd) {
+    case FP_IOC_GET_DEVICE_INFO:
+    case FP_IOC_GET_STATUS:
+    case FP_IOC_GET_POWER_MODE:
+    case FP_IOC_GET_IMAGE_SIZE:
+    case FP_IOC_GET_FINGER_EVENT:
+        return fp_xiaomi_ioctl_query(dev, cmd, argp);
+    }
+    
+    /*
+     * Cancellation must not queue behind the call it interrupts.
+     * ENROLL_CANCEL only interrupts an enrollment step, then takes
+     * io_lock as usual to tell the sensor.
+     */
+    if (cmd == FP_IOC_CANCEL) {
+        fp_xiaomi_cancel_io(dev, file);
+        return 0;
+    }
+    
+    if (cmd == FP_IOC_ENROLL_CANCEL) {
+        switch (READ_ONCE(dev->io_cmd)) {
+        case FP_IOC_ENROLL_START:
+        case FP_IOC_ENROLL_CONTINUE:
+        case FP_IOC_ENROLL_COMPLETE:
+            fp_xiaomi_cancel_io(dev, file);
+            break;
+        }
+    }
+    
+    if (fp_xiaomi_get_state(dev) == FP_STATE_DISCONNECTED) {
         return -ENODEV;
     }
     
-    mutex_lock(&dev->io_lock);
+    ret = fp_xiaomi_pm_get(dev);
+    if (ret) {
+        return ret;
+    }
     
-    /* Copy from user space */
-    if (copy_from_user(dev->bulk_out_buffer, buffer, count)) {
-        ret = -EFAULT;
-        goto out;
+    if (mutex_lock_interruptible(&dev->io_lock)) {
+        fp_xiaomi_pm_put(dev);
+        return -ERESTARTSYS;
     }
     
-    /* Write data to device */
-    ret = fp_xiaomi_bulk_transfer(dev, dev->bulk_out_buffer, count,
-                                 FP_BULK_OUT_EP, true);
+    fp_xiaomi_detect_pause(dev);
+    fp_xiaomi_io_begin(dev, file, cmd);
+    ret = fp_xiaomi_ioctl_locked(dev, cmd, argp);
+    fp_xiaomi_io_end(dev);
+    if (ret == -ECANCELED) {
+        fp_xiaomi_sensor_stop(dev);
+    }
+    fp_xiaomi_detect_arm(dev);
     
-out:
     mutex_unlock(&dev->io_lock);
+    fp_xiaomi_pm_put(dev);
     return ret;
 }
 
-static __poll_t fp_xiaomi_poll(struct file *file, poll_table *wait)
+/* Wake-on-touch captures only go to a ring somebody has mapped */
+static void fp_xiaomi_vma_open(struct vm_area_struct *vma)
+{
+    struct fp_xiaomi_device *dev = vma->vm_private_data;
+    
+    atomic_inc(&dev->ring_maps);
+}
+
+static void fp_xiaomi_vma_close(struct vm_area_struct *vma)
+{
+    struct fp_xiaomi_device *dev = vma->vm_private_data;
+    
+    atomic_dec(&dev->ring_maps);
+}
+
+static const struct vm_operations_struct fp_xiaomi_vm_ops = {
+    .open = fp_xiaomi_vma_open,
+    .close = fp_xiaomi_vma_close,
+};
+
+static int fp_xiaomi_mmap(struct file *file, struct vm_area_struct *vma)
 {
     struct fp_xiaomi_device *dev = file->private_data;
-    __poll_t mask = 0;
+    unsigned long size = vma->vm_end - vma->vm_start;
+    int ret;
     
-    if (!dev) {
-        return EPOLLERR;
+    if (!dev || !dev->ring) {
+        return -ENODEV;
     }
     
-    poll_wait(file, &dev->read_wait, wait);
-    poll_wait(file, &dev->write_wait, wait);
+    /* Only the whole ring, mapped from offset 0, is supported */
+    if (vma->vm_pgoff != 0 || size > PAGE_ALIGN(FP_RING_MAP_SIZE)) {
+        return -EINVAL;
+    }
     
-    /* Check if device is ready for I/O */
-    if (fp_xiaomi_get_state(dev) == FP_STATE_READY) {
-        mask |= EPOLLIN | EPOLLRDNORM;  /* Ready for reading */
-        mask |= EPOLLOUT | EPOLLWRNORM; /* Ready for writing */
-    } else if (fp_xiaomi_get_state(dev) == FP_STATE_DISCONNECTED) {
-        mask |= EPOLLERR | EPOLLHUP;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    
+    ret = remap_vmalloc_range(vma, dev->ring, 0);
+    if (ret) {
+        return ret;
     }
     
-    return mask;
+    vma->vm_private_data = dev;
+    vma->vm_ops = &fp_xiaomi_vm_ops;
+    fp_xiaomi_vma_open(vma);
+    return 0;
 }
 
 /* Character device file operations */
@@ -653,9 +3317,117 @@ static const struct file_operations fp_xiaomi_fops = {
     .read = fp_xiaomi_read,
     .write = fp_xiaomi_write,
     .poll = fp_xiaomi_poll,
+    .unlocked_ioctl = fp_xiaomi_ioctl,
+    .mmap = fp_xiaomi_mmap,
     .llseek = no_llseek,
 };
 
+/**
+ * sysfs: one read-only file per counter under fp_xiaomiN/stats/
+ */
+static ssize_t fp_xiaomi_stat_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct fp_xiaomi_device *dev = dev_get_drvdata(d);
+    struct dev_ext_attribute *ea = container_of(attr, struct dev_ext_attribute, attr);
+    struct fp_xiaomi_stats stats;
+    
+    fp_xiaomi_stats_read(dev, &stats);
+    return sprintf(buf, "%lu\n", stats.counters[(uintptr_t)ea->var]);
+}
+
+#define FP_STAT_ATTR(_name, _stat)                                          \
+    static struct dev_ext_attribute fp_stat_attr_##_name = {                \
+        __ATTR(_name, 0444, fp_xiaomi_stat_show, NULL), (void *)(_stat) \
+    }
+
+FP_STAT_ATTR(bytes_in, FP_STAT_BYTES_IN);
+FP_STAT_ATTR(bytes_out, FP_STAT_BYTES_OUT);
+FP_STAT_ATTR(control_transfers, FP_STAT_CONTROL_TRANSFERS);
+FP_STAT_ATTR(bulk_packets, FP_STAT_BULK_PACKETS);
+FP_STAT_ATTR(retries, FP_STAT_RETRIES);
+FP_STAT_ATTR(timeouts, FP_STAT_TIMEOUTS);
+FP_STAT_ATTR(stalls, FP_STAT_STALLS);
+FP_STAT_ATTR(errors, FP_STAT_ERRORS);
+FP_STAT_ATTR(captures, FP_STAT_CAPTURES);
+FP_STAT_ATTR(capture_failures, FP_STAT_CAPTURE_FAILURES);
+FP_STAT_ATTR(matches, FP_STAT_MATCHES);
+FP_STAT_ATTR(no_matches, FP_STAT_NO_MATCHES);
+FP_STAT_ATTR(early_rejects, FP_STAT_EARLY_REJECTS);
+FP_STAT_ATTR(prechecks, FP_STAT_PRECHECKS);
+
+static struct attribute *fp_xiaomi_stats_attrs[] = {
+    &fp_stat_attr_bytes_in.attr.attr,
+    &fp_stat_attr_bytes_out.attr.attr,
+    &fp_stat_attr_control_transfers.attr.attr,
+    &fp_stat_attr_bulk_packets.attr.attr,
+    &fp_stat_attr_retries.attr.attr,
+    &fp_stat_attr_timeouts.attr.attr,
+    &fp_stat_attr_stalls.attr.attr,
+    &fp_stat_attr_errors.attr.attr,
+    &fp_stat_attr_captures.attr.attr,
+    &fp_stat_attr_capture_failures.attr.attr,
+    &fp_stat_attr_matches.attr.attr,
+    &fp_stat_attr_no_matches.attr.attr,
+    &fp_stat_attr_early_rejects.attr.attr,
+    &fp_stat_attr_prechecks.attr.attr,
+    NULL,
+};
+
+static const struct attribute_group fp_xiaomi_stats_group = {
+    .name = "stats",
+    .attrs = fp_xiaomi_stats_attrs,
+};
+
+static const struct attribute_group *fp_xiaomi_groups[] = {
+    &fp_xiaomi_stats_group,
+    NULL,
+};
+
+/**
+ * debugfs: one latency histogram file per phase, any write clears it
+ */
+static int fp_xiaomi_latency_debugfs_show(struct seq_file *m, void *unused)
+{
+    fp_xiaomi_latency_show(m, m->private);
+    return 0;
+}
+
+static int fp_xiaomi_latency_debugfs_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, fp_xiaomi_latency_debugfs_show, inode->i_private);
+}
+
+static ssize_t fp_xiaomi_latency_debugfs_write(struct file *file, const char __user *buffer,
+                                               size_t count, loff_t *ppos)
+{
+    struct seq_file *m = file->private_data;
+    
+    fp_xiaomi_latency_reset(m->private);
+    return count;
+}
+
+static const struct file_operations fp_xiaomi_latency_fops = {
+    .owner = THIS_MODULE,
+    .open = fp_xiaomi_latency_debugfs_open,
+    .read = seq_read,
+    .write = fp_xiaomi_latency_debugfs_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* debugfs failures are not fatal; the calls below accept error pointers */
+static void fp_xiaomi_debugfs_init(struct fp_xiaomi_device *dev)
+{
+    int i;
+    
+    dev->debugfs_dir = debugfs_create_dir(dev_name(&dev->interface->dev),
+                                          fp_xiaomi_debugfs_root);
+    for (i = 0; i < FP_LATENCY_PHASES; i++) {
+        debugfs_create_file(fp_latency_phase_names[i], 0600, dev->debugfs_dir,
+                            &dev->latency[i], &fp_xiaomi_latency_fops);
+    }
+}
+
 /**
  * USB probe function - called when device is connected
  */
@@ -678,6 +3450,12 @@ static int fp_xiaomi_probe(struct usb_interface *interface,
         return -ENOMEM;
     }
     
+    dev->stats = alloc_percpu(struct fp_xiaomi_stats);
+    if (!dev->stats) {
+        kfree(dev);
+        return -ENOMEM;
+    }
+    
     /* Initialize device structure */
     kref_init(&dev->kref);
     dev->udev = usb_get_dev(udev);
@@ -687,13 +3465,25 @@ static int fp_xiaomi_probe(struct usb_interface *interface,
     mutex_init(&dev->device_lock);
     mutex_init(&dev->io_lock);
     spin_lock_init(&dev->state_lock);
+    seqlock_init(&dev->snapshot_lock);
+    spin_lock_init(&dev->capture_lock);
+    spin_lock_init(&dev->event_lock);
+    INIT_KFIFO(dev->finger_events);
+    init_usb_anchor(&dev->capture_anchor);
+    init_usb_anchor(&dev->io_anchor);
+    init_completion(&dev->capture_done);
+    init_completion(&dev->drain_done);
     init_waitqueue_head(&dev->read_wait);
     init_waitqueue_head(&dev->write_wait);
     
-    /* Initialize atomic counters */
+    /* Initialize counters */
     atomic_set(&dev->open_count, 0);
-    atomic_set(&dev->error_count, 0);
-    atomic_set(&dev->retry_count, 0);
+    atomic_set(&dev->pm_requests, 0);
+    atomic_set(&dev->ring_maps, 0);
+    atomic_set(&dev->template_generation, 1);
+    dev->start_time = jiffies;
+    dev->power.mode = FP_POWER_ACTIVE;
+    dev->power.auto_suspend_delay = FP_XIAOMI_AUTOSUSPEND_DELAY_S;
     
     /* Set initial state */
     fp_xiaomi_set_state(dev, FP_STATE_INITIALIZING);
@@ -728,22 +3518,71 @@ static int fp_xiaomi_probe(struct usb_interface *interface,
     /* Allocate I/O buffers - FPC L:0001 specific */
     dev->bulk_in_buffer = kzalloc(FP_XIAOMI_BUFFER_SIZE, GFP_KERNEL);
     dev->control_buffer = kzalloc(FP_XIAOMI_BUFFER_SIZE, GFP_KERNEL);
+    dev->codec_buffer = kmalloc(FP_XIAOMI_MAX_IMAGE_SIZE, GFP_KERNEL);
+    dev->io_setup = kmalloc(sizeof(*dev->io_setup), GFP_KERNEL);
+    
+    if (!dev->bulk_in_buffer || !dev->control_buffer || !dev->codec_buffer ||
+        !dev->io_setup) {
+        ret = -ENOMEM;
+        goto error;
+    }
+    
+    /* Allocate the mmap()-able frame ring */
+    ret = fp_xiaomi_ring_init(dev);
+    if (ret) {
+        goto error;
+    }
     
-    if (!dev->bulk_in_buffer || !dev->control_buffer) {
+    /* URB for synchronous command and bulk data transfers */
+    dev->io_urb = usb_alloc_urb(0, GFP_KERNEL);
+    
+    if (!dev->io_urb) {
         ret = -ENOMEM;
         goto error;
     }
     
-    /* Allocate URBs - Only bulk IN needed */
-    dev->bulk_in_urb = usb_alloc_urb(0, GFP_KERNEL);
+    /* Pre-allocate the capture URB ring with DMA-coherent buffers */
+    for (i = 0; i < FP_XIAOMI_URB_RING_SIZE; i++) {
+        dev->capture_urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+        if (!dev->capture_urbs[i]) {
+            ret = -ENOMEM;
+            goto error;
+        }
+        
+        dev->capture_bufs[i] = usb_alloc_coherent(udev, FP_XIAOMI_URB_BUFFER_SIZE,
+                                                  GFP_KERNEL,
+                                                  &dev->capture_urbs[i]->transfer_dma);
+        if (!dev->capture_bufs[i]) {
+            usb_free_urb(dev->capture_urbs[i]);
+            dev->capture_urbs[i] = NULL;
+            ret = -ENOMEM;
+            goto error;
+        }
+    }
+    
+    /* Finger detect URB, armed whenever the node is open and idle */
+    dev->detect_urb = usb_alloc_urb(0, GFP_KERNEL);
+    if (!dev->detect_urb) {
+        ret = -ENOMEM;
+        goto error;
+    }
     
-    if (!dev->bulk_in_urb) {
+    dev->detect_buf = usb_alloc_coherent(udev, FP_XIAOMI_BUFFER_SIZE, GFP_KERNEL,
+                                         &dev->detect_urb->transfer_dma);
+    if (!dev->detect_buf) {
+        usb_free_urb(dev->detect_urb);
+        dev->detect_urb = NULL;
         ret = -ENOMEM;
         goto error;
     }
     
-    /* Create work queue */
-    dev->workqueue = create_singlethread_workqueue("fp_xiaomi_wq");
+    /*
+     * Unbound and ordered: one reader's work runs in sequence, while
+     * several readers bring their sensors up at the same time on
+     * whichever CPUs are free.
+     */
+    dev->workqueue = alloc_ordered_workqueue("fp_xiaomi/%s", WQ_MEM_RECLAIM,
+                                             dev_name(&interface->dev));
     if (!dev->workqueue) {
         ret = -ENOMEM;
         goto error;
@@ -752,6 +3591,11 @@ static int fp_xiaomi_probe(struct usb_interface *interface,
     /* Initialize work items */
     INIT_WORK(&dev->init_work, fp_xiaomi_init_work);
     INIT_WORK(&dev->error_work, fp_xiaomi_error_work);
+    INIT_WORK(&dev->drain_work, fp_xiaomi_drain_work);
+    INIT_DELAYED_WORK(&dev->stream_work, fp_xiaomi_stream_work);
+    INIT_DELAYED_WORK(&dev->prearm_work, fp_xiaomi_prearm_work);
+    fp_xiaomi_recovery_init(&dev->recovery, dev, &interface->dev,
+                            &fp_xiaomi_recovery_ops, dev->workqueue);
     
     /* Set up power management */
     pm_qos_add_request(&dev->pm_qos, PM_QOS_CPU_DMA_LATENCY, 
@@ -779,9 +3623,9 @@ static int fp_xiaomi_probe(struct usb_interface *interface,
     }
     
     /* Create device node */
-    dev->dev = device_create(fp_xiaomi_class, &interface->dev,
-                            MKDEV(MAJOR(fp_xiaomi_devt), dev->minor),
-                            dev, "fp_xiaomi%d", dev->minor);
+    dev->dev = device_create_with_groups(fp_xiaomi_class, &interface->dev,
+                                        MKDEV(MAJOR(fp_xiaomi_devt), dev->minor),
+                                        dev, fp_xiaomi_groups, "fp_xiaomi%d", dev->minor);
     if (IS_ERR(dev->dev)) {
         ret = PTR_ERR(dev->dev);
         fp_dev_err(dev, "Failed to create device node: %d", ret);
@@ -791,7 +3635,11 @@ static int fp_xiaomi_probe(struct usb_interface *interface,
     /* Store device pointer in interface */
     usb_set_intfdata(interface, dev);
     
+    fp_xiaomi_debugfs_init(dev);
+    
     /* Enable autosuspend */
+    pm_runtime_set_autosuspend_delay(&udev->dev,
+                                     FP_XIAOMI_AUTOSUSPEND_DELAY_S * MSEC_PER_SEC);
     usb_enable_autosuspend(udev);
     
     /* Start device initialization */
@@ -827,6 +3675,14 @@ static void fp_xiaomi_disconnect(struct usb_interface *interface)
     /* Set disconnected state */
     fp_xiaomi_set_state(dev, FP_STATE_DISCONNECTED);
     
+    debugfs_remove_recursive(dev->debugfs_dir);
+    
+    /* Stop any frame capture or command in progress */
+    usb_kill_anchored_urbs(&dev->capture_anchor);
+    usb_kill_anchored_urbs(&dev->io_anchor);
+    usb_kill_urb(dev->detect_urb);
+    cancel_work_sync(&dev->drain_work);
+    
     /* Remove device node */
     device_destroy(fp_xiaomi_class, MKDEV(MAJOR(fp_xiaomi_devt), dev->minor));
     
@@ -838,9 +3694,12 @@ static void fp_xiaomi_disconnect(struct usb_interface *interface)
     idr_remove(&fp_xiaomi_idr, dev->minor);
     mutex_unlock(&fp_xiaomi_mutex);
     
-    /* Cancel pending work */
+    /* Cancel pending work; init_work may requeue the stream, so it goes last */
     cancel_work_sync(&dev->init_work);
     cancel_work_sync(&dev->error_work);
+    fp_xiaomi_recovery_cleanup(&dev->recovery);
+    cancel_delayed_work_sync(&dev->stream_work);
+    cancel_delayed_work_sync(&dev->prearm_work);
     
     /* Wake up any waiting processes */
     wake_up_interruptible(&dev->read_wait);
@@ -871,10 +3730,30 @@ static int fp_xiaomi_suspend(struct usb_interface *interface, pm_message_t messa
     /* Cancel pending work */
     cancel_work_sync(&dev->init_work);
     cancel_work_sync(&dev->error_work);
+    fp_xiaomi_recovery_cleanup(&dev->recovery);
+    
+    /* A stream stays owned across suspend; init_work requeues it on resume */
+    cancel_delayed_work_sync(&dev->stream_work);
+    
+    /* Abort any frame capture in progress, including a rejected tail */
+    usb_kill_anchored_urbs(&dev->capture_anchor);
+    cancel_work_sync(&dev->drain_work);
+    
+    /*
+     * Only the URB goes; the sensor itself stays armed so a touch can
+     * wake the bus. init_work re-arms the URB on resume.
+     */
+    mutex_lock(&dev->io_lock);
+    usb_kill_urb(dev->detect_urb);
+    dev->detect_armed = false;
+    dev->wake_check = false;
+    dev->wake_capture = false;
+    mutex_unlock(&dev->io_lock);
     
     /* Set suspended state */
     mutex_lock(&dev->device_lock);
     dev->pm_suspended = true;
+    dev->pm_auto_suspended = PMSG_IS_AUTO(message);
     fp_xiaomi_set_state(dev, FP_STATE_SUSPENDED);
     mutex_unlock(&dev->device_lock);
     
@@ -884,6 +3763,7 @@ static int fp_xiaomi_suspend(struct usb_interface *interface, pm_message_t messa
 static int fp_xiaomi_resume(struct usb_interface *interface)
 {
     struct fp_xiaomi_device *dev = usb_get_intfdata(interface);
+    bool unrequested;
     
     if (!dev) {
         return 0;
@@ -893,8 +3773,17 @@ static int fp_xiaomi_resume(struct usb_interface *interface)
     
     mutex_lock(&dev->device_lock);
     dev->pm_suspended = false;
+    unrequested = dev->pm_auto_suspended && atomic_read(&dev->pm_requests) == 0 &&
+                  atomic_read(&dev->open_count) > 0;
     mutex_unlock(&dev->device_lock);
     
+    /* Maybe the sensor woke us; init_work looks for the touch before init */
+    if (unrequested) {
+        mutex_lock(&dev->io_lock);
+        dev->wake_check = true;
+        mutex_unlock(&dev->io_lock);
+    }
+    
     /* Reinitialize device */
     queue_work(dev->workqueue, &dev->init_work);
     
@@ -957,17 +3846,20 @@ static int __init fp_xiaomi_init(void)
         goto error_chrdev;
     }
     
+    fp_xiaomi_debugfs_root = debugfs_create_dir("fp_xiaomi", NULL);
+    
     /* Register USB driver */
     ret = usb_register(&fp_xiaomi_driver);
     if (ret) {
         pr_err("[FP_XIAOMI] Failed to register USB driver: %d\n", ret);
-        goto error_class;
+        goto error_debugfs;
     }
     
     pr_info("[FP_XIAOMI] Driver loaded successfully\n");
     return 0;
     
-error_class:
+error_debugfs:
+    debugfs_remove_recursive(fp_xiaomi_debugfs_root);
     class_destroy(fp_xiaomi_class);
 error_chrdev:
     unregister_chrdev_region(fp_xiaomi_devt, FP_XIAOMI_MAX_DEVICES);
@@ -981,6 +3873,8 @@ static void __exit fp_xiaomi_exit(void)
     /* Unregister USB driver */
     usb_deregister(&fp_xiaomi_driver);
     
+    debugfs_remove_recursive(fp_xiaomi_debugfs_root);
+    
     /* Destroy device class */
     class_destroy(fp_xiaomi_class);
     
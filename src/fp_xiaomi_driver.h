@@ -68,9 +68,56 @@ struct fp_image_data {
     __u8 quality;
     __u16 flags;
     __u32 size;
+    __u32 sequence;          /* Out: frame ring sequence the frame was published under */
     __u8 *data;
 };
 
+/*
+ * FP_IMG_FORMAT_COMPRESSED: lossless GRAY8. A struct fp_compressed_header
+ * (little-endian) is followed by payload_size bytes of bitstream, filled
+ * from the least significant bit of each byte up.
+ *
+ * Pixels are coded in raster order. Each is predicted from its left (a),
+ * upper (b) and upper-left (c) neighbours with the median edge detector:
+ * min(a, b) if c >= max(a, b), max(a, b) if c <= min(a, b), otherwise
+ * a + b - c. On the first row b = c = a, in the first column a = c = b,
+ * and all three are 128 for the first pixel. The residual modulo 256 is
+ * folded to m = 0, 1, 2, ... for 0, -1, 1, -2, ... and Rice coded with
+ * parameter k: m >> k in unary (ones closed by a zero), then the low k
+ * bits of m. A quotient of FP_CODEC_ESCAPE or more is sent instead as
+ * FP_CODEC_ESCAPE ones followed by m in 8 bits.
+ *
+ * k adapts per context. The context is the activity of the row above,
+ * |d - b| + |b - c| with d the upper-right neighbour (b past the last
+ * column, a on the first row), split at 4, 12 and 32 into
+ * FP_CODEC_CONTEXTS classes. Each holds a residual sum A (starting at
+ * FP_CODEC_INIT_SUM) and count N (starting at 1); k is the smallest
+ * value up to 8 with N << k >= A. After each pixel m is added to A and
+ * N is incremented, and both are halved when N reaches FP_CODEC_RESET.
+ */
+#define FP_CODEC_MAGIC           0x315a5046  /* "FPZ1" */
+#define FP_CODEC_ESCAPE          24
+#define FP_CODEC_CONTEXTS        4
+#define FP_CODEC_INIT_SUM        16
+#define FP_CODEC_RESET           64
+
+struct fp_compressed_header {
+    __u32 magic;                /* FP_CODEC_MAGIC */
+    __u16 width;
+    __u16 height;
+    __u32 payload_size;         /* Bitstream bytes after the header */
+};
+
+/* Streaming capture parameters */
+struct fp_stream_params {
+    __u32 interval_us;       /* Frame start to frame start; 0: back to back */
+    __u32 max_frames;        /* Stop after this many frames; 0: until stopped */
+    __u32 flags;             /* FP_STREAM_* */
+    __u32 reserved[5];
+};
+
+#define FP_STREAM_DROP_OLDEST    0x0001  /* Recycle unread slots instead of waiting */
+
 /* Template data structure */
 struct fp_template_data {
     __u8 id;
@@ -107,7 +154,7 @@ struct fp_identify_params {
     __u32 flags;
     __u8 matched_id;
     __u8 confidence;
-    __u16 reserved;
+    __u16 candidate_mask;        /* Bit n-1 set: template n may match; 0: all */
 };
 
 /* Device status structure */
@@ -120,9 +167,29 @@ struct fp_device_status {
     __u32 successful_matches;
     __u32 failed_matches;
     __u32 error_count;
-    __u32 reserved[2];
+    __u32 template_generation;   /* Changes whenever stored templates may have; never 0 */
+    __u32 reserved[1];
 };
 
+/* FP_IOC_GET_DEBUG_INFO word layout; counters wrap at 32 bits */
+#define FP_DEBUG_INFO_WORDS             16
+#define FP_DEBUG_INFO_STATE             0
+#define FP_DEBUG_INFO_OPEN_COUNT        1
+#define FP_DEBUG_INFO_ERRORS            2
+#define FP_DEBUG_INFO_RETRIES           3
+#define FP_DEBUG_INFO_CAPTURES          4
+#define FP_DEBUG_INFO_RING_PRODUCER     5
+#define FP_DEBUG_INFO_RING_CONSUMER     6
+#define FP_DEBUG_INFO_LAST_ERROR        7
+#define FP_DEBUG_INFO_DEBUG_LEVEL       8
+#define FP_DEBUG_INFO_BYTES_IN          9
+#define FP_DEBUG_INFO_BYTES_OUT         10
+#define FP_DEBUG_INFO_CONTROL_TRANSFERS 11
+#define FP_DEBUG_INFO_BULK_PACKETS      12
+#define FP_DEBUG_INFO_TIMEOUTS          13
+#define FP_DEBUG_INFO_STALLS            14
+#define FP_DEBUG_INFO_CAPTURE_FAILURES  15
+
 /* Calibration parameters */
 struct fp_calibration_params {
     __u8 mode;
@@ -135,9 +202,161 @@ struct fp_calibration_params {
 /* Power management parameters */
 struct fp_power_params {
     __u8 mode;
-    __u8 auto_suspend_delay;
+    __u8 auto_suspend_delay;     /* Idle seconds before USB autosuspend; 0: never */
+    __u16 flags;
+    __u32 reserved[2];
+};
+
+/*
+ * Memory-mapped frame ring
+ *
+ * mmap() of the device node at offset 0 exposes FP_RING_MAP_SIZE bytes:
+ * a struct fp_frame_ring header followed by FP_RING_SLOT_COUNT frame
+ * slots of FP_RING_SLOT_STRIDE bytes each. The driver publishes a frame
+ * by filling slot (producer % slot_count) and then advancing producer;
+ * the reader advances consumer once it is done with a slot. Indices are
+ * free-running counters, so producer - consumer is the fill level.
+ *
+ * A stream started with FP_STREAM_DROP_OLDEST may find the ring full
+ * and take the oldest slot back by advancing consumer itself, counting
+ * the frame in dropped. Readers of such a stream advance consumer with
+ * a compare-and-swap from the sequence they read; if it fails the slot
+ * was recycled while they held it and its contents must be discarded.
+ *
+ * The mapping is writable, but the driver only ever writes producer and
+ * the slot headers: it keeps its own producer index and never reads
+ * either back, so a reader scribbling over them only confuses itself.
+ */
+#define FP_RING_MAGIC            0x46505247  /* "FPRG" */
+#define FP_RING_VERSION          1
+#define FP_RING_SLOT_COUNT       4
+#define FP_RING_HEADER_SIZE      4096
+#define FP_RING_SLOT_STRIDE      (10 * 4096)
+#define FP_RING_MAP_SIZE         (FP_RING_HEADER_SIZE + \
+                                  FP_RING_SLOT_COUNT * FP_RING_SLOT_STRIDE)
+
+/* Frame ring header, placed at offset 0 of the mapping */
+struct fp_frame_ring {
+    __u32 magic;
+    __u32 version;
+    __u32 slot_count;
+    __u32 slot_stride;
+    __u32 slot_offset;
+    __u32 dropped;           /* Frames a drop-oldest stream recycled unread */
+    __s32 stream_status;     /* -errno that ended the last stream, else 0 */
+    __u32 reserved0[9];
+    __u32 producer;          /* Written by the driver */
+    __u32 reserved1[15];
+    __u32 consumer;          /* Written by the reader */
+    __u32 reserved2[15];
+};
+
+/* fp_frame_slot flags */
+#define FP_FRAME_FLAG_WAKE       0x0001  /* Captured by the driver when a touch woke it */
+#define FP_FRAME_FLAG_STREAM     0x0002  /* Captured by a stream (FP_IOC_STREAM_START) */
+
+/* Per-slot header; frame data follows immediately */
+struct fp_frame_slot {
+    __u32 sequence;
+    __u32 size;
+    __u16 width;
+    __u16 height;
+    __u8 format;
+    __u8 quality;
     __u16 flags;
+    __u64 timestamp_ns;
     __u32 reserved[2];
+    __u8 data[];
+};
+
+/* Protocol commands */
+#define FP_CMD_GET_INFO          0x01
+#define FP_CMD_RESET             0x02
+#define FP_CMD_CALIBRATE         0x03
+#define FP_CMD_CAPTURE           0x10
+#define FP_CMD_DETECT_FINGER     0x12
+#define FP_CMD_ENROLL_START      0x20
+#define FP_CMD_ENROLL_CONTINUE   0x21
+#define FP_CMD_ENROLL_COMPLETE   0x22
+#define FP_CMD_ENROLL_CANCEL     0x23
+#define FP_CMD_VERIFY            0x30
+#define FP_CMD_IDENTIFY          0x31
+#define FP_CMD_STORE_TEMPLATE    0x40
+#define FP_CMD_LOAD_TEMPLATE     0x41
+#define FP_CMD_DELETE_TEMPLATE   0x42
+#define FP_CMD_LIST_TEMPLATES    0x43
+#define FP_CMD_SET_POWER         0x50
+#define FP_CMD_GET_POWER         0x51
+
+/* Response codes */
+#define FP_RESP_OK               0x00
+#define FP_RESP_ERROR            0x01
+#define FP_RESP_TIMEOUT          0x02
+#define FP_RESP_NO_FINGER        0x03
+#define FP_RESP_BAD_IMAGE        0x04
+#define FP_RESP_NO_MATCH         0x05
+#define FP_RESP_BUSY             0x06
+#define FP_RESP_NOT_SUPPORTED    0x07
+
+/* Command/response packet structure */
+struct fp_packet {
+    __u8 cmd;
+    __u8 flags;
+    __u16 length;
+    __u8 data[];
+} __attribute__((packed));
+
+/*
+ * Finger presence detection
+ *
+ * While the device node is open and idle the driver arms the sensor
+ * with FP_CMD_DETECT_FINGER (wValue 1 = arm, 0 = disarm) and keeps one
+ * bulk IN request pending. The sensor answers only on a state change,
+ * with a struct fp_packet whose cmd is FP_CMD_DETECT_FINGER and whose
+ * flags field is an FP_FINGER_EVENT_* code. Queued events make poll()
+ * report EPOLLPRI; FP_IOC_GET_FINGER_EVENT dequeues them one at a time
+ * and fails with EAGAIN once the queue is empty.
+ */
+#define FP_FINGER_EVENT_DOWN     1
+#define FP_FINGER_EVENT_UP       2
+
+struct fp_finger_event {
+    __u8 type;               /* FP_FINGER_EVENT_* */
+    __u8 reserved[7];
+    __u64 timestamp_ns;      /* CLOCK_REALTIME */
+};
+
+/*
+ * Batched command submission
+ *
+ * FP_IOC_SUBMIT_BATCH runs up to FP_BATCH_MAX_COMMANDS protocol commands
+ * back-to-back under a single device lock hold. commands points to
+ * commands_len bytes of packed struct fp_packet records (header plus
+ * length bytes of parameters); for a command packet, flags carries the
+ * wValue argument (template ID, power mode, ...). The driver writes one
+ * response packet per executed command to responses: cmd is echoed,
+ * flags holds the FP_RESP_* status and data the response payload.
+ * Reset and commands with a bulk data phase (capture, enroll complete,
+ * load and store template) are rejected with EINVAL; use their IOCTLs.
+ * Each command gets the driver's default timeout, as it would on its own.
+ * A batched SET_POWER changes the mode only and keeps the autosuspend
+ * delay; ENROLL_START must carry the sensor's full parameter block (id,
+ * threshold, attempts, name, __le32 flags) and its steps then run with
+ * the default timeout.
+ */
+#define FP_BATCH_MAX_COMMANDS    32
+#define FP_BATCH_MAX_PAYLOAD     63
+#define FP_BATCH_STOP_ON_ERROR   0x0001
+
+struct fp_batch {
+    __u32 count;             /* Number of command packets */
+    __u32 flags;             /* FP_BATCH_* */
+    __u64 commands;          /* User pointer to command packets */
+    __u64 responses;         /* User pointer to response buffer */
+    __u32 commands_len;      /* Size of the command packets in bytes */
+    __u32 responses_len;     /* In: buffer size, out: bytes written */
+    __u32 completed;         /* Out: number of responses written */
+    __s32 error;             /* Out: errno of the first failure, or 0 */
 };
 
 /* IOCTL commands */
@@ -148,9 +367,56 @@ struct fp_power_params {
 #define FP_IOC_RESET_DEVICE       _IO(FP_XIAOMI_IOC_MAGIC, 0x03)
 #define FP_IOC_CALIBRATE          _IOW(FP_XIAOMI_IOC_MAGIC, 0x04, struct fp_calibration_params)
 
-/* Image capture */
+/*
+ * Abort the call this file descriptor has in progress, from any thread
+ * and without waiting for it: its transfers are killed and it fails
+ * with ECANCELED. ENROLL_CANCEL does the same to an enrollment step
+ * before telling the sensor.
+ * The timeout_ms of VERIFY, IDENTIFY and ENROLL_START (reused for each
+ * ENROLL_CONTINUE) bounds the whole call; 0 selects the driver default.
+ */
+#define FP_IOC_CANCEL             _IO(FP_XIAOMI_IOC_MAGIC, 0x05)
+
+/*
+ * Speculative warm-up, e.g. on lid open: the call resumes the sensor,
+ * finishes its init and arms finger detection before returning, then
+ * holds off autosuspend for the __u32 timeout_ms it is given (0: the
+ * driver default, clamped to 60 s). The window ends at the first touch
+ * or at the timeout; calling again extends it. If the frame ring is
+ * mapped, that touch is captured into it at once, tagged
+ * FP_FRAME_FLAG_WAKE.
+ */
+#define FP_IOC_PREARM             _IOW(FP_XIAOMI_IOC_MAGIC, 0x06, __u32)
+
+/*
+ * Image capture (data == NULL publishes the frame to the mmap ring only).
+ * With FP_FLAG_QUALITY_CHECK in flags on input, quality is the share of
+ * the sensor (0-100) that must show ridges; the capture ends early with
+ * EBADMSG once the frame can no longer get there. The same gate runs
+ * ahead of VERIFY, IDENTIFY and ENROLL_CONTINUE when their params carry
+ * FP_FLAG_QUALITY_CHECK and a quality_threshold. format set to
+ * FP_IMG_FORMAT_COMPRESSED on input asks for the frame compressed; it
+ * is returned as GRAY8 when that would not make it smaller. A non-zero
+ * size on input is the capacity of data; a frame that would not fit
+ * fails with ENOSPC.
+ */
 #define FP_IOC_CAPTURE_IMAGE      _IOR(FP_XIAOMI_IOC_MAGIC, 0x10, struct fp_image_data)
 #define FP_IOC_GET_IMAGE_SIZE     _IOR(FP_XIAOMI_IOC_MAGIC, 0x11, __u32)
+#define FP_IOC_GET_FINGER_EVENT   _IOR(FP_XIAOMI_IOC_MAGIC, 0x12, struct fp_finger_event)
+
+/*
+ * Streaming capture into the mmap ring. STREAM_START captures frames
+ * interval_us apart until STREAM_STOP, max_frames frames, or close of
+ * the file that started it. Each frame is published like a ring-only
+ * capture, flagged FP_FRAME_FLAG_STREAM with its own sequence and
+ * timestamp. While the ring is full the stream waits for the reader,
+ * or recycles the oldest slot with FP_STREAM_DROP_OLDEST. io_lock is
+ * taken per frame, so other calls run between frames. One stream per
+ * device (EBUSY); only the starting file may stop it (EPERM). A stream
+ * that fails repeatedly stops and leaves the error in stream_status.
+ */
+#define FP_IOC_STREAM_START       _IOW(FP_XIAOMI_IOC_MAGIC, 0x13, struct fp_stream_params)
+#define FP_IOC_STREAM_STOP        _IO(FP_XIAOMI_IOC_MAGIC, 0x14)
 
 /* Template management */
 #define FP_IOC_ENROLL_START       _IOW(FP_XIAOMI_IOC_MAGIC, 0x20, struct fp_enroll_params)
@@ -174,11 +440,21 @@ struct fp_power_params {
 #define FP_IOC_GET_POWER_MODE     _IOR(FP_XIAOMI_IOC_MAGIC, 0x51, struct fp_power_params)
 
 /* Debugging and diagnostics */
-#define FP_IOC_GET_DEBUG_INFO     _IOR(FP_XIAOMI_IOC_MAGIC, 0x60, __u32[16])
+#define FP_IOC_GET_DEBUG_INFO     _IOR(FP_XIAOMI_IOC_MAGIC, 0x60, __u32[FP_DEBUG_INFO_WORDS])
 #define FP_IOC_SET_DEBUG_LEVEL    _IOW(FP_XIAOMI_IOC_MAGIC, 0x61, __u8)
 
+/* Batched submission */
+#define FP_IOC_SUBMIT_BATCH       _IOWR(FP_XIAOMI_IOC_MAGIC, 0x70, struct fp_batch)
+
 /* Maximum IOCTL number */
-#define FP_IOC_MAXNR              0x61
+#define FP_IOC_MAXNR              0x70
+
+/*
+ * IOCTLs fail with -1 and errno set. Sensor responses map to:
+ * ENODATA (no finger), EBADMSG (bad image), ENOKEY (no match),
+ * ETIMEDOUT, EBUSY, EOPNOTSUPP; other failures use EIO/EPROTO.
+ * A call aborted by FP_IOC_CANCEL fails with ECANCELED.
+ */
 
 /* Error codes returned by driver */
 #define FP_SUCCESS                0
@@ -242,41 +518,6 @@ struct fp_power_params {
 
 /* Kernel-only definitions */
 
-/* Protocol commands */
-#define FP_CMD_GET_INFO          0x01
-#define FP_CMD_RESET             0x02
-#define FP_CMD_CALIBRATE         0x03
-#define FP_CMD_CAPTURE           0x10
-#define FP_CMD_ENROLL_START      0x20
-#define FP_CMD_ENROLL_CONTINUE   0x21
-#define FP_CMD_ENROLL_COMPLETE   0x22
-#define FP_CMD_VERIFY            0x30
-#define FP_CMD_IDENTIFY          0x31
-#define FP_CMD_STORE_TEMPLATE    0x40
-#define FP_CMD_LOAD_TEMPLATE     0x41
-#define FP_CMD_DELETE_TEMPLATE   0x42
-#define FP_CMD_LIST_TEMPLATES    0x43
-#define FP_CMD_SET_POWER         0x50
-#define FP_CMD_GET_POWER         0x51
-
-/* Response codes */
-#define FP_RESP_OK               0x00
-#define FP_RESP_ERROR            0x01
-#define FP_RESP_TIMEOUT          0x02
-#define FP_RESP_NO_FINGER        0x03
-#define FP_RESP_BAD_IMAGE        0x04
-#define FP_RESP_NO_MATCH         0x05
-#define FP_RESP_BUSY             0x06
-#define FP_RESP_NOT_SUPPORTED    0x07
-
-/* Command/response packet structure */
-struct fp_packet {
-    __u8 cmd;
-    __u8 flags;
-    __u16 length;
-    __u8 data[];
-} __packed;
-
 /* Firmware update structure */
 struct fp_firmware_info {
     __u32 version;
@@ -285,6 +526,112 @@ struct fp_firmware_info {
     __u8 *data;
 };
 
+#include <linux/workqueue.h>
+#include <linux/timer.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+
+struct device;
+struct fp_xiaomi_device;
+
+/* Failure classes handed to the recovery engine */
+enum fp_error_type {
+    FP_RECOVERY_COMMUNICATION,
+    FP_RECOVERY_TIMEOUT,
+    FP_RECOVERY_HARDWARE,
+    FP_RECOVERY_STATE,
+    FP_RECOVERY_ERROR_TYPES
+};
+
+/* Recovery ladder, cheapest first */
+enum fp_recovery_strategy {
+    FP_STRATEGY_CLEAR_HALT,      /* Clear a stalled bulk pipe */
+    FP_STRATEGY_PROTOCOL_RESET,  /* FP_CMD_RESET */
+    FP_STRATEGY_REINITIALIZE,    /* Reload firmware and device info */
+    FP_STRATEGY_PORT_RESET,      /* USB port reset */
+    FP_RECOVERY_STRATEGIES
+};
+
+/* Device hooks used by the recovery engine; all are called in process context */
+struct fp_recovery_ops {
+    int (*clear_halt)(struct fp_xiaomi_device *dev);        /* Bulk IN pipe */
+    int (*reset_hardware)(struct fp_xiaomi_device *dev);    /* USB port reset */
+    int (*reset_interface)(struct fp_xiaomi_device *dev);   /* Sensor protocol reset */
+    int (*reinitialize)(struct fp_xiaomi_device *dev);      /* Firmware and device info */
+    int (*test_communication)(struct fp_xiaomi_device *dev);
+    void (*recovered)(struct fp_xiaomi_device *dev);        /* Back to READY */
+    void (*recovery_failed)(struct fp_xiaomi_device *dev);
+};
+
+/* Outcome history for one error type */
+struct fp_recovery_history {
+    u16 successes[FP_RECOVERY_STRATEGIES];
+    u16 failures[FP_RECOVERY_STRATEGIES];
+    s8 last_success;             /* Strategy that worked last, -1 if none */
+    u32 last_latency_ms;
+};
+
+/*
+ * Per-device recovery state, embedded in the device structure. Recovery
+ * work runs on the owning device's workqueue, so devices recover
+ * independently. lock protects in_progress and last_error; history is
+ * only touched by the recovery work.
+ */
+struct fp_recovery_context {
+    struct fp_xiaomi_device *dev;
+    struct device *log_dev;
+    const struct fp_recovery_ops *ops;
+    struct workqueue_struct *workqueue;
+    struct work_struct recovery_work;
+    struct timer_list recovery_timer;
+    spinlock_t lock;
+    atomic_t recovery_attempts;
+    enum fp_error_type last_error;
+    bool recovery_in_progress;
+    unsigned int recovery_count;
+    struct fp_recovery_history history[FP_RECOVERY_ERROR_TYPES];
+};
+
+void fp_xiaomi_recovery_init(struct fp_recovery_context *ctx, struct fp_xiaomi_device *dev,
+                             struct device *log_dev, const struct fp_recovery_ops *ops,
+                             struct workqueue_struct *workqueue);
+void fp_xiaomi_recovery_cleanup(struct fp_recovery_context *ctx);
+int fp_xiaomi_trigger_recovery(struct fp_recovery_context *ctx, enum fp_error_type error_type);
+bool fp_xiaomi_recovery_available(struct fp_recovery_context *ctx);
+unsigned int fp_xiaomi_backoff_ms(unsigned int attempt, unsigned int base_ms,
+                                  unsigned int cap_ms);
+
+/*
+ * Latency histogram, HDR style: values in microseconds, one group per
+ * power of two, each split into FP_LATENCY_SUB_BUCKETS linear buckets,
+ * so any recorded value is reported within 12.5%. Recording is a few
+ * lock-free atomic adds and is safe from any context.
+ */
+#define FP_LATENCY_SUB_BITS     3
+#define FP_LATENCY_SUB_BUCKETS  (1 << FP_LATENCY_SUB_BITS)
+#define FP_LATENCY_GROUPS       25      /* Up to 2^27 us (~134 s) */
+#define FP_LATENCY_BUCKETS      (FP_LATENCY_GROUPS * FP_LATENCY_SUB_BUCKETS)
+
+struct seq_file;
+
+struct fp_latency_hist {
+    atomic64_t buckets[FP_LATENCY_BUCKETS];
+    atomic64_t sum_us;
+    atomic64_t max_us;
+};
+
+void fp_xiaomi_latency_record(struct fp_latency_hist *hist, u64 ns);
+void fp_xiaomi_latency_reset(struct fp_latency_hist *hist);
+void fp_xiaomi_latency_show(struct seq_file *m, struct fp_latency_hist *hist);
+
+/*
+ * Encode a GRAY8 frame as FP_IMG_FORMAT_COMPRESSED into dst. Returns
+ * the encoded size, or -ENOSPC when it would not fit in dst_len, in
+ * which case the frame is best sent as it is.
+ */
+ssize_t fp_xiaomi_compress(const u8 *src, u16 width, u16 height,
+                           u8 *dst, size_t dst_len);
+
 #endif /* __KERNEL__ */
 
 #endif /* _FP_XIAOMI_DRIVER_H */
\ No newline at end of file
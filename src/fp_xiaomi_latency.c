@@ -0,0 +1,144 @@
+/**
+ * @file fp_xiaomi_latency.c
+ * @brief Latency histograms for Xiaomi FPC Fingerprint Scanner Driver
+ * @author Project contributors
+ * @version 1.0.0
+ *
+ * Always-on per-phase latency histograms, exposed through debugfs so
+ * tail latency can be compared across firmware versions without a
+ * debug build.
+ *
+ * @copyright GPL v2 License
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#include <linux/bitops.h>
+#include "fp_xiaomi_driver.h"
+
+/* Group 0 holds 0..7 us exactly; group g > 0 covers [8 << (g - 1), 16 << (g - 1)) */
+static unsigned int fp_latency_bucket(u64 us)
+{
+    unsigned int msb, group;
+    
+    if (us < FP_LATENCY_SUB_BUCKETS) {
+        return us;
+    }
+    
+    msb = fls64(us) - 1;
+    group = msb - FP_LATENCY_SUB_BITS + 1;
+    if (group >= FP_LATENCY_GROUPS) {
+        return FP_LATENCY_BUCKETS - 1;
+    }
+    
+    return group * FP_LATENCY_SUB_BUCKETS +
+           ((us >> (msb - FP_LATENCY_SUB_BITS)) & (FP_LATENCY_SUB_BUCKETS - 1));
+}
+
+static u64 fp_latency_bucket_low(unsigned int bucket)
+{
+    unsigned int group = bucket / FP_LATENCY_SUB_BUCKETS;
+    unsigned int sub = bucket % FP_LATENCY_SUB_BUCKETS;
+    
+    if (group == 0) {
+        return sub;
+    }
+    
+    return (u64)(FP_LATENCY_SUB_BUCKETS + sub) << (group - 1);
+}
+
+static u64 fp_latency_bucket_high(unsigned int bucket)
+{
+    unsigned int group = bucket / FP_LATENCY_SUB_BUCKETS;
+    
+    return fp_latency_bucket_low(bucket) + (group ? 1ULL << (group - 1) : 1) - 1;
+}
+
+void fp_xiaomi_latency_record(struct fp_latency_hist *hist, u64 ns)
+{
+    u64 us = div_u64(ns, NSEC_PER_USEC);
+    s64 max;
+    
+    atomic64_inc(&hist->buckets[fp_latency_bucket(us)]);
+    atomic64_add(us, &hist->sum_us);
+    
+    max = atomic64_read(&hist->max_us);
+    while ((u64)max < us) {
+        s64 old = atomic64_cmpxchg(&hist->max_us, max, us);
+        if (old == max) {
+            break;
+        }
+        max = old;
+    }
+}
+
+void fp_xiaomi_latency_reset(struct fp_latency_hist *hist)
+{
+    int i;
+    
+    for (i = 0; i < FP_LATENCY_BUCKETS; i++) {
+        atomic64_set(&hist->buckets[i], 0);
+    }
+    atomic64_set(&hist->sum_us, 0);
+    atomic64_set(&hist->max_us, 0);
+}
+
+/* Upper bound of the bucket holding the given per-mille rank */
+static u64 fp_latency_percentile(const u64 *counts, u64 total, unsigned int permille, u64 max)
+{
+    u64 rank = div_u64(total * permille + 999, 1000);
+    u64 seen = 0;
+    int i;
+    
+    for (i = 0; i < FP_LATENCY_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return min(fp_latency_bucket_high(i), max);
+        }
+    }
+    
+    return max;
+}
+
+void fp_xiaomi_latency_show(struct seq_file *m, struct fp_latency_hist *hist)
+{
+    static const unsigned int permille[] = { 500, 900, 990, 999 };
+    static const char * const labels[] = { "p50", "p90", "p99", "p99.9" };
+    u64 total = 0;
+    u64 max;
+    u64 *counts;
+    int i;
+    
+    counts = kmalloc_array(FP_LATENCY_BUCKETS, sizeof(*counts), GFP_KERNEL);
+    if (!counts) {
+        return;
+    }
+    
+    /* Percentiles come from one pass over the buckets, not from count */
+    for (i = 0; i < FP_LATENCY_BUCKETS; i++) {
+        counts[i] = atomic64_read(&hist->buckets[i]);
+        total += counts[i];
+    }
+    max = atomic64_read(&hist->max_us);
+    
+    seq_printf(m, "count: %llu\n", total);
+    seq_printf(m, "mean_us: %llu\n",
+               total ? div64_u64(atomic64_read(&hist->sum_us), total) : 0);
+    seq_printf(m, "max_us: %llu\n", max);
+    for (i = 0; i < ARRAY_SIZE(permille); i++) {
+        seq_printf(m, "%s_us: %llu\n", labels[i],
+                   total ? fp_latency_percentile(counts, total, permille[i], max) : 0);
+    }
+    
+    seq_puts(m, "buckets_us:\n");
+    for (i = 0; i < FP_LATENCY_BUCKETS; i++) {
+        if (counts[i]) {
+            seq_printf(m, "  %llu-%llu: %llu\n", fp_latency_bucket_low(i),
+                       fp_latency_bucket_high(i), counts[i]);
+        }
+    }
+    
+    kfree(counts);
+}
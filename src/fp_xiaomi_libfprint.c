@@ -42,6 +42,8 @@ struct _FpDeviceXiaomiFpc {
     GCancellable *cancellable;
     FpPrint *enroll_print;
     gint enroll_stage;
+    guint8 enroll_id;
+    guint16 stored_mask;        /* Occupied sensor slots, bit n-1 for template n */
 };
 
 G_DECLARE_FINAL_TYPE(FpDeviceXiaomiFpc, fpi_device_xiaomi_fpc, FPI, DEVICE_XIAOMI_FPC, FpDevice)
@@ -54,6 +56,7 @@ static void fpi_device_xiaomi_fpc_close(FpDevice *device);
 static void fpi_device_xiaomi_fpc_enroll(FpDevice *device);
 static void fpi_device_xiaomi_fpc_verify(FpDevice *device);
 static void fpi_device_xiaomi_fpc_identify(FpDevice *device);
+static void fpi_device_xiaomi_fpc_delete(FpDevice *device);
 static void fpi_device_xiaomi_fpc_cancel(FpDevice *device);
 
 /**
@@ -90,6 +93,127 @@ static void fpi_device_xiaomi_fpc_probe(FpDevice *device)
     fpi_device_probe_complete(device, NULL, NULL, NULL);
 }
 
+/*
+ * Print index
+ *
+ * Each print records the sensor slot its template was enrolled into,
+ * next to the template bytes ("(yay)"). Slot 0 means the print only
+ * exists on the host, which is also how plain "ay" prints from older
+ * versions are read. stored_mask mirrors fp_xiaomi_list_templates():
+ * it is loaded on open, kept current by enroll and delete, and synced
+ * again before enroll picks a slot and before verify and identify, so
+ * a slot taken by another client is never overwritten and matches know
+ * which prints the sensor holds. The library caches the list, so the sync is
+ * a memory read unless another client changed the sensor's templates.
+ */
+#define XIAOMI_PRINT_DATA_TYPE "(yay)"
+
+static FpPrint *xiaomi_print_new(FpDevice *device, guint8 template_id,
+                                 const fp_xiaomi_template_t *template)
+{
+    FpPrint *print;
+    
+    print = fp_print_new(device);
+    fpi_print_set_type(print, FPI_PRINT_RAW);
+    fpi_print_set_device_stored(print, template_id != 0);
+    fpi_print_set_raw(print,
+                      g_variant_new(XIAOMI_PRINT_DATA_TYPE, template_id,
+                                    g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE,
+                                                              template->data,
+                                                              template->size,
+                                                              sizeof(guint8))));
+    
+    return print;
+}
+
+/* Template view of a print; data stays owned by the print */
+static gboolean xiaomi_print_get(FpPrint *print, guint8 *template_id,
+                                 fp_xiaomi_template_t *template)
+{
+    GVariant *data = NULL;
+    GVariant *bytes;
+    gsize size;
+    
+    *template_id = 0;
+    memset(template, 0, sizeof(*template));
+    
+    g_object_get(print, "fpi-data", &data, NULL);
+    if (!data) {
+        return FALSE;
+    }
+    
+    if (g_variant_is_of_type(data, G_VARIANT_TYPE(XIAOMI_PRINT_DATA_TYPE))) {
+        g_variant_get(data, "(y@ay)", template_id, &bytes);
+    } else if (g_variant_is_of_type(data, G_VARIANT_TYPE_BYTESTRING)) {
+        bytes = g_variant_ref(data);
+    } else {
+        g_variant_unref(data);
+        return FALSE;
+    }
+    
+    template->type = FP_XIAOMI_TEMPLATE_PROPRIETARY;
+    template->data = (uint8_t *)g_variant_get_fixed_array(bytes, &size, sizeof(guint8));
+    template->size = size;
+    template->id = *template_id;
+    
+    g_variant_unref(bytes);
+    g_variant_unref(data);
+    return size > 0;
+}
+
+static gboolean xiaomi_index_has(FpDeviceXiaomiFpc *self, guint8 template_id)
+{
+    return template_id > 0 && template_id <= FP_XIAOMI_MAX_TEMPLATES &&
+           (self->stored_mask & (1U << (template_id - 1)));
+}
+
+static void xiaomi_index_set(FpDeviceXiaomiFpc *self, guint8 template_id, gboolean stored)
+{
+    if (template_id == 0 || template_id > FP_XIAOMI_MAX_TEMPLATES) {
+        return;
+    }
+    
+    if (stored) {
+        self->stored_mask |= 1U << (template_id - 1);
+    } else {
+        self->stored_mask &= ~(1U << (template_id - 1));
+    }
+}
+
+/* Lowest free sensor slot, 0 if the sensor is full */
+static guint8 xiaomi_index_free_slot(FpDeviceXiaomiFpc *self)
+{
+    guint8 id;
+    
+    for (id = 1; id <= FP_XIAOMI_MAX_TEMPLATES; id++) {
+        if (!xiaomi_index_has(self, id)) {
+            return id;
+        }
+    }
+    
+    return 0;
+}
+
+static int xiaomi_index_sync(FpDeviceXiaomiFpc *self)
+{
+    uint8_t ids[FP_XIAOMI_MAX_TEMPLATES];
+    size_t count = G_N_ELEMENTS(ids);
+    size_t i;
+    int ret;
+    
+    ret = fp_xiaomi_list_templates(self->xiaomi_dev, ids, &count);
+    if (ret != FP_XIAOMI_SUCCESS) {
+        return ret;
+    }
+    
+    self->stored_mask = 0;
+    for (i = 0; i < count; i++) {
+        xiaomi_index_set(self, ids[i], TRUE);
+    }
+    
+    return FP_XIAOMI_SUCCESS;
+}
+
 /**
  * Device open function
  */
@@ -115,6 +239,12 @@ static void fpi_device_xiaomi_fpc_open(FpDevice *device)
         goto error;
     }
     
+    if (xiaomi_index_sync(self) != FP_XIAOMI_SUCCESS) {
+        error = g_error_new(FP_DEVICE_ERROR, FP_DEVICE_ERROR_GENERAL,
+                           "Failed to read stored templates");
+        goto error;
+    }
+    
     /* Mark device as claimed to fix fprintd issues */
     self->device_claimed = TRUE;
     
@@ -161,139 +291,354 @@ static void fpi_device_xiaomi_fpc_close(FpDevice *device)
     fpi_device_close_complete(device, NULL);
 }
 
-/**
- * Enrollment function
+/*
+ * Asynchronous library calls
+ *
+ * libfp_xiaomi calls block until the sensor answers, so each one runs
+ * in a GTask worker thread and completes on the device's main context.
+ * Only one call is in flight per device at a time.
  */
-static void fpi_device_xiaomi_fpc_enroll(FpDevice *device)
+typedef enum {
+    XIAOMI_OP_ENROLL_START,
+    XIAOMI_OP_ENROLL_CONTINUE,
+    XIAOMI_OP_ENROLL_COMPLETE,
+    XIAOMI_OP_VERIFY,
+    XIAOMI_OP_IDENTIFY,
+    XIAOMI_OP_MATCH,
+    XIAOMI_OP_DELETE,
+} XiaomiOp;
+
+typedef struct {
+    XiaomiOp op;
+    fp_xiaomi_device_t *dev;
+    uint8_t template_id;
+    uint8_t matched_id;
+    uint8_t confidence;
+    fp_xiaomi_template_t template;
+    /* IDENTIFY: sensor slots to search */
+    uint8_t candidate_ids[FP_XIAOMI_MAX_TEMPLATES];
+    size_t n_candidate_ids;
+    /* MATCH: host templates to search, data owned by the prints */
+    fp_xiaomi_template_t *candidates;
+    size_t n_candidates;
+    size_t matched_index;
+    int result;
+} XiaomiCall;
+
+static void xiaomi_call_free(gpointer data)
+{
+    XiaomiCall *call = data;
+    
+    fp_xiaomi_free_template(&call->template);
+    g_free(call->candidates);
+    g_free(call);
+}
+
+static void xiaomi_call_worker(GTask *task, gpointer source_object,
+                               gpointer task_data, GCancellable *cancellable)
+{
+    XiaomiCall *call = task_data;
+    
+    switch (call->op) {
+    case XIAOMI_OP_ENROLL_START:
+        call->result = fp_xiaomi_enroll_start(call->dev, call->template_id, "libfprint",
+                                              FP_XIAOMI_TIMEOUT_DEFAULT);
+        break;
+    case XIAOMI_OP_ENROLL_CONTINUE:
+        call->result = fp_xiaomi_enroll_continue(call->dev);
+        break;
+    case XIAOMI_OP_ENROLL_COMPLETE:
+        call->result = fp_xiaomi_enroll_complete(call->dev, &call->template);
+        break;
+    case XIAOMI_OP_VERIFY:
+        call->result = fp_xiaomi_verify(call->dev, call->template_id,
+                                        FP_XIAOMI_TIMEOUT_DEFAULT);
+        break;
+    case XIAOMI_OP_IDENTIFY:
+        call->result = fp_xiaomi_identify_candidates(call->dev, call->candidate_ids,
+                                                     call->n_candidate_ids,
+                                                     &call->matched_id, &call->confidence,
+                                                     FP_XIAOMI_TIMEOUT_DEFAULT);
+        break;
+    case XIAOMI_OP_MATCH:
+        /* One capture, scored on the host against every candidate */
+        call->result = fp_xiaomi_capture_template(call->dev, &call->template,
+                                                  FP_XIAOMI_TIMEOUT_DEFAULT);
+        if (call->result == FP_XIAOMI_SUCCESS) {
+            call->result = fp_xiaomi_match_best(&call->template, call->candidates,
+                                                call->n_candidates, 0,
+                                                &call->matched_index, &call->confidence);
+        }
+        break;
+    case XIAOMI_OP_DELETE:
+        call->result = fp_xiaomi_delete_template(call->dev, call->template_id);
+        break;
+    default:
+        call->result = FP_XIAOMI_ERROR_INVALID_PARAM;
+        break;
+    }
+    
+    g_task_return_boolean(task, TRUE);
+}
+
+static XiaomiCall *xiaomi_call_new(FpDevice *device, XiaomiOp op, uint8_t template_id)
 {
     FpDeviceXiaomiFpc *self = FPI_DEVICE_XIAOMI_FPC(device);
-    FpPrint *print = NULL;
-    GError *error = NULL;
-    int ret;
+    XiaomiCall *call;
     
-    g_debug("Starting enrollment on Xiaomi FPC device");
+    call = g_new0(XiaomiCall, 1);
+    call->op = op;
+    call->dev = self->xiaomi_dev;
+    call->template_id = template_id;
+    
+    return call;
+}
+
+static void xiaomi_call_run(FpDevice *device, XiaomiCall *call,
+                            GAsyncReadyCallback callback, gpointer user_data)
+{
+    GTask *task;
     
+    task = g_task_new(device, fpi_device_get_cancellable(device), callback, user_data);
+    g_task_set_task_data(task, call, xiaomi_call_free);
+    g_task_run_in_thread(task, xiaomi_call_worker);
+    g_object_unref(task);
+}
+
+static void xiaomi_call_start(FpDevice *device, XiaomiOp op, uint8_t template_id,
+                              GAsyncReadyCallback callback, gpointer user_data)
+{
+    xiaomi_call_run(device, xiaomi_call_new(device, op, template_id), callback, user_data);
+}
+
+/* Result of a finished call; NULL with *error set if the action was cancelled */
+static XiaomiCall *xiaomi_call_finish(FpDevice *device, GAsyncResult *res, GError **error)
+{
+    if (g_cancellable_is_cancelled(fpi_device_get_cancellable(device))) {
+        *error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED, "Operation cancelled");
+        return NULL;
+    }
+    
+    return g_task_get_task_data(G_TASK(res));
+}
+
+static GError *xiaomi_check_open(FpDeviceXiaomiFpc *self)
+{
     if (!self->xiaomi_dev || !self->device_claimed) {
-        error = g_error_new(FP_DEVICE_ERROR, FP_DEVICE_ERROR_NOT_OPEN,
+        return g_error_new(FP_DEVICE_ERROR, FP_DEVICE_ERROR_NOT_OPEN,
                            "Device not properly opened or claimed");
-        goto error;
     }
     
-    /* Start enrollment */
-    if (self->enroll_stage == 0) {
-        ret = fp_xiaomi_enroll_start(self->xiaomi_dev, 1, "libfprint", 
-                                    FP_XIAOMI_TIMEOUT_DEFAULT);
-        if (ret != FP_XIAOMI_SUCCESS) {
-            error = g_error_new(FP_DEVICE_ERROR, FP_DEVICE_ERROR_GENERAL,
-                               "Failed to start enrollment: %s",
-                               fp_xiaomi_get_error_string(ret));
-            goto error;
-        }
-        self->enroll_stage = 1;
+    return NULL;
+}
+
+/**
+ * Enrollment state machine
+ *
+ * Touches are pipelined: as soon as one enroll_continue returns, the
+ * next one is already waiting on the sensor before progress for the
+ * finished touch is reported, so the fprintd D-Bus round trip no longer
+ * sits between two captures.
+ */
+enum {
+    ENROLL_START,
+    ENROLL_CAPTURE,
+    ENROLL_COMPLETE,
+    ENROLL_NUM_STATES,
+};
+
+static void enroll_start_cb(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    FpDevice *device = FP_DEVICE(source);
+    FpiSsm *ssm = user_data;
+    GError *error = NULL;
+    XiaomiCall *call;
+    
+    call = xiaomi_call_finish(device, res, &error);
+    if (!call) {
+        fpi_ssm_mark_failed(ssm, error);
+        return;
     }
     
-    /* Continue enrollment */
-    ret = fp_xiaomi_enroll_continue(self->xiaomi_dev);
+    if (call->result != FP_XIAOMI_SUCCESS) {
+        fpi_ssm_mark_failed(ssm, g_error_new(FP_DEVICE_ERROR, FP_DEVICE_ERROR_GENERAL,
+                                             "Failed to start enrollment: %s",
+                                             fp_xiaomi_get_error_string(call->result)));
+        return;
+    }
     
-    if (ret == FP_XIAOMI_SUCCESS) {
+    fpi_ssm_next_state(ssm);
+}
+
+static void enroll_capture_cb(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    FpDevice *device = FP_DEVICE(source);
+    FpDeviceXiaomiFpc *self = FPI_DEVICE_XIAOMI_FPC(device);
+    FpiSsm *ssm = user_data;
+    GError *error = NULL;
+    GError *retry = NULL;
+    XiaomiCall *call;
+    
+    call = xiaomi_call_finish(device, res, &error);
+    if (!call) {
+        fpi_ssm_mark_failed(ssm, error);
+        return;
+    }
+    
+    switch (call->result) {
+    case FP_XIAOMI_SUCCESS:
         self->enroll_stage++;
-        
-        /* Check if enrollment is complete */
         if (self->enroll_stage >= fpi_device_get_nr_enroll_stages(device)) {
-            fp_xiaomi_template_t template;
-            
-            ret = fp_xiaomi_enroll_complete(self->xiaomi_dev, &template);
-            if (ret == FP_XIAOMI_SUCCESS) {
-                /* Create libfprint print object */
-                print = fp_print_new(device);
-                
-                /* Store template data in print */
-                fpi_print_set_type(print, FPI_PRINT_RAW);
-                fpi_print_set_device_stored(print, TRUE);
-                
-                /* Set print data */
-                g_variant_builder_init(&builder, G_VARIANT_TYPE("ay"));
-                for (guint i = 0; i < template.size; i++) {
-                    g_variant_builder_add(&builder, "y", template.data[i]);
-                }
-                fpi_print_set_raw(print, g_variant_builder_end(&builder));
-                
-                fp_xiaomi_free_template(&template);
-                
-                g_info("Enrollment completed successfully");
-                fpi_device_enroll_complete(device, print, NULL);
-                
-                self->enroll_stage = 0;
-                return;
-            }
-        } else {
-            /* Request next enrollment stage */
-            fpi_device_enroll_progress(device, self->enroll_stage, print, NULL);
+            fpi_ssm_next_state(ssm);
             return;
         }
-    } else if (ret == FP_XIAOMI_ERROR_NO_FINGER) {
-        /* No finger detected, wait and retry */
-        fpi_device_enroll_progress(device, self->enroll_stage, NULL, 
-                                  g_error_new(FP_DEVICE_RETRY, FP_DEVICE_RETRY_TOO_SHORT,
-                                            "Place finger on sensor"));
+        break;
+    
+    case FP_XIAOMI_ERROR_NO_FINGER:
+        retry = g_error_new(FP_DEVICE_RETRY, FP_DEVICE_RETRY_TOO_SHORT,
+                            "Place finger on sensor");
+        break;
+    
+    case FP_XIAOMI_ERROR_BAD_IMAGE:
+        retry = g_error_new(FP_DEVICE_RETRY, FP_DEVICE_RETRY_CENTER_FINGER,
+                            "Center finger on sensor");
+        break;
+    
+    default:
+        fpi_ssm_mark_failed(ssm, g_error_new(FP_DEVICE_ERROR, FP_DEVICE_ERROR_GENERAL,
+                                             "Enrollment failed: %s",
+                                             fp_xiaomi_get_error_string(call->result)));
         return;
-    } else if (ret == FP_XIAOMI_ERROR_BAD_IMAGE) {
-        /* Poor image quality, retry */
-        fpi_device_enroll_progress(device, self->enroll_stage, NULL,
-                                  g_error_new(FP_DEVICE_RETRY, FP_DEVICE_RETRY_CENTER_FINGER,
-                                            "Center finger on sensor"));
+    }
+    
+    /* Arm the next touch first, then report this one */
+    xiaomi_call_start(device, XIAOMI_OP_ENROLL_CONTINUE, 0, enroll_capture_cb, ssm);
+    fpi_device_enroll_progress(device, self->enroll_stage, NULL, retry);
+}
+
+static void enroll_complete_cb(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    FpDevice *device = FP_DEVICE(source);
+    FpDeviceXiaomiFpc *self = FPI_DEVICE_XIAOMI_FPC(device);
+    FpiSsm *ssm = user_data;
+    GError *error = NULL;
+    XiaomiCall *call;
+    FpPrint *print;
+    
+    call = xiaomi_call_finish(device, res, &error);
+    if (!call) {
+        fpi_ssm_mark_failed(ssm, error);
         return;
     }
     
-    /* Enrollment failed */
-    error = g_error_new(FP_DEVICE_ERROR, FP_DEVICE_ERROR_GENERAL,
-                       "Enrollment failed: %s", fp_xiaomi_get_error_string(ret));
+    if (call->result != FP_XIAOMI_SUCCESS) {
+        fpi_ssm_mark_failed(ssm, g_error_new(FP_DEVICE_ERROR, FP_DEVICE_ERROR_GENERAL,
+                                             "Enrollment failed: %s",
+                                             fp_xiaomi_get_error_string(call->result)));
+        return;
+    }
     
-error:
-    if (self->xiaomi_dev) {
-        fp_xiaomi_enroll_cancel(self->xiaomi_dev);
+    xiaomi_index_set(self, self->enroll_id, TRUE);
+    print = xiaomi_print_new(device, self->enroll_id, &call->template);
+    
+    g_clear_object(&self->enroll_print);
+    self->enroll_print = print;
+    fpi_ssm_mark_completed(ssm);
+}
+
+static void enroll_run_state(FpiSsm *ssm, FpDevice *device)
+{
+    FpDeviceXiaomiFpc *self = FPI_DEVICE_XIAOMI_FPC(device);
+    
+    switch (fpi_ssm_get_cur_state(ssm)) {
+    case ENROLL_START:
+        xiaomi_call_start(device, XIAOMI_OP_ENROLL_START, self->enroll_id,
+                          enroll_start_cb, ssm);
+        break;
+    
+    case ENROLL_CAPTURE:
+        xiaomi_call_start(device, XIAOMI_OP_ENROLL_CONTINUE, 0, enroll_capture_cb, ssm);
+        break;
+    
+    case ENROLL_COMPLETE:
+        xiaomi_call_start(device, XIAOMI_OP_ENROLL_COMPLETE, 0, enroll_complete_cb, ssm);
+        break;
     }
+}
+
+static void enroll_ssm_done(FpiSsm *ssm, FpDevice *device, GError *error)
+{
+    FpDeviceXiaomiFpc *self = FPI_DEVICE_XIAOMI_FPC(device);
+    
     self->enroll_stage = 0;
-    fpi_device_enroll_complete(device, NULL, error);
+    
+    if (error) {
+        if (self->xiaomi_dev) {
+            fp_xiaomi_enroll_cancel(self->xiaomi_dev);
+        }
+        fpi_device_enroll_complete(device, NULL, error);
+        return;
+    }
+    
+    g_info("Enrollment completed successfully");
+    fpi_device_enroll_complete(device, g_steal_pointer(&self->enroll_print), NULL);
 }
 
 /**
- * Verification function
+ * Enrollment function
  */
-static void fpi_device_xiaomi_fpc_verify(FpDevice *device)
+static void fpi_device_xiaomi_fpc_enroll(FpDevice *device)
 {
     FpDeviceXiaomiFpc *self = FPI_DEVICE_XIAOMI_FPC(device);
-    FpPrint *print;
-    GError *error = NULL;
-    int ret;
+    GError *error;
+    FpiSsm *ssm;
     
-    g_debug("Starting verification on Xiaomi FPC device");
+    g_debug("Starting enrollment on Xiaomi FPC device");
     
-    if (!self->xiaomi_dev || !self->device_claimed) {
-        error = g_error_new(FP_DEVICE_ERROR, FP_DEVICE_ERROR_NOT_OPEN,
-                           "Device not properly opened or claimed");
-        goto error;
+    error = xiaomi_check_open(self);
+    if (!error && xiaomi_index_sync(self) != FP_XIAOMI_SUCCESS) {
+        error = g_error_new(FP_DEVICE_ERROR, FP_DEVICE_ERROR_GENERAL,
+                           "Failed to read stored templates");
     }
-    
-    print = fpi_device_get_verify_data(device);
-    if (!print) {
-        error = g_error_new(FP_DEVICE_ERROR, FP_DEVICE_ERROR_DATA_INVALID,
-                           "No print data provided for verification");
-        goto error;
+    if (!error) {
+        self->enroll_id = xiaomi_index_free_slot(self);
+        if (self->enroll_id == 0) {
+            error = g_error_new(FP_DEVICE_ERROR, FP_DEVICE_ERROR_DATA_FULL,
+                               "No free template slot on the sensor");
+        }
+    }
+    if (error) {
+        fpi_device_enroll_complete(device, NULL, error);
+        return;
     }
     
-    /* Perform verification */
-    ret = fp_xiaomi_verify(self->xiaomi_dev, 1, FP_XIAOMI_TIMEOUT_DEFAULT);
+    self->enroll_stage = 0;
+    ssm = fpi_ssm_new(device, enroll_run_state, ENROLL_NUM_STATES);
+    fpi_ssm_start(ssm, enroll_ssm_done);
+}
+
+static void verify_cb(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    FpDevice *device = FP_DEVICE(source);
+    GError *error = NULL;
+    XiaomiCall *call;
     
-    if (ret == FP_XIAOMI_SUCCESS) {
+    call = xiaomi_call_finish(device, res, &error);
+    if (!call) {
+        fpi_device_verify_complete(device, FPI_MATCH_ERROR, NULL, error);
+        return;
+    }
+    
+    if (call->result == FP_XIAOMI_SUCCESS) {
         g_info("Verification successful - match found");
-        fpi_device_verify_complete(device, FPI_MATCH_SUCCESS, print, NULL);
+        fpi_device_verify_complete(device, FPI_MATCH_SUCCESS,
+                                   fpi_device_get_verify_data(device), NULL);
         return;
-    } else if (ret == FP_XIAOMI_ERROR_NO_MATCH) {
+    } else if (call->result == FP_XIAOMI_ERROR_NO_MATCH) {
         g_info("Verification failed - no match");
         fpi_device_verify_complete(device, FPI_MATCH_FAIL, NULL, NULL);
         return;
-    } else if (ret == FP_XIAOMI_ERROR_NO_FINGER) {
+    } else if (call->result == FP_XIAOMI_ERROR_NO_FINGER) {
         error = g_error_new(FP_DEVICE_RETRY, FP_DEVICE_RETRY_TOO_SHORT,
                            "Place finger on sensor");
         fpi_device_verify_complete(device, FPI_MATCH_ERROR, NULL, error);
@@ -302,57 +647,100 @@ static void fpi_device_xiaomi_fpc_verify(FpDevice *device)
     
     /* Verification error */
     error = g_error_new(FP_DEVICE_ERROR, FP_DEVICE_ERROR_GENERAL,
-                       "Verification failed: %s", fp_xiaomi_get_error_string(ret));
-    
-error:
+                       "Verification failed: %s", fp_xiaomi_get_error_string(call->result));
     fpi_device_verify_complete(device, FPI_MATCH_ERROR, NULL, error);
 }
 
 /**
- * Identification function
+ * Verification function
  */
-static void fpi_device_xiaomi_fpc_identify(FpDevice *device)
+static void fpi_device_xiaomi_fpc_verify(FpDevice *device)
 {
     FpDeviceXiaomiFpc *self = FPI_DEVICE_XIAOMI_FPC(device);
-    GPtrArray *prints;
-    FpPrint *match = NULL;
-    GError *error = NULL;
-    uint8_t matched_id, confidence;
-    int ret;
+    fp_xiaomi_template_t template;
+    guint8 template_id = 0;
+    FpPrint *print;
+    XiaomiCall *call;
+    GError *error;
     
-    g_debug("Starting identification on Xiaomi FPC device");
+    g_debug("Starting verification on Xiaomi FPC device");
     
-    if (!self->xiaomi_dev || !self->device_claimed) {
-        error = g_error_new(FP_DEVICE_ERROR, FP_DEVICE_ERROR_NOT_OPEN,
-                           "Device not properly opened or claimed");
-        goto error;
+    error = xiaomi_check_open(self);
+    if (!error) {
+        print = fpi_device_get_verify_data(device);
+        if (!print || !xiaomi_print_get(print, &template_id, &template)) {
+            error = g_error_new(FP_DEVICE_ERROR, FP_DEVICE_ERROR_DATA_INVALID,
+                               "No print data provided for verification");
+        }
+    }
+    if (error) {
+        fpi_device_verify_complete(device, FPI_MATCH_ERROR, NULL, error);
+        return;
     }
     
-    prints = fpi_device_get_identify_data(device);
-    if (!prints || prints->len == 0) {
-        error = g_error_new(FP_DEVICE_ERROR, FP_DEVICE_ERROR_DATA_INVALID,
-                           "No prints provided for identification");
-        goto error;
+    /* Prints the sensor holds are matched there, anything else on the host */
+    xiaomi_index_sync(self);
+    if (xiaomi_index_has(self, template_id)) {
+        xiaomi_call_start(device, XIAOMI_OP_VERIFY, template_id, verify_cb, NULL);
+        return;
     }
     
-    /* Perform identification */
-    ret = fp_xiaomi_identify(self->xiaomi_dev, &matched_id, &confidence,
-                            FP_XIAOMI_TIMEOUT_DEFAULT);
+    call = xiaomi_call_new(device, XIAOMI_OP_MATCH, 0);
+    call->candidates = g_new(fp_xiaomi_template_t, 1);
+    call->candidates[0] = template;
+    call->n_candidates = 1;
+    xiaomi_call_run(device, call, verify_cb, NULL);
+}
+
+/* Map a successful identify back to the print it matched */
+static FpPrint *xiaomi_identify_lookup(GPtrArray *prints, XiaomiCall *call)
+{
+    fp_xiaomi_template_t template;
+    guint8 template_id;
+    guint i;
+    
+    if (call->op == XIAOMI_OP_MATCH) {
+        return call->matched_index < prints->len ?
+               g_ptr_array_index(prints, call->matched_index) : NULL;
+    }
     
-    if (ret == FP_XIAOMI_SUCCESS) {
-        /* Find matching print in the provided list */
-        if (matched_id > 0 && matched_id <= prints->len) {
-            match = g_ptr_array_index(prints, matched_id - 1);
-            g_info("Identification successful - matched template %d with %d%% confidence",
-                   matched_id, confidence);
+    for (i = 0; i < prints->len; i++) {
+        if (xiaomi_print_get(g_ptr_array_index(prints, i), &template_id, &template) &&
+            template_id == call->matched_id) {
+            return g_ptr_array_index(prints, i);
+        }
+    }
+    
+    return NULL;
+}
+
+static void identify_cb(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    FpDevice *device = FP_DEVICE(source);
+    GPtrArray *prints = fpi_device_get_identify_data(device);
+    FpPrint *match = NULL;
+    GError *error = NULL;
+    XiaomiCall *call;
+    
+    call = xiaomi_call_finish(device, res, &error);
+    if (!call) {
+        fpi_device_identify_complete(device, NULL, error);
+        return;
+    }
+    
+    if (call->result == FP_XIAOMI_SUCCESS) {
+        match = xiaomi_identify_lookup(prints, call);
+        if (match) {
+            g_info("Identification successful - matched print with %d%% confidence",
+                   call->confidence);
         }
         fpi_device_identify_complete(device, match, NULL);
         return;
-    } else if (ret == FP_XIAOMI_ERROR_NO_MATCH) {
+    } else if (call->result == FP_XIAOMI_ERROR_NO_MATCH) {
         g_info("Identification failed - no match found");
         fpi_device_identify_complete(device, NULL, NULL);
         return;
-    } else if (ret == FP_XIAOMI_ERROR_NO_FINGER) {
+    } else if (call->result == FP_XIAOMI_ERROR_NO_FINGER) {
         error = g_error_new(FP_DEVICE_RETRY, FP_DEVICE_RETRY_TOO_SHORT,
                            "Place finger on sensor");
         fpi_device_identify_complete(device, NULL, error);
@@ -361,12 +749,132 @@ static void fpi_device_xiaomi_fpc_identify(FpDevice *device)
     
     /* Identification error */
     error = g_error_new(FP_DEVICE_ERROR, FP_DEVICE_ERROR_GENERAL,
-                       "Identification failed: %s", fp_xiaomi_get_error_string(ret));
-    
-error:
+                       "Identification failed: %s", fp_xiaomi_get_error_string(call->result));
     fpi_device_identify_complete(device, NULL, error);
 }
 
+/**
+ * Identification function
+ */
+static void fpi_device_xiaomi_fpc_identify(FpDevice *device)
+{
+    FpDeviceXiaomiFpc *self = FPI_DEVICE_XIAOMI_FPC(device);
+    fp_xiaomi_template_t *templates;
+    guint8 template_id;
+    gboolean on_sensor = TRUE;
+    guint16 seen = 0;
+    GPtrArray *prints;
+    XiaomiCall *call;
+    GError *error;
+    guint i;
+    
+    g_debug("Starting identification on Xiaomi FPC device");
+    
+    error = xiaomi_check_open(self);
+    if (!error) {
+        prints = fpi_device_get_identify_data(device);
+        if (!prints || prints->len == 0) {
+            error = g_error_new(FP_DEVICE_ERROR, FP_DEVICE_ERROR_DATA_INVALID,
+                               "No prints provided for identification");
+        }
+    }
+    if (error) {
+        fpi_device_identify_complete(device, NULL, error);
+        return;
+    }
+    
+    /*
+     * Either one sensor identify restricted to the candidates' slots, or,
+     * if any candidate is not held by the sensor, one capture scored on
+     * the host against all of them. Unreadable prints never match.
+     */
+    xiaomi_index_sync(self);
+    call = xiaomi_call_new(device, XIAOMI_OP_IDENTIFY, 0);
+    templates = g_new0(fp_xiaomi_template_t, prints->len);
+    
+    for (i = 0; i < prints->len; i++) {
+        if (!xiaomi_print_get(g_ptr_array_index(prints, i), &template_id, &templates[i])) {
+            continue;
+        }
+        if (!xiaomi_index_has(self, template_id)) {
+            on_sensor = FALSE;
+        } else if (!(seen & (1U << (template_id - 1)))) {
+            seen |= 1U << (template_id - 1);
+            call->candidate_ids[call->n_candidate_ids++] = template_id;
+        }
+    }
+    
+    if (on_sensor && call->n_candidate_ids > 0) {
+        g_free(templates);
+    } else {
+        call->op = XIAOMI_OP_MATCH;
+        call->candidates = templates;
+        call->n_candidates = prints->len;
+    }
+    
+    xiaomi_call_run(device, call, identify_cb, NULL);
+}
+
+static void delete_cb(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    FpDevice *device = FP_DEVICE(source);
+    FpDeviceXiaomiFpc *self = FPI_DEVICE_XIAOMI_FPC(device);
+    GError *error = NULL;
+    XiaomiCall *call;
+    
+    call = xiaomi_call_finish(device, res, &error);
+    if (!call) {
+        fpi_device_delete_complete(device, error);
+        return;
+    }
+    
+    if (call->result != FP_XIAOMI_SUCCESS) {
+        /* Do not guess which slots survived */
+        xiaomi_index_sync(self);
+        fpi_device_delete_complete(device,
+                                   g_error_new(FP_DEVICE_ERROR, FP_DEVICE_ERROR_GENERAL,
+                                               "Failed to delete template: %s",
+                                               fp_xiaomi_get_error_string(call->result)));
+        return;
+    }
+    
+    xiaomi_index_set(self, call->template_id, FALSE);
+    fpi_device_delete_complete(device, NULL);
+}
+
+/**
+ * Delete function
+ */
+static void fpi_device_xiaomi_fpc_delete(FpDevice *device)
+{
+    FpDeviceXiaomiFpc *self = FPI_DEVICE_XIAOMI_FPC(device);
+    fp_xiaomi_template_t template;
+    guint8 template_id = 0;
+    FpPrint *print = NULL;
+    GError *error;
+    
+    g_debug("Deleting print on Xiaomi FPC device");
+    
+    error = xiaomi_check_open(self);
+    if (error) {
+        fpi_device_delete_complete(device, error);
+        return;
+    }
+    
+    fpi_device_get_delete_data(device, &print);
+    if (print) {
+        xiaomi_print_get(print, &template_id, &template);
+    }
+    
+    /* Host-only prints have nothing on the sensor to remove */
+    if (!xiaomi_index_has(self, template_id)) {
+        fpi_device_delete_complete(device, NULL);
+        return;
+    }
+    
+    xiaomi_call_start(device, XIAOMI_OP_DELETE, template_id, delete_cb, NULL);
+}
+
 /**
  * Cancel operation function
  */
@@ -381,11 +889,13 @@ static void fpi_device_xiaomi_fpc_cancel(FpDevice *device)
     }
     
     if (self->xiaomi_dev) {
-        /* Cancel any ongoing enrollment */
+        /* Free the sensor now rather than when the call times out */
+        fp_xiaomi_cancel(self->xiaomi_dev);
         fp_xiaomi_enroll_cancel(self->xiaomi_dev);
     }
     
     self->enroll_stage = 0;
+    self->enroll_id = 0;
 }
 
 /**
@@ -407,6 +917,7 @@ static void fpi_device_xiaomi_fpc_class_init(FpDeviceXiaomiFpcClass *klass)
     dev_class->enroll = fpi_device_xiaomi_fpc_enroll;
     dev_class->verify = fpi_device_xiaomi_fpc_verify;
     dev_class->identify = fpi_device_xiaomi_fpc_identify;
+    dev_class->delete = fpi_device_xiaomi_fpc_delete;
     dev_class->cancel = fpi_device_xiaomi_fpc_cancel;
 }
 
@@ -420,4 +931,6 @@ static void fpi_device_xiaomi_fpc_init(FpDeviceXiaomiFpc *self)
     self->cancellable = NULL;
     self->enroll_print = NULL;
     self->enroll_stage = 0;
+    self->enroll_id = 0;
+    self->stored_mask = 0;
 }
\ No newline at end of file
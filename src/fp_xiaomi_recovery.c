@@ -7,156 +7,195 @@
  * This file implements comprehensive error recovery mechanisms to handle
  * hardware failures, communication timeouts, and system state corruption.
  * It provides automatic recovery procedures and fallback mechanisms.
+ *
+ * Each device embeds its own struct fp_recovery_context and recovers on
+ * its own workqueue, so one failing sensor never delays another.
+ * Recovery walks a ladder of increasingly expensive strategies with
+ * jittered exponential backoff between steps, and remembers per error
+ * type which strategy worked so the next recovery can start there.
  */
 
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/device.h>
 #include <linux/delay.h>
 #include <linux/workqueue.h>
 #include <linux/timer.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
 #include "fp_xiaomi_driver.h"
+#include "fp_xiaomi_trace.h"
 
 #define FP_RECOVERY_MAX_ATTEMPTS    3
 #define FP_RECOVERY_TIMEOUT_MS      5000
-#define FP_HARDWARE_RESET_DELAY_MS  100
-#define FP_COMM_RETRY_DELAY_MS      50
 
-/**
- * Recovery state tracking
- */
-struct fp_recovery_context {
-    struct fp_xiaomi_device *dev;
-    struct work_struct recovery_work;
-    struct timer_list recovery_timer;
-    atomic_t recovery_attempts;
-    enum fp_error_type last_error;
-    bool recovery_in_progress;
-    struct mutex recovery_lock;
+/* Backoff between ladder steps: 5 ms doubling up to 320 ms, with jitter */
+#define FP_RECOVERY_BACKOFF_BASE_MS 5
+#define FP_RECOVERY_BACKOFF_CAP_MS  320
+
+/* A strategy is skipped once it has failed this often without a success */
+#define FP_RECOVERY_SKIP_FAILURES   4
+
+static const char * const fp_strategy_names[FP_RECOVERY_STRATEGIES] = {
+    [FP_STRATEGY_CLEAR_HALT] = "clear halt",
+    [FP_STRATEGY_PROTOCOL_RESET] = "protocol reset",
+    [FP_STRATEGY_REINITIALIZE] = "reinitialize",
+    [FP_STRATEGY_PORT_RESET] = "port reset",
 };
 
-static struct fp_recovery_context *g_recovery_ctx = NULL;
+/* Cheapest strategy worth trying for each error type */
+static const enum fp_recovery_strategy fp_strategy_floor[FP_RECOVERY_ERROR_TYPES] = {
+    [FP_RECOVERY_COMMUNICATION] = FP_STRATEGY_CLEAR_HALT,
+    [FP_RECOVERY_TIMEOUT] = FP_STRATEGY_CLEAR_HALT,
+    [FP_RECOVERY_HARDWARE] = FP_STRATEGY_PROTOCOL_RESET,
+    [FP_RECOVERY_STATE] = FP_STRATEGY_REINITIALIZE,
+};
 
 /**
- * Hardware reset sequence with progressive delays
+ * Exponential backoff with jitter
+ *
+ * Returns a delay in [d/2, d] where d = min(base << attempt, cap), so
+ * devices that fail together do not retry in lockstep.
  */
-static int fp_hardware_reset_sequence(struct fp_xiaomi_device *dev)
+unsigned int fp_xiaomi_backoff_ms(unsigned int attempt, unsigned int base_ms,
+                                  unsigned int cap_ms)
 {
-    int ret, attempt;
+    unsigned int delay = cap_ms;
     
-    pr_info("fp_xiaomi: Starting hardware reset sequence\n");
+    if (attempt < 16 && (base_ms << attempt) < cap_ms) {
+        delay = base_ms << attempt;
+    }
     
-    for (attempt = 0; attempt < FP_RECOVERY_MAX_ATTEMPTS; attempt++) {
-        /* Progressive delay between attempts */
-        if (attempt > 0) {
-            msleep(FP_HARDWARE_RESET_DELAY_MS * (attempt + 1));
-        }
-        
-        /* Power cycle the device */
-        ret = fp_xiaomi_power_off(dev);
-        if (ret) {
-            pr_warn("fp_xiaomi: Power off failed on attempt %d: %d\n", 
-                    attempt + 1, ret);
-            continue;
-        }
-        
-        msleep(100);
-        
-        ret = fp_xiaomi_power_on(dev);
-        if (ret) {
-            pr_warn("fp_xiaomi: Power on failed on attempt %d: %d\n", 
-                    attempt + 1, ret);
-            continue;
-        }
-        
-        /* Test communication */
-        ret = fp_xiaomi_test_communication(dev);
+    return delay / 2 + prandom_u32_max(delay / 2 + 1);
+}
+
+/*
+ * Run one ladder step; 0 once the device answers again. Every step ends
+ * with a real round trip: reinitialize falls back to default device
+ * info when the sensor is silent, so its own result proves nothing.
+ */
+static int fp_recovery_run_strategy(struct fp_recovery_context *ctx,
+                                    enum fp_recovery_strategy strategy)
+{
+    int ret;
+    
+    switch (strategy) {
+    case FP_STRATEGY_CLEAR_HALT:
+        ret = ctx->ops->clear_halt(ctx->dev);
+        break;
+    case FP_STRATEGY_PROTOCOL_RESET:
+        ret = ctx->ops->reset_interface(ctx->dev);
+        break;
+    case FP_STRATEGY_REINITIALIZE:
+        ret = ctx->ops->reinitialize(ctx->dev);
+        break;
+    case FP_STRATEGY_PORT_RESET:
+        ret = ctx->ops->reset_hardware(ctx->dev);
         if (ret == 0) {
-            pr_info("fp_xiaomi: Hardware reset successful on attempt %d\n", 
-                    attempt + 1);
-            return 0;
+            ret = ctx->ops->reinitialize(ctx->dev);
         }
-        
-        pr_warn("fp_xiaomi: Communication test failed on attempt %d: %d\n", 
-                attempt + 1, ret);
+        break;
+    default:
+        return -EINVAL;
     }
     
-    pr_err("fp_xiaomi: Hardware reset sequence failed after %d attempts\n", 
-           FP_RECOVERY_MAX_ATTEMPTS);
-    return -EIO;
+    if (ret) {
+        return ret;
+    }
+    
+    return ctx->ops->test_communication(ctx->dev);
+}
+
+static bool fp_recovery_strategy_hopeless(const struct fp_recovery_history *history,
+                                          enum fp_recovery_strategy strategy)
+{
+    return history->successes[strategy] == 0 &&
+           history->failures[strategy] >= FP_RECOVERY_SKIP_FAILURES;
+}
+
+static void fp_recovery_record(struct fp_recovery_history *history,
+                               enum fp_recovery_strategy strategy, bool success)
+{
+    u16 *counter = success ? &history->successes[strategy] : &history->failures[strategy];
+    int i;
+    
+    /* Halve everything on overflow so old outcomes fade out */
+    if (*counter == U16_MAX) {
+        for (i = 0; i < FP_RECOVERY_STRATEGIES; i++) {
+            history->successes[i] /= 2;
+            history->failures[i] /= 2;
+        }
+    }
+    
+    (*counter)++;
+    if (success) {
+        history->last_success = strategy;
+    }
 }
 
 /**
- * Communication recovery with protocol reset
+ * Escalate through the recovery ladder
+ *
+ * The strategy that last fixed this error type is tried first, then the
+ * ladder from the type's floor upwards. Steps that have never worked for
+ * this type are skipped (except the last resort), and the whole walk is
+ * bounded by FP_RECOVERY_TIMEOUT_MS.
  */
-static int fp_communication_recovery(struct fp_xiaomi_device *dev)
+static int fp_recovery_escalate(struct fp_recovery_context *ctx,
+                                enum fp_error_type error_type,
+                                enum fp_recovery_strategy *used)
 {
-    int ret, attempt;
+    struct fp_recovery_history *history = &ctx->history[error_type];
+    unsigned long deadline = jiffies + msecs_to_jiffies(FP_RECOVERY_TIMEOUT_MS);
+    enum fp_recovery_strategy order[FP_RECOVERY_STRATEGIES + 1];
+    enum fp_recovery_strategy strategy;
+    unsigned int step = 0;
+    int count = 0;
+    int ret = -EIO;
+    int i;
     
-    pr_info("fp_xiaomi: Starting communication recovery\n");
-    
-    for (attempt = 0; attempt < FP_RECOVERY_MAX_ATTEMPTS; attempt++) {
-        if (attempt > 0) {
-            msleep(FP_COMM_RETRY_DELAY_MS * (attempt + 1));
+    if (history->last_success >= 0) {
+        order[count++] = history->last_success;
+    }
+    for (i = fp_strategy_floor[error_type]; i < FP_RECOVERY_STRATEGIES; i++) {
+        if (i != history->last_success) {
+            order[count++] = i;
         }
+    }
+    
+    for (i = 0; i < count; i++) {
+        strategy = order[i];
         
-        /* Reset USB interface */
-        ret = fp_xiaomi_reset_interface(dev);
-        if (ret) {
-            pr_warn("fp_xiaomi: Interface reset failed on attempt %d: %d\n", 
-                    attempt + 1, ret);
+        if (i < count - 1 && fp_recovery_strategy_hopeless(history, strategy)) {
             continue;
         }
         
-        /* Reinitialize protocol */
-        ret = fp_xiaomi_init_protocol(dev);
-        if (ret) {
-            pr_warn("fp_xiaomi: Protocol init failed on attempt %d: %d\n", 
-                    attempt + 1, ret);
-            continue;
+        if (time_after(jiffies, deadline)) {
+            dev_warn(ctx->log_dev, "Recovery budget exhausted before %s\n",
+                     fp_strategy_names[strategy]);
+            break;
         }
         
-        /* Test basic commands */
-        ret = fp_xiaomi_get_device_info(dev, NULL);
+        /* First step runs immediately; later ones back off */
+        if (step > 0) {
+            msleep(fp_xiaomi_backoff_ms(step - 1, FP_RECOVERY_BACKOFF_BASE_MS,
+                                        FP_RECOVERY_BACKOFF_CAP_MS));
+        }
+        step++;
+        
+        ret = fp_recovery_run_strategy(ctx, strategy);
+        trace_fp_xiaomi_recovery_step(ctx->log_dev, error_type, strategy, ret);
+        fp_recovery_record(history, strategy, ret == 0);
         if (ret == 0) {
-            pr_info("fp_xiaomi: Communication recovery successful on attempt %d\n", 
-                    attempt + 1);
+            *used = strategy;
             return 0;
         }
         
-        pr_warn("fp_xiaomi: Device info test failed on attempt %d: %d\n", 
-                attempt + 1, ret);
+        dev_warn(ctx->log_dev, "Recovery step %s failed: %d\n",
+                 fp_strategy_names[strategy], ret);
     }
     
-    pr_err("fp_xiaomi: Communication recovery failed after %d attempts\n", 
-           FP_RECOVERY_MAX_ATTEMPTS);
-    return -ECOMM;
-}
-
-/**
- * State corruption recovery
- */
-static int fp_state_recovery(struct fp_xiaomi_device *dev)
-{
-    int ret;
-    
-    pr_info("fp_xiaomi: Starting state recovery\n");
-    
-    /* Clear all internal state */
-    mutex_lock(&dev->state_lock);
-    dev->state = FP_STATE_UNINITIALIZED;
-    dev->capture_in_progress = false;
-    dev->last_error = FP_ERROR_NONE;
-    mutex_unlock(&dev->state_lock);
-    
-    /* Reinitialize device */
-    ret = fp_xiaomi_initialize(dev);
-    if (ret) {
-        pr_err("fp_xiaomi: State recovery initialization failed: %d\n", ret);
-        return ret;
-    }
-    
-    pr_info("fp_xiaomi: State recovery completed successfully\n");
-    return 0;
+    return ret;
 }
 
 /**
@@ -167,65 +206,54 @@ static void fp_recovery_work_func(struct work_struct *work)
     struct fp_recovery_context *ctx = container_of(work, 
                                                    struct fp_recovery_context, 
                                                    recovery_work);
-    struct fp_xiaomi_device *dev = ctx->dev;
-    int ret = -1;
-    
-    mutex_lock(&ctx->recovery_lock);
+    enum fp_recovery_strategy used = FP_STRATEGY_CLEAR_HALT;
+    enum fp_error_type error_type;
+    unsigned long flags;
+    ktime_t start;
+    int ret;
     
+    spin_lock_irqsave(&ctx->lock, flags);
     if (!ctx->recovery_in_progress) {
-        mutex_unlock(&ctx->recovery_lock);
+        spin_unlock_irqrestore(&ctx->lock, flags);
         return;
     }
+    error_type = ctx->last_error;
+    spin_unlock_irqrestore(&ctx->lock, flags);
     
-    pr_info("fp_xiaomi: Starting automatic recovery for error type %d\n", 
-            ctx->last_error);
-    
-    /* Choose recovery strategy based on error type */
-    switch (ctx->last_error) {
-    case FP_ERROR_HARDWARE_FAILURE:
-        ret = fp_hardware_reset_sequence(dev);
-        break;
-        
-    case FP_ERROR_COMMUNICATION:
-        ret = fp_communication_recovery(dev);
-        break;
-        
-    case FP_ERROR_STATE_CORRUPTION:
-        ret = fp_state_recovery(dev);
-        break;
-        
-    case FP_ERROR_TIMEOUT:
-        /* Try communication recovery first, then hardware reset */
-        ret = fp_communication_recovery(dev);
-        if (ret != 0) {
-            ret = fp_hardware_reset_sequence(dev);
-        }
-        break;
-        
-    default:
-        pr_warn("fp_xiaomi: Unknown error type for recovery: %d\n", 
-                ctx->last_error);
-        ret = fp_state_recovery(dev);
-        break;
+    if (error_type >= FP_RECOVERY_ERROR_TYPES) {
+        dev_warn(ctx->log_dev, "Unknown error type for recovery: %d\n", error_type);
+        error_type = FP_RECOVERY_STATE;
     }
     
+    dev_info(ctx->log_dev, "Starting automatic recovery for error type %d\n", error_type);
+    
+    start = ktime_get();
+    ret = fp_recovery_escalate(ctx, error_type, &used);
+    
+    del_timer_sync(&ctx->recovery_timer);
+    trace_fp_xiaomi_recovery_done(ctx->log_dev, error_type, ret,
+                                  ktime_ms_delta(ktime_get(), start));
+    
     if (ret == 0) {
-        pr_info("fp_xiaomi: Automatic recovery successful\n");
+        ctx->history[error_type].last_latency_ms = ktime_ms_delta(ktime_get(), start);
+        dev_info(ctx->log_dev, "Automatic recovery successful via %s in %u ms\n",
+                 fp_strategy_names[used], ctx->history[error_type].last_latency_ms);
         atomic_set(&ctx->recovery_attempts, 0);
-        dev->recovery_count++;
+        ctx->recovery_count++;
+        ctx->ops->recovered(ctx->dev);
     } else {
         int attempts = atomic_inc_return(&ctx->recovery_attempts);
-        pr_err("fp_xiaomi: Recovery attempt %d failed: %d\n", attempts, ret);
+        dev_err(ctx->log_dev, "Recovery attempt %d failed: %d\n", attempts, ret);
         
         if (attempts >= FP_RECOVERY_MAX_ATTEMPTS) {
-            pr_err("fp_xiaomi: Maximum recovery attempts reached, marking device as failed\n");
-            dev->state = FP_STATE_ERROR;
-            dev->device_failed = true;
+            dev_err(ctx->log_dev, "Maximum recovery attempts reached, marking device as failed\n");
+            ctx->ops->recovery_failed(ctx->dev);
         }
     }
     
+    spin_lock_irqsave(&ctx->lock, flags);
     ctx->recovery_in_progress = false;
-    mutex_unlock(&ctx->recovery_lock);
+    spin_unlock_irqrestore(&ctx->lock, flags);
 }
 
 /**
@@ -236,99 +264,103 @@ static void fp_recovery_timer_callback(struct timer_list *timer)
     struct fp_recovery_context *ctx = container_of(timer, 
                                                    struct fp_recovery_context, 
                                                    recovery_timer);
+    unsigned long flags;
     
-    pr_warn("fp_xiaomi: Recovery timeout, forcing recovery completion\n");
+    dev_warn(ctx->log_dev, "Recovery timeout, forcing recovery completion\n");
     
-    mutex_lock(&ctx->recovery_lock);
+    spin_lock_irqsave(&ctx->lock, flags);
     ctx->recovery_in_progress = false;
-    mutex_unlock(&ctx->recovery_lock);
+    spin_unlock_irqrestore(&ctx->lock, flags);
 }
 
 /**
  * Trigger automatic recovery
  */
-int fp_xiaomi_trigger_recovery(struct fp_xiaomi_device *dev, 
+int fp_xiaomi_trigger_recovery(struct fp_recovery_context *ctx,
                               enum fp_error_type error_type)
 {
-    if (!g_recovery_ctx || !dev) {
+    unsigned long flags;
+    
+    if (!ctx || !ctx->ops) {
         return -EINVAL;
     }
     
-    mutex_lock(&g_recovery_ctx->recovery_lock);
+    spin_lock_irqsave(&ctx->lock, flags);
     
-    if (g_recovery_ctx->recovery_in_progress) {
-        pr_info("fp_xiaomi: Recovery already in progress, skipping\n");
-        mutex_unlock(&g_recovery_ctx->recovery_lock);
+    if (ctx->recovery_in_progress) {
+        spin_unlock_irqrestore(&ctx->lock, flags);
+        dev_info(ctx->log_dev, "Recovery already in progress, skipping\n");
         return -EBUSY;
     }
     
-    if (atomic_read(&g_recovery_ctx->recovery_attempts) >= FP_RECOVERY_MAX_ATTEMPTS) {
-        pr_err("fp_xiaomi: Maximum recovery attempts already reached\n");
-        mutex_unlock(&g_recovery_ctx->recovery_lock);
+    if (atomic_read(&ctx->recovery_attempts) >= FP_RECOVERY_MAX_ATTEMPTS) {
+        spin_unlock_irqrestore(&ctx->lock, flags);
+        dev_err(ctx->log_dev, "Maximum recovery attempts already reached\n");
         return -ENODEV;
     }
     
-    g_recovery_ctx->dev = dev;
-    g_recovery_ctx->last_error = error_type;
-    g_recovery_ctx->recovery_in_progress = true;
+    ctx->last_error = error_type;
+    ctx->recovery_in_progress = true;
     
     /* Start recovery timer */
-    mod_timer(&g_recovery_ctx->recovery_timer, 
+    mod_timer(&ctx->recovery_timer, 
               jiffies + msecs_to_jiffies(FP_RECOVERY_TIMEOUT_MS));
     
-    /* Schedule recovery work */
-    schedule_work(&g_recovery_ctx->recovery_work);
+    /* Schedule recovery work on the device's own workqueue */
+    queue_work(ctx->workqueue, &ctx->recovery_work);
     
-    mutex_unlock(&g_recovery_ctx->recovery_lock);
+    spin_unlock_irqrestore(&ctx->lock, flags);
     
-    pr_info("fp_xiaomi: Recovery triggered for error type %d\n", error_type);
+    dev_info(ctx->log_dev, "Recovery triggered for error type %d\n", error_type);
     return 0;
 }
 
 /**
- * Initialize recovery system
+ * Initialize a device's recovery context
  */
-int fp_xiaomi_recovery_init(void)
+void fp_xiaomi_recovery_init(struct fp_recovery_context *ctx, struct fp_xiaomi_device *dev,
+                             struct device *log_dev, const struct fp_recovery_ops *ops,
+                             struct workqueue_struct *workqueue)
 {
-    g_recovery_ctx = kzalloc(sizeof(*g_recovery_ctx), GFP_KERNEL);
-    if (!g_recovery_ctx) {
-        return -ENOMEM;
-    }
+    int i;
     
-    INIT_WORK(&g_recovery_ctx->recovery_work, fp_recovery_work_func);
-    timer_setup(&g_recovery_ctx->recovery_timer, fp_recovery_timer_callback, 0);
-    mutex_init(&g_recovery_ctx->recovery_lock);
-    atomic_set(&g_recovery_ctx->recovery_attempts, 0);
-    g_recovery_ctx->recovery_in_progress = false;
+    ctx->dev = dev;
+    ctx->log_dev = log_dev;
+    ctx->ops = ops;
+    ctx->workqueue = workqueue;
     
-    pr_info("fp_xiaomi: Recovery system initialized\n");
-    return 0;
+    INIT_WORK(&ctx->recovery_work, fp_recovery_work_func);
+    timer_setup(&ctx->recovery_timer, fp_recovery_timer_callback, 0);
+    spin_lock_init(&ctx->lock);
+    atomic_set(&ctx->recovery_attempts, 0);
+    ctx->recovery_in_progress = false;
+    ctx->recovery_count = 0;
+    
+    memset(ctx->history, 0, sizeof(ctx->history));
+    for (i = 0; i < FP_RECOVERY_ERROR_TYPES; i++) {
+        ctx->history[i].last_success = -1;
+    }
 }
 
 /**
- * Cleanup recovery system
+ * Stop a device's recovery context
  */
-void fp_xiaomi_recovery_cleanup(void)
+void fp_xiaomi_recovery_cleanup(struct fp_recovery_context *ctx)
 {
-    if (!g_recovery_ctx) {
+    if (!ctx->ops) {
         return;
     }
     
     /* Cancel any pending work */
-    cancel_work_sync(&g_recovery_ctx->recovery_work);
-    del_timer_sync(&g_recovery_ctx->recovery_timer);
-    
-    kfree(g_recovery_ctx);
-    g_recovery_ctx = NULL;
-    
-    pr_info("fp_xiaomi: Recovery system cleaned up\n");
+    cancel_work_sync(&ctx->recovery_work);
+    del_timer_sync(&ctx->recovery_timer);
 }
 
 /**
  * Check if recovery is available
  */
-bool fp_xiaomi_recovery_available(void)
+bool fp_xiaomi_recovery_available(struct fp_recovery_context *ctx)
 {
-    return (g_recovery_ctx != NULL && 
-            atomic_read(&g_recovery_ctx->recovery_attempts) < FP_RECOVERY_MAX_ATTEMPTS);
-}
\ No newline at end of file
+    return ctx && ctx->ops &&
+           atomic_read(&ctx->recovery_attempts) < FP_RECOVERY_MAX_ATTEMPTS;
+}
@@ -0,0 +1,162 @@
+/**
+ * @file fp_xiaomi_trace.h
+ * @brief Tracepoints for Xiaomi FPC Fingerprint Scanner Driver
+ * @author Project contributors
+ * @version 1.0.0
+ *
+ * Enable with e.g.
+ *   echo 1 > /sys/kernel/tracing/events/fp_xiaomi/enable
+ * Events cost a static branch while disabled.
+ *
+ * @copyright GPL v2 License
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM fp_xiaomi
+
+#if !defined(_FP_XIAOMI_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _FP_XIAOMI_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/device.h>
+#include <linux/usb/ch9.h>
+#include "fp_xiaomi_driver.h"
+
+#define fp_trace_show_strategy(strategy)                     \
+    __print_symbolic(strategy,                               \
+                     { FP_STRATEGY_CLEAR_HALT, "clear_halt" }, \
+                     { FP_STRATEGY_PROTOCOL_RESET, "protocol_reset" }, \
+                     { FP_STRATEGY_REINITIALIZE, "reinitialize" }, \
+                     { FP_STRATEGY_PORT_RESET, "port_reset" })
+
+TRACE_EVENT(fp_xiaomi_control,
+    TP_PROTO(struct device *dev, u8 request, u8 requesttype, u16 value, u16 index,
+             u16 size, int ret, u64 duration_ns),
+    TP_ARGS(dev, request, requesttype, value, index, size, ret, duration_ns),
+    TP_STRUCT__entry(
+        __string(dev, dev_name(dev))
+        __field(u8, request)
+        __field(u8, requesttype)
+        __field(u16, value)
+        __field(u16, index)
+        __field(u16, size)
+        __field(int, ret)
+        __field(u64, duration_ns)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev_name(dev));
+        __entry->request = request;
+        __entry->requesttype = requesttype;
+        __entry->value = value;
+        __entry->index = index;
+        __entry->size = size;
+        __entry->ret = ret;
+        __entry->duration_ns = duration_ns;
+    ),
+    TP_printk("%s req=0x%02x %s val=0x%04x idx=0x%04x size=%u ret=%d %llu ns",
+              __get_str(dev), __entry->request,
+              (__entry->requesttype & USB_DIR_IN) ? "in" : "out",
+              __entry->value, __entry->index, __entry->size, __entry->ret,
+              __entry->duration_ns)
+);
+
+TRACE_EVENT(fp_xiaomi_bulk_packet,
+    TP_PROTO(struct device *dev, u32 length, u32 actual, int status),
+    TP_ARGS(dev, length, actual, status),
+    TP_STRUCT__entry(
+        __string(dev, dev_name(dev))
+        __field(u32, length)
+        __field(u32, actual)
+        __field(int, status)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev_name(dev));
+        __entry->length = length;
+        __entry->actual = actual;
+        __entry->status = status;
+    ),
+    TP_printk("%s len=%u actual=%u status=%d",
+              __get_str(dev), __entry->length, __entry->actual, __entry->status)
+);
+
+TRACE_EVENT(fp_xiaomi_frame,
+    TP_PROTO(struct device *dev, u32 size, int ret, u64 duration_ns),
+    TP_ARGS(dev, size, ret, duration_ns),
+    TP_STRUCT__entry(
+        __string(dev, dev_name(dev))
+        __field(u32, size)
+        __field(int, ret)
+        __field(u64, duration_ns)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev_name(dev));
+        __entry->size = size;
+        __entry->ret = ret;
+        __entry->duration_ns = duration_ns;
+    ),
+    TP_printk("%s size=%u ret=%d %llu ns",
+              __get_str(dev), __entry->size, __entry->ret, __entry->duration_ns)
+);
+
+TRACE_EVENT(fp_xiaomi_state,
+    TP_PROTO(struct device *dev, int old_state, int new_state),
+    TP_ARGS(dev, old_state, new_state),
+    TP_STRUCT__entry(
+        __string(dev, dev_name(dev))
+        __field(int, old_state)
+        __field(int, new_state)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev_name(dev));
+        __entry->old_state = old_state;
+        __entry->new_state = new_state;
+    ),
+    TP_printk("%s %d -> %d", __get_str(dev), __entry->old_state, __entry->new_state)
+);
+
+TRACE_EVENT(fp_xiaomi_recovery_step,
+    TP_PROTO(struct device *dev, int error_type, int strategy, int ret),
+    TP_ARGS(dev, error_type, strategy, ret),
+    TP_STRUCT__entry(
+        __string(dev, dev_name(dev))
+        __field(int, error_type)
+        __field(int, strategy)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev_name(dev));
+        __entry->error_type = error_type;
+        __entry->strategy = strategy;
+        __entry->ret = ret;
+    ),
+    TP_printk("%s type=%d %s ret=%d", __get_str(dev), __entry->error_type,
+              fp_trace_show_strategy(__entry->strategy), __entry->ret)
+);
+
+TRACE_EVENT(fp_xiaomi_recovery_done,
+    TP_PROTO(struct device *dev, int error_type, int ret, u32 duration_ms),
+    TP_ARGS(dev, error_type, ret, duration_ms),
+    TP_STRUCT__entry(
+        __string(dev, dev_name(dev))
+        __field(int, error_type)
+        __field(int, ret)
+        __field(u32, duration_ms)
+    ),
+    TP_fast_assign(
+        __assign_str(dev, dev_name(dev));
+        __entry->error_type = error_type;
+        __entry->ret = ret;
+        __entry->duration_ms = duration_ms;
+    ),
+    TP_printk("%s type=%d ret=%d %u ms", __get_str(dev), __entry->error_type,
+              __entry->ret, __entry->duration_ms)
+);
+
+#endif /* _FP_XIAOMI_TRACE_H */
+
+/* Must stay outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE fp_xiaomi_trace
+#include <trace/define_trace.h>
@@ -11,18 +11,24 @@
  * @copyright GPL v2 License
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
 #include <pthread.h>
 
 #include "libfp_xiaomi.h"
+#include "libfp_xiaomi_private.h"
 #include "fp_xiaomi_driver.h"
 
 /* Library version */
@@ -33,19 +39,261 @@
 /* Default device path */
 #define DEFAULT_DEVICE_PATH "/dev/fp_xiaomi0"
 
+/* Library-generated events queued per device before the oldest is dropped */
+#define EVENT_QUEUE_SIZE 32
+
+/* Oldest wake-on-touch frame still handed out as a fresh capture */
+#define WAKE_FRAME_MAX_AGE_NS (500ULL * 1000000ULL)
+
+/* Idle scratch buffers kept per pool; more callers than this fall back to malloc */
+#define BUFFER_POOL_DEPTH 4
+
+/*
+ * Free list of equally sized scratch buffers, so the copying capture
+ * and template calls reuse memory instead of allocating per call.
+ */
+struct buffer_pool {
+    pthread_mutex_t lock;
+    size_t size;                    /* Bytes per buffer */
+    unsigned int count;             /* Buffers in idle[] */
+    void *idle[BUFFER_POOL_DEPTH];
+};
+
+static int pool_init(struct buffer_pool *pool, size_t size)
+{
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    pool->size = size;
+    pool->count = 0;
+    
+    /* One buffer up front covers the usual single caller */
+    pool->idle[0] = malloc(size);
+    if (pool->idle[0]) {
+        pool->count = 1;
+    }
+    
+    return 0;
+}
+
+static void pool_destroy(struct buffer_pool *pool)
+{
+    while (pool->count) {
+        free(pool->idle[--pool->count]);
+    }
+    pthread_mutex_destroy(&pool->lock);
+}
+
+static void *pool_get(struct buffer_pool *pool)
+{
+    void *buffer = NULL;
+    
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count) {
+        buffer = pool->idle[--pool->count];
+    }
+    pthread_mutex_unlock(&pool->lock);
+    
+    return buffer ? buffer : malloc(pool->size);
+}
+
+static void pool_put(struct buffer_pool *pool, void *buffer)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count < BUFFER_POOL_DEPTH) {
+        pool->idle[pool->count++] = buffer;
+        buffer = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    
+    free(buffer);
+}
+
+/* Bytes of one captured frame, from the reported sensor geometry */
+static size_t frame_bytes(const struct fp_device_info *info)
+{
+    size_t size = (size_t)info->image_width * info->image_height;
+    
+    return size && size <= FP_XIAOMI_MAX_IMAGE_SIZE ? size : FP_XIAOMI_MAX_IMAGE_SIZE;
+}
+
 /* Internal structure for device handle */
 struct fp_xiaomi_device_internal {
     int fd;                          /* Device file descriptor */
     char device_path[256];           /* Device path */
-    struct fp_device_info info;     /* Device information */
-    pthread_mutex_t mutex;          /* Thread safety */
+    struct fp_device_info info;     /* Fixed at open except template_count */
+    pthread_mutex_t io_lock;        /* Held for calls that talk to the sensor */
+    pthread_rwlock_t info_lock;     /* Protects info.template_count and the template cache */
+    uint32_t template_generation;   /* Driver generation template_ids is from; 0: empty */
+    uint8_t template_ids[FP_XIAOMI_MAX_TEMPLATES]; /* Last FP_IOC_LIST_TEMPLATES answer */
+    pthread_rwlock_t recorder_lock; /* Protects the recorder pointer */
     bool initialized;               /* Initialization status */
     fp_xiaomi_event_callback_t event_callback; /* Event callback */
     void *callback_data;            /* Callback user data */
-    pthread_t event_thread;         /* Event handling thread */
-    bool event_thread_running;      /* Event thread status */
+    int event_fd;                   /* eventfd, readable while events are queued */
+    int poll_fd;                    /* epoll set handed out by get_event_fd */
+    pthread_mutex_t event_lock;     /* Protects the event queue */
+    fp_xiaomi_event_t events[EVENT_QUEUE_SIZE]; /* Library-generated events */
+    unsigned int event_head;        /* Oldest queued event */
+    unsigned int event_count;       /* Number of queued events */
+    struct fp_frame_ring *ring;     /* Mapped frame ring (NULL if unmapped) */
+    struct fp_xiaomi_recorder *recorder; /* Trace being written (NULL if not recording) */
+    struct fp_xiaomi_replay *replay; /* Trace served instead of the driver */
+    struct buffer_pool image_pool;  /* frame_bytes() capture scratch */
+    struct buffer_pool template_pool; /* FP_XIAOMI_MAX_TEMPLATE_SIZE template scratch */
 };
 
+/* Translate an ioctl errno into a library error code */
+static int errno_to_error(int err)
+{
+    switch (err) {
+    case ENODATA:
+        return FP_XIAOMI_ERROR_NO_FINGER;
+    case EBADMSG:
+        return FP_XIAOMI_ERROR_BAD_IMAGE;
+    case ENOKEY:
+        return FP_XIAOMI_ERROR_NO_MATCH;
+    case ETIMEDOUT:
+        return FP_XIAOMI_ERROR_TIMEOUT;
+    case ECANCELED:
+        return FP_XIAOMI_ERROR_CANCELLED;
+    case EBUSY:
+    case ENOBUFS:
+        return FP_XIAOMI_ERROR_BUSY;
+    case ENOMEM:
+        return FP_XIAOMI_ERROR_MEMORY;
+    case EINVAL:
+    case ENOSPC:
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    case ENOTTY:
+    case EOPNOTSUPP:
+        return FP_XIAOMI_ERROR_NOT_SUPPORTED;
+    case EACCES:
+    case EPERM:
+        return FP_XIAOMI_ERROR_PERMISSION;
+    case EPROTO:
+        return FP_XIAOMI_ERROR_PROTOCOL;
+    default:
+        return FP_XIAOMI_ERROR_DEVICE;
+    }
+}
+
+/* Translate a batch response status (FP_RESP_*) into a library error code */
+static int resp_to_error(uint8_t resp)
+{
+    switch (resp) {
+    case FP_RESP_OK:
+        return FP_XIAOMI_SUCCESS;
+    case FP_RESP_TIMEOUT:
+        return FP_XIAOMI_ERROR_TIMEOUT;
+    case FP_RESP_NO_FINGER:
+        return FP_XIAOMI_ERROR_NO_FINGER;
+    case FP_RESP_BAD_IMAGE:
+        return FP_XIAOMI_ERROR_BAD_IMAGE;
+    case FP_RESP_NO_MATCH:
+        return FP_XIAOMI_ERROR_NO_MATCH;
+    case FP_RESP_BUSY:
+        return FP_XIAOMI_ERROR_BUSY;
+    case FP_RESP_NOT_SUPPORTED:
+        return FP_XIAOMI_ERROR_NOT_SUPPORTED;
+    default:
+        return FP_XIAOMI_ERROR_DEVICE;
+    }
+}
+
+/*
+ * Every driver call goes through here so it can be recorded or, on a
+ * replay handle, served from the trace. Callers need not hold io_lock:
+ * the status and info queries come through here without it. The
+ * recorder is only looked at under recorder_lock, and only after the
+ * call returns so record_stop() never waits for a capture. Finger
+ * events and cancellation are asynchronous and not recorded.
+ */
+static int device_ioctl(struct fp_xiaomi_device_internal *dev, unsigned long request, void *arg)
+{
+    uint64_t start_ns;
+    int ret, err;
+    
+    if (dev->replay) {
+        return fp_xiaomi_replay_ioctl(dev->replay, request, arg, dev->ring);
+    }
+    
+    if (!__atomic_load_n(&dev->recorder, __ATOMIC_RELAXED) ||
+        request == FP_IOC_GET_FINGER_EVENT || request == FP_IOC_CANCEL ||
+        request == FP_IOC_PREARM) {
+        return ioctl(dev->fd, request, arg);
+    }
+    
+    start_ns = fp_xiaomi_monotonic_ns();
+    ret = ioctl(dev->fd, request, arg);
+    err = errno;
+    
+    pthread_rwlock_rdlock(&dev->recorder_lock);
+    if (dev->recorder) {
+        fp_xiaomi_recorder_add(dev->recorder, request, arg, ret, err, start_ns, dev->ring);
+    }
+    pthread_rwlock_unlock(&dev->recorder_lock);
+    
+    errno = err;
+    return ret;
+}
+
+/* Create the lock classes of a new handle; errno is set on failure */
+static int locks_init(struct fp_xiaomi_device_internal *dev)
+{
+    if (pthread_mutex_init(&dev->io_lock, NULL) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    if (pthread_rwlock_init(&dev->info_lock, NULL) != 0) {
+        pthread_mutex_destroy(&dev->io_lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    if (pthread_rwlock_init(&dev->recorder_lock, NULL) != 0) {
+        pthread_rwlock_destroy(&dev->info_lock);
+        pthread_mutex_destroy(&dev->io_lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    
+    return 0;
+}
+
+static void locks_destroy(struct fp_xiaomi_device_internal *dev)
+{
+    pthread_rwlock_destroy(&dev->recorder_lock);
+    pthread_rwlock_destroy(&dev->info_lock);
+    pthread_mutex_destroy(&dev->io_lock);
+}
+
+/* Publish a template count learned from the sensor for get_device_info() */
+static void publish_template_count(struct fp_xiaomi_device_internal *dev, uint8_t count)
+{
+    pthread_rwlock_wrlock(&dev->info_lock);
+    dev->info.template_count = count;
+    pthread_rwlock_unlock(&dev->info_lock);
+}
+
+/*
+ * Remember a list answer under the generation read before it was
+ * listed. A change racing with the list leaves the cache a generation
+ * behind its contents, which only costs one more list.
+ */
+static void cache_templates(struct fp_xiaomi_device_internal *dev, const uint8_t *ids,
+                            uint32_t generation, uint8_t count)
+{
+    pthread_rwlock_wrlock(&dev->info_lock);
+    memcpy(dev->template_ids, ids, sizeof(dev->template_ids));
+    dev->template_generation = generation;
+    dev->info.template_count = count;
+    pthread_rwlock_unlock(&dev->info_lock);
+}
+
 /* Global library initialization status */
 static bool library_initialized = false;
 static pthread_mutex_t library_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -82,6 +330,7 @@ void fp_xiaomi_cleanup(void)
     }
     
     /* Cleanup library resources */
+    fp_xiaomi_pool_shutdown();
     library_initialized = false;
     
     pthread_mutex_unlock(&library_mutex);
@@ -97,12 +346,134 @@ void fp_xiaomi_get_version(int *major, int *minor, int *patch)
     if (patch) *patch = LIBFP_XIAOMI_VERSION_PATCH;
 }
 
+/*
+ * Event queue
+ *
+ * Finger events stay queued in the driver and wake the device fd with
+ * POLLPRI; events the library generates itself (capture, verify) go to
+ * a small per-device queue that keeps event_fd readable while non-empty.
+ * Both fds sit in one epoll set, which is what callers poll.
+ */
+static int events_init(struct fp_xiaomi_device_internal *dev)
+{
+    struct epoll_event ev;
+    
+    dev->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (dev->event_fd < 0) {
+        return -1;
+    }
+    
+    dev->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (dev->poll_fd < 0) {
+        goto error_eventfd;
+    }
+    
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLPRI;
+    ev.data.fd = dev->fd;
+    if (epoll_ctl(dev->poll_fd, EPOLL_CTL_ADD, dev->fd, &ev) != 0) {
+        goto error_epoll;
+    }
+    
+    ev.events = EPOLLIN;
+    ev.data.fd = dev->event_fd;
+    if (epoll_ctl(dev->poll_fd, EPOLL_CTL_ADD, dev->event_fd, &ev) != 0) {
+        goto error_epoll;
+    }
+    
+    if (pthread_mutex_init(&dev->event_lock, NULL) != 0) {
+        errno = ENOMEM;
+        goto error_epoll;
+    }
+    
+    return 0;
+    
+error_epoll:
+    close(dev->poll_fd);
+error_eventfd:
+    close(dev->event_fd);
+    return -1;
+}
+
+static void events_destroy(struct fp_xiaomi_device_internal *dev)
+{
+    close(dev->poll_fd);
+    close(dev->event_fd);
+    pthread_mutex_destroy(&dev->event_lock);
+}
+
+/* Scratch pools, sized once the device geometry is known */
+static int buffers_init(struct fp_xiaomi_device_internal *dev)
+{
+    if (pool_init(&dev->image_pool, frame_bytes(&dev->info)) != 0) {
+        return -1;
+    }
+    
+    if (pool_init(&dev->template_pool, FP_XIAOMI_MAX_TEMPLATE_SIZE) != 0) {
+        pool_destroy(&dev->image_pool);
+        return -1;
+    }
+    
+    return 0;
+}
+
+static void buffers_destroy(struct fp_xiaomi_device_internal *dev)
+{
+    pool_destroy(&dev->image_pool);
+    pool_destroy(&dev->template_pool);
+}
+
+/* Queue a library-generated event and make the event fd readable */
+static void queue_event(struct fp_xiaomi_device_internal *dev, const fp_xiaomi_event_t *event)
+{
+    uint64_t one = 1;
+    
+    pthread_mutex_lock(&dev->event_lock);
+    
+    if (dev->event_count == EVENT_QUEUE_SIZE) {
+        dev->event_head = (dev->event_head + 1) % EVENT_QUEUE_SIZE;
+        dev->event_count--;
+    }
+    
+    dev->events[(dev->event_head + dev->event_count) % EVENT_QUEUE_SIZE] = *event;
+    
+    if (dev->event_count++ == 0) {
+        (void)write(dev->event_fd, &one, sizeof(one));
+    }
+    
+    pthread_mutex_unlock(&dev->event_lock);
+}
+
+/* Pop the oldest library-generated event; false if the queue is empty */
+static bool dequeue_event(struct fp_xiaomi_device_internal *dev, fp_xiaomi_event_t *event)
+{
+    uint64_t count;
+    bool found = false;
+    
+    pthread_mutex_lock(&dev->event_lock);
+    
+    if (dev->event_count) {
+        *event = dev->events[dev->event_head];
+        dev->event_head = (dev->event_head + 1) % EVENT_QUEUE_SIZE;
+        found = true;
+        
+        /* Last one out resets the eventfd counter */
+        if (--dev->event_count == 0) {
+            (void)read(dev->event_fd, &count, sizeof(count));
+        }
+    }
+    
+    pthread_mutex_unlock(&dev->event_lock);
+    return found;
+}
+
 /**
  * Open device
  */
 fp_xiaomi_device_t *fp_xiaomi_open_device(const char *device_path)
 {
     struct fp_xiaomi_device_internal *dev;
+    const char *trace_path;
     int ret;
     
     if (!library_initialized) {
@@ -110,6 +481,13 @@ fp_xiaomi_device_t *fp_xiaomi_open_device(const char *device_path)
         return NULL;
     }
     
+    /* Lets unmodified applications run against a recording */
+    trace_path = getenv("FP_XIAOMI_REPLAY");
+    if (trace_path && *trace_path) {
+        return fp_xiaomi_open_replay(trace_path,
+                                     getenv("FP_XIAOMI_REPLAY_FAST") ? FP_XIAOMI_REPLAY_FAST : 0);
+    }
+    
     /* Allocate device structure */
     dev = calloc(1, sizeof(*dev));
     if (!dev) {
@@ -124,27 +502,125 @@ fp_xiaomi_device_t *fp_xiaomi_open_device(const char *device_path)
         strncpy(dev->device_path, DEFAULT_DEVICE_PATH, sizeof(dev->device_path) - 1);
     }
     
-    /* Initialize mutex */
-    if (pthread_mutex_init(&dev->mutex, NULL) != 0) {
+    /* Initialize locks */
+    if (locks_init(dev) != 0) {
         free(dev);
-        errno = ENOMEM;
         return NULL;
     }
     
     /* Open device */
     dev->fd = open(dev->device_path, O_RDWR);
     if (dev->fd < 0) {
-        pthread_mutex_destroy(&dev->mutex);
+        locks_destroy(dev);
         free(dev);
         return NULL;
     }
     
     /* Get device information */
-    ret = ioctl(dev->fd, FP_IOC_GET_DEVICE_INFO, &dev->info);
+    ret = device_ioctl(dev, FP_IOC_GET_DEVICE_INFO, &dev->info);
     if (ret < 0) {
         close(dev->fd);
-        pthread_mutex_destroy(&dev->mutex);
+        locks_destroy(dev);
+        free(dev);
+        return NULL;
+    }
+    
+    if (events_init(dev) != 0) {
+        ret = errno;
+        close(dev->fd);
+        locks_destroy(dev);
+        free(dev);
+        errno = ret;
+        return NULL;
+    }
+    
+    if (buffers_init(dev) != 0) {
+        ret = errno;
+        events_destroy(dev);
+        close(dev->fd);
+        locks_destroy(dev);
+        free(dev);
+        errno = ret;
+        return NULL;
+    }
+    
+    trace_path = getenv("FP_XIAOMI_RECORD");
+    if (trace_path && *trace_path) {
+        dev->recorder = fp_xiaomi_recorder_open(trace_path, &dev->info);
+        if (!dev->recorder) {
+            ret = errno;
+            buffers_destroy(dev);
+            events_destroy(dev);
+            close(dev->fd);
+            locks_destroy(dev);
+            free(dev);
+            errno = ret;
+            return NULL;
+        }
+    }
+    
+    dev->initialized = true;
+    return (fp_xiaomi_device_t *)dev;
+}
+
+/**
+ * Open a recorded trace as a device
+ */
+fp_xiaomi_device_t *fp_xiaomi_open_replay(const char *trace_path, uint32_t flags)
+{
+    struct fp_xiaomi_device_internal *dev;
+    int ret;
+    
+    if (!library_initialized || !trace_path) {
+        errno = EINVAL;
+        return NULL;
+    }
+    
+    dev = calloc(1, sizeof(*dev));
+    if (!dev) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    strncpy(dev->device_path, trace_path, sizeof(dev->device_path) - 1);
+    
+    if (locks_init(dev) != 0) {
+        free(dev);
+        return NULL;
+    }
+    
+    dev->replay = fp_xiaomi_replay_load(trace_path, !(flags & FP_XIAOMI_REPLAY_FAST));
+    if (!dev->replay) {
+        ret = errno;
+        locks_destroy(dev);
+        free(dev);
+        errno = ret;
+        return NULL;
+    }
+    dev->info = *fp_xiaomi_replay_info(dev->replay);
+    
+    /* Stands in for the device node in the epoll set; never becomes ready */
+    dev->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (dev->fd < 0 || events_init(dev) != 0) {
+        ret = errno;
+        if (dev->fd >= 0) {
+            close(dev->fd);
+        }
+        fp_xiaomi_replay_free(dev->replay);
+        locks_destroy(dev);
+        free(dev);
+        errno = ret;
+        return NULL;
+    }
+    
+    if (buffers_init(dev) != 0) {
+        ret = errno;
+        events_destroy(dev);
+        close(dev->fd);
+        fp_xiaomi_replay_free(dev->replay);
+        locks_destroy(dev);
         free(dev);
+        errno = ret;
         return NULL;
     }
     
@@ -164,13 +640,20 @@ int fp_xiaomi_close_device(fp_xiaomi_device_t *device)
         return FP_XIAOMI_ERROR_INVALID_PARAM;
     }
     
-    pthread_mutex_lock(&dev->mutex);
+    pthread_mutex_lock(&dev->io_lock);
+    
+    events_destroy(dev);
+    buffers_destroy(dev);
     
-    /* Stop event thread if running */
-    if (dev->event_thread_running) {
-        dev->event_thread_running = false;
-        pthread_cancel(dev->event_thread);
-        pthread_join(dev->event_thread, NULL);
+    fp_xiaomi_recorder_close(dev->recorder);
+    dev->recorder = NULL;
+    fp_xiaomi_replay_free(dev->replay);
+    dev->replay = NULL;
+    
+    /* Unmap frame ring */
+    if (dev->ring) {
+        munmap(dev->ring, FP_RING_MAP_SIZE);
+        dev->ring = NULL;
     }
     
     /* Close device */
@@ -181,8 +664,8 @@ int fp_xiaomi_close_device(fp_xiaomi_device_t *device)
     
     dev->initialized = false;
     
-    pthread_mutex_unlock(&dev->mutex);
-    pthread_mutex_destroy(&dev->mutex);
+    pthread_mutex_unlock(&dev->io_lock);
+    locks_destroy(dev);
     
     free(dev);
     return FP_XIAOMI_SUCCESS;
@@ -200,7 +683,8 @@ int fp_xiaomi_get_device_info(fp_xiaomi_device_t *device, fp_xiaomi_device_info_
         return FP_XIAOMI_ERROR_INVALID_PARAM;
     }
     
-    pthread_mutex_lock(&dev->mutex);
+    /* Never waits for io_lock, so it answers during a capture */
+    pthread_rwlock_rdlock(&dev->info_lock);
     
     /* Copy device information */
     info->vendor_id = dev->info.vendor_id;
@@ -212,7 +696,7 @@ int fp_xiaomi_get_device_info(fp_xiaomi_device_t *device, fp_xiaomi_device_info_
     info->template_count = dev->info.template_count;
     info->capabilities = dev->info.capabilities;
     
-    pthread_mutex_unlock(&dev->mutex);
+    pthread_rwlock_unlock(&dev->info_lock);
     return FP_XIAOMI_SUCCESS;
 }
 
@@ -230,12 +714,10 @@ int fp_xiaomi_get_status(fp_xiaomi_device_t *device, fp_xiaomi_status_t *status)
         return FP_XIAOMI_ERROR_INVALID_PARAM;
     }
     
-    pthread_mutex_lock(&dev->mutex);
-    
-    ret = ioctl(dev->fd, FP_IOC_GET_STATUS, &driver_status);
+    /* The driver answers from its seqlock snapshot; no io_lock needed */
+    ret = device_ioctl(dev, FP_IOC_GET_STATUS, &driver_status);
     if (ret < 0) {
-        pthread_mutex_unlock(&dev->mutex);
-        return FP_XIAOMI_ERROR_DEVICE;
+        return errno_to_error(errno);
     }
     
     /* Convert driver status to library status */
@@ -247,39 +729,68 @@ int fp_xiaomi_get_status(fp_xiaomi_device_t *device, fp_xiaomi_status_t *status)
     status->failed_matches = driver_status.failed_matches;
     status->error_count = driver_status.error_count;
     
-    pthread_mutex_unlock(&dev->mutex);
     return FP_XIAOMI_SUCCESS;
 }
 
 /**
- * Capture fingerprint image
+ * Fill in the quality of a capture, decoding a temporary copy if it came compressed
  */
-int fp_xiaomi_capture_image(fp_xiaomi_device_t *device, fp_xiaomi_image_t *image)
+static void estimate_quality(fp_xiaomi_image_t *image)
+{
+    fp_xiaomi_image_t decoded;
+    
+    if (image->format != FP_XIAOMI_IMG_FORMAT_COMPRESSED) {
+        fp_xiaomi_preprocess_image(image, 0);
+        return;
+    }
+    
+    if (fp_xiaomi_image_decompress(image, &decoded) == FP_XIAOMI_SUCCESS) {
+        fp_xiaomi_preprocess_image(&decoded, 0);
+        image->quality = decoded.quality;
+        fp_xiaomi_free_image(&decoded);
+    }
+}
+
+/**
+ * Capture an image, asking the driver for format (GRAY8 or COMPRESSED).
+ * With buffer set the driver writes straight into it (frame_bytes() at
+ * least); otherwise the frame lands in pool scratch and image->data is
+ * a malloc()ed copy of exactly image->size bytes.
+ */
+static int capture_image(fp_xiaomi_device_t *device, fp_xiaomi_image_t *image,
+                         uint8_t format, uint8_t *buffer)
 {
     struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
     struct fp_image_data driver_image;
+    fp_xiaomi_event_t event;
+    uint8_t *scratch = NULL;
     int ret;
     
-    if (!dev || !dev->initialized || !image) {
-        errno = EINVAL;
-        return FP_XIAOMI_ERROR_INVALID_PARAM;
-    }
-    
-    pthread_mutex_lock(&dev->mutex);
+    pthread_mutex_lock(&dev->io_lock);
     
-    /* Allocate image buffer */
-    driver_image.data = malloc(FP_XIAOMI_MAX_IMAGE_SIZE);
-    if (!driver_image.data) {
-        pthread_mutex_unlock(&dev->mutex);
-        return FP_XIAOMI_ERROR_MEMORY;
+    if (!buffer) {
+        scratch = pool_get(&dev->image_pool);
+        if (!scratch) {
+            pthread_mutex_unlock(&dev->io_lock);
+            return FP_XIAOMI_ERROR_MEMORY;
+        }
     }
     
+    /* No quality gate on plain captures */
+    memset(&driver_image, 0, sizeof(driver_image));
+    driver_image.format = format;
+    driver_image.data = buffer ? buffer : scratch;
+    driver_image.size = frame_bytes(&dev->info);
+    
     /* Capture image */
-    ret = ioctl(dev->fd, FP_IOC_CAPTURE_IMAGE, &driver_image);
+    ret = device_ioctl(dev, FP_IOC_CAPTURE_IMAGE, &driver_image);
     if (ret < 0) {
-        free(driver_image.data);
-        pthread_mutex_unlock(&dev->mutex);
-        return FP_XIAOMI_ERROR_DEVICE;
+        ret = errno_to_error(errno);
+        if (scratch) {
+            pool_put(&dev->image_pool, scratch);
+        }
+        pthread_mutex_unlock(&dev->io_lock);
+        return ret;
     }
     
     /* Copy image data */
@@ -288,76 +799,374 @@ int fp_xiaomi_capture_image(fp_xiaomi_device_t *device, fp_xiaomi_image_t *image
     image->format = driver_image.format;
     image->quality = driver_image.quality;
     image->size = driver_image.size;
+    image->data = buffer;
     
-    /* Allocate and copy image data */
-    image->data = malloc(image->size);
-    if (!image->data) {
-        free(driver_image.data);
-        pthread_mutex_unlock(&dev->mutex);
-        return FP_XIAOMI_ERROR_MEMORY;
+    if (scratch) {
+        image->data = malloc(image->size);
+        if (image->data) {
+            memcpy(image->data, scratch, image->size);
+        }
+        pool_put(&dev->image_pool, scratch);
+        if (!image->data) {
+            pthread_mutex_unlock(&dev->io_lock);
+            return FP_XIAOMI_ERROR_MEMORY;
+        }
     }
     
-    memcpy(image->data, driver_image.data, image->size);
-    free(driver_image.data);
+    pthread_mutex_unlock(&dev->io_lock);
+    
+    /* The sensor leaves quality at 0; the estimate costs well under a millisecond */
+    if (!image->quality) {
+        estimate_quality(image);
+    }
+    
+    memset(&event, 0, sizeof(event));
+    event.type = FP_XIAOMI_EVENT_IMAGE_CAPTURED;
+    event.timestamp = time(NULL);
+    queue_event(dev, &event);
     
-    pthread_mutex_unlock(&dev->mutex);
     return FP_XIAOMI_SUCCESS;
 }
 
 /**
- * Free image data
+ * Capture fingerprint image
  */
-void fp_xiaomi_free_image(fp_xiaomi_image_t *image)
+int fp_xiaomi_capture_image(fp_xiaomi_device_t *device, fp_xiaomi_image_t *image)
 {
-    if (image && image->data) {
-        free(image->data);
-        image->data = NULL;
-        image->size = 0;
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    
+    if (!dev || !dev->initialized || !image) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
     }
+    
+    return capture_image(device, image, FP_IMG_FORMAT_GRAY8, NULL);
 }
 
 /**
- * Start fingerprint enrollment
+ * Capture fingerprint image into a caller-provided buffer
  */
-int fp_xiaomi_enroll_start(fp_xiaomi_device_t *device, uint8_t template_id, 
-                          const char *name, uint32_t timeout_ms)
+int fp_xiaomi_capture_image_into(fp_xiaomi_device_t *device, fp_xiaomi_image_t *image,
+                                 uint8_t *buffer, size_t capacity)
 {
     struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
-    struct fp_enroll_params params;
-    int ret;
     
-    if (!dev || !dev->initialized) {
+    if (!dev || !dev->initialized || !image || !buffer || capacity < frame_bytes(&dev->info)) {
         errno = EINVAL;
         return FP_XIAOMI_ERROR_INVALID_PARAM;
     }
     
-    pthread_mutex_lock(&dev->mutex);
+    return capture_image(device, image, FP_IMG_FORMAT_GRAY8, buffer);
+}
+
+/**
+ * Capture fingerprint image in compressed form
+ */
+int fp_xiaomi_capture_image_compressed(fp_xiaomi_device_t *device, fp_xiaomi_image_t *image)
+{
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
     
-    /* Prepare enrollment parameters */
-    memset(&params, 0, sizeof(params));
-    params.template_id = template_id;
-    if (name) {
-        strncpy((char *)params.name, name, sizeof(params.name) - 1);
+    if (!dev || !dev->initialized || !image) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
     }
-    params.quality_threshold = FP_QUALITY_MEDIUM;
-    params.max_attempts = 5;
-    params.timeout_ms = timeout_ms ? timeout_ms : FP_TIMEOUT_DEFAULT;
     
-    ret = ioctl(dev->fd, FP_IOC_ENROLL_START, &params);
+    return capture_image(device, image, FP_IMG_FORMAT_COMPRESSED, NULL);
+}
+
+/**
+ * Free image data
+ */
+void fp_xiaomi_free_image(fp_xiaomi_image_t *image)
+{
+    if (image && image->data) {
+        free(image->data);
+        image->data = NULL;
+        image->size = 0;
+    }
+}
+
+/**
+ * Map frame ring
+ */
+int fp_xiaomi_map_frames(fp_xiaomi_device_t *device)
+{
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    struct fp_frame_ring *ring;
+    
+    if (!dev || !dev->initialized) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    pthread_mutex_lock(&dev->io_lock);
+    
+    if (dev->ring) {
+        pthread_mutex_unlock(&dev->io_lock);
+        return FP_XIAOMI_SUCCESS;
+    }
+    
+    if (dev->replay) {
+        ring = fp_xiaomi_replay_map_ring();
+    } else {
+        ring = mmap(NULL, FP_RING_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+    }
+    if (ring == MAP_FAILED) {
+        pthread_mutex_unlock(&dev->io_lock);
+        return FP_XIAOMI_ERROR_NOT_SUPPORTED;
+    }
+    
+    if (ring->magic != FP_RING_MAGIC || ring->version != FP_RING_VERSION) {
+        munmap(ring, FP_RING_MAP_SIZE);
+        pthread_mutex_unlock(&dev->io_lock);
+        return FP_XIAOMI_ERROR_PROTOCOL;
+    }
+    
+    dev->ring = ring;
+    
+    pthread_mutex_unlock(&dev->io_lock);
+    return FP_XIAOMI_SUCCESS;
+}
+
+/* Take the oldest unread frame from the ring, if there is one */
+static bool ring_frame_at(struct fp_xiaomi_device_internal *dev, uint32_t sequence,
+                          fp_xiaomi_frame_t *frame)
+{
+    struct fp_frame_ring *ring = dev->ring;
+    struct fp_frame_slot *slot;
+    uint32_t consumer = ring->consumer;
+    uint32_t producer = __atomic_load_n(&ring->producer, __ATOMIC_ACQUIRE);
+    
+    /* Only unread frames are described; anything else may be rewritten */
+    if (sequence - consumer >= producer - consumer) {
+        return false;
+    }
+    
+    slot = (struct fp_frame_slot *)((uint8_t *)ring + ring->slot_offset +
+                                    (sequence % ring->slot_count) * ring->slot_stride);
+    
+    frame->image.width = slot->width;
+    frame->image.height = slot->height;
+    frame->image.format = slot->format;
+    frame->image.quality = slot->quality;
+    frame->image.size = slot->size;
+    frame->image.data = slot->data;
+    frame->sequence = sequence;
+    frame->timestamp_ns = slot->timestamp_ns;
+    
+    return true;
+}
+
+/* The oldest unread frame */
+static bool ring_peek_frame(struct fp_xiaomi_device_internal *dev, fp_xiaomi_frame_t *frame)
+{
+    return ring_frame_at(dev, dev->ring->consumer, frame);
+}
+
+/*
+ * Hand the slot of frame sequence back. A drop-oldest stream may have
+ * moved consumer past it already, so this is a compare-and-swap; false
+ * means consumer was not at sequence (it is left in *consumer).
+ */
+static bool ring_advance(struct fp_xiaomi_device_internal *dev, uint32_t sequence,
+                         uint32_t *consumer)
+{
+    *consumer = sequence;
+    return __atomic_compare_exchange_n(&dev->ring->consumer, consumer, sequence + 1, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * The driver captures on its own when a touch wakes the sensor from
+ * autosuspend. Such a frame is the capture the caller is about to ask
+ * for, unless it has gone stale, in which case it is dropped.
+ */
+static bool ring_take_wake_frame(struct fp_xiaomi_device_internal *dev, fp_xiaomi_frame_t *frame)
+{
+    const struct fp_frame_slot *slot;
+    uint32_t consumer;
+    
+    if (!ring_peek_frame(dev, frame)) {
+        return false;
+    }
+    
+    slot = (const struct fp_frame_slot *)(frame->image.data - offsetof(struct fp_frame_slot, data));
+    if (!(slot->flags & FP_FRAME_FLAG_WAKE)) {
+        return false;
+    }
     
-    pthread_mutex_unlock(&dev->mutex);
+    if (fp_xiaomi_monotonic_ns() - frame->timestamp_ns <= WAKE_FRAME_MAX_AGE_NS) {
+        return true;
+    }
+    
+    ring_advance(dev, frame->sequence, &consumer);
+    return false;
+}
+
+/**
+ * Capture frame into ring
+ */
+int fp_xiaomi_capture_frame(fp_xiaomi_device_t *device, fp_xiaomi_frame_t *frame)
+{
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    struct fp_image_data driver_image;
+    int ret;
+    
+    if (!dev || !dev->initialized || !frame) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    ret = fp_xiaomi_map_frames(device);
+    if (ret != FP_XIAOMI_SUCCESS) {
+        return ret;
+    }
+    
+    if (ring_take_wake_frame(dev, frame)) {
+        return FP_XIAOMI_SUCCESS;
+    }
+    
+    pthread_mutex_lock(&dev->io_lock);
+    
+    /* A NULL data pointer asks the driver to publish to the ring only */
+    memset(&driver_image, 0, sizeof(driver_image));
+    ret = device_ioctl(dev, FP_IOC_CAPTURE_IMAGE, &driver_image);
+    
+    pthread_mutex_unlock(&dev->io_lock);
     
     if (ret < 0) {
-        return FP_XIAOMI_ERROR_DEVICE;
+        return errno_to_error(errno);
+    }
+    
+    /* The frame this call captured, not the oldest one still unread */
+    if (!ring_frame_at(dev, driver_image.sequence, frame)) {
+        /* A drop-oldest stream recycled it already */
+        return FP_XIAOMI_ERROR_BAD_IMAGE;
     }
     
     return FP_XIAOMI_SUCCESS;
 }
 
 /**
- * Continue fingerprint enrollment
+ * Wait for next frame in ring
  */
-int fp_xiaomi_enroll_continue(fp_xiaomi_device_t *device)
+int fp_xiaomi_next_frame(fp_xiaomi_device_t *device, fp_xiaomi_frame_t *frame,
+                        uint32_t timeout_ms)
+{
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    struct pollfd pfd;
+    struct timespec now, deadline;
+    long remaining_ms;
+    int ret;
+    
+    if (!dev || !dev->initialized || !dev->ring || !frame) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    if (timeout_ms == 0) {
+        timeout_ms = FP_TIMEOUT_DEFAULT;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    
+    while (!ring_peek_frame(dev, frame)) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        remaining_ms = (deadline.tv_sec - now.tv_sec) * 1000L +
+                       (deadline.tv_nsec - now.tv_nsec) / 1000000L;
+        if (remaining_ms <= 0) {
+            return FP_XIAOMI_ERROR_TIMEOUT;
+        }
+        
+        pfd.fd = dev->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        
+        ret = poll(&pfd, 1, (int)remaining_ms);
+        if (ret < 0 && errno != EINTR) {
+            return FP_XIAOMI_ERROR_DEVICE;
+        }
+        if (pfd.revents & (POLLERR | POLLHUP)) {
+            return FP_XIAOMI_ERROR_DEVICE;
+        }
+    }
+    
+    return FP_XIAOMI_SUCCESS;
+}
+
+/**
+ * Release frame slot
+ */
+int fp_xiaomi_release_frame(fp_xiaomi_device_t *device, const fp_xiaomi_frame_t *frame)
+{
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    uint32_t consumer;
+    
+    if (!dev || !dev->initialized || !dev->ring || !frame) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    /* Slots are handed back strictly in order */
+    if (ring_advance(dev, frame->sequence, &consumer)) {
+        return FP_XIAOMI_SUCCESS;
+    }
+    
+    /* Consumer already past the frame: the driver recycled its slot */
+    if ((int32_t)(consumer - frame->sequence) > 0) {
+        return FP_XIAOMI_ERROR_BAD_IMAGE;
+    }
+    
+    return FP_XIAOMI_ERROR_INVALID_PARAM;
+}
+
+/**
+ * Start streaming capture
+ */
+int fp_xiaomi_stream_start(fp_xiaomi_device_t *device, uint32_t interval_us,
+                           uint32_t max_frames, uint32_t flags)
+{
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    struct fp_stream_params params;
+    int ret;
+    
+    if (!dev || !dev->initialized || (flags & ~FP_XIAOMI_STREAM_DROP_OLDEST)) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    /* Frames only reach the caller through the ring */
+    ret = fp_xiaomi_map_frames(device);
+    if (ret != FP_XIAOMI_SUCCESS) {
+        return ret;
+    }
+    
+    memset(&params, 0, sizeof(params));
+    params.interval_us = interval_us;
+    params.max_frames = max_frames;
+    params.flags = (flags & FP_XIAOMI_STREAM_DROP_OLDEST) ? FP_STREAM_DROP_OLDEST : 0;
+    
+    pthread_mutex_lock(&dev->io_lock);
+    ret = device_ioctl(dev, FP_IOC_STREAM_START, &params);
+    pthread_mutex_unlock(&dev->io_lock);
+    
+    if (ret < 0) {
+        return errno_to_error(errno);
+    }
+    
+    return FP_XIAOMI_SUCCESS;
+}
+
+/**
+ * Stop streaming capture
+ */
+int fp_xiaomi_stream_stop(fp_xiaomi_device_t *device)
 {
     struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
     int ret;
@@ -367,45 +1176,131 @@ int fp_xiaomi_enroll_continue(fp_xiaomi_device_t *device)
         return FP_XIAOMI_ERROR_INVALID_PARAM;
     }
     
-    pthread_mutex_lock(&dev->mutex);
-    ret = ioctl(dev->fd, FP_IOC_ENROLL_CONTINUE);
-    pthread_mutex_unlock(&dev->mutex);
+    pthread_mutex_lock(&dev->io_lock);
+    ret = device_ioctl(dev, FP_IOC_STREAM_STOP, NULL);
+    pthread_mutex_unlock(&dev->io_lock);
     
     if (ret < 0) {
-        return FP_XIAOMI_ERROR_DEVICE;
+        return errno_to_error(errno);
     }
     
     return FP_XIAOMI_SUCCESS;
 }
 
 /**
- * Complete fingerprint enrollment
+ * Get streaming status
  */
-int fp_xiaomi_enroll_complete(fp_xiaomi_device_t *device, fp_xiaomi_template_t *template)
+int fp_xiaomi_stream_status(fp_xiaomi_device_t *device, uint32_t *dropped)
 {
     struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
-    struct fp_template_data driver_template;
+    int32_t status;
+    
+    if (!dev || !dev->initialized || !dev->ring) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    if (dropped) {
+        *dropped = __atomic_load_n(&dev->ring->dropped, __ATOMIC_RELAXED);
+    }
+    
+    status = __atomic_load_n(&dev->ring->stream_status, __ATOMIC_RELAXED);
+    return status ? errno_to_error(-status) : FP_XIAOMI_SUCCESS;
+}
+
+/**
+ * Start fingerprint enrollment
+ */
+int fp_xiaomi_enroll_start(fp_xiaomi_device_t *device, uint8_t template_id, 
+                          const char *name, uint32_t timeout_ms)
+{
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    struct fp_enroll_params params;
     int ret;
     
-    if (!dev || !dev->initialized || !template) {
+    if (!dev || !dev->initialized) {
         errno = EINVAL;
         return FP_XIAOMI_ERROR_INVALID_PARAM;
     }
     
-    pthread_mutex_lock(&dev->mutex);
+    pthread_mutex_lock(&dev->io_lock);
     
-    /* Allocate template buffer */
-    driver_template.data = malloc(FP_XIAOMI_MAX_TEMPLATE_SIZE);
-    if (!driver_template.data) {
-        pthread_mutex_unlock(&dev->mutex);
-        return FP_XIAOMI_ERROR_MEMORY;
+    /* Prepare enrollment parameters */
+    memset(&params, 0, sizeof(params));
+    params.template_id = template_id;
+    if (name) {
+        strncpy((char *)params.name, name, sizeof(params.name) - 1);
     }
+    params.quality_threshold = FP_QUALITY_MEDIUM;
+    params.max_attempts = 5;
+    params.timeout_ms = timeout_ms ? timeout_ms : FP_TIMEOUT_DEFAULT;
+    /* Misplaced touches are turned away by the driver before the sensor round trip */
+    params.flags = FP_FLAG_QUALITY_CHECK;
+    
+    ret = device_ioctl(dev, FP_IOC_ENROLL_START, &params);
+    
+    pthread_mutex_unlock(&dev->io_lock);
     
-    ret = ioctl(dev->fd, FP_IOC_ENROLL_COMPLETE, &driver_template);
     if (ret < 0) {
-        free(driver_template.data);
-        pthread_mutex_unlock(&dev->mutex);
-        return FP_XIAOMI_ERROR_DEVICE;
+        return errno_to_error(errno);
+    }
+    
+    return FP_XIAOMI_SUCCESS;
+}
+
+/**
+ * Continue fingerprint enrollment
+ */
+int fp_xiaomi_enroll_continue(fp_xiaomi_device_t *device)
+{
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    int ret;
+    
+    if (!dev || !dev->initialized) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    pthread_mutex_lock(&dev->io_lock);
+    ret = device_ioctl(dev, FP_IOC_ENROLL_CONTINUE, NULL);
+    pthread_mutex_unlock(&dev->io_lock);
+    
+    if (ret < 0) {
+        return errno_to_error(errno);
+    }
+    
+    return FP_XIAOMI_SUCCESS;
+}
+
+/*
+ * Fetch the sensor's enrolled template; caller holds io_lock. With
+ * buffer set (FP_XIAOMI_MAX_TEMPLATE_SIZE bytes) the driver writes
+ * straight into it, otherwise template->data is a malloc()ed copy.
+ */
+static int read_enrolled_template(struct fp_xiaomi_device_internal *dev,
+                                  fp_xiaomi_template_t *template, uint8_t *buffer)
+{
+    struct fp_template_data driver_template;
+    uint8_t *scratch = NULL;
+    int ret;
+    
+    memset(&driver_template, 0, sizeof(driver_template));
+    
+    if (!buffer) {
+        scratch = pool_get(&dev->template_pool);
+        if (!scratch) {
+            return FP_XIAOMI_ERROR_MEMORY;
+        }
+    }
+    driver_template.data = buffer ? buffer : scratch;
+    
+    ret = device_ioctl(dev, FP_IOC_ENROLL_COMPLETE, &driver_template);
+    if (ret < 0) {
+        ret = errno_to_error(errno);
+        if (scratch) {
+            pool_put(&dev->template_pool, scratch);
+        }
+        return ret;
     }
     
     /* Copy template data */
@@ -414,22 +1309,64 @@ int fp_xiaomi_enroll_complete(fp_xiaomi_device_t *device, fp_xiaomi_template_t *
     template->quality = driver_template.quality;
     template->size = driver_template.size;
     strncpy(template->name, (char *)driver_template.name, sizeof(template->name) - 1);
+    template->data = buffer;
     
-    /* Allocate and copy template data */
-    template->data = malloc(template->size);
-    if (!template->data) {
-        free(driver_template.data);
-        pthread_mutex_unlock(&dev->mutex);
-        return FP_XIAOMI_ERROR_MEMORY;
+    if (scratch) {
+        template->data = malloc(template->size);
+        if (template->data) {
+            memcpy(template->data, scratch, template->size);
+        }
+        pool_put(&dev->template_pool, scratch);
+        if (!template->data) {
+            return FP_XIAOMI_ERROR_MEMORY;
+        }
     }
     
-    memcpy(template->data, driver_template.data, template->size);
-    free(driver_template.data);
-    
-    pthread_mutex_unlock(&dev->mutex);
     return FP_XIAOMI_SUCCESS;
 }
 
+/**
+ * Complete fingerprint enrollment
+ */
+int fp_xiaomi_enroll_complete(fp_xiaomi_device_t *device, fp_xiaomi_template_t *template)
+{
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    int ret;
+    
+    if (!dev || !dev->initialized || !template) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    pthread_mutex_lock(&dev->io_lock);
+    ret = read_enrolled_template(dev, template, NULL);
+    pthread_mutex_unlock(&dev->io_lock);
+    
+    return ret;
+}
+
+/**
+ * Complete fingerprint enrollment into a caller-provided buffer
+ */
+int fp_xiaomi_enroll_complete_into(fp_xiaomi_device_t *device, fp_xiaomi_template_t *template,
+                                   uint8_t *buffer, size_t capacity)
+{
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    int ret;
+    
+    if (!dev || !dev->initialized || !template || !buffer ||
+        capacity < FP_XIAOMI_MAX_TEMPLATE_SIZE) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    pthread_mutex_lock(&dev->io_lock);
+    ret = read_enrolled_template(dev, template, buffer);
+    pthread_mutex_unlock(&dev->io_lock);
+    
+    return ret;
+}
+
 /**
  * Cancel fingerprint enrollment
  */
@@ -443,12 +1380,11 @@ int fp_xiaomi_enroll_cancel(fp_xiaomi_device_t *device)
         return FP_XIAOMI_ERROR_INVALID_PARAM;
     }
     
-    pthread_mutex_lock(&dev->mutex);
-    ret = ioctl(dev->fd, FP_IOC_ENROLL_CANCEL);
-    pthread_mutex_unlock(&dev->mutex);
+    /* Not serialized behind an enroll step that is still waiting for a finger */
+    ret = device_ioctl(dev, FP_IOC_ENROLL_CANCEL, NULL);
     
     if (ret < 0) {
-        return FP_XIAOMI_ERROR_DEVICE;
+        return errno_to_error(errno);
     }
     
     return FP_XIAOMI_SUCCESS;
@@ -461,6 +1397,7 @@ int fp_xiaomi_verify(fp_xiaomi_device_t *device, uint8_t template_id, uint32_t t
 {
     struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
     struct fp_verify_params params;
+    fp_xiaomi_event_t event;
     int ret;
     
     if (!dev || !dev->initialized) {
@@ -468,7 +1405,7 @@ int fp_xiaomi_verify(fp_xiaomi_device_t *device, uint8_t template_id, uint32_t t
         return FP_XIAOMI_ERROR_INVALID_PARAM;
     }
     
-    pthread_mutex_lock(&dev->mutex);
+    pthread_mutex_lock(&dev->io_lock);
     
     /* Prepare verification parameters */
     memset(&params, 0, sizeof(params));
@@ -476,15 +1413,21 @@ int fp_xiaomi_verify(fp_xiaomi_device_t *device, uint8_t template_id, uint32_t t
     params.quality_threshold = FP_QUALITY_MEDIUM;
     params.timeout_ms = timeout_ms ? timeout_ms : FP_TIMEOUT_DEFAULT;
     
-    ret = ioctl(dev->fd, FP_IOC_VERIFY, &params);
+    ret = device_ioctl(dev, FP_IOC_VERIFY, &params);
+    ret = ret < 0 ? errno_to_error(errno) : FP_XIAOMI_SUCCESS;
     
-    pthread_mutex_unlock(&dev->mutex);
+    pthread_mutex_unlock(&dev->io_lock);
     
-    if (ret < 0) {
-        return FP_XIAOMI_ERROR_DEVICE;
+    if (ret == FP_XIAOMI_SUCCESS || ret == FP_XIAOMI_ERROR_NO_MATCH) {
+        memset(&event, 0, sizeof(event));
+        event.type = FP_XIAOMI_EVENT_VERIFICATION_COMPLETE;
+        event.timestamp = time(NULL);
+        event.data.verification.matched = ret == FP_XIAOMI_SUCCESS;
+        event.data.verification.template_id = template_id;
+        queue_event(dev, &event);
     }
     
-    return FP_XIAOMI_SUCCESS;
+    return ret;
 }
 
 /**
@@ -492,37 +1435,166 @@ int fp_xiaomi_verify(fp_xiaomi_device_t *device, uint8_t template_id, uint32_t t
  */
 int fp_xiaomi_identify(fp_xiaomi_device_t *device, uint8_t *matched_id, 
                       uint8_t *confidence, uint32_t timeout_ms)
+{
+    return fp_xiaomi_identify_candidates(device, NULL, 0, matched_id, confidence, timeout_ms);
+}
+
+/**
+ * Identify fingerprint against a subset of stored templates
+ */
+int fp_xiaomi_identify_candidates(fp_xiaomi_device_t *device, const uint8_t *candidates,
+                                 size_t count, uint8_t *matched_id, uint8_t *confidence,
+                                 uint32_t timeout_ms)
 {
     struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
     struct fp_identify_params params;
+    fp_xiaomi_event_t event;
+    uint16_t mask = 0;
+    size_t i;
     int ret;
     
-    if (!dev || !dev->initialized) {
+    if (!dev || !dev->initialized || (!candidates && count)) {
         errno = EINVAL;
         return FP_XIAOMI_ERROR_INVALID_PARAM;
     }
     
-    pthread_mutex_lock(&dev->mutex);
+    for (i = 0; i < count; i++) {
+        if (candidates[i] == 0 || candidates[i] > FP_XIAOMI_MAX_TEMPLATES) {
+            errno = EINVAL;
+            return FP_XIAOMI_ERROR_INVALID_PARAM;
+        }
+        mask |= (uint16_t)(1U << (candidates[i] - 1));
+    }
+    
+    pthread_mutex_lock(&dev->io_lock);
     
     /* Prepare identification parameters */
     memset(&params, 0, sizeof(params));
     params.quality_threshold = FP_QUALITY_MEDIUM;
     params.timeout_ms = timeout_ms ? timeout_ms : FP_TIMEOUT_DEFAULT;
+    params.candidate_mask = mask;
     
-    ret = ioctl(dev->fd, FP_IOC_IDENTIFY, &params);
+    ret = device_ioctl(dev, FP_IOC_IDENTIFY, &params);
     if (ret < 0) {
-        pthread_mutex_unlock(&dev->mutex);
-        return FP_XIAOMI_ERROR_DEVICE;
+        pthread_mutex_unlock(&dev->io_lock);
+        return errno_to_error(errno);
     }
     
     /* Return results */
     if (matched_id) *matched_id = params.matched_id;
     if (confidence) *confidence = params.confidence;
     
-    pthread_mutex_unlock(&dev->mutex);
+    pthread_mutex_unlock(&dev->io_lock);
+    
+    memset(&event, 0, sizeof(event));
+    event.type = FP_XIAOMI_EVENT_VERIFICATION_COMPLETE;
+    event.timestamp = time(NULL);
+    event.data.verification.matched = true;
+    event.data.verification.template_id = params.matched_id;
+    event.data.verification.confidence = params.confidence;
+    queue_event(dev, &event);
+    
     return FP_XIAOMI_SUCCESS;
 }
 
+/*
+ * Capture a probe template for host-side matching
+ *
+ * Runs a single-sample enrollment into template slot 0, which the
+ * sensor never stores (list_templates treats 0 as an empty slot), and
+ * reads the extracted template back into buffer as in
+ * read_enrolled_template(). The driver does not bump the template
+ * generation for slot 0, so probes keep the template list cached.
+ */
+static int capture_template(struct fp_xiaomi_device_internal *dev, fp_xiaomi_template_t *template,
+                            uint32_t timeout_ms, uint8_t *buffer)
+{
+    struct fp_enroll_params params;
+    int ret;
+    
+    memset(template, 0, sizeof(*template));
+    memset(&params, 0, sizeof(params));
+    params.template_id = 0;
+    params.quality_threshold = FP_QUALITY_MEDIUM;
+    params.max_attempts = 1;
+    params.timeout_ms = timeout_ms ? timeout_ms : FP_TIMEOUT_DEFAULT;
+    
+    pthread_mutex_lock(&dev->io_lock);
+    
+    if (device_ioctl(dev, FP_IOC_ENROLL_START, &params) < 0) {
+        ret = errno_to_error(errno);
+        goto out;
+    }
+    
+    if (device_ioctl(dev, FP_IOC_ENROLL_CONTINUE, NULL) < 0) {
+        ret = errno_to_error(errno);
+        device_ioctl(dev, FP_IOC_ENROLL_CANCEL, NULL);
+        goto out;
+    }
+    
+    ret = read_enrolled_template(dev, template, buffer);
+    
+out:
+    pthread_mutex_unlock(&dev->io_lock);
+    return ret;
+}
+
+/**
+ * Capture a probe template for host-side matching
+ */
+int fp_xiaomi_capture_template(fp_xiaomi_device_t *device, fp_xiaomi_template_t *template,
+                              uint32_t timeout_ms)
+{
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    
+    if (!dev || !dev->initialized || !template) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    return capture_template(dev, template, timeout_ms, NULL);
+}
+
+/**
+ * Capture a probe template into a caller-provided buffer
+ */
+int fp_xiaomi_capture_template_into(fp_xiaomi_device_t *device, fp_xiaomi_template_t *template,
+                                   uint8_t *buffer, size_t capacity, uint32_t timeout_ms)
+{
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    
+    if (!dev || !dev->initialized || !template || !buffer ||
+        capacity < FP_XIAOMI_MAX_TEMPLATE_SIZE) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    return capture_template(dev, template, timeout_ms, buffer);
+}
+
+/**
+ * Identify against a host-side gallery
+ */
+int fp_xiaomi_identify_gallery(fp_xiaomi_device_t *device, const fp_xiaomi_gallery_t *gallery,
+                              uint32_t *matched_id, uint8_t *confidence, uint32_t timeout_ms)
+{
+    fp_xiaomi_template_t probe;
+    uint8_t buffer[FP_XIAOMI_MAX_TEMPLATE_SIZE];
+    int ret;
+    
+    if (!gallery || !matched_id || !confidence) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    ret = fp_xiaomi_capture_template_into(device, &probe, buffer, sizeof(buffer), timeout_ms);
+    if (ret != FP_XIAOMI_SUCCESS) {
+        return ret;
+    }
+    
+    return fp_xiaomi_gallery_match(gallery, &probe, 0, matched_id, confidence);
+}
+
 /**
  * Free template data
  */
@@ -542,7 +1614,11 @@ int fp_xiaomi_list_templates(fp_xiaomi_device_t *device, uint8_t *template_ids,
                             size_t *count)
 {
     struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    struct fp_device_status status;
     uint8_t driver_list[FP_XIAOMI_MAX_TEMPLATES];
+    uint32_t generation = 0;
+    uint8_t stored = 0;
+    bool cached = false;
     int ret;
     size_t i, found_count = 0;
     
@@ -551,25 +1627,46 @@ int fp_xiaomi_list_templates(fp_xiaomi_device_t *device, uint8_t *template_ids,
         return FP_XIAOMI_ERROR_INVALID_PARAM;
     }
     
-    pthread_mutex_lock(&dev->mutex);
+    /* Lock-free in the driver; one without template generations reports 0 */
+    if (device_ioctl(dev, FP_IOC_GET_STATUS, &status) == 0) {
+        generation = status.template_generation;
+    }
     
-    ret = ioctl(dev->fd, FP_IOC_LIST_TEMPLATES, driver_list);
-    if (ret < 0) {
-        pthread_mutex_unlock(&dev->mutex);
-        return FP_XIAOMI_ERROR_DEVICE;
+    if (generation) {
+        pthread_rwlock_rdlock(&dev->info_lock);
+        if (dev->template_generation == generation) {
+            memcpy(driver_list, dev->template_ids, sizeof(driver_list));
+            cached = true;
+        }
+        pthread_rwlock_unlock(&dev->info_lock);
+    }
+    
+    if (!cached) {
+        pthread_mutex_lock(&dev->io_lock);
+        ret = device_ioctl(dev, FP_IOC_LIST_TEMPLATES, driver_list);
+        pthread_mutex_unlock(&dev->io_lock);
+        if (ret < 0) {
+            return errno_to_error(errno);
+        }
     }
     
     /* Count and copy valid template IDs */
-    for (i = 0; i < FP_XIAOMI_MAX_TEMPLATES && found_count < *count; i++) {
-        if (driver_list[i] != 0) {
+    for (i = 0; i < FP_XIAOMI_MAX_TEMPLATES; i++) {
+        if (driver_list[i] == 0) {
+            continue;
+        }
+        if (found_count < *count) {
             template_ids[found_count] = driver_list[i];
             found_count++;
         }
+        stored++;
     }
     
     *count = found_count;
     
-    pthread_mutex_unlock(&dev->mutex);
+    if (!cached) {
+        cache_templates(dev, driver_list, generation, stored);
+    }
     return FP_XIAOMI_SUCCESS;
 }
 
@@ -586,12 +1683,12 @@ int fp_xiaomi_delete_template(fp_xiaomi_device_t *device, uint8_t template_id)
         return FP_XIAOMI_ERROR_INVALID_PARAM;
     }
     
-    pthread_mutex_lock(&dev->mutex);
-    ret = ioctl(dev->fd, FP_IOC_DELETE_TEMPLATE, &template_id);
-    pthread_mutex_unlock(&dev->mutex);
+    pthread_mutex_lock(&dev->io_lock);
+    ret = device_ioctl(dev, FP_IOC_DELETE_TEMPLATE, &template_id);
+    pthread_mutex_unlock(&dev->io_lock);
     
     if (ret < 0) {
-        return FP_XIAOMI_ERROR_DEVICE;
+        return errno_to_error(errno);
     }
     
     return FP_XIAOMI_SUCCESS;
@@ -610,17 +1707,93 @@ int fp_xiaomi_clear_templates(fp_xiaomi_device_t *device)
         return FP_XIAOMI_ERROR_INVALID_PARAM;
     }
     
-    pthread_mutex_lock(&dev->mutex);
-    ret = ioctl(dev->fd, FP_IOC_CLEAR_TEMPLATES);
-    pthread_mutex_unlock(&dev->mutex);
+    pthread_mutex_lock(&dev->io_lock);
+    ret = device_ioctl(dev, FP_IOC_CLEAR_TEMPLATES, NULL);
+    pthread_mutex_unlock(&dev->io_lock);
     
     if (ret < 0) {
-        return FP_XIAOMI_ERROR_DEVICE;
+        return errno_to_error(errno);
     }
     
+    publish_template_count(dev, 0);
     return FP_XIAOMI_SUCCESS;
 }
 
+/**
+ * Submit a batch of commands
+ */
+int fp_xiaomi_submit_batch(fp_xiaomi_device_t *device, const fp_xiaomi_command_t *commands,
+                           fp_xiaomi_response_t *responses, size_t count,
+                           bool stop_on_error, size_t *completed)
+{
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    uint8_t cmd_buf[FP_XIAOMI_BATCH_MAX_COMMANDS *
+                    (sizeof(struct fp_packet) + FP_XIAOMI_BATCH_MAX_DATA)];
+    uint8_t resp_buf[FP_XIAOMI_BATCH_MAX_COMMANDS *
+                     (sizeof(struct fp_packet) + FP_BATCH_MAX_PAYLOAD)];
+    struct fp_batch batch;
+    struct fp_packet pkt;
+    size_t offset = 0;
+    size_t i;
+    int ret;
+    
+    if (completed) {
+        *completed = 0;
+    }
+    
+    if (!dev || !dev->initialized || !commands || !responses ||
+        count == 0 || count > FP_XIAOMI_BATCH_MAX_COMMANDS) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    /* Pack commands into the driver's fp_packet stream */
+    for (i = 0; i < count; i++) {
+        if (commands[i].length > FP_XIAOMI_BATCH_MAX_DATA) {
+            errno = EINVAL;
+            return FP_XIAOMI_ERROR_INVALID_PARAM;
+        }
+        pkt.cmd = (uint8_t)commands[i].code;
+        pkt.flags = commands[i].arg;
+        pkt.length = commands[i].length;
+        memcpy(cmd_buf + offset, &pkt, sizeof(pkt));
+        memcpy(cmd_buf + offset + sizeof(pkt), commands[i].data, pkt.length);
+        offset += sizeof(pkt) + pkt.length;
+    }
+    
+    memset(&batch, 0, sizeof(batch));
+    batch.count = count;
+    batch.flags = stop_on_error ? FP_BATCH_STOP_ON_ERROR : 0;
+    batch.commands = (uintptr_t)cmd_buf;
+    batch.commands_len = offset;
+    batch.responses = (uintptr_t)resp_buf;
+    batch.responses_len = sizeof(resp_buf);
+    
+    pthread_mutex_lock(&dev->io_lock);
+    ret = device_ioctl(dev, FP_IOC_SUBMIT_BATCH, &batch);
+    pthread_mutex_unlock(&dev->io_lock);
+    
+    if (ret < 0) {
+        return errno_to_error(errno);
+    }
+    
+    /* Unpack one response per executed command */
+    offset = 0;
+    for (i = 0; i < batch.completed && i < count; i++) {
+        memcpy(&pkt, resp_buf + offset, sizeof(pkt));
+        responses[i].result = resp_to_error(pkt.flags);
+        responses[i].length = pkt.length;
+        memcpy(responses[i].data, resp_buf + offset + sizeof(pkt), pkt.length);
+        offset += sizeof(pkt) + pkt.length;
+    }
+    
+    if (completed) {
+        *completed = i;
+    }
+    
+    return batch.error ? errno_to_error(-batch.error) : FP_XIAOMI_SUCCESS;
+}
+
 /**
  * Reset device
  */
@@ -634,48 +1807,156 @@ int fp_xiaomi_reset_device(fp_xiaomi_device_t *device)
         return FP_XIAOMI_ERROR_INVALID_PARAM;
     }
     
-    pthread_mutex_lock(&dev->mutex);
-    ret = ioctl(dev->fd, FP_IOC_RESET_DEVICE);
-    pthread_mutex_unlock(&dev->mutex);
+    pthread_mutex_lock(&dev->io_lock);
+    ret = device_ioctl(dev, FP_IOC_RESET_DEVICE, NULL);
+    pthread_mutex_unlock(&dev->io_lock);
     
     if (ret < 0) {
-        return FP_XIAOMI_ERROR_DEVICE;
+        return errno_to_error(errno);
     }
     
     return FP_XIAOMI_SUCCESS;
 }
 
 /**
- * Event handling thread
+ * Cancel the call in progress
  */
-static void *event_thread_func(void *arg)
+int fp_xiaomi_cancel(fp_xiaomi_device_t *device)
 {
-    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)arg;
-    fd_set readfds;
-    struct timeval timeout;
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    
+    if (!dev || !dev->initialized) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    /* Must not take io_lock: the call being cancelled holds it */
+    if (device_ioctl(dev, FP_IOC_CANCEL, NULL) < 0) {
+        return errno_to_error(errno);
+    }
+    
+    return FP_XIAOMI_SUCCESS;
+}
+
+/**
+ * Warm the sensor up ahead of a touch
+ */
+int fp_xiaomi_prearm(fp_xiaomi_device_t *device, uint32_t timeout_ms)
+{
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
     int ret;
     
-    while (dev->event_thread_running) {
-        FD_ZERO(&readfds);
-        FD_SET(dev->fd, &readfds);
-        
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        
-        ret = select(dev->fd + 1, &readfds, NULL, NULL, &timeout);
-        if (ret > 0 && FD_ISSET(dev->fd, &readfds)) {
-            /* Device has data available - this indicates an event */
-            if (dev->event_callback) {
-                fp_xiaomi_event_t event;
-                event.type = FP_XIAOMI_EVENT_FINGER_DETECTED;
-                event.timestamp = time(NULL);
-                
-                dev->event_callback(device, &event, dev->callback_data);
-            }
+    if (!dev || !dev->initialized) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    pthread_mutex_lock(&dev->io_lock);
+    ret = device_ioctl(dev, FP_IOC_PREARM, &timeout_ms);
+    pthread_mutex_unlock(&dev->io_lock);
+    
+    if (ret < 0) {
+        return errno_to_error(errno);
+    }
+    
+    return FP_XIAOMI_SUCCESS;
+}
+
+/**
+ * Start recording driver calls
+ */
+int fp_xiaomi_record_start(fp_xiaomi_device_t *device, const char *trace_path)
+{
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    struct fp_xiaomi_recorder *recorder;
+    
+    if (!dev || !dev->initialized || !trace_path || dev->replay) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    pthread_rwlock_rdlock(&dev->info_lock);
+    recorder = fp_xiaomi_recorder_open(trace_path, &dev->info);
+    pthread_rwlock_unlock(&dev->info_lock);
+    if (!recorder) {
+        return errno == ENOMEM ? FP_XIAOMI_ERROR_MEMORY : FP_XIAOMI_ERROR_PERMISSION;
+    }
+    
+    pthread_rwlock_wrlock(&dev->recorder_lock);
+    fp_xiaomi_recorder_close(dev->recorder);
+    __atomic_store_n(&dev->recorder, recorder, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&dev->recorder_lock);
+    
+    return FP_XIAOMI_SUCCESS;
+}
+
+/**
+ * Stop recording driver calls
+ */
+int fp_xiaomi_record_stop(fp_xiaomi_device_t *device)
+{
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    struct fp_xiaomi_recorder *recorder;
+    
+    if (!dev || !dev->initialized) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    pthread_rwlock_wrlock(&dev->recorder_lock);
+    recorder = dev->recorder;
+    __atomic_store_n(&dev->recorder, NULL, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&dev->recorder_lock);
+    
+    return fp_xiaomi_recorder_close(recorder);
+}
+
+/**
+ * Get pollable event fd
+ */
+int fp_xiaomi_get_event_fd(fp_xiaomi_device_t *device)
+{
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    
+    if (!dev || !dev->initialized) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    return dev->poll_fd;
+}
+
+/**
+ * Fetch next pending event
+ */
+int fp_xiaomi_next_event(fp_xiaomi_device_t *device, fp_xiaomi_event_t *event)
+{
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    struct fp_finger_event finger;
+    
+    if (!dev || !dev->initialized || !event) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    if (dequeue_event(dev, event)) {
+        return FP_XIAOMI_SUCCESS;
+    }
+    
+    /* Served from the driver's lock-free path; never waits for io_lock */
+    if (device_ioctl(dev, FP_IOC_GET_FINGER_EVENT, &finger) < 0) {
+        if (errno == EAGAIN) {
+            return FP_XIAOMI_ERROR_WOULD_BLOCK;
         }
+        return errno_to_error(errno);
     }
     
-    return NULL;
+    memset(event, 0, sizeof(*event));
+    event->type = finger.type == FP_FINGER_EVENT_DOWN ?
+                  FP_XIAOMI_EVENT_FINGER_DETECTED : FP_XIAOMI_EVENT_FINGER_REMOVED;
+    event->timestamp = (time_t)(finger.timestamp_ns / 1000000000ULL);
+    
+    return FP_XIAOMI_SUCCESS;
 }
 
 /**
@@ -691,33 +1972,44 @@ int fp_xiaomi_set_event_callback(fp_xiaomi_device_t *device,
         return FP_XIAOMI_ERROR_INVALID_PARAM;
     }
     
-    pthread_mutex_lock(&dev->mutex);
+    pthread_mutex_lock(&dev->event_lock);
+    dev->event_callback = callback;
+    dev->callback_data = user_data;
+    pthread_mutex_unlock(&dev->event_lock);
+    
+    return FP_XIAOMI_SUCCESS;
+}
+
+/**
+ * Deliver pending events to the callback
+ */
+int fp_xiaomi_dispatch_events(fp_xiaomi_device_t *device)
+{
+    struct fp_xiaomi_device_internal *dev = (struct fp_xiaomi_device_internal *)device;
+    fp_xiaomi_event_callback_t callback;
+    fp_xiaomi_event_t event;
+    void *user_data;
+    int dispatched = 0;
+    int ret;
     
-    /* Stop existing event thread */
-    if (dev->event_thread_running) {
-        dev->event_thread_running = false;
-        pthread_cancel(dev->event_thread);
-        pthread_join(dev->event_thread, NULL);
+    if (!dev || !dev->initialized) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
     }
     
-    /* Set new callback */
-    dev->event_callback = callback;
-    dev->callback_data = user_data;
+    pthread_mutex_lock(&dev->event_lock);
+    callback = dev->event_callback;
+    user_data = dev->callback_data;
+    pthread_mutex_unlock(&dev->event_lock);
     
-    /* Start event thread if callback is set */
-    if (callback) {
-        dev->event_thread_running = true;
-        if (pthread_create(&dev->event_thread, NULL, event_thread_func, dev) != 0) {
-            dev->event_thread_running = false;
-            dev->event_callback = NULL;
-            dev->callback_data = NULL;
-            pthread_mutex_unlock(&dev->mutex);
-            return FP_XIAOMI_ERROR_DEVICE;
+    while ((ret = fp_xiaomi_next_event(device, &event)) == FP_XIAOMI_SUCCESS) {
+        if (callback) {
+            callback(device, &event, user_data);
         }
+        dispatched++;
     }
     
-    pthread_mutex_unlock(&dev->mutex);
-    return FP_XIAOMI_SUCCESS;
+    return ret == FP_XIAOMI_ERROR_WOULD_BLOCK ? dispatched : ret;
 }
 
 /**
@@ -758,6 +2050,10 @@ const char *fp_xiaomi_get_error_string(int error_code)
         return "Storage full";
     case FP_XIAOMI_ERROR_TEMPLATE_EXIST:
         return "Template already exists";
+    case FP_XIAOMI_ERROR_WOULD_BLOCK:
+        return "Operation would block";
+    case FP_XIAOMI_ERROR_CANCELLED:
+        return "Operation cancelled";
     default:
         return "Unknown error";
     }
@@ -29,6 +29,9 @@ extern "C" {
 #define FP_XIAOMI_MAX_TEMPLATE_SIZE 1024
 #define FP_XIAOMI_MAX_TEMPLATES     10
 #define FP_XIAOMI_MAX_NAME_LEN      32
+#define FP_XIAOMI_BATCH_MAX_COMMANDS 32
+#define FP_XIAOMI_BATCH_MAX_DATA    64
+#define FP_XIAOMI_MAX_READERS       8       /* Readers a manager will open */
 
 /* Error codes */
 typedef enum {
@@ -47,7 +50,9 @@ typedef enum {
     FP_XIAOMI_ERROR_NOT_SUPPORTED = -12,
     FP_XIAOMI_ERROR_PERMISSION = -13,
     FP_XIAOMI_ERROR_STORAGE_FULL = -14,
-    FP_XIAOMI_ERROR_TEMPLATE_EXIST = -15
+    FP_XIAOMI_ERROR_TEMPLATE_EXIST = -15,
+    FP_XIAOMI_ERROR_WOULD_BLOCK = -16,
+    FP_XIAOMI_ERROR_CANCELLED = -17
 } fp_xiaomi_error_t;
 
 /* Device states */
@@ -89,6 +94,12 @@ typedef enum {
 /* Opaque device handle */
 typedef struct fp_xiaomi_device fp_xiaomi_device_t;
 
+/* Host-side template gallery (opaque) */
+typedef struct fp_xiaomi_gallery fp_xiaomi_gallery_t;
+
+/* Set of readers opened together (opaque) */
+typedef struct fp_xiaomi_manager fp_xiaomi_manager_t;
+
 /* Device information structure */
 typedef struct {
     uint16_t vendor_id;
@@ -121,6 +132,13 @@ typedef struct {
     uint8_t *data;
 } fp_xiaomi_image_t;
 
+/* Frame published in the driver's memory-mapped frame ring */
+typedef struct {
+    fp_xiaomi_image_t image;    /* image.data points into the shared ring */
+    uint32_t sequence;          /* Frame sequence number */
+    uint64_t timestamp_ns;      /* CLOCK_MONOTONIC capture time */
+} fp_xiaomi_frame_t;
+
 /* Template data structure */
 typedef struct {
     uint8_t id;
@@ -131,6 +149,36 @@ typedef struct {
     uint8_t *data;
 } fp_xiaomi_template_t;
 
+/* Sensor protocol commands accepted by fp_xiaomi_submit_batch() */
+typedef enum {
+    FP_XIAOMI_CMD_GET_INFO = 0x01,
+    FP_XIAOMI_CMD_CALIBRATE = 0x03,
+    FP_XIAOMI_CMD_ENROLL_START = 0x20,
+    FP_XIAOMI_CMD_ENROLL_CONTINUE = 0x21,
+    FP_XIAOMI_CMD_ENROLL_CANCEL = 0x23,
+    FP_XIAOMI_CMD_VERIFY = 0x30,
+    FP_XIAOMI_CMD_IDENTIFY = 0x31,
+    FP_XIAOMI_CMD_DELETE_TEMPLATE = 0x42,
+    FP_XIAOMI_CMD_LIST_TEMPLATES = 0x43,
+    FP_XIAOMI_CMD_SET_POWER = 0x50,
+    FP_XIAOMI_CMD_GET_POWER = 0x51
+} fp_xiaomi_command_code_t;
+
+/* Batched command: wire parameter block plus its argument byte */
+typedef struct {
+    fp_xiaomi_command_code_t code;
+    uint8_t arg;                /* Template ID, power mode, ... */
+    uint16_t length;            /* Bytes used in data */
+    uint8_t data[FP_XIAOMI_BATCH_MAX_DATA];
+} fp_xiaomi_command_t;
+
+/* Batched command response */
+typedef struct {
+    int result;                 /* FP_XIAOMI_SUCCESS or error code */
+    uint16_t length;            /* Bytes of response payload in data */
+    uint8_t data[FP_XIAOMI_BATCH_MAX_DATA];
+} fp_xiaomi_response_t;
+
 /* Event structure */
 typedef struct {
     fp_xiaomi_event_type_t type;
@@ -187,6 +235,19 @@ void fp_xiaomi_get_version(int *major, int *minor, int *patch);
  */
 fp_xiaomi_device_t *fp_xiaomi_open_device(const char *device_path);
 
+/* Replay flags */
+#define FP_XIAOMI_REPLAY_FAST       0x0001  /* Answer immediately instead of at recorded speed */
+
+/**
+ * Open a recorded trace in place of the device
+ * @param trace_path Trace written by fp_xiaomi_record_start
+ * @param flags FP_XIAOMI_REPLAY_* flags
+ * @return Device handle on success, NULL on failure
+ * @note fp_xiaomi_open_device does this when FP_XIAOMI_REPLAY names a trace;
+ *       FP_XIAOMI_REPLAY_FAST in the environment selects the flag of that name
+ */
+fp_xiaomi_device_t *fp_xiaomi_open_replay(const char *trace_path, uint32_t flags);
+
 /**
  * Close fingerprint device
  * @param device Device handle
@@ -196,6 +257,10 @@ int fp_xiaomi_close_device(fp_xiaomi_device_t *device);
 
 /**
  * Get device information
+ *
+ * Answered from the handle's cache without waiting for a capture or
+ * match in progress on another thread. template_count is as of the last
+ * fp_xiaomi_list_templates() or fp_xiaomi_clear_templates().
  * @param device Device handle
  * @param info Device information structure (output)
  * @return FP_XIAOMI_SUCCESS on success, error code on failure
@@ -204,6 +269,9 @@ int fp_xiaomi_get_device_info(fp_xiaomi_device_t *device, fp_xiaomi_device_info_
 
 /**
  * Get device status
+ *
+ * Served by the driver's lock-free snapshot; never waits for a capture
+ * or match in progress on another thread.
  * @param device Device handle
  * @param status Device status structure (output)
  * @return FP_XIAOMI_SUCCESS on success, error code on failure
@@ -217,6 +285,49 @@ int fp_xiaomi_get_status(fp_xiaomi_device_t *device, fp_xiaomi_status_t *status)
  */
 int fp_xiaomi_reset_device(fp_xiaomi_device_t *device);
 
+/**
+ * Cancel the capture, match or enrollment step in progress
+ *
+ * Safe from any thread and never waits for the call it interrupts,
+ * which frees the sensor and fails with FP_XIAOMI_ERROR_CANCELLED
+ * within milliseconds. Does nothing if no call is in progress.
+ * @param device Device handle
+ * @return FP_XIAOMI_SUCCESS on success, error code on failure
+ */
+int fp_xiaomi_cancel(fp_xiaomi_device_t *device);
+
+/**
+ * Warm the sensor up ahead of a likely touch (lid open, screen wake)
+ *
+ * Returns once the sensor is resumed and armed, and keeps it from
+ * autosuspending until the first touch or until timeout_ms has passed
+ * (0 selects the driver default); calling again extends the window.
+ * When the frame ring is mapped, that first touch is captured into it,
+ * so the capture or verify that follows starts without sensor latency.
+ * @param device Device handle
+ * @param timeout_ms How long to stay ready; 0 for the driver default
+ * @return FP_XIAOMI_SUCCESS on success, error code on failure
+ */
+int fp_xiaomi_prearm(fp_xiaomi_device_t *device, uint32_t timeout_ms);
+
+/* Recording */
+
+/**
+ * Record every driver call and its results to a trace file for replay
+ * @param device Device handle (not a replay handle)
+ * @param trace_path Trace file to create
+ * @return FP_XIAOMI_SUCCESS on success, error code on failure
+ * @note Setting FP_XIAOMI_RECORD starts recording in fp_xiaomi_open_device
+ */
+int fp_xiaomi_record_start(fp_xiaomi_device_t *device, const char *trace_path);
+
+/**
+ * Stop recording and close the trace file
+ * @param device Device handle
+ * @return FP_XIAOMI_SUCCESS on success, FP_XIAOMI_ERROR_DEVICE if the trace is incomplete
+ */
+int fp_xiaomi_record_stop(fp_xiaomi_device_t *device);
+
 /* Image capture */
 
 /**
@@ -224,15 +335,158 @@ int fp_xiaomi_reset_device(fp_xiaomi_device_t *device);
  * @param device Device handle
  * @param image Image structure (output, must be freed with fp_xiaomi_free_image)
  * @return FP_XIAOMI_SUCCESS on success, error code on failure
+ * @note image->quality is estimated on the host when the sensor reports none
  */
 int fp_xiaomi_capture_image(fp_xiaomi_device_t *device, fp_xiaomi_image_t *image);
 
+/**
+ * Capture fingerprint image into a caller-provided buffer, without allocating
+ * @param device Device handle
+ * @param image Image structure (output, image->data points at buffer; do not free)
+ * @param buffer Destination for the pixels
+ * @param capacity Size of buffer, at least image_width * image_height from
+ *        fp_xiaomi_get_device_info()
+ * @return FP_XIAOMI_SUCCESS on success, error code on failure
+ */
+int fp_xiaomi_capture_image_into(fp_xiaomi_device_t *device, fp_xiaomi_image_t *image,
+                                 uint8_t *buffer, size_t capacity);
+
+/**
+ * Capture fingerprint image compressed by the driver, for storage or IPC
+ * @param device Device handle
+ * @param image Image structure (output, must be freed with fp_xiaomi_free_image)
+ * @return FP_XIAOMI_SUCCESS on success, error code on failure
+ * @note image->format is FP_XIAOMI_IMG_FORMAT_COMPRESSED, or GRAY8 when the
+ *       frame would not shrink; fp_xiaomi_image_decompress() restores it
+ */
+int fp_xiaomi_capture_image_compressed(fp_xiaomi_device_t *device, fp_xiaomi_image_t *image);
+
 /**
  * Free image data
  * @param image Image structure
  */
 void fp_xiaomi_free_image(fp_xiaomi_image_t *image);
 
+/* Zero-copy frame access */
+
+/**
+ * Map the driver's frame ring into the process
+ * @param device Device handle
+ * @return FP_XIAOMI_SUCCESS on success, error code on failure
+ */
+int fp_xiaomi_map_frames(fp_xiaomi_device_t *device);
+
+/**
+ * Capture a frame into the frame ring without copying it
+ *
+ * Returns the frame this call captured, even while earlier frames are
+ * still held or unread; those must be released before it.
+ * @param device Device handle
+ * @param frame Frame descriptor (output, release with fp_xiaomi_release_frame)
+ * @return FP_XIAOMI_SUCCESS on success, error code on failure
+ */
+int fp_xiaomi_capture_frame(fp_xiaomi_device_t *device, fp_xiaomi_frame_t *frame);
+
+/**
+ * Wait for the next unread frame in the frame ring
+ * @param device Device handle
+ * @param frame Frame descriptor (output, release with fp_xiaomi_release_frame)
+ * @param timeout_ms Timeout in milliseconds (0 for default)
+ * @return FP_XIAOMI_SUCCESS on success, FP_XIAOMI_ERROR_TIMEOUT if no frame arrived
+ */
+int fp_xiaomi_next_frame(fp_xiaomi_device_t *device, fp_xiaomi_frame_t *frame,
+                        uint32_t timeout_ms);
+
+/**
+ * Hand a frame slot back to the driver
+ * @param device Device handle
+ * @param frame Frame returned by fp_xiaomi_capture_frame/fp_xiaomi_next_frame
+ * @return FP_XIAOMI_SUCCESS on success, FP_XIAOMI_ERROR_BAD_IMAGE if a
+ *         drop-oldest stream recycled the slot while it was held (discard
+ *         anything computed from it), other error codes on failure
+ * @note Frames must be released in the order they were obtained
+ */
+int fp_xiaomi_release_frame(fp_xiaomi_device_t *device, const fp_xiaomi_frame_t *frame);
+
+/* Streaming flags */
+#define FP_XIAOMI_STREAM_DROP_OLDEST    0x0001  /* Recycle the oldest unread frame when the ring is full */
+
+/**
+ * Capture frames into the frame ring continuously
+ *
+ * Read the frames with fp_xiaomi_next_frame() and fp_xiaomi_release_frame()
+ * as they arrive; each carries its own sequence number and timestamp. Other
+ * calls on the device run between frames. While every slot is unread the
+ * stream waits for the reader, unless FP_XIAOMI_STREAM_DROP_OLDEST is set.
+ * @param device Device handle
+ * @param interval_us Time from one frame start to the next (0 for as fast as the sensor delivers)
+ * @param max_frames Number of frames to capture (0 to run until fp_xiaomi_stream_stop)
+ * @param flags FP_XIAOMI_STREAM_* flags
+ * @return FP_XIAOMI_SUCCESS on success, FP_XIAOMI_ERROR_BUSY if the device
+ *         is already streaming, FP_XIAOMI_ERROR_NOT_SUPPORTED on a replayed
+ *         trace (streamed frames are not recorded), other error codes on failure
+ */
+int fp_xiaomi_stream_start(fp_xiaomi_device_t *device, uint32_t interval_us,
+                           uint32_t max_frames, uint32_t flags);
+
+/**
+ * Stop the stream this handle started
+ * @param device Device handle
+ * @return FP_XIAOMI_SUCCESS on success (also when no stream runs),
+ *         FP_XIAOMI_ERROR_PERMISSION if another handle owns the stream
+ */
+int fp_xiaomi_stream_stop(fp_xiaomi_device_t *device);
+
+/**
+ * Get the outcome of the current or last stream
+ * @param device Device handle (frames must be mapped)
+ * @param dropped Frames recycled unread by drop-oldest streams so far (output, may be NULL)
+ * @return FP_XIAOMI_SUCCESS while streaming or after a normal stop, otherwise
+ *         the error that stopped the stream
+ */
+int fp_xiaomi_stream_status(fp_xiaomi_device_t *device, uint32_t *dropped);
+
+/* Image preprocessing */
+
+/* Preprocessing flags; with neither set only the quality is estimated */
+#define FP_XIAOMI_PREPROCESS_NORMALIZE  0x0001  /* Subtract background, normalize contrast */
+#define FP_XIAOMI_PREPROCESS_ENHANCE    0x0002  /* Normalize, then Gabor-filter along the ridges */
+#define FP_XIAOMI_PREPROCESS_ALL        (FP_XIAOMI_PREPROCESS_NORMALIZE | FP_XIAOMI_PREPROCESS_ENHANCE)
+
+/**
+ * Preprocess a GRAY8 image in place and set its quality field
+ * @param image Image to process (at least 16x16); frames from the ring work too
+ * @param flags FP_XIAOMI_PREPROCESS_* flags (0 to estimate quality without modifying the image)
+ * @return FP_XIAOMI_SUCCESS on success, FP_XIAOMI_ERROR_NOT_SUPPORTED for other formats
+ * @note Quality is 0-100: ridge clarity averaged over the whole sensor area,
+ *       so partial touches score low as well as smudged ones
+ */
+int fp_xiaomi_preprocess_image(fp_xiaomi_image_t *image, uint32_t flags);
+
+/**
+ * Get the name of the preprocessing kernels in use ("avx2", "sse2", "neon" or "scalar")
+ * @return Backend name string
+ */
+const char *fp_xiaomi_preprocess_backend(void);
+
+/* Lossless compression */
+
+/**
+ * Compress a GRAY8 image into FP_XIAOMI_IMG_FORMAT_COMPRESSED
+ * @param src Image to compress
+ * @param dst Compressed image (output, must be freed with fp_xiaomi_free_image)
+ * @return FP_XIAOMI_SUCCESS on success, FP_XIAOMI_ERROR_NOT_SUPPORTED for other formats
+ */
+int fp_xiaomi_image_compress(const fp_xiaomi_image_t *src, fp_xiaomi_image_t *dst);
+
+/**
+ * Decompress an FP_XIAOMI_IMG_FORMAT_COMPRESSED image back to GRAY8
+ * @param src Compressed image, from the driver or fp_xiaomi_image_compress()
+ * @param dst Decoded image (output, must be freed with fp_xiaomi_free_image)
+ * @return FP_XIAOMI_SUCCESS on success, FP_XIAOMI_ERROR_BAD_IMAGE if src is corrupt
+ */
+int fp_xiaomi_image_decompress(const fp_xiaomi_image_t *src, fp_xiaomi_image_t *dst);
+
 /* Enrollment */
 
 /**
@@ -261,8 +515,22 @@ int fp_xiaomi_enroll_continue(fp_xiaomi_device_t *device);
  */
 int fp_xiaomi_enroll_complete(fp_xiaomi_device_t *device, fp_xiaomi_template_t *template);
 
+/**
+ * Complete fingerprint enrollment into a caller-provided buffer, without allocating
+ * @param device Device handle
+ * @param template Template structure (output, template->data points at buffer; do not free)
+ * @param buffer Destination for the template data
+ * @param capacity Size of buffer, at least FP_XIAOMI_MAX_TEMPLATE_SIZE
+ * @return FP_XIAOMI_SUCCESS on success, error code on failure
+ */
+int fp_xiaomi_enroll_complete_into(fp_xiaomi_device_t *device, fp_xiaomi_template_t *template,
+                                   uint8_t *buffer, size_t capacity);
+
 /**
  * Cancel fingerprint enrollment
+ *
+ * May be called from any thread; an fp_xiaomi_enroll_continue() in
+ * progress on another thread fails with FP_XIAOMI_ERROR_CANCELLED.
  * @param device Device handle
  * @return FP_XIAOMI_SUCCESS on success, error code on failure
  */
@@ -290,10 +558,257 @@ int fp_xiaomi_verify(fp_xiaomi_device_t *device, uint8_t template_id, uint32_t t
 int fp_xiaomi_identify(fp_xiaomi_device_t *device, uint8_t *matched_id,
                       uint8_t *confidence, uint32_t timeout_ms);
 
+/**
+ * Identify fingerprint against a subset of stored templates
+ * @param device Device handle
+ * @param candidates Template IDs that may match (NULL with count 0 for all stored templates)
+ * @param count Number of candidate IDs
+ * @param matched_id Matched template ID (output, only valid on success)
+ * @param confidence Match confidence 0-100 (output, only valid on success)
+ * @param timeout_ms Timeout in milliseconds (0 for default)
+ * @return FP_XIAOMI_SUCCESS on match, FP_XIAOMI_ERROR_NO_MATCH on no match, other error codes on failure
+ */
+int fp_xiaomi_identify_candidates(fp_xiaomi_device_t *device, const uint8_t *candidates,
+                                 size_t count, uint8_t *matched_id, uint8_t *confidence,
+                                 uint32_t timeout_ms);
+
+/* Host-side matching */
+
+/**
+ * Capture a probe template without storing it on the sensor
+ * @param device Device handle
+ * @param template Template structure (output, free with fp_xiaomi_free_template)
+ * @param timeout_ms Timeout in milliseconds (0 for default)
+ * @return FP_XIAOMI_SUCCESS on success, error code on failure
+ */
+int fp_xiaomi_capture_template(fp_xiaomi_device_t *device, fp_xiaomi_template_t *template,
+                              uint32_t timeout_ms);
+
+/**
+ * Capture a probe template into a caller-provided buffer, without allocating
+ * @param device Device handle
+ * @param template Template structure (output, template->data points at buffer; do not free)
+ * @param buffer Destination for the template data
+ * @param capacity Size of buffer, at least FP_XIAOMI_MAX_TEMPLATE_SIZE
+ * @param timeout_ms Timeout in milliseconds (0 for default)
+ * @return FP_XIAOMI_SUCCESS on success, error code on failure
+ */
+int fp_xiaomi_capture_template_into(fp_xiaomi_device_t *device, fp_xiaomi_template_t *template,
+                                   uint8_t *buffer, size_t capacity, uint32_t timeout_ms);
+
+/**
+ * Score a probe template against a candidate template
+ * @param probe Probe template
+ * @param candidate Candidate template
+ * @param score Match score 0-100 (output); 0 if the templates are not comparable
+ * @return FP_XIAOMI_SUCCESS on success, error code on failure
+ */
+int fp_xiaomi_match_score(const fp_xiaomi_template_t *probe,
+                         const fp_xiaomi_template_t *candidate, uint8_t *score);
+
+/**
+ * Find the best match for a probe among host-stored templates
+ * @param probe Probe template
+ * @param templates Array of candidate templates
+ * @param count Number of candidate templates
+ * @param threshold Minimum score for a match (0 for FP_XIAOMI_MATCH_THRESHOLD)
+ * @param index Index of the best matching template (output, only valid on success)
+ * @param confidence Score of the best match (output, only valid on success)
+ * @return FP_XIAOMI_SUCCESS on match, FP_XIAOMI_ERROR_NO_MATCH on no match, other error codes on failure
+ */
+int fp_xiaomi_match_best(const fp_xiaomi_template_t *probe,
+                        const fp_xiaomi_template_t *templates, size_t count,
+                        uint8_t threshold, size_t *index, uint8_t *confidence);
+
+/**
+ * Get the name of the matching kernel in use ("avx2", "neon" or "scalar")
+ * @return Backend name string
+ */
+const char *fp_xiaomi_match_backend(void);
+
+/* Template gallery */
+
+/**
+ * Create an empty template gallery
+ * @param capacity Number of templates to reserve space for (0 for default)
+ * @return Gallery handle or NULL on failure
+ */
+fp_xiaomi_gallery_t *fp_xiaomi_gallery_create(size_t capacity);
+
+/**
+ * Destroy a template gallery
+ * @param gallery Gallery handle
+ */
+void fp_xiaomi_gallery_destroy(fp_xiaomi_gallery_t *gallery);
+
+/**
+ * Copy a template into the gallery
+ * @param gallery Gallery handle
+ * @param id Gallery-wide template ID (independent of the sensor slot ID)
+ * @param template Template to add; its data is copied
+ * @return FP_XIAOMI_SUCCESS on success, FP_XIAOMI_ERROR_TEMPLATE_EXIST if id is taken, other error codes on failure
+ */
+int fp_xiaomi_gallery_add(fp_xiaomi_gallery_t *gallery, uint32_t id,
+                         const fp_xiaomi_template_t *template);
+
+/**
+ * Remove a template from the gallery
+ * @param gallery Gallery handle
+ * @param id Template ID
+ * @return FP_XIAOMI_SUCCESS on success, FP_XIAOMI_ERROR_INVALID_PARAM if not found
+ */
+int fp_xiaomi_gallery_remove(fp_xiaomi_gallery_t *gallery, uint32_t id);
+
+/**
+ * Get the number of templates in the gallery
+ * @param gallery Gallery handle
+ * @return Template count
+ */
+size_t fp_xiaomi_gallery_count(const fp_xiaomi_gallery_t *gallery);
+
+/**
+ * List the IDs of the templates in the gallery
+ * @param gallery Gallery handle
+ * @param ids Array to store template IDs (output)
+ * @param count Size of array on input, number of IDs stored on output
+ * @return FP_XIAOMI_SUCCESS on success, error code on failure
+ */
+int fp_xiaomi_gallery_ids(const fp_xiaomi_gallery_t *gallery, uint32_t *ids, size_t *count);
+
+/**
+ * Look up a template in the gallery
+ * @param gallery Gallery handle
+ * @param id Template ID
+ * @param template Template view (output); data points into the gallery and
+ *        stays valid until the gallery is next modified. Do not free it.
+ *        The 8-bit sensor id field is left 0.
+ * @return FP_XIAOMI_SUCCESS on success, FP_XIAOMI_ERROR_INVALID_PARAM if not found
+ */
+int fp_xiaomi_gallery_get(const fp_xiaomi_gallery_t *gallery, uint32_t id,
+                         fp_xiaomi_template_t *template);
+
+/**
+ * Find a match for a probe in the gallery
+ *
+ * Large galleries are scanned in parallel on the matcher thread pool.
+ * The scan stops at the first template scoring at least threshold, so
+ * the result is an acceptable match rather than necessarily the best.
+ * @param gallery Gallery handle
+ * @param probe Probe template
+ * @param threshold Minimum score for a match (0 for FP_XIAOMI_MATCH_THRESHOLD)
+ * @param matched_id ID of the matching template (output, only valid on success)
+ * @param confidence Score of the match (output, only valid on success)
+ * @return FP_XIAOMI_SUCCESS on match, FP_XIAOMI_ERROR_NO_MATCH on no match, other error codes on failure
+ */
+int fp_xiaomi_gallery_match(const fp_xiaomi_gallery_t *gallery,
+                           const fp_xiaomi_template_t *probe, uint8_t threshold,
+                           uint32_t *matched_id, uint8_t *confidence);
+
+/**
+ * Set the number of threads used for gallery matching
+ * @param threads Thread count including the caller (0 for one per online CPU, 1 for serial)
+ * @return FP_XIAOMI_SUCCESS on success, error code on failure
+ */
+int fp_xiaomi_set_match_threads(size_t threads);
+
+/**
+ * Capture a probe and identify it against a host-side gallery
+ * @param device Device handle
+ * @param gallery Gallery handle
+ * @param matched_id Matched gallery template ID (output, only valid on success)
+ * @param confidence Match confidence 0-100 (output, only valid on success)
+ * @param timeout_ms Timeout in milliseconds (0 for default)
+ * @return FP_XIAOMI_SUCCESS on match, FP_XIAOMI_ERROR_NO_MATCH on no match, other error codes on failure
+ */
+int fp_xiaomi_identify_gallery(fp_xiaomi_device_t *device, const fp_xiaomi_gallery_t *gallery,
+                              uint32_t *matched_id, uint8_t *confidence, uint32_t timeout_ms);
+
+/* Gallery open flags */
+#define FP_XIAOMI_GALLERY_VERIFY    0x0001  /* Check the data CRC (reads the whole file) */
+
+/**
+ * Save a gallery to a file, atomically replacing any existing file
+ * @param gallery Gallery handle
+ * @param path File path
+ * @return FP_XIAOMI_SUCCESS on success, error code on failure
+ */
+int fp_xiaomi_gallery_save(const fp_xiaomi_gallery_t *gallery, const char *path);
+
+/**
+ * Open a gallery file by mapping it into memory
+ * @param path File path
+ * @param flags FP_XIAOMI_GALLERY_* flags
+ * @return Gallery handle (free with fp_xiaomi_gallery_destroy) or NULL on
+ *         failure with errno set (EBADMSG for a corrupt or foreign file)
+ */
+fp_xiaomi_gallery_t *fp_xiaomi_gallery_open(const char *path, uint32_t flags);
+
+/* Multi-reader manager */
+
+/**
+ * Open every reader on the system (/dev/fp_xiaomi*)
+ *
+ * Readers are opened and brought up in parallel, so the call takes about
+ * as long as the slowest reader. Readers that fail to open are skipped.
+ * @return Manager handle (free with fp_xiaomi_manager_close) or NULL if
+ *         no reader could be opened, with errno set
+ */
+fp_xiaomi_manager_t *fp_xiaomi_manager_open(void);
+
+/**
+ * Close every reader and free the manager
+ * @param manager Manager handle
+ */
+void fp_xiaomi_manager_close(fp_xiaomi_manager_t *manager);
+
+/**
+ * Get the number of open readers
+ * @param manager Manager handle
+ * @return Reader count, in device node order
+ */
+size_t fp_xiaomi_manager_count(const fp_xiaomi_manager_t *manager);
+
+/**
+ * Get a reader's device handle, for calls aimed at one reader
+ * @param manager Manager handle
+ * @param index Reader index, below fp_xiaomi_manager_count()
+ * @return Device handle owned by the manager, or NULL if index is out of range
+ */
+fp_xiaomi_device_t *fp_xiaomi_manager_device(const fp_xiaomi_manager_t *manager, size_t index);
+
+/**
+ * Get a reader's device node path
+ * @param manager Manager handle
+ * @param index Reader index, below fp_xiaomi_manager_count()
+ * @return Path string owned by the manager, or NULL if index is out of range
+ */
+const char *fp_xiaomi_manager_path(const fp_xiaomi_manager_t *manager, size_t index);
+
+/**
+ * Identify a finger on whichever reader it is placed first
+ *
+ * Every reader waits for a finger at once. The first one to capture
+ * answers and the others are cancelled; a reader that fails does not
+ * stop the rest from waiting.
+ * @param manager Manager handle
+ * @param reader Index of the reader that answered (output, may be NULL)
+ * @param matched_id Matched template ID on that reader (output, only valid on success)
+ * @param confidence Match confidence 0-100 (output, only valid on success)
+ * @param timeout_ms Timeout in milliseconds for each reader (0 for default)
+ * @return FP_XIAOMI_SUCCESS on match, FP_XIAOMI_ERROR_NO_MATCH on no match,
+ *         FP_XIAOMI_ERROR_TIMEOUT if no finger arrived, other error codes
+ *         if every reader failed
+ */
+int fp_xiaomi_manager_identify(fp_xiaomi_manager_t *manager, size_t *reader,
+                               uint8_t *matched_id, uint8_t *confidence, uint32_t timeout_ms);
+
 /* Template management */
 
 /**
  * List stored templates
+ *
+ * Answered from memory while the driver reports the sensor's templates
+ * unchanged since the last list; only a change costs a sensor round trip.
  * @param device Device handle
  * @param template_ids Array to store template IDs (output)
  * @param count Size of array on input, number of templates found on output
@@ -322,19 +837,68 @@ int fp_xiaomi_clear_templates(fp_xiaomi_device_t *device);
  */
 void fp_xiaomi_free_template(fp_xiaomi_template_t *template);
 
+/* Batched commands */
+
+/**
+ * Run several sensor commands with a single driver call
+ * @param device Device handle
+ * @param commands Commands to run, in order
+ * @param responses Array of count responses (output)
+ * @param count Number of commands (at most FP_XIAOMI_BATCH_MAX_COMMANDS)
+ * @param stop_on_error Stop at the first command that fails
+ * @param completed Number of commands executed (output, may be NULL)
+ * @return FP_XIAOMI_SUCCESS if every executed command succeeded,
+ *         otherwise the error of the first failing command
+ */
+int fp_xiaomi_submit_batch(fp_xiaomi_device_t *device, const fp_xiaomi_command_t *commands,
+                           fp_xiaomi_response_t *responses, size_t count,
+                           bool stop_on_error, size_t *completed);
+
 /* Event handling */
 
+/*
+ * The library starts no threads for events. Add the descriptor from
+ * fp_xiaomi_get_event_fd() to your poll/epoll loop (it becomes readable
+ * when events are pending) and drain it with fp_xiaomi_next_event()
+ * or fp_xiaomi_dispatch_events().
+ */
+
+/**
+ * Get a descriptor that polls readable while events are pending
+ * @param device Device handle
+ * @return File descriptor owned by the device handle (do not close),
+ *         or error code on failure
+ */
+int fp_xiaomi_get_event_fd(fp_xiaomi_device_t *device);
+
+/**
+ * Fetch the next pending event without blocking
+ * @param device Device handle
+ * @param event Event (output)
+ * @return FP_XIAOMI_SUCCESS if an event was returned,
+ *         FP_XIAOMI_ERROR_WOULD_BLOCK if none is pending, error code on failure
+ */
+int fp_xiaomi_next_event(fp_xiaomi_device_t *device, fp_xiaomi_event_t *event);
+
 /**
  * Set event callback function
  * @param device Device handle
  * @param callback Callback function (NULL to disable)
  * @param user_data User data passed to callback
  * @return FP_XIAOMI_SUCCESS on success, error code on failure
+ * @note The callback runs inside fp_xiaomi_dispatch_events()
  */
 int fp_xiaomi_set_event_callback(fp_xiaomi_device_t *device,
                                 fp_xiaomi_event_callback_t callback,
                                 void *user_data);
 
+/**
+ * Drain pending events into the event callback
+ * @param device Device handle
+ * @return Number of events delivered, or error code on failure
+ */
+int fp_xiaomi_dispatch_events(fp_xiaomi_device_t *device);
+
 /* Utility functions */
 
 /**
@@ -373,6 +937,11 @@ const char *fp_xiaomi_get_error_string(int error_code);
 #define FP_XIAOMI_QUALITY_HIGH      75
 #define FP_XIAOMI_QUALITY_MAX       100
 
+/**
+ * Default host-side match score threshold
+ */
+#define FP_XIAOMI_MATCH_THRESHOLD   40
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,757 @@
+/**
+ * @file libfp_xiaomi_gallery.c
+ * @brief Host-side template gallery for libfp_xiaomi
+ * @author Project contributors
+ * @version 1.0.0
+ *
+ * Keeps host-stored templates in a structure-of-arrays layout: IDs,
+ * type, quality, size and arena offset are parallel arrays, and all
+ * template bytes are packed into one aligned arena. A 1:N scan then
+ * walks the ID/size arrays and the arena linearly instead of chasing
+ * one heap pointer per template.
+ *
+ * A gallery is not internally locked. Concurrent matching is safe as
+ * long as no thread modifies the gallery at the same time.
+ *
+ * Galleries persist to a single file laid out exactly like the
+ * in-memory arrays (see struct gallery_file_header), so
+ * fp_xiaomi_gallery_open() maps it and matches against it in place
+ * instead of reading and parsing each template.
+ *
+ * @copyright GPL v2 License
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libfp_xiaomi.h"
+#include "libfp_xiaomi_private.h"
+
+#define GALLERY_DEFAULT_CAPACITY 64
+
+/*
+ * Gallery file layout (host byte order; a byte-swapped magic means the
+ * file came from the other endianness and is rejected):
+ *
+ *   header | ids[count] | types[count] | qualities[count] |
+ *   sizes[count] | offsets[count] | names[count] | arena
+ *
+ * Every section starts on an FP_GALLERY_ALIGN boundary, so a page-aligned
+ * mapping keeps arena templates aligned for the SIMD kernels.
+ */
+#define GALLERY_FILE_MAGIC       0x47585046  /* "FPXG" */
+#define GALLERY_FILE_VERSION     1
+
+struct gallery_file_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t count;
+    uint32_t flags;
+    uint64_t file_size;
+    uint64_t ids_offset;
+    uint64_t types_offset;
+    uint64_t qualities_offset;
+    uint64_t sizes_offset;
+    uint64_t offsets_offset;
+    uint64_t names_offset;
+    uint64_t arena_offset;
+    uint64_t arena_size;
+    uint32_t data_crc;           /* CRC-32 of bytes [header_size, file_size) */
+    uint32_t header_crc;         /* CRC-32 of the header with header_crc = 0 */
+};
+
+/* Arena footprint of a template of the given size */
+static size_t gallery_span(uint32_t size)
+{
+    return (size + FP_GALLERY_ALIGN - 1) & ~(size_t)(FP_GALLERY_ALIGN - 1);
+}
+
+static int gallery_find(const struct fp_xiaomi_gallery *gallery, uint32_t id, size_t *index)
+{
+    size_t i;
+    
+    for (i = 0; i < gallery->count; i++) {
+        if (gallery->ids[i] == id) {
+            *index = i;
+            return 0;
+        }
+    }
+    
+    return -1;
+}
+
+/* Resize every parallel array to hold capacity slots */
+static int gallery_reserve_slots(struct fp_xiaomi_gallery *gallery, size_t capacity)
+{
+    void *p;
+    
+    if (capacity <= gallery->capacity) {
+        return 0;
+    }
+    
+#define GALLERY_GROW(field)                                                  \
+    do {                                                                     \
+        p = realloc(gallery->field, capacity * sizeof(*gallery->field));     \
+        if (!p) {                                                            \
+            return -1;                                                       \
+        }                                                                    \
+        gallery->field = p;                                                  \
+    } while (0)
+    
+    GALLERY_GROW(ids);
+    GALLERY_GROW(types);
+    GALLERY_GROW(qualities);
+    GALLERY_GROW(sizes);
+    GALLERY_GROW(offsets);
+    GALLERY_GROW(names);
+    
+#undef GALLERY_GROW
+    
+    gallery->capacity = capacity;
+    return 0;
+}
+
+/* Grow the arena to at least size bytes, keeping FP_GALLERY_ALIGN alignment */
+static int gallery_reserve_arena(struct fp_xiaomi_gallery *gallery, size_t size)
+{
+    size_t capacity = gallery->arena_capacity ? gallery->arena_capacity : 4096;
+    void *arena;
+    
+    if (size <= gallery->arena_capacity) {
+        return 0;
+    }
+    
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    
+    if (posix_memalign(&arena, FP_GALLERY_ALIGN, capacity) != 0) {
+        return -1;
+    }
+    
+    if (gallery->arena_used) {
+        memcpy(arena, gallery->arena, gallery->arena_used);
+    }
+    free(gallery->arena);
+    
+    gallery->arena = arena;
+    gallery->arena_capacity = capacity;
+    return 0;
+}
+
+static void gallery_release_storage(struct fp_xiaomi_gallery *gallery)
+{
+    if (gallery->map) {
+        munmap(gallery->map, gallery->map_size);
+    } else {
+        free(gallery->ids);
+        free(gallery->types);
+        free(gallery->qualities);
+        free(gallery->sizes);
+        free(gallery->offsets);
+        free(gallery->names);
+        free(gallery->arena);
+    }
+}
+
+/*
+ * Move a file-backed gallery onto the heap so it can be modified. A file
+ * need not keep its arena in index order, so the copy is repacked with
+ * offsets recomputed from the spans, which fp_xiaomi_gallery_remove()
+ * relies on.
+ */
+static int gallery_unshare(struct fp_xiaomi_gallery *gallery)
+{
+    struct fp_xiaomi_gallery copy;
+    size_t count = gallery->count;
+    size_t arena_used = 0;
+    size_t i;
+    
+    if (!gallery->map) {
+        return 0;
+    }
+    
+    for (i = 0; i < count; i++) {
+        arena_used += gallery_span(gallery->sizes[i]);
+    }
+    
+    memset(&copy, 0, sizeof(copy));
+    if (gallery_reserve_slots(&copy, count > GALLERY_DEFAULT_CAPACITY ?
+                                     count * 2 : GALLERY_DEFAULT_CAPACITY) != 0 ||
+        gallery_reserve_arena(&copy, arena_used) != 0) {
+        gallery_release_storage(&copy);
+        return -1;
+    }
+    
+    memcpy(copy.ids, gallery->ids, count * sizeof(*copy.ids));
+    memcpy(copy.types, gallery->types, count * sizeof(*copy.types));
+    memcpy(copy.qualities, gallery->qualities, count * sizeof(*copy.qualities));
+    memcpy(copy.sizes, gallery->sizes, count * sizeof(*copy.sizes));
+    memcpy(copy.names, gallery->names, count * sizeof(*copy.names));
+    for (i = 0; i < count; i++) {
+        /* The file only bounds the template, not its padding */
+        copy.offsets[i] = (uint32_t)copy.arena_used;
+        memcpy(copy.arena + copy.arena_used, gallery->arena + gallery->offsets[i],
+               gallery->sizes[i]);
+        memset(copy.arena + copy.arena_used + gallery->sizes[i], 0,
+               gallery_span(gallery->sizes[i]) - gallery->sizes[i]);
+        copy.arena_used += gallery_span(gallery->sizes[i]);
+    }
+    copy.count = count;
+    
+    gallery_release_storage(gallery);
+    *gallery = copy;
+    return 0;
+}
+
+/**
+ * Create gallery
+ */
+fp_xiaomi_gallery_t *fp_xiaomi_gallery_create(size_t capacity)
+{
+    struct fp_xiaomi_gallery *gallery;
+    
+    gallery = calloc(1, sizeof(*gallery));
+    if (!gallery) {
+        return NULL;
+    }
+    
+    if (capacity == 0) {
+        capacity = GALLERY_DEFAULT_CAPACITY;
+    }
+    
+    if (gallery_reserve_slots(gallery, capacity) != 0 ||
+        gallery_reserve_arena(gallery, capacity * gallery_span(FP_XIAOMI_MAX_TEMPLATE_SIZE / 2)) != 0) {
+        fp_xiaomi_gallery_destroy(gallery);
+        return NULL;
+    }
+    
+    return gallery;
+}
+
+/**
+ * Destroy gallery
+ */
+void fp_xiaomi_gallery_destroy(fp_xiaomi_gallery_t *gallery)
+{
+    if (!gallery) {
+        return;
+    }
+    
+    gallery_release_storage(gallery);
+    free(gallery);
+}
+
+/**
+ * Add template to gallery
+ */
+int fp_xiaomi_gallery_add(fp_xiaomi_gallery_t *gallery, uint32_t id,
+                         const fp_xiaomi_template_t *template)
+{
+    size_t index, span;
+    
+    if (!gallery || !template || !template->data || template->size == 0 ||
+        template->size > FP_XIAOMI_MAX_TEMPLATE_SIZE) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    if (gallery_find(gallery, id, &index) == 0) {
+        return FP_XIAOMI_ERROR_TEMPLATE_EXIST;
+    }
+    
+    if (gallery_unshare(gallery) != 0) {
+        return FP_XIAOMI_ERROR_MEMORY;
+    }
+    
+    span = gallery_span(template->size);
+    if (gallery->arena_used + span > UINT32_MAX) {
+        return FP_XIAOMI_ERROR_STORAGE_FULL;
+    }
+    
+    if ((gallery->count == gallery->capacity &&
+         gallery_reserve_slots(gallery, gallery->capacity * 2) != 0) ||
+        gallery_reserve_arena(gallery, gallery->arena_used + span) != 0) {
+        return FP_XIAOMI_ERROR_MEMORY;
+    }
+    
+    index = gallery->count;
+    gallery->ids[index] = id;
+    gallery->types[index] = (uint8_t)template->type;
+    gallery->qualities[index] = template->quality;
+    gallery->sizes[index] = template->size;
+    gallery->offsets[index] = (uint32_t)gallery->arena_used;
+    memcpy(gallery->names[index], template->name, FP_XIAOMI_MAX_NAME_LEN);
+    gallery->names[index][FP_XIAOMI_MAX_NAME_LEN - 1] = '\0';
+    
+    memcpy(gallery->arena + gallery->arena_used, template->data, template->size);
+    memset(gallery->arena + gallery->arena_used + template->size, 0, span - template->size);
+    
+    gallery->arena_used += span;
+    gallery->count++;
+    
+    return FP_XIAOMI_SUCCESS;
+}
+
+/**
+ * Remove template from gallery, compacting the arena
+ */
+int fp_xiaomi_gallery_remove(fp_xiaomi_gallery_t *gallery, uint32_t id)
+{
+    size_t index, tail, span, start;
+    size_t i;
+    
+    if (!gallery || gallery_find(gallery, id, &index) != 0) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    if (gallery_unshare(gallery) != 0) {
+        return FP_XIAOMI_ERROR_MEMORY;
+    }
+    
+    start = gallery->offsets[index];
+    span = gallery_span(gallery->sizes[index]);
+    
+    /* Slide later template bytes down over the hole */
+    memmove(gallery->arena + start, gallery->arena + start + span,
+            gallery->arena_used - start - span);
+    gallery->arena_used -= span;
+    
+    tail = gallery->count - index - 1;
+    
+#define GALLERY_SHIFT(field)                                                 \
+    memmove(&gallery->field[index], &gallery->field[index + 1],              \
+            tail * sizeof(*gallery->field))
+    
+    GALLERY_SHIFT(ids);
+    GALLERY_SHIFT(types);
+    GALLERY_SHIFT(qualities);
+    GALLERY_SHIFT(sizes);
+    GALLERY_SHIFT(offsets);
+    GALLERY_SHIFT(names);
+    
+#undef GALLERY_SHIFT
+    
+    gallery->count--;
+    for (i = index; i < gallery->count; i++) {
+        gallery->offsets[i] -= span;
+    }
+    
+    return FP_XIAOMI_SUCCESS;
+}
+
+/**
+ * Get gallery size
+ */
+size_t fp_xiaomi_gallery_count(const fp_xiaomi_gallery_t *gallery)
+{
+    return gallery ? gallery->count : 0;
+}
+
+/**
+ * List gallery template IDs
+ */
+int fp_xiaomi_gallery_ids(const fp_xiaomi_gallery_t *gallery, uint32_t *ids, size_t *count)
+{
+    size_t n;
+    
+    if (!gallery || !ids || !count) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    n = gallery->count < *count ? gallery->count : *count;
+    memcpy(ids, gallery->ids, n * sizeof(*ids));
+    *count = n;
+    
+    return FP_XIAOMI_SUCCESS;
+}
+
+/**
+ * Look up template by ID
+ */
+int fp_xiaomi_gallery_get(const fp_xiaomi_gallery_t *gallery, uint32_t id,
+                         fp_xiaomi_template_t *template)
+{
+    size_t index;
+    
+    if (!gallery || !template || gallery_find(gallery, id, &index) != 0) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    memset(template, 0, sizeof(*template));
+    template->type = gallery->types[index];
+    template->quality = gallery->qualities[index];
+    template->size = gallery->sizes[index];
+    memcpy(template->name, gallery->names[index], FP_XIAOMI_MAX_NAME_LEN);
+    template->data = gallery->arena + gallery->offsets[index];
+    
+    return FP_XIAOMI_SUCCESS;
+}
+
+size_t fp_xiaomi_gallery_scan(const struct fp_xiaomi_gallery *gallery,
+                              const fp_xiaomi_template_t *probe,
+                              size_t begin, size_t end,
+                              uint32_t stop_distance, uint32_t *distance)
+{
+    uint32_t best_distance = UINT32_MAX;
+    uint32_t d;
+    uint8_t type = (uint8_t)probe->type;
+    size_t best = end;
+    size_t i;
+    
+    for (i = begin; i < end; i++) {
+        if (gallery->sizes[i] != probe->size || gallery->types[i] != type) {
+            continue;
+        }
+        d = fp_xiaomi_hamming(probe->data, gallery->arena + gallery->offsets[i], probe->size);
+        if (d < best_distance) {
+            best_distance = d;
+            best = i;
+            if (d <= stop_distance) {
+                break;
+            }
+        }
+    }
+    
+    *distance = best_distance;
+    return best;
+}
+
+/**
+ * 1:N search over the gallery, stopping at the first acceptable match
+ */
+int fp_xiaomi_gallery_match(const fp_xiaomi_gallery_t *gallery,
+                           const fp_xiaomi_template_t *probe, uint8_t threshold,
+                           uint32_t *matched_id, uint8_t *confidence)
+{
+    uint32_t distance;
+    uint8_t score;
+    size_t best;
+    
+    if (!gallery || !probe || !probe->data || !probe->size || !matched_id || !confidence) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    if (threshold == 0) {
+        threshold = FP_XIAOMI_MATCH_THRESHOLD;
+    }
+    
+    best = fp_xiaomi_pool_scan(gallery, probe,
+                               fp_xiaomi_hamming_limit(threshold, probe->size), &distance);
+    if (best == gallery->count) {
+        return FP_XIAOMI_ERROR_NO_MATCH;
+    }
+    
+    score = fp_xiaomi_hamming_score(distance, probe->size);
+    if (score < threshold) {
+        return FP_XIAOMI_ERROR_NO_MATCH;
+    }
+    
+    *matched_id = gallery->ids[best];
+    *confidence = score;
+    return FP_XIAOMI_SUCCESS;
+}
+
+/* CRC-32 (IEEE 802.3, reflected) */
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+    uint32_t c;
+    int i, k;
+    
+    for (i = 0; i < 256; i++) {
+        c = (uint32_t)i;
+        for (k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t gallery_crc32(const uint8_t *data, size_t len)
+{
+    uint32_t crc = 0xFFFFFFFFu;
+    size_t i;
+    
+    pthread_once(&crc_once, crc_init);
+    for (i = 0; i < len; i++) {
+        crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static uint32_t header_crc32(const struct gallery_file_header *header)
+{
+    struct gallery_file_header copy = *header;
+    
+    copy.header_crc = 0;
+    return gallery_crc32((const uint8_t *)&copy, sizeof(copy));
+}
+
+static uint64_t gallery_align(uint64_t offset)
+{
+    return (offset + FP_GALLERY_ALIGN - 1) & ~(uint64_t)(FP_GALLERY_ALIGN - 1);
+}
+
+/* Lay out sections after the header; returns the file size */
+static uint64_t gallery_layout(struct gallery_file_header *header, size_t count,
+                               size_t arena_size)
+{
+    uint64_t offset = gallery_align(sizeof(*header));
+    
+    header->ids_offset = offset;
+    offset = gallery_align(offset + count * sizeof(uint32_t));
+    header->types_offset = offset;
+    offset = gallery_align(offset + count * sizeof(uint8_t));
+    header->qualities_offset = offset;
+    offset = gallery_align(offset + count * sizeof(uint8_t));
+    header->sizes_offset = offset;
+    offset = gallery_align(offset + count * sizeof(uint32_t));
+    header->offsets_offset = offset;
+    offset = gallery_align(offset + count * sizeof(uint32_t));
+    header->names_offset = offset;
+    offset = gallery_align(offset + count * FP_XIAOMI_MAX_NAME_LEN);
+    header->arena_offset = offset;
+    header->arena_size = arena_size;
+    
+    return offset + arena_size;
+}
+
+static int gallery_io_error(int err)
+{
+    switch (err) {
+    case EACCES:
+    case EPERM:
+    case EROFS:
+        return FP_XIAOMI_ERROR_PERMISSION;
+    case ENOSPC:
+    case EDQUOT:
+        return FP_XIAOMI_ERROR_STORAGE_FULL;
+    case ENOMEM:
+        return FP_XIAOMI_ERROR_MEMORY;
+    default:
+        return FP_XIAOMI_ERROR_DEVICE;
+    }
+}
+
+/**
+ * Write gallery to a file
+ *
+ * The file is written next to its final name and renamed into place,
+ * so readers never map a half-written gallery.
+ */
+int fp_xiaomi_gallery_save(const fp_xiaomi_gallery_t *gallery, const char *path)
+{
+    struct gallery_file_header header;
+    uint8_t *image;
+    char *tmp_path;
+    size_t count, done;
+    uint64_t file_size;
+    ssize_t n;
+    int ret = FP_XIAOMI_SUCCESS;
+    int fd;
+    
+    if (!gallery || !path) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    count = gallery->count;
+    memset(&header, 0, sizeof(header));
+    header.magic = GALLERY_FILE_MAGIC;
+    header.version = GALLERY_FILE_VERSION;
+    header.header_size = sizeof(header);
+    header.count = (uint32_t)count;
+    file_size = gallery_layout(&header, count, gallery->arena_used);
+    header.file_size = file_size;
+    
+    image = calloc(1, file_size);
+    if (!image) {
+        return FP_XIAOMI_ERROR_MEMORY;
+    }
+    
+    memcpy(image + header.ids_offset, gallery->ids, count * sizeof(uint32_t));
+    memcpy(image + header.types_offset, gallery->types, count);
+    memcpy(image + header.qualities_offset, gallery->qualities, count);
+    memcpy(image + header.sizes_offset, gallery->sizes, count * sizeof(uint32_t));
+    memcpy(image + header.offsets_offset, gallery->offsets, count * sizeof(uint32_t));
+    memcpy(image + header.names_offset, gallery->names, count * FP_XIAOMI_MAX_NAME_LEN);
+    memcpy(image + header.arena_offset, gallery->arena, gallery->arena_used);
+    
+    header.data_crc = gallery_crc32(image + sizeof(header), file_size - sizeof(header));
+    header.header_crc = header_crc32(&header);
+    memcpy(image, &header, sizeof(header));
+    
+    tmp_path = malloc(strlen(path) + sizeof(".tmp"));
+    if (!tmp_path) {
+        free(image);
+        return FP_XIAOMI_ERROR_MEMORY;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+    
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        ret = gallery_io_error(errno);
+        goto out;
+    }
+    
+    for (done = 0; done < file_size; done += n) {
+        n = write(fd, image + done, file_size - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            ret = gallery_io_error(errno);
+            break;
+        }
+    }
+    
+    if (ret == FP_XIAOMI_SUCCESS && fsync(fd) != 0) {
+        ret = gallery_io_error(errno);
+    }
+    close(fd);
+    
+    if (ret == FP_XIAOMI_SUCCESS && rename(tmp_path, path) != 0) {
+        ret = gallery_io_error(errno);
+    }
+    if (ret != FP_XIAOMI_SUCCESS) {
+        unlink(tmp_path);
+    }
+    
+out:
+    free(tmp_path);
+    free(image);
+    return ret;
+}
+
+/* Check that count elements of elem_size at offset lie inside the file */
+static bool gallery_section_ok(const struct gallery_file_header *header,
+                               uint64_t offset, uint64_t elem_size)
+{
+    return offset % FP_GALLERY_ALIGN == 0 && offset >= header->header_size &&
+           offset <= header->file_size &&
+           header->count * elem_size <= header->file_size - offset;
+}
+
+/**
+ * Map a gallery file
+ *
+ * Validates the header and the per-template bounds, which only touches
+ * the small index arrays. FP_XIAOMI_GALLERY_VERIFY additionally checks
+ * the data CRC, which reads the whole file.
+ */
+fp_xiaomi_gallery_t *fp_xiaomi_gallery_open(const char *path, uint32_t flags)
+{
+    const struct gallery_file_header *header;
+    struct fp_xiaomi_gallery *gallery;
+    struct stat st;
+    uint8_t *map;
+    uint32_t i;
+    int fd;
+    
+    if (!path) {
+        errno = EINVAL;
+        return NULL;
+    }
+    
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+    
+    if ((size_t)st.st_size < sizeof(*header)) {
+        close(fd);
+        errno = EBADMSG;
+        return NULL;
+    }
+    
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    
+    header = (const struct gallery_file_header *)map;
+    if (header->magic != GALLERY_FILE_MAGIC || header->version != GALLERY_FILE_VERSION ||
+        header->header_size != sizeof(*header) || header->file_size != (uint64_t)st.st_size ||
+        header->header_crc != header_crc32(header) ||
+        !gallery_section_ok(header, header->ids_offset, sizeof(uint32_t)) ||
+        !gallery_section_ok(header, header->types_offset, sizeof(uint8_t)) ||
+        !gallery_section_ok(header, header->qualities_offset, sizeof(uint8_t)) ||
+        !gallery_section_ok(header, header->sizes_offset, sizeof(uint32_t)) ||
+        !gallery_section_ok(header, header->offsets_offset, sizeof(uint32_t)) ||
+        !gallery_section_ok(header, header->names_offset, FP_XIAOMI_MAX_NAME_LEN) ||
+        header->arena_offset % FP_GALLERY_ALIGN != 0 ||
+        header->arena_offset > header->file_size ||
+        header->arena_size > header->file_size - header->arena_offset) {
+        goto corrupt;
+    }
+    
+    gallery = calloc(1, sizeof(*gallery));
+    if (!gallery) {
+        munmap(map, st.st_size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    gallery->map = map;
+    gallery->map_size = st.st_size;
+    gallery->count = header->count;
+    gallery->capacity = header->count;
+    gallery->ids = (uint32_t *)(map + header->ids_offset);
+    gallery->types = map + header->types_offset;
+    gallery->qualities = map + header->qualities_offset;
+    gallery->sizes = (uint32_t *)(map + header->sizes_offset);
+    gallery->offsets = (uint32_t *)(map + header->offsets_offset);
+    gallery->names = (char (*)[FP_XIAOMI_MAX_NAME_LEN])(map + header->names_offset);
+    gallery->arena = map + header->arena_offset;
+    gallery->arena_used = header->arena_size;
+    gallery->arena_capacity = header->arena_size;
+    
+    /* The scan trusts offsets and sizes, so bound every template */
+    for (i = 0; i < header->count; i++) {
+        if (gallery->sizes[i] > FP_XIAOMI_MAX_TEMPLATE_SIZE ||
+            gallery->offsets[i] > header->arena_size ||
+            gallery->sizes[i] > header->arena_size - gallery->offsets[i]) {
+            free(gallery);
+            goto corrupt;
+        }
+    }
+    
+    if ((flags & FP_XIAOMI_GALLERY_VERIFY) &&
+        header->data_crc != gallery_crc32(map + sizeof(*header),
+                                          header->file_size - sizeof(*header))) {
+        free(gallery);
+        goto corrupt;
+    }
+    
+    return gallery;
+    
+corrupt:
+    munmap(map, st.st_size);
+    errno = EBADMSG;
+    return NULL;
+}
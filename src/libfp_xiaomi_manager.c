@@ -0,0 +1,385 @@
+/**
+ * @file libfp_xiaomi_manager.c
+ * @brief Multi-reader device manager for libfp_xiaomi
+ * @author Project contributors
+ * @version 1.0.0
+ *
+ * Finds every /dev/fp_xiaomi<N> node and opens them on one thread each.
+ * Opening a node waits for the driver to finish bringing its sensor up,
+ * so a station with eight readers starts in the time of the slowest one
+ * instead of the sum of all of them.
+ *
+ * An identify request goes to all readers at once. The first reader a
+ * finger lands on answers (match or no match), and the others are
+ * cancelled with fp_xiaomi_cancel().
+ *
+ * @copyright GPL v2 License
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libfp_xiaomi.h"
+
+#define MANAGER_DEV_DIR         "/dev"
+#define MANAGER_DEV_PREFIX      "fp_xiaomi"
+#define MANAGER_PATH_LEN        256
+#define MANAGER_RECANCEL_MS     10      /* Retry period for readers cancelled too early */
+
+struct fp_xiaomi_manager {
+    size_t count;
+    fp_xiaomi_device_t *devices[FP_XIAOMI_MAX_READERS];
+    char paths[FP_XIAOMI_MAX_READERS][MANAGER_PATH_LEN];
+};
+
+struct open_task {
+    pthread_t thread;
+    bool started;
+    char path[MANAGER_PATH_LEN];
+    unsigned long minor;
+    fp_xiaomi_device_t *device;
+    int err;
+};
+
+/* Shared by the readers taking part in one fp_xiaomi_manager_identify() */
+struct identify_race {
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    fp_xiaomi_manager_t *manager;
+    uint32_t timeout_ms;
+    size_t running;
+    size_t failed;
+    size_t winner;               /* manager->count until a reader answers */
+    int result;
+    int failure;
+    uint8_t matched_id;
+    uint8_t confidence;
+};
+
+struct identify_task {
+    pthread_t thread;
+    bool started;
+    struct identify_race *race;
+    size_t index;
+};
+
+/* NN in fp_xiaomiNN, or -1 if name is not a reader node */
+static long reader_minor(const char *name)
+{
+    const char *digits = name + strlen(MANAGER_DEV_PREFIX);
+    char *end;
+    long minor;
+    
+    if (strncmp(name, MANAGER_DEV_PREFIX, strlen(MANAGER_DEV_PREFIX)) != 0 ||
+        strlen(name) >= FP_XIAOMI_MAX_NAME_LEN || *digits < '0' || *digits > '9') {
+        return -1;
+    }
+    
+    minor = strtol(digits, &end, 10);
+    return *end ? -1 : minor;
+}
+
+static int compare_minor(const void *a, const void *b)
+{
+    const struct open_task *x = a;
+    const struct open_task *y = b;
+    
+    return (x->minor > y->minor) - (x->minor < y->minor);
+}
+
+static void *open_worker(void *arg)
+{
+    struct open_task *task = arg;
+    
+    task->device = fp_xiaomi_open_device(task->path);
+    task->err = task->device ? 0 : errno;
+    return NULL;
+}
+
+/* Reader nodes in minor order; returns how many were found */
+static size_t find_readers(struct open_task *tasks)
+{
+    struct dirent *entry;
+    size_t count = 0;
+    long minor;
+    DIR *dir;
+    
+    dir = opendir(MANAGER_DEV_DIR);
+    if (!dir) {
+        return 0;
+    }
+    
+    while ((entry = readdir(dir)) != NULL && count < FP_XIAOMI_MAX_READERS) {
+        minor = reader_minor(entry->d_name);
+        if (minor < 0) {
+            continue;
+        }
+        memset(&tasks[count], 0, sizeof(tasks[count]));
+        snprintf(tasks[count].path, sizeof(tasks[count].path), "%s/%.*s",
+                 MANAGER_DEV_DIR, FP_XIAOMI_MAX_NAME_LEN, entry->d_name);
+        tasks[count].minor = (unsigned long)minor;
+        count++;
+    }
+    
+    closedir(dir);
+    qsort(tasks, count, sizeof(tasks[0]), compare_minor);
+    return count;
+}
+
+/**
+ * Open every reader
+ */
+fp_xiaomi_manager_t *fp_xiaomi_manager_open(void)
+{
+    struct open_task tasks[FP_XIAOMI_MAX_READERS];
+    fp_xiaomi_manager_t *manager;
+    size_t found, i;
+    int err = ENODEV;
+    
+    found = find_readers(tasks);
+    if (found == 0) {
+        errno = ENODEV;
+        return NULL;
+    }
+    
+    manager = calloc(1, sizeof(*manager));
+    if (!manager) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    /* The calling thread takes the first reader itself */
+    for (i = 1; i < found; i++) {
+        tasks[i].started = pthread_create(&tasks[i].thread, NULL, open_worker, &tasks[i]) == 0;
+    }
+    open_worker(&tasks[0]);
+    
+    for (i = 0; i < found; i++) {
+        if (i > 0) {
+            if (tasks[i].started) {
+                pthread_join(tasks[i].thread, NULL);
+            } else {
+                open_worker(&tasks[i]);
+            }
+        }
+    
+        if (!tasks[i].device) {
+            err = tasks[i].err;
+            continue;
+        }
+        manager->devices[manager->count] = tasks[i].device;
+        memcpy(manager->paths[manager->count], tasks[i].path, MANAGER_PATH_LEN);
+        manager->count++;
+    }
+    
+    if (manager->count == 0) {
+        free(manager);
+        errno = err;
+        return NULL;
+    }
+    
+    return manager;
+}
+
+/**
+ * Close every reader
+ */
+void fp_xiaomi_manager_close(fp_xiaomi_manager_t *manager)
+{
+    size_t i;
+    
+    if (!manager) {
+        return;
+    }
+    
+    for (i = 0; i < manager->count; i++) {
+        fp_xiaomi_close_device(manager->devices[i]);
+    }
+    free(manager);
+}
+
+/**
+ * Number of open readers
+ */
+size_t fp_xiaomi_manager_count(const fp_xiaomi_manager_t *manager)
+{
+    return manager ? manager->count : 0;
+}
+
+/**
+ * Reader handle by index
+ */
+fp_xiaomi_device_t *fp_xiaomi_manager_device(const fp_xiaomi_manager_t *manager, size_t index)
+{
+    if (!manager || index >= manager->count) {
+        errno = EINVAL;
+        return NULL;
+    }
+    
+    return manager->devices[index];
+}
+
+/**
+ * Device node of a reader
+ */
+const char *fp_xiaomi_manager_path(const fp_xiaomi_manager_t *manager, size_t index)
+{
+    if (!manager || index >= manager->count) {
+        errno = EINVAL;
+        return NULL;
+    }
+    
+    return manager->paths[index];
+}
+
+/* A reader that returns one of these never saw a finger */
+static bool reader_idle(int result)
+{
+    return result == FP_XIAOMI_ERROR_TIMEOUT || result == FP_XIAOMI_ERROR_NO_FINGER ||
+           result == FP_XIAOMI_ERROR_CANCELLED;
+}
+
+/* Stop the readers that lost; caller holds race->lock */
+static void cancel_losers(struct identify_race *race)
+{
+    size_t i;
+    
+    for (i = 0; i < race->manager->count; i++) {
+        if (i != race->winner) {
+            fp_xiaomi_cancel(race->manager->devices[i]);
+        }
+    }
+}
+
+static void *identify_worker(void *arg)
+{
+    struct identify_task *task = arg;
+    struct identify_race *race = task->race;
+    uint8_t matched_id = 0;
+    uint8_t confidence = 0;
+    int ret;
+    
+    ret = fp_xiaomi_identify(race->manager->devices[task->index], &matched_id, &confidence,
+                             race->timeout_ms);
+    
+    pthread_mutex_lock(&race->lock);
+    if (race->winner == race->manager->count && !reader_idle(ret)) {
+        if (ret == FP_XIAOMI_SUCCESS || ret == FP_XIAOMI_ERROR_NO_MATCH ||
+            ret == FP_XIAOMI_ERROR_BAD_IMAGE) {
+            race->winner = task->index;
+            race->result = ret;
+            race->matched_id = matched_id;
+            race->confidence = confidence;
+            cancel_losers(race);
+        } else {
+            /* A broken reader does not end the wait on the others */
+            race->failed++;
+            race->failure = ret;
+        }
+    }
+    race->running--;
+    pthread_cond_signal(&race->finished);
+    pthread_mutex_unlock(&race->lock);
+    
+    return NULL;
+}
+
+/**
+ * Identify on whichever reader a finger lands on first
+ */
+int fp_xiaomi_manager_identify(fp_xiaomi_manager_t *manager, size_t *reader,
+                               uint8_t *matched_id, uint8_t *confidence, uint32_t timeout_ms)
+{
+    struct identify_task tasks[FP_XIAOMI_MAX_READERS];
+    struct identify_race race;
+    struct timespec deadline;
+    size_t i;
+    int ret;
+    
+    if (!manager || manager->count == 0) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    memset(&race, 0, sizeof(race));
+    if (pthread_mutex_init(&race.lock, NULL) != 0) {
+        return FP_XIAOMI_ERROR_MEMORY;
+    }
+    if (pthread_cond_init(&race.finished, NULL) != 0) {
+        pthread_mutex_destroy(&race.lock);
+        return FP_XIAOMI_ERROR_MEMORY;
+    }
+    race.manager = manager;
+    race.timeout_ms = timeout_ms;
+    race.winner = manager->count;
+    race.result = FP_XIAOMI_ERROR_TIMEOUT;
+    
+    pthread_mutex_lock(&race.lock);
+    for (i = 0; i < manager->count; i++) {
+        tasks[i].race = &race;
+        tasks[i].index = i;
+        tasks[i].started = pthread_create(&tasks[i].thread, NULL, identify_worker,
+                                          &tasks[i]) == 0;
+        if (tasks[i].started) {
+            race.running++;
+        } else {
+            race.failed++;
+            race.failure = FP_XIAOMI_ERROR_MEMORY;
+        }
+    }
+    
+    /*
+     * A cancel only stops a call that has reached the driver, so keep
+     * stopping the losers until the last of them has returned.
+     */
+    while (race.running > 0) {
+        if (race.winner == manager->count) {
+            pthread_cond_wait(&race.finished, &race.lock);
+            continue;
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += MANAGER_RECANCEL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (pthread_cond_timedwait(&race.finished, &race.lock, &deadline) == ETIMEDOUT) {
+            cancel_losers(&race);
+        }
+    }
+    pthread_mutex_unlock(&race.lock);
+    
+    for (i = 0; i < manager->count; i++) {
+        if (tasks[i].started) {
+            pthread_join(tasks[i].thread, NULL);
+        }
+    }
+    
+    ret = race.result;
+    if (race.winner == manager->count && race.failed == manager->count) {
+        ret = race.failure;
+    }
+    
+    if (race.winner < manager->count) {
+        if (reader) {
+            *reader = race.winner;
+        }
+        if (matched_id) {
+            *matched_id = race.matched_id;
+        }
+        if (confidence) {
+            *confidence = race.confidence;
+        }
+    }
+    
+    pthread_cond_destroy(&race.finished);
+    pthread_mutex_destroy(&race.lock);
+    return ret;
+}
@@ -0,0 +1,249 @@
+/**
+ * @file libfp_xiaomi_match.c
+ * @brief Host-side template matching for libfp_xiaomi
+ * @author Project contributors
+ * @version 1.0.0
+ *
+ * Scores probe templates against templates kept on the host, so 1:N
+ * identification is not limited by the sensor's template storage.
+ * Templates are compared as fixed-length bit vectors: the score falls
+ * linearly from 100 (identical) to 0 at the Hamming distance expected
+ * between unrelated templates (half the bits). The distance kernel is
+ * picked once at runtime: AVX2 or NEON where available, scalar
+ * otherwise.
+ *
+ * @copyright GPL v2 License
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FP_MATCH_HAVE_AVX2 1
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define FP_MATCH_HAVE_NEON 1
+#endif
+
+#include "libfp_xiaomi.h"
+#include "libfp_xiaomi_private.h"
+
+typedef uint32_t (*hamming_fn)(const uint8_t *a, const uint8_t *b, size_t len);
+
+static hamming_fn hamming_impl;
+static const char *hamming_name;
+static pthread_once_t hamming_once = PTHREAD_ONCE_INIT;
+
+/* Portable kernel: 64 bits at a time */
+static uint32_t hamming_scalar(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    uint32_t distance = 0;
+    uint64_t x, y;
+    size_t i = 0;
+    
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        distance += __builtin_popcountll(x ^ y);
+    }
+    
+    for (; i < len; i++) {
+        distance += __builtin_popcount(a[i] ^ b[i]);
+    }
+    
+    return distance;
+}
+
+#ifdef FP_MATCH_HAVE_AVX2
+/* Nibble lookup popcount, summed per 64-bit lane with vpsadbw */
+__attribute__((target("avx2")))
+static uint32_t hamming_avx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    uint64_t lanes[4];
+    size_t i = 0;
+    
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                     _mm256_loadu_si256((const __m256i *)(b + i)));
+        __m256i lo = _mm256_and_si256(x, low_mask);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), low_mask);
+        __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo),
+                                      _mm256_shuffle_epi8(lut, hi));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, zero));
+    }
+    
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    
+    return (uint32_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3]) +
+           hamming_scalar(a + i, b + i, len - i);
+}
+#endif
+
+#ifdef FP_MATCH_HAVE_NEON
+static uint32_t hamming_neon(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    uint32x4_t acc = vdupq_n_u32(0);
+    uint64x2_t sum;
+    size_t i = 0;
+    
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t cnt = vcntq_u8(veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+        acc = vpadalq_u16(acc, vpaddlq_u8(cnt));
+    }
+    
+    sum = vpaddlq_u32(acc);
+    
+    return (uint32_t)(vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1)) +
+           hamming_scalar(a + i, b + i, len - i);
+}
+#endif
+
+static void hamming_select(void)
+{
+    hamming_impl = hamming_scalar;
+    hamming_name = "scalar";
+    
+#ifdef FP_MATCH_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        hamming_impl = hamming_avx2;
+        hamming_name = "avx2";
+    }
+#endif
+    
+#ifdef FP_MATCH_HAVE_NEON
+    hamming_impl = hamming_neon;
+    hamming_name = "neon";
+#endif
+}
+
+uint32_t fp_xiaomi_hamming(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    pthread_once(&hamming_once, hamming_select);
+    return hamming_impl(a, b, len);
+}
+
+uint8_t fp_xiaomi_hamming_score(uint32_t distance, size_t len)
+{
+    uint64_t bits = (uint64_t)len * 8;
+    uint64_t penalty;
+    
+    if (bits == 0) {
+        return 0;
+    }
+    
+    /* 100 at distance 0, 0 at distance bits / 2 and beyond */
+    penalty = (200 * (uint64_t)distance + bits - 1) / bits;
+    
+    return penalty >= 100 ? 0 : (uint8_t)(100 - penalty);
+}
+
+uint32_t fp_xiaomi_hamming_limit(uint8_t threshold, size_t len)
+{
+    if (threshold > 100) {
+        threshold = 100;
+    }
+    
+    /* Inverse of fp_xiaomi_hamming_score(): ceil(200 * d / bits) <= 100 - threshold */
+    return (uint32_t)(((uint64_t)(100 - threshold) * len * 8) / 200);
+}
+
+/* Templates are comparable when their encoding and length agree */
+static bool templates_comparable(const fp_xiaomi_template_t *probe,
+                                 const fp_xiaomi_template_t *candidate)
+{
+    return candidate->data && candidate->size == probe->size &&
+           candidate->type == probe->type;
+}
+
+/**
+ * Score one template pair
+ */
+int fp_xiaomi_match_score(const fp_xiaomi_template_t *probe,
+                         const fp_xiaomi_template_t *candidate, uint8_t *score)
+{
+    if (!probe || !probe->data || !probe->size || !candidate || !score) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    *score = 0;
+    if (templates_comparable(probe, candidate)) {
+        *score = fp_xiaomi_hamming_score(fp_xiaomi_hamming(probe->data, candidate->data,
+                                                           probe->size),
+                                         probe->size);
+    }
+    
+    return FP_XIAOMI_SUCCESS;
+}
+
+/**
+ * 1:N search over an array of templates
+ */
+int fp_xiaomi_match_best(const fp_xiaomi_template_t *probe,
+                        const fp_xiaomi_template_t *templates, size_t count,
+                        uint8_t threshold, size_t *index, uint8_t *confidence)
+{
+    uint32_t best_distance = UINT32_MAX;
+    uint32_t distance;
+    size_t best = 0;
+    uint8_t score;
+    size_t i;
+    
+    if (!probe || !probe->data || !probe->size || (!templates && count) ||
+        !index || !confidence) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    if (threshold == 0) {
+        threshold = FP_XIAOMI_MATCH_THRESHOLD;
+    }
+    
+    pthread_once(&hamming_once, hamming_select);
+    
+    for (i = 0; i < count; i++) {
+        if (!templates_comparable(probe, &templates[i])) {
+            continue;
+        }
+        distance = hamming_impl(probe->data, templates[i].data, probe->size);
+        if (distance < best_distance) {
+            best_distance = distance;
+            best = i;
+            if (distance == 0) {
+                break;
+            }
+        }
+    }
+    
+    if (best_distance == UINT32_MAX) {
+        return FP_XIAOMI_ERROR_NO_MATCH;
+    }
+    
+    score = fp_xiaomi_hamming_score(best_distance, probe->size);
+    if (score < threshold) {
+        return FP_XIAOMI_ERROR_NO_MATCH;
+    }
+    
+    *index = best;
+    *confidence = score;
+    return FP_XIAOMI_SUCCESS;
+}
+
+/**
+ * Report the selected matching kernel
+ */
+const char *fp_xiaomi_match_backend(void)
+{
+    pthread_once(&hamming_once, hamming_select);
+    return hamming_name;
+}
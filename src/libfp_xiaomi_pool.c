@@ -0,0 +1,343 @@
+/**
+ * @file libfp_xiaomi_pool.c
+ * @brief Parallel gallery scanning for libfp_xiaomi
+ * @author Project contributors
+ * @version 1.0.0
+ *
+ * A persistent pool of matcher threads, started on first use. A scan
+ * splits the gallery into fixed-size chunks dealt out evenly to one
+ * queue per participant (the workers plus the calling thread). Each
+ * participant drains its own queue from the front; when it runs dry it
+ * steals the back half of another queue, so a slow shard (cache
+ * misses, a preempted core) does not hold up the whole scan. The first
+ * participant to find a template within the accept distance raises a
+ * stop flag and everyone returns.
+ *
+ * @copyright GPL v2 License
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libfp_xiaomi.h"
+#include "libfp_xiaomi_private.h"
+
+#define POOL_MAX_THREADS      64
+#define POOL_CHUNK_TEMPLATES  256
+#define POOL_MIN_TEMPLATES    (4 * POOL_CHUNK_TEMPLATES)
+#define POOL_CACHE_LINE       64
+
+#define POOL_PACK(begin, end) ((uint64_t)(begin) | ((uint64_t)(end) << 32))
+#define POOL_BEGIN(range)     ((uint32_t)(range))
+#define POOL_END(range)       ((uint32_t)((range) >> 32))
+
+/* Chunk range [begin, end) owned by one participant, packed for CAS */
+struct pool_queue {
+    uint64_t range;
+} __attribute__((aligned(POOL_CACHE_LINE)));
+
+struct pool_job {
+    const struct fp_xiaomi_gallery *gallery;
+    const fp_xiaomi_template_t *probe;
+    uint32_t stop_distance;
+    size_t count;
+    int participants;
+    int stop;
+    uint64_t best;               /* distance << 32 | slot, lowest wins */
+    struct pool_queue queues[POOL_MAX_THREADS + 1];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    pthread_mutex_t submit_lock;
+    pthread_t threads[POOL_MAX_THREADS];
+    size_t requested;
+    int nthreads;
+    bool started;
+    bool shutdown;
+    uint64_t generation;
+    uint64_t start_generation;
+    int active;
+    struct pool_job *job;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+    .submit_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Owner side: take the next chunk from the front of our own queue */
+static bool pool_pop(struct pool_queue *queue, uint32_t *chunk)
+{
+    uint64_t range = __atomic_load_n(&queue->range, __ATOMIC_ACQUIRE);
+    
+    while (POOL_BEGIN(range) < POOL_END(range)) {
+        if (__atomic_compare_exchange_n(&queue->range, &range,
+                                        POOL_PACK(POOL_BEGIN(range) + 1, POOL_END(range)),
+                                        false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *chunk = POOL_BEGIN(range);
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+/* Thief side: move the back half of a victim's queue into our own */
+static bool pool_steal(struct pool_job *job, int self, uint32_t *chunk)
+{
+    struct pool_queue *victim;
+    uint64_t range;
+    uint32_t begin, end, take;
+    int i;
+    
+    for (i = 1; i < job->participants; i++) {
+        victim = &job->queues[(self + i) % job->participants];
+        range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+    
+        while (POOL_BEGIN(range) < POOL_END(range)) {
+            begin = POOL_BEGIN(range);
+            end = POOL_END(range);
+            take = (end - begin + 1) / 2;
+    
+            if (__atomic_compare_exchange_n(&victim->range, &range,
+                                            POOL_PACK(begin, end - take),
+                                            false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                /* Our queue is empty, so only thieves' failing CASes race this */
+                __atomic_store_n(&job->queues[self].range,
+                                 POOL_PACK(end - take + 1, end), __ATOMIC_RELEASE);
+                *chunk = end - take;
+                return true;
+            }
+        }
+    }
+    
+    return false;
+}
+
+static void pool_offer(struct pool_job *job, uint32_t distance, size_t slot)
+{
+    uint64_t candidate = ((uint64_t)distance << 32) | (uint32_t)slot;
+    uint64_t best = __atomic_load_n(&job->best, __ATOMIC_RELAXED);
+    
+    while (candidate < best &&
+           !__atomic_compare_exchange_n(&job->best, &best, candidate, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    
+    if (distance <= job->stop_distance) {
+        __atomic_store_n(&job->stop, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void pool_participate(struct pool_job *job, int self)
+{
+    uint32_t chunk, distance;
+    size_t begin, end, slot;
+    
+    while (!__atomic_load_n(&job->stop, __ATOMIC_RELAXED)) {
+        if (!pool_pop(&job->queues[self], &chunk) && !pool_steal(job, self, &chunk)) {
+            break;
+        }
+    
+        begin = (size_t)chunk * POOL_CHUNK_TEMPLATES;
+        end = begin + POOL_CHUNK_TEMPLATES < job->count ?
+              begin + POOL_CHUNK_TEMPLATES : job->count;
+    
+        slot = fp_xiaomi_gallery_scan(job->gallery, job->probe, begin, end,
+                                      job->stop_distance, &distance);
+        if (slot != end) {
+            pool_offer(job, distance, slot);
+        }
+    }
+}
+
+static void *pool_worker(void *arg)
+{
+    int self = (int)(intptr_t)arg;
+    uint64_t seen = pool.start_generation;
+    struct pool_job *job;
+    
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.shutdown && pool.generation == seen) {
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        }
+        if (pool.shutdown) {
+            pthread_mutex_unlock(&pool.lock);
+            return NULL;
+        }
+        seen = pool.generation;
+        job = pool.job;
+        pthread_mutex_unlock(&pool.lock);
+    
+        pool_participate(job, self);
+    
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.active == 0) {
+            pthread_cond_signal(&pool.idle);
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+/* Start the workers; caller holds submit_lock */
+static void pool_start(void)
+{
+    long cpus;
+    int want;
+    
+    if (pool.started) {
+        return;
+    }
+    
+    if (pool.requested) {
+        want = (int)pool.requested - 1;
+    } else {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        want = cpus > 1 ? (int)cpus - 1 : 0;
+    }
+    if (want > POOL_MAX_THREADS) {
+        want = POOL_MAX_THREADS;
+    }
+    
+    pool.shutdown = false;
+    pool.start_generation = pool.generation;
+    for (pool.nthreads = 0; pool.nthreads < want; pool.nthreads++) {
+        if (pthread_create(&pool.threads[pool.nthreads], NULL, pool_worker,
+                           (void *)(intptr_t)pool.nthreads) != 0) {
+            break;
+        }
+    }
+    
+    pool.started = true;
+}
+
+/* Stop the workers; caller holds submit_lock */
+static void pool_stop(void)
+{
+    int i;
+    
+    if (!pool.started) {
+        return;
+    }
+    
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = true;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    
+    for (i = 0; i < pool.nthreads; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    
+    pool.nthreads = 0;
+    pool.started = false;
+}
+
+size_t fp_xiaomi_pool_scan(const struct fp_xiaomi_gallery *gallery,
+                           const fp_xiaomi_template_t *probe,
+                           uint32_t stop_distance, uint32_t *distance)
+{
+    struct pool_job *job;
+    size_t chunks, per, slot;
+    int i;
+    
+    if (gallery->count < POOL_MIN_TEMPLATES) {
+        return fp_xiaomi_gallery_scan(gallery, probe, 0, gallery->count,
+                                      stop_distance, distance);
+    }
+    
+    pthread_mutex_lock(&pool.submit_lock);
+    pool_start();
+    
+    job = NULL;
+    if (pool.nthreads > 0 && posix_memalign((void **)&job, POOL_CACHE_LINE, sizeof(*job)) != 0) {
+        job = NULL;
+    }
+    if (!job) {
+        pthread_mutex_unlock(&pool.submit_lock);
+        return fp_xiaomi_gallery_scan(gallery, probe, 0, gallery->count,
+                                      stop_distance, distance);
+    }
+    
+    memset(job, 0, sizeof(*job));
+    job->gallery = gallery;
+    job->probe = probe;
+    job->stop_distance = stop_distance;
+    job->count = gallery->count;
+    job->participants = pool.nthreads + 1;
+    job->best = UINT64_MAX;
+    
+    /* Deal contiguous chunk ranges so each queue streams its own arena span */
+    chunks = (gallery->count + POOL_CHUNK_TEMPLATES - 1) / POOL_CHUNK_TEMPLATES;
+    per = chunks / job->participants;
+    for (i = 0; i < job->participants; i++) {
+        size_t begin = i * per + ((size_t)i < chunks % job->participants ? (size_t)i :
+                                  chunks % job->participants);
+        size_t end = begin + per + ((size_t)i < chunks % job->participants ? 1 : 0);
+        job->queues[i].range = POOL_PACK(begin, end);
+    }
+    
+    pthread_mutex_lock(&pool.lock);
+    pool.job = job;
+    pool.active = pool.nthreads;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    
+    /* The caller's queue is the last one */
+    pool_participate(job, pool.nthreads);
+    
+    pthread_mutex_lock(&pool.lock);
+    while (pool.active > 0) {
+        pthread_cond_wait(&pool.idle, &pool.lock);
+    }
+    pool.job = NULL;
+    pthread_mutex_unlock(&pool.lock);
+    
+    pthread_mutex_unlock(&pool.submit_lock);
+    
+    if (job->best == UINT64_MAX) {
+        slot = gallery->count;
+        *distance = UINT32_MAX;
+    } else {
+        slot = (uint32_t)job->best;
+        *distance = (uint32_t)(job->best >> 32);
+    }
+    
+    free(job);
+    return slot;
+}
+
+void fp_xiaomi_pool_shutdown(void)
+{
+    pthread_mutex_lock(&pool.submit_lock);
+    pool_stop();
+    pthread_mutex_unlock(&pool.submit_lock);
+}
+
+/**
+ * Set matcher thread count
+ */
+int fp_xiaomi_set_match_threads(size_t threads)
+{
+    if (threads > POOL_MAX_THREADS + 1) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    pthread_mutex_lock(&pool.submit_lock);
+    pool_stop();
+    pool.requested = threads;
+    pthread_mutex_unlock(&pool.submit_lock);
+    
+    return FP_XIAOMI_SUCCESS;
+}
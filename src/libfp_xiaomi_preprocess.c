@@ -0,0 +1,1113 @@
+/**
+ * @file libfp_xiaomi_preprocess.c
+ * @brief Image preprocessing and quality estimation for libfp_xiaomi
+ * @author Project contributors
+ * @version 1.0.0
+ *
+ * Turns raw GRAY8 captures into normalized, ridge-enhanced images and
+ * scores them. The image is processed in a single pass down its rows,
+ * each stage consuming rows as soon as the previous one has produced
+ * them:
+ *
+ *  1. normalize - subtract the local background (mean over a
+ *     (2 * PP_RADIUS + 1)^2 window kept as running column sums) and
+ *     scale by the local standard deviation
+ *  2. tensor    - Sobel gradients of the normalized rows, summed into a
+ *     structure tensor per PP_BLOCK x PP_BLOCK block; a finished block
+ *     row yields ridge orientation, coherence and the foreground mask
+ *  3. enhance   - an even Gabor filter tuned to each block's orientation,
+ *     written back in place once no earlier stage needs the raw rows
+ *
+ * Quality needs only the first two stages, so the quality-only path
+ * leaves the image untouched. The hot row kernels are picked once at
+ * runtime: AVX2 or SSE2 on x86, NEON on ARM, scalar otherwise. Results
+ * may differ by one gray level between kernels due to rounding.
+ *
+ * @copyright GPL v2 License
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FP_PP_HAVE_SSE2 1
+#define FP_PP_HAVE_AVX2 1
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define FP_PP_HAVE_NEON 1
+#endif
+
+#include "libfp_xiaomi.h"
+#include "libfp_xiaomi_private.h"
+
+#define PP_BLOCK            16      /* Orientation/quality block; the SIMD tensor kernels assume 16 */
+#define PP_RADIUS           8       /* Background window radius */
+#define PP_TAPS             9       /* Gabor kernel is PP_TAPS x PP_TAPS */
+#define PP_HALF             (PP_TAPS / 2)
+#define PP_PAD              PP_HALF /* Replicated border on each normalized row */
+#define PP_ORIENTATIONS     16
+#define PP_BACKGROUND       0xff    /* Orientation value of background blocks */
+
+#define PP_NORM_GAIN        40.0f   /* Output gray levels per local standard deviation */
+#define PP_NORM_EPS         16.0f   /* Variance floor, keeps flat areas from being amplified */
+#define PP_RIDGE_PERIOD     9.0f    /* Ridge spacing in pixels at ~500 dpi */
+#define PP_SIGMA_ACROSS     2.5f
+#define PP_SIGMA_ALONG      3.0f
+#define PP_ENHANCE_GAIN     1.5f
+#define PP_FOREGROUND_STD   6.0f    /* Raw standard deviation below which a block is background */
+#define PP_COHERENCE_GOOD   0.7f    /* Coherence scored as a perfect block */
+
+typedef void (*colsum_fn)(uint16_t *sum, uint32_t *sq, const uint8_t *add,
+                          const uint8_t *sub, size_t n);
+typedef void (*normalize_fn)(uint8_t *out, const uint8_t *in, const uint32_t *sum,
+                             const uint32_t *sq, size_t n, float inv_area);
+typedef void (*tensor_fn)(const uint8_t *r0, const uint8_t *r1, const uint8_t *r2,
+                          size_t n, int64_t (*acc)[3]);
+typedef void (*gabor_fn)(uint8_t *out, const uint8_t *const *rows, const float *kernel,
+                         size_t n);
+
+static struct {
+    const char *name;
+    colsum_fn colsum;
+    normalize_fn normalize;
+    tensor_fn tensor;
+    gabor_fn gabor;
+} kernels;
+
+static float gabor_bank[PP_ORIENTATIONS][PP_TAPS * PP_TAPS];
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Per-thread scratch for the pipeline buffers, kept between calls so a
+ * steady capture loop does not allocate. It only grows, and is freed
+ * when the thread exits.
+ */
+#define PP_SCRATCH_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+struct pp_workspace {
+    size_t capacity;
+    unsigned char *base;
+};
+
+static pthread_key_t workspace_key;
+static pthread_once_t workspace_once = PTHREAD_ONCE_INIT;
+static bool workspace_ready;
+
+/* Per-call pipeline state */
+struct pp_state {
+    const uint8_t *src;
+    uint8_t *dst;               /* NULL when only estimating quality */
+    bool enhance;
+    size_t width;
+    size_t height;
+    size_t stride;              /* Normalized row pitch, PP_PAD on each side */
+    size_t blocks_x;
+    size_t blocks_y;
+    size_t next_emit;           /* Next block row to write back */
+    uint8_t *norm;
+    uint16_t *col_sum;
+    uint32_t *col_sq;
+    uint32_t *box_sum;
+    uint32_t *box_sq;
+    int64_t (*tensor)[3];       /* Gxx, Gyy, Gxy of the block row being summed */
+    float *block_std;           /* Raw standard deviation at each block centre */
+    uint8_t *orient;            /* blocks_x * blocks_y orientations or PP_BACKGROUND */
+    float score;                /* Sum of per-block quality */
+    unsigned char *scratch;     /* Backing store of the buffers above */
+    bool scratch_owned;         /* Not the thread's workspace; free after the call */
+};
+
+static inline size_t clamp_index(ptrdiff_t i, size_t n)
+{
+    if (i < 0) {
+        return 0;
+    }
+    return (size_t)i >= n ? n - 1 : (size_t)i;
+}
+
+static inline uint8_t clamp_pixel(float v)
+{
+    if (v <= 0.0f) {
+        return 0;
+    }
+    return v >= 255.0f ? 255 : (uint8_t)(v + 0.5f);
+}
+
+/* Portable kernels */
+
+static void colsum_scalar(uint16_t *sum, uint32_t *sq, const uint8_t *add,
+                          const uint8_t *sub, size_t n)
+{
+    size_t i;
+    
+    for (i = 0; i < n; i++) {
+        sum[i] += add[i] - sub[i];
+        sq[i] += (uint32_t)add[i] * add[i] - (uint32_t)sub[i] * sub[i];
+    }
+}
+
+static void normalize_scalar(uint8_t *out, const uint8_t *in, const uint32_t *sum,
+                             const uint32_t *sq, size_t n, float inv_area)
+{
+    float mean, var;
+    size_t i;
+    
+    for (i = 0; i < n; i++) {
+        mean = sum[i] * inv_area;
+        var = sq[i] * inv_area - mean * mean;
+        if (var < 0.0f) {
+            var = 0.0f;
+        }
+        out[i] = clamp_pixel(128.0f + (in[i] - mean) * PP_NORM_GAIN / sqrtf(var + PP_NORM_EPS));
+    }
+}
+
+/* Rows carry a replicated border, so x - 1 and x + 1 are always readable */
+static void tensor_range(const uint8_t *r0, const uint8_t *r1, const uint8_t *r2,
+                         size_t begin, size_t end, int64_t (*acc)[3])
+{
+    const uint8_t *p0, *p1, *p2;
+    int gx, gy;
+    size_t x;
+    
+    for (x = begin; x < end; x++) {
+        p0 = r0 + x;
+        p1 = r1 + x;
+        p2 = r2 + x;
+        gx = (p0[1] - p0[-1]) + 2 * (p1[1] - p1[-1]) + (p2[1] - p2[-1]);
+        gy = (p2[-1] + 2 * p2[0] + p2[1]) - (p0[-1] + 2 * p0[0] + p0[1]);
+        acc[x / PP_BLOCK][0] += gx * gx;
+        acc[x / PP_BLOCK][1] += gy * gy;
+        acc[x / PP_BLOCK][2] += gx * gy;
+    }
+}
+
+static void tensor_scalar(const uint8_t *r0, const uint8_t *r1, const uint8_t *r2,
+                          size_t n, int64_t (*acc)[3])
+{
+    tensor_range(r0, r1, r2, 0, n, acc);
+}
+
+static void gabor_range(uint8_t *out, const uint8_t *const *rows, const float *kernel,
+                        size_t begin, size_t end)
+{
+    const uint8_t *p;
+    float acc;
+    size_t x;
+    int r, c;
+    
+    for (x = begin; x < end; x++) {
+        acc = 128.0f;
+        for (r = 0; r < PP_TAPS; r++) {
+            p = rows[r] + x - PP_HALF;
+            for (c = 0; c < PP_TAPS; c++) {
+                acc += kernel[r * PP_TAPS + c] * p[c];
+            }
+        }
+        out[x] = clamp_pixel(acc);
+    }
+}
+
+static void gabor_scalar(uint8_t *out, const uint8_t *const *rows, const float *kernel,
+                         size_t n)
+{
+    gabor_range(out, rows, kernel, 0, n);
+}
+
+#ifdef FP_PP_HAVE_SSE2
+__attribute__((target("sse2")))
+static inline __m128i widen8_sse2(const uint8_t *p)
+{
+    return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p), _mm_setzero_si128());
+}
+
+__attribute__((target("sse2")))
+static inline __m128 load4_sse2(const uint8_t *p)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int32_t word;
+    
+    memcpy(&word, p, sizeof(word));
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(word), zero),
+                                              zero));
+}
+
+__attribute__((target("sse2")))
+static inline void store4_sse2(uint8_t *out, __m128 v)
+{
+    __m128i q = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()),
+                                           _mm_set1_ps(255.0f)));
+    int32_t word;
+    
+    q = _mm_packs_epi32(q, q);
+    word = _mm_cvtsi128_si32(_mm_packus_epi16(q, q));
+    memcpy(out, &word, sizeof(word));
+}
+
+__attribute__((target("sse2")))
+static inline int32_t hsum_sse2(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0x4e));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0xb1));
+    return _mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("sse2")))
+static void colsum_sse2(uint16_t *sum, uint32_t *sq, const uint8_t *add,
+                        const uint8_t *sub, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a, b, a2, b2, s;
+    size_t i = 0;
+    
+    for (; i + 8 <= n; i += 8) {
+        a = widen8_sse2(add + i);
+        b = widen8_sse2(sub + i);
+        s = _mm_loadu_si128((const __m128i *)(sum + i));
+        _mm_storeu_si128((__m128i *)(sum + i), _mm_add_epi16(_mm_sub_epi16(s, b), a));
+    
+        /* 255^2 still fits an unsigned 16-bit lane */
+        a2 = _mm_mullo_epi16(a, a);
+        b2 = _mm_mullo_epi16(b, b);
+        s = _mm_loadu_si128((const __m128i *)(sq + i));
+        s = _mm_add_epi32(s, _mm_sub_epi32(_mm_unpacklo_epi16(a2, zero),
+                                           _mm_unpacklo_epi16(b2, zero)));
+        _mm_storeu_si128((__m128i *)(sq + i), s);
+        s = _mm_loadu_si128((const __m128i *)(sq + i + 4));
+        s = _mm_add_epi32(s, _mm_sub_epi32(_mm_unpackhi_epi16(a2, zero),
+                                           _mm_unpackhi_epi16(b2, zero)));
+        _mm_storeu_si128((__m128i *)(sq + i + 4), s);
+    }
+    
+    colsum_scalar(sum + i, sq + i, add + i, sub + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void normalize_sse2(uint8_t *out, const uint8_t *in, const uint32_t *sum,
+                           const uint32_t *sq, size_t n, float inv_area)
+{
+    const __m128 inv = _mm_set1_ps(inv_area);
+    __m128 mean, var, v;
+    size_t i = 0;
+    
+    for (; i + 4 <= n; i += 4) {
+        mean = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(sum + i))), inv);
+        var = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(sq + i))), inv);
+        var = _mm_max_ps(_mm_sub_ps(var, _mm_mul_ps(mean, mean)), _mm_setzero_ps());
+        v = _mm_mul_ps(_mm_sub_ps(load4_sse2(in + i), mean), _mm_set1_ps(PP_NORM_GAIN));
+        v = _mm_div_ps(v, _mm_sqrt_ps(_mm_add_ps(var, _mm_set1_ps(PP_NORM_EPS))));
+        store4_sse2(out + i, _mm_add_ps(v, _mm_set1_ps(128.0f)));
+    }
+    
+    normalize_scalar(out + i, in + i, sum + i, sq + i, n - i, inv_area);
+}
+
+__attribute__((target("sse2")))
+static void tensor_sse2(const uint8_t *r0, const uint8_t *r1, const uint8_t *r2,
+                        size_t n, int64_t (*acc)[3])
+{
+    const size_t blocks = n / PP_BLOCK;
+    __m128i xx, yy, xy, gx, gy;
+    size_t b, x, half;
+    
+    for (b = 0; b < blocks; b++) {
+        xx = yy = xy = _mm_setzero_si128();
+        for (half = 0; half < 2; half++) {
+            x = b * PP_BLOCK + half * 8;
+            gx = _mm_add_epi16(_mm_sub_epi16(widen8_sse2(r0 + x + 1), widen8_sse2(r0 + x - 1)),
+                               _mm_sub_epi16(widen8_sse2(r2 + x + 1), widen8_sse2(r2 + x - 1)));
+            gx = _mm_add_epi16(gx, _mm_slli_epi16(_mm_sub_epi16(widen8_sse2(r1 + x + 1),
+                                                                widen8_sse2(r1 + x - 1)), 1));
+            gy = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(widen8_sse2(r2 + x - 1),
+                                                           widen8_sse2(r2 + x + 1)),
+                                             _mm_slli_epi16(widen8_sse2(r2 + x), 1)),
+                               _mm_add_epi16(_mm_add_epi16(widen8_sse2(r0 + x - 1),
+                                                           widen8_sse2(r0 + x + 1)),
+                                             _mm_slli_epi16(widen8_sse2(r0 + x), 1)));
+            xx = _mm_add_epi32(xx, _mm_madd_epi16(gx, gx));
+            yy = _mm_add_epi32(yy, _mm_madd_epi16(gy, gy));
+            xy = _mm_add_epi32(xy, _mm_madd_epi16(gx, gy));
+        }
+        acc[b][0] += hsum_sse2(xx);
+        acc[b][1] += hsum_sse2(yy);
+        acc[b][2] += hsum_sse2(xy);
+    }
+    
+    tensor_range(r0, r1, r2, blocks * PP_BLOCK, n, acc);
+}
+
+__attribute__((target("sse2")))
+static void gabor_sse2(uint8_t *out, const uint8_t *const *rows, const float *kernel,
+                       size_t n)
+{
+    const uint8_t *p;
+    __m128 acc;
+    size_t x = 0;
+    int r, c;
+    
+    for (; x + 4 <= n; x += 4) {
+        acc = _mm_set1_ps(128.0f);
+        for (r = 0; r < PP_TAPS; r++) {
+            p = rows[r] + x - PP_HALF;
+            for (c = 0; c < PP_TAPS; c++) {
+                acc = _mm_add_ps(acc, _mm_mul_ps(load4_sse2(p + c),
+                                                 _mm_set1_ps(kernel[r * PP_TAPS + c])));
+            }
+        }
+        store4_sse2(out + x, acc);
+    }
+    
+    gabor_range(out, rows, kernel, x, n);
+}
+#endif
+
+#ifdef FP_PP_HAVE_AVX2
+__attribute__((target("avx2")))
+static inline __m256i widen16_avx2(const uint8_t *p)
+{
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)p));
+}
+
+__attribute__((target("avx2")))
+static inline __m256 load8_avx2(const uint8_t *p)
+{
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)p)));
+}
+
+/* Pack within each 128-bit lane, then gather the two low dwords */
+__attribute__((target("avx2")))
+static inline void store8_avx2(uint8_t *out, __m256 v)
+{
+    __m256i q = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()),
+                                                 _mm256_set1_ps(255.0f)));
+    
+    q = _mm256_packs_epi32(q, q);
+    q = _mm256_packus_epi16(q, q);
+    q = _mm256_permutevar8x32_epi32(q, _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0));
+    _mm_storel_epi64((__m128i *)out, _mm256_castsi256_si128(q));
+}
+
+__attribute__((target("avx2")))
+static inline int32_t hsum_avx2(__m256i v)
+{
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+    return _mm_cvtsi128_si32(s);
+}
+
+__attribute__((target("avx2")))
+static void colsum_avx2(uint16_t *sum, uint32_t *sq, const uint8_t *add,
+                        const uint8_t *sub, size_t n)
+{
+    __m256i a, b, a2, b2, s;
+    size_t i = 0;
+    
+    for (; i + 16 <= n; i += 16) {
+        a = widen16_avx2(add + i);
+        b = widen16_avx2(sub + i);
+        s = _mm256_loadu_si256((const __m256i *)(sum + i));
+        _mm256_storeu_si256((__m256i *)(sum + i), _mm256_add_epi16(_mm256_sub_epi16(s, b), a));
+    
+        a2 = _mm256_mullo_epi16(a, a);
+        b2 = _mm256_mullo_epi16(b, b);
+        s = _mm256_loadu_si256((const __m256i *)(sq + i));
+        s = _mm256_add_epi32(s, _mm256_sub_epi32(
+                _mm256_cvtepu16_epi32(_mm256_castsi256_si128(a2)),
+                _mm256_cvtepu16_epi32(_mm256_castsi256_si128(b2))));
+        _mm256_storeu_si256((__m256i *)(sq + i), s);
+        s = _mm256_loadu_si256((const __m256i *)(sq + i + 8));
+        s = _mm256_add_epi32(s, _mm256_sub_epi32(
+                _mm256_cvtepu16_epi32(_mm256_extracti128_si256(a2, 1)),
+                _mm256_cvtepu16_epi32(_mm256_extracti128_si256(b2, 1))));
+        _mm256_storeu_si256((__m256i *)(sq + i + 8), s);
+    }
+    
+    colsum_scalar(sum + i, sq + i, add + i, sub + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void normalize_avx2(uint8_t *out, const uint8_t *in, const uint32_t *sum,
+                           const uint32_t *sq, size_t n, float inv_area)
+{
+    const __m256 inv = _mm256_set1_ps(inv_area);
+    __m256 mean, var, v;
+    size_t i = 0;
+    
+    for (; i + 8 <= n; i += 8) {
+        mean = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(sum + i))),
+                             inv);
+        var = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(sq + i))),
+                            inv);
+        var = _mm256_max_ps(_mm256_sub_ps(var, _mm256_mul_ps(mean, mean)), _mm256_setzero_ps());
+        v = _mm256_mul_ps(_mm256_sub_ps(load8_avx2(in + i), mean), _mm256_set1_ps(PP_NORM_GAIN));
+        v = _mm256_div_ps(v, _mm256_sqrt_ps(_mm256_add_ps(var, _mm256_set1_ps(PP_NORM_EPS))));
+        store8_avx2(out + i, _mm256_add_ps(v, _mm256_set1_ps(128.0f)));
+    }
+    
+    normalize_scalar(out + i, in + i, sum + i, sq + i, n - i, inv_area);
+}
+
+__attribute__((target("avx2")))
+static void tensor_avx2(const uint8_t *r0, const uint8_t *r1, const uint8_t *r2,
+                        size_t n, int64_t (*acc)[3])
+{
+    const size_t blocks = n / PP_BLOCK;
+    __m256i gx, gy;
+    size_t b, x;
+    
+    for (b = 0; b < blocks; b++) {
+        x = b * PP_BLOCK;
+        gx = _mm256_add_epi16(_mm256_sub_epi16(widen16_avx2(r0 + x + 1), widen16_avx2(r0 + x - 1)),
+                              _mm256_sub_epi16(widen16_avx2(r2 + x + 1), widen16_avx2(r2 + x - 1)));
+        gx = _mm256_add_epi16(gx, _mm256_slli_epi16(_mm256_sub_epi16(widen16_avx2(r1 + x + 1),
+                                                                     widen16_avx2(r1 + x - 1)), 1));
+        gy = _mm256_sub_epi16(_mm256_add_epi16(_mm256_add_epi16(widen16_avx2(r2 + x - 1),
+                                                                widen16_avx2(r2 + x + 1)),
+                                               _mm256_slli_epi16(widen16_avx2(r2 + x), 1)),
+                              _mm256_add_epi16(_mm256_add_epi16(widen16_avx2(r0 + x - 1),
+                                                                widen16_avx2(r0 + x + 1)),
+                                               _mm256_slli_epi16(widen16_avx2(r0 + x), 1)));
+        acc[b][0] += hsum_avx2(_mm256_madd_epi16(gx, gx));
+        acc[b][1] += hsum_avx2(_mm256_madd_epi16(gy, gy));
+        acc[b][2] += hsum_avx2(_mm256_madd_epi16(gx, gy));
+    }
+    
+    tensor_range(r0, r1, r2, blocks * PP_BLOCK, n, acc);
+}
+
+__attribute__((target("avx2")))
+static void gabor_avx2(uint8_t *out, const uint8_t *const *rows, const float *kernel,
+                       size_t n)
+{
+    const uint8_t *p;
+    __m256 acc;
+    size_t x = 0;
+    int r, c;
+    
+    for (; x + 8 <= n; x += 8) {
+        acc = _mm256_set1_ps(128.0f);
+        for (r = 0; r < PP_TAPS; r++) {
+            p = rows[r] + x - PP_HALF;
+            for (c = 0; c < PP_TAPS; c++) {
+                acc = _mm256_add_ps(acc, _mm256_mul_ps(load8_avx2(p + c),
+                                                       _mm256_set1_ps(kernel[r * PP_TAPS + c])));
+            }
+        }
+        store8_avx2(out + x, acc);
+    }
+    
+    gabor_range(out, rows, kernel, x, n);
+}
+#endif
+
+#ifdef FP_PP_HAVE_NEON
+static inline int16x8_t widen8_neon(const uint8_t *p)
+{
+    return vreinterpretq_s16_u16(vmovl_u8(vld1_u8(p)));
+}
+
+static inline void load8_neon(const uint8_t *p, float32x4_t *lo, float32x4_t *hi)
+{
+    uint16x8_t w = vmovl_u8(vld1_u8(p));
+    
+    *lo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(w)));
+    *hi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(w)));
+}
+
+static inline uint16x4_t pack4_neon(float32x4_t v)
+{
+    v = vminq_f32(vmaxq_f32(v, vdupq_n_f32(0.0f)), vdupq_n_f32(255.0f));
+    return vmovn_u32(vcvtq_u32_f32(vaddq_f32(v, vdupq_n_f32(0.5f))));
+}
+
+static inline void store8_neon(uint8_t *out, float32x4_t lo, float32x4_t hi)
+{
+    vst1_u8(out, vmovn_u16(vcombine_u16(pack4_neon(lo), pack4_neon(hi))));
+}
+
+/* Estimate plus two Newton steps; ARMv7 has no vector square root */
+static inline float32x4_t rsqrt_neon(float32x4_t x)
+{
+    float32x4_t r = vrsqrteq_f32(x);
+    
+    r = vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(x, r), r));
+    return vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(x, r), r));
+}
+
+static inline float32x4_t normalize4_neon(float32x4_t p, const uint32_t *sum,
+                                          const uint32_t *sq, float inv_area)
+{
+    float32x4_t mean = vmulq_n_f32(vcvtq_f32_u32(vld1q_u32(sum)), inv_area);
+    float32x4_t var = vmulq_n_f32(vcvtq_f32_u32(vld1q_u32(sq)), inv_area);
+    
+    var = vmaxq_f32(vmlsq_f32(var, mean, mean), vdupq_n_f32(0.0f));
+    var = rsqrt_neon(vaddq_f32(var, vdupq_n_f32(PP_NORM_EPS)));
+    return vmlaq_f32(vdupq_n_f32(128.0f), vmulq_n_f32(vsubq_f32(p, mean), PP_NORM_GAIN), var);
+}
+
+static inline int32x4_t sum_squares_neon(int32x4_t acc, int16x8_t a, int16x8_t b)
+{
+    acc = vmlal_s16(acc, vget_low_s16(a), vget_low_s16(b));
+    return vmlal_s16(acc, vget_high_s16(a), vget_high_s16(b));
+}
+
+static inline int64_t hsum_neon(int32x4_t v)
+{
+    int64x2_t s = vpaddlq_s32(v);
+    
+    return vgetq_lane_s64(s, 0) + vgetq_lane_s64(s, 1);
+}
+
+static void colsum_neon(uint16_t *sum, uint32_t *sq, const uint8_t *add,
+                        const uint8_t *sub, size_t n)
+{
+    uint16x8_t a, b;
+    uint32x4_t s;
+    size_t i = 0;
+    
+    for (; i + 8 <= n; i += 8) {
+        a = vmovl_u8(vld1_u8(add + i));
+        b = vmovl_u8(vld1_u8(sub + i));
+        vst1q_u16(sum + i, vaddq_u16(vsubq_u16(vld1q_u16(sum + i), b), a));
+    
+        s = vsubq_u32(vmull_u16(vget_low_u16(a), vget_low_u16(a)),
+                      vmull_u16(vget_low_u16(b), vget_low_u16(b)));
+        vst1q_u32(sq + i, vaddq_u32(vld1q_u32(sq + i), s));
+        s = vsubq_u32(vmull_u16(vget_high_u16(a), vget_high_u16(a)),
+                      vmull_u16(vget_high_u16(b), vget_high_u16(b)));
+        vst1q_u32(sq + i + 4, vaddq_u32(vld1q_u32(sq + i + 4), s));
+    }
+    
+    colsum_scalar(sum + i, sq + i, add + i, sub + i, n - i);
+}
+
+static void normalize_neon(uint8_t *out, const uint8_t *in, const uint32_t *sum,
+                           const uint32_t *sq, size_t n, float inv_area)
+{
+    float32x4_t lo, hi;
+    size_t i = 0;
+    
+    for (; i + 8 <= n; i += 8) {
+        load8_neon(in + i, &lo, &hi);
+        store8_neon(out + i, normalize4_neon(lo, sum + i, sq + i, inv_area),
+                    normalize4_neon(hi, sum + i + 4, sq + i + 4, inv_area));
+    }
+    
+    normalize_scalar(out + i, in + i, sum + i, sq + i, n - i, inv_area);
+}
+
+static void tensor_neon(const uint8_t *r0, const uint8_t *r1, const uint8_t *r2,
+                        size_t n, int64_t (*acc)[3])
+{
+    const size_t blocks = n / PP_BLOCK;
+    int32x4_t xx, yy, xy;
+    int16x8_t gx, gy;
+    size_t b, x, half;
+    
+    for (b = 0; b < blocks; b++) {
+        xx = yy = xy = vdupq_n_s32(0);
+        for (half = 0; half < 2; half++) {
+            x = b * PP_BLOCK + half * 8;
+            gx = vaddq_s16(vsubq_s16(widen8_neon(r0 + x + 1), widen8_neon(r0 + x - 1)),
+                           vsubq_s16(widen8_neon(r2 + x + 1), widen8_neon(r2 + x - 1)));
+            gx = vaddq_s16(gx, vshlq_n_s16(vsubq_s16(widen8_neon(r1 + x + 1),
+                                                     widen8_neon(r1 + x - 1)), 1));
+            gy = vsubq_s16(vaddq_s16(vaddq_s16(widen8_neon(r2 + x - 1), widen8_neon(r2 + x + 1)),
+                                     vshlq_n_s16(widen8_neon(r2 + x), 1)),
+                           vaddq_s16(vaddq_s16(widen8_neon(r0 + x - 1), widen8_neon(r0 + x + 1)),
+                                     vshlq_n_s16(widen8_neon(r0 + x), 1)));
+            xx = sum_squares_neon(xx, gx, gx);
+            yy = sum_squares_neon(yy, gy, gy);
+            xy = sum_squares_neon(xy, gx, gy);
+        }
+        acc[b][0] += hsum_neon(xx);
+        acc[b][1] += hsum_neon(yy);
+        acc[b][2] += hsum_neon(xy);
+    }
+    
+    tensor_range(r0, r1, r2, blocks * PP_BLOCK, n, acc);
+}
+
+static void gabor_neon(uint8_t *out, const uint8_t *const *rows, const float *kernel,
+                       size_t n)
+{
+    float32x4_t acc_lo, acc_hi, lo, hi;
+    const uint8_t *p;
+    size_t x = 0;
+    int r, c;
+    
+    for (; x + 8 <= n; x += 8) {
+        acc_lo = acc_hi = vdupq_n_f32(128.0f);
+        for (r = 0; r < PP_TAPS; r++) {
+            p = rows[r] + x - PP_HALF;
+            for (c = 0; c < PP_TAPS; c++) {
+                load8_neon(p + c, &lo, &hi);
+                acc_lo = vmlaq_n_f32(acc_lo, lo, kernel[r * PP_TAPS + c]);
+                acc_hi = vmlaq_n_f32(acc_hi, hi, kernel[r * PP_TAPS + c]);
+            }
+        }
+        store8_neon(out + x, acc_lo, acc_hi);
+    }
+    
+    gabor_range(out, rows, kernel, x, n);
+}
+#endif
+
+/*
+ * Even Gabor kernels, one per orientation. theta is the gradient
+ * direction (across the ridges); each kernel is made zero-mean so flat
+ * areas map to mid-gray, and scaled so a ridge pattern of the tuned
+ * period passes with PP_ENHANCE_GAIN.
+ */
+static void build_gabor_bank(void)
+{
+    const double pi = 3.14159265358979323846;
+    double theta, u, v, envelope, wave, mean, gain;
+    double taps[PP_TAPS * PP_TAPS];
+    int o, x, y, i;
+    
+    for (o = 0; o < PP_ORIENTATIONS; o++) {
+        theta = pi * o / PP_ORIENTATIONS;
+        mean = 0.0;
+        gain = 0.0;
+        for (y = -PP_HALF; y <= PP_HALF; y++) {
+            for (x = -PP_HALF; x <= PP_HALF; x++) {
+                u = x * cos(theta) + y * sin(theta);
+                v = -x * sin(theta) + y * cos(theta);
+                envelope = exp(-0.5 * (u * u / (PP_SIGMA_ACROSS * PP_SIGMA_ACROSS) +
+                                       v * v / (PP_SIGMA_ALONG * PP_SIGMA_ALONG)));
+                wave = cos(2.0 * pi * u / PP_RIDGE_PERIOD);
+                i = (y + PP_HALF) * PP_TAPS + (x + PP_HALF);
+                taps[i] = envelope * wave;
+                mean += taps[i];
+                gain += envelope * wave * wave;
+            }
+        }
+    
+        mean /= PP_TAPS * PP_TAPS;
+        for (i = 0; i < PP_TAPS * PP_TAPS; i++) {
+            gabor_bank[o][i] = (float)((taps[i] - mean) * PP_ENHANCE_GAIN / gain);
+        }
+    }
+}
+
+static void kernels_scalar(void)
+{
+    kernels.name = "scalar";
+    kernels.colsum = colsum_scalar;
+    kernels.normalize = normalize_scalar;
+    kernels.tensor = tensor_scalar;
+    kernels.gabor = gabor_scalar;
+}
+
+static void kernels_best(void)
+{
+    kernels_scalar();
+    
+#ifdef FP_PP_HAVE_SSE2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        kernels.name = "sse2";
+        kernels.colsum = colsum_sse2;
+        kernels.normalize = normalize_sse2;
+        kernels.tensor = tensor_sse2;
+        kernels.gabor = gabor_sse2;
+    }
+#endif
+    
+#ifdef FP_PP_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.name = "avx2";
+        kernels.colsum = colsum_avx2;
+        kernels.normalize = normalize_avx2;
+        kernels.tensor = tensor_avx2;
+        kernels.gabor = gabor_avx2;
+    }
+#endif
+    
+#ifdef FP_PP_HAVE_NEON
+    kernels.name = "neon";
+    kernels.colsum = colsum_neon;
+    kernels.normalize = normalize_neon;
+    kernels.tensor = tensor_neon;
+    kernels.gabor = gabor_neon;
+#endif
+}
+
+static void kernels_select(void)
+{
+    kernels_best();
+    build_gabor_bank();
+}
+
+static inline const uint8_t *src_row(const struct pp_state *st, size_t y)
+{
+    return st->src + y * st->width;
+}
+
+static inline uint8_t *norm_row(const struct pp_state *st, size_t y)
+{
+    return st->norm + y * st->stride + PP_PAD;
+}
+
+static inline size_t block_rows(const struct pp_state *st, size_t by)
+{
+    size_t left = st->height - by * PP_BLOCK;
+    
+    return left < PP_BLOCK ? left : PP_BLOCK;
+}
+
+static void workspace_free(void *ptr)
+{
+    struct pp_workspace *ws = ptr;
+    
+    free(ws->base);
+    free(ws);
+}
+
+static void workspace_create_key(void)
+{
+    workspace_ready = pthread_key_create(&workspace_key, workspace_free) == 0;
+}
+
+/* At least size bytes of scratch; *owned is set when the caller must free it */
+static unsigned char *workspace_get(size_t size, bool *owned)
+{
+    struct pp_workspace *ws;
+    unsigned char *base;
+    
+    pthread_once(&workspace_once, workspace_create_key);
+    
+    *owned = false;
+    ws = workspace_ready ? pthread_getspecific(workspace_key) : NULL;
+    if (!ws && workspace_ready) {
+        ws = calloc(1, sizeof(*ws));
+        if (ws && pthread_setspecific(workspace_key, ws) != 0) {
+            free(ws);
+            ws = NULL;
+        }
+    }
+    
+    if (!ws) {
+        *owned = true;
+        return malloc(size);
+    }
+    
+    if (ws->capacity < size) {
+        base = realloc(ws->base, size);
+        if (!base) {
+            return NULL;
+        }
+        ws->base = base;
+        ws->capacity = size;
+    }
+    
+    return ws->base;
+}
+
+static void pp_state_free(struct pp_state *st)
+{
+    if (st->scratch_owned) {
+        free(st->scratch);
+    }
+}
+
+static int pp_state_init(struct pp_state *st, fp_xiaomi_image_t *image, uint32_t flags)
+{
+    const size_t w = image->width;
+    const size_t h = image->height;
+    size_t sizes[8], offset, total = 0;
+    ptrdiff_t k;
+    size_t i, x, y;
+    
+    memset(st, 0, sizeof(*st));
+    st->src = image->data;
+    st->dst = (flags & (FP_XIAOMI_PREPROCESS_NORMALIZE | FP_XIAOMI_PREPROCESS_ENHANCE)) ?
+              image->data : NULL;
+    st->enhance = (flags & FP_XIAOMI_PREPROCESS_ENHANCE) != 0;
+    st->width = w;
+    st->height = h;
+    st->stride = w + 2 * PP_PAD;
+    st->blocks_x = (w + PP_BLOCK - 1) / PP_BLOCK;
+    st->blocks_y = (h + PP_BLOCK - 1) / PP_BLOCK;
+    
+    /* Slack after the last normalized row covers the widest vector load */
+    sizes[0] = st->stride * h + 16;
+    sizes[1] = w * sizeof(*st->col_sum);
+    sizes[2] = w * sizeof(*st->col_sq);
+    sizes[3] = w * sizeof(*st->box_sum);
+    sizes[4] = w * sizeof(*st->box_sq);
+    sizes[5] = st->blocks_x * sizeof(*st->tensor);
+    sizes[6] = st->blocks_x * sizeof(*st->block_std);
+    sizes[7] = st->blocks_x * st->blocks_y;
+    for (i = 0; i < 8; i++) {
+        total += PP_SCRATCH_ALIGN(sizes[i]);
+    }
+    
+    st->scratch = workspace_get(total, &st->scratch_owned);
+    if (!st->scratch) {
+        return FP_XIAOMI_ERROR_MEMORY;
+    }
+    
+    offset = 0;
+    st->norm = st->scratch + offset;
+    offset += PP_SCRATCH_ALIGN(sizes[0]);
+    st->col_sum = (uint16_t *)(st->scratch + offset);
+    offset += PP_SCRATCH_ALIGN(sizes[1]);
+    st->col_sq = (uint32_t *)(st->scratch + offset);
+    offset += PP_SCRATCH_ALIGN(sizes[2]);
+    st->box_sum = (uint32_t *)(st->scratch + offset);
+    offset += PP_SCRATCH_ALIGN(sizes[3]);
+    st->box_sq = (uint32_t *)(st->scratch + offset);
+    offset += PP_SCRATCH_ALIGN(sizes[4]);
+    st->tensor = (int64_t (*)[3])(st->scratch + offset);
+    offset += PP_SCRATCH_ALIGN(sizes[5]);
+    st->block_std = (float *)(st->scratch + offset);
+    offset += PP_SCRATCH_ALIGN(sizes[6]);
+    st->orient = st->scratch + offset;
+    
+    memset(st->col_sum, 0, sizes[1]);
+    memset(st->col_sq, 0, sizes[2]);
+    memset(st->tensor, 0, sizes[5]);
+    memset(st->block_std, 0, sizes[6]);
+    
+    /* Window for row 0: rows -PP_RADIUS..PP_RADIUS, clamped to the image */
+    for (k = -PP_RADIUS; k <= PP_RADIUS; k++) {
+        y = clamp_index(k, h);
+        for (x = 0; x < w; x++) {
+            st->col_sum[x] += st->src[y * w + x];
+            st->col_sq[x] += (uint32_t)st->src[y * w + x] * st->src[y * w + x];
+        }
+    }
+    
+    return FP_XIAOMI_SUCCESS;
+}
+
+/* Stage 1: background subtraction and contrast normalization of row y */
+static void stage_normalize(struct pp_state *st, size_t y)
+{
+    const float inv_area = 1.0f / ((2 * PP_RADIUS + 1) * (2 * PP_RADIUS + 1));
+    const size_t w = st->width;
+    const size_t by = y / PP_BLOCK;
+    uint8_t *row = norm_row(st, y);
+    uint32_t sum = 0, sq = 0;
+    size_t add, sub, x, bx, cx;
+    float mean, var;
+    ptrdiff_t k;
+    
+    for (k = -PP_RADIUS; k <= PP_RADIUS; k++) {
+        sum += st->col_sum[clamp_index(k, w)];
+        sq += st->col_sq[clamp_index(k, w)];
+    }
+    for (x = 0; x < w; x++) {
+        st->box_sum[x] = sum;
+        st->box_sq[x] = sq;
+        add = clamp_index((ptrdiff_t)x + PP_RADIUS + 1, w);
+        sub = clamp_index((ptrdiff_t)x - PP_RADIUS, w);
+        sum += st->col_sum[add] - st->col_sum[sub];
+        sq += st->col_sq[add] - st->col_sq[sub];
+    }
+    
+    kernels.normalize(row, src_row(st, y), st->box_sum, st->box_sq, w, inv_area);
+    memset(row - PP_PAD, row[0], PP_PAD);
+    memset(row + w, row[w - 1], PP_PAD);
+    
+    /* The window statistics at each block centre decide foreground */
+    if (y == by * PP_BLOCK + block_rows(st, by) / 2) {
+        for (bx = 0; bx < st->blocks_x; bx++) {
+            cx = bx * PP_BLOCK + (w - bx * PP_BLOCK < PP_BLOCK ? w - bx * PP_BLOCK : PP_BLOCK) / 2;
+            mean = st->box_sum[cx] * inv_area;
+            var = st->box_sq[cx] * inv_area - mean * mean;
+            st->block_std[bx] = var > 0.0f ? sqrtf(var) : 0.0f;
+        }
+    }
+}
+
+/* Orientation, coherence and quality of a finished block row */
+static void finish_block_row(struct pp_state *st, size_t by)
+{
+    const double pi = 3.14159265358979323846;
+    double gxx, gyy, gxy, energy, coherence, theta;
+    uint8_t *orient = st->orient + by * st->blocks_x;
+    size_t bx;
+    
+    for (bx = 0; bx < st->blocks_x; bx++) {
+        gxx = (double)st->tensor[bx][0];
+        gyy = (double)st->tensor[bx][1];
+        gxy = (double)st->tensor[bx][2];
+        energy = gxx + gyy;
+        st->tensor[bx][0] = st->tensor[bx][1] = st->tensor[bx][2] = 0;
+    
+        if (st->block_std[bx] < PP_FOREGROUND_STD || energy <= 0.0) {
+            orient[bx] = PP_BACKGROUND;
+            continue;
+        }
+    
+        coherence = sqrt((gxx - gyy) * (gxx - gyy) + 4.0 * gxy * gxy) / energy;
+        theta = 0.5 * atan2(2.0 * gxy, gxx - gyy);
+        if (theta < 0.0) {
+            theta += pi;
+        }
+        orient[bx] = (uint8_t)((int)lround(theta / pi * PP_ORIENTATIONS) % PP_ORIENTATIONS);
+        st->score += coherence >= PP_COHERENCE_GOOD ? 1.0f : (float)(coherence / PP_COHERENCE_GOOD);
+    }
+}
+
+/* Stage 2: gradients of normalized row y into the block structure tensor */
+static void stage_tensor(struct pp_state *st, size_t y)
+{
+    const size_t by = y / PP_BLOCK;
+    
+    kernels.tensor(norm_row(st, y > 0 ? y - 1 : 0), norm_row(st, y),
+                   norm_row(st, y + 1 < st->height ? y + 1 : y), st->width, st->tensor);
+    
+    if (y == by * PP_BLOCK + block_rows(st, by) - 1) {
+        finish_block_row(st, by);
+    }
+}
+
+/* Stage 3: write block row by back, enhanced or just normalized */
+static void stage_emit(struct pp_state *st, size_t by)
+{
+    const uint8_t *rows[PP_TAPS];
+    const uint8_t *shifted[PP_TAPS];
+    const uint8_t *orient = st->orient + by * st->blocks_x;
+    size_t y, end, bx, x0, n;
+    uint8_t *out;
+    int k;
+    
+    end = by * PP_BLOCK + block_rows(st, by);
+    for (y = by * PP_BLOCK; y < end; y++) {
+        out = st->dst + y * st->width;
+        if (!st->enhance) {
+            memcpy(out, norm_row(st, y), st->width);
+            continue;
+        }
+    
+        for (k = 0; k < PP_TAPS; k++) {
+            rows[k] = norm_row(st, clamp_index((ptrdiff_t)y + k - PP_HALF, st->height));
+        }
+        for (bx = 0; bx < st->blocks_x; bx++) {
+            x0 = bx * PP_BLOCK;
+            n = st->width - x0 < PP_BLOCK ? st->width - x0 : PP_BLOCK;
+            if (orient[bx] == PP_BACKGROUND) {
+                memset(out + x0, 128, n);
+                continue;
+            }
+            for (k = 0; k < PP_TAPS; k++) {
+                shifted[k] = rows[k] + x0;
+            }
+            kernels.gabor(out + x0, shifted, gabor_bank[orient[bx]], n);
+        }
+    }
+}
+
+/*
+ * One pass down the image. Writing back is in place, so block row by is
+ * emitted only once the background window has moved past its last row
+ * (row + PP_RADIUS + 1); by then its orientation is known and the
+ * Gabor rows below it (PP_HALF < PP_RADIUS) are normalized.
+ */
+static void pp_run(struct pp_state *st)
+{
+    const size_t h = st->height;
+    size_t y, last;
+    
+    for (y = 0; y < h; y++) {
+        stage_normalize(st, y);
+        if (y > 0) {
+            stage_tensor(st, y - 1);
+        }
+    
+        while (st->dst && st->next_emit < st->blocks_y) {
+            last = st->next_emit * PP_BLOCK + block_rows(st, st->next_emit) - 1;
+            if (last + PP_RADIUS + 1 > y) {
+                break;
+            }
+            stage_emit(st, st->next_emit++);
+        }
+    
+        if (y + 1 < h) {
+            kernels.colsum(st->col_sum, st->col_sq,
+                           src_row(st, clamp_index((ptrdiff_t)y + 1 + PP_RADIUS, h)),
+                           src_row(st, clamp_index((ptrdiff_t)y - PP_RADIUS, h)), st->width);
+        }
+    }
+    
+    stage_tensor(st, h - 1);
+    while (st->dst && st->next_emit < st->blocks_y) {
+        stage_emit(st, st->next_emit++);
+    }
+}
+
+/**
+ * Preprocess a GRAY8 image in place and estimate its quality
+ */
+int fp_xiaomi_preprocess_image(fp_xiaomi_image_t *image, uint32_t flags)
+{
+    struct pp_state st;
+    int ret;
+    
+    if (!image || !image->data || (flags & ~FP_XIAOMI_PREPROCESS_ALL)) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    if (image->format != FP_XIAOMI_IMG_FORMAT_GRAY8) {
+        return FP_XIAOMI_ERROR_NOT_SUPPORTED;
+    }
+    
+    if (image->width < PP_BLOCK || image->height < PP_BLOCK ||
+        image->size < (uint32_t)image->width * image->height) {
+        errno = EINVAL;
+        return FP_XIAOMI_ERROR_INVALID_PARAM;
+    }
+    
+    pthread_once(&kernels_once, kernels_select);
+    
+    ret = pp_state_init(&st, image, flags);
+    if (ret != FP_XIAOMI_SUCCESS) {
+        return ret;
+    }
+    
+    pp_run(&st);
+    
+    /* Coverage and clarity both count: background blocks score zero */
+    image->quality = (uint8_t)lroundf(100.0f * st.score / (st.blocks_x * st.blocks_y));
+    
+    pp_state_free(&st);
+    return FP_XIAOMI_SUCCESS;
+}
+
+/**
+ * Report the selected preprocessing kernels
+ */
+const char *fp_xiaomi_preprocess_backend(void)
+{
+    pthread_once(&kernels_once, kernels_select);
+    return kernels.name;
+}
+
+/**
+ * Switch between the portable and the best supported kernels
+ */
+const char *fp_xiaomi_preprocess_force_scalar(bool scalar)
+{
+    pthread_once(&kernels_once, kernels_select);
+    
+    if (scalar) {
+        kernels_scalar();
+    } else {
+        kernels_best();
+    }
+    
+    return kernels.name;
+}
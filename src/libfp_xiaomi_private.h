@@ -0,0 +1,153 @@
+/**
+ * @file libfp_xiaomi_private.h
+ * @brief Internal interfaces shared between libfp_xiaomi source files
+ * @author Project contributors
+ * @version 1.0.0
+ *
+ * Not installed; applications use libfp_xiaomi.h only.
+ *
+ * @copyright GPL v2 License
+ */
+
+#ifndef _LIBFP_XIAOMI_PRIVATE_H
+#define _LIBFP_XIAOMI_PRIVATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libfp_xiaomi.h"
+
+/* Alignment of each template in the gallery arena (one AVX2 vector) */
+#define FP_GALLERY_ALIGN 32
+
+/*
+ * Template gallery: per-template fields are parallel arrays indexed by
+ * slot, template bytes live back-to-back in one aligned arena at
+ * offsets[i]. Slots are kept dense; removal compacts both. A gallery
+ * opened from a file points straight into the read-only mapping (map
+ * != NULL) and is copied to the heap on first modification.
+ */
+struct fp_xiaomi_gallery {
+    size_t count;
+    size_t capacity;
+    uint32_t *ids;
+    uint8_t *types;
+    uint8_t *qualities;
+    uint32_t *sizes;
+    uint32_t *offsets;
+    char (*names)[FP_XIAOMI_MAX_NAME_LEN];
+    uint8_t *arena;
+    size_t arena_used;
+    size_t arena_capacity;
+    void *map;
+    size_t map_size;
+};
+
+/**
+ * Count differing bits between two equally sized byte strings
+ * using the best kernel the CPU supports
+ */
+uint32_t fp_xiaomi_hamming(const uint8_t *a, const uint8_t *b, size_t len);
+
+/**
+ * Convert a Hamming distance over len bytes into a 0-100 match score
+ */
+uint8_t fp_xiaomi_hamming_score(uint32_t distance, size_t len);
+
+/**
+ * Largest Hamming distance over len bytes that still scores threshold
+ */
+uint32_t fp_xiaomi_hamming_limit(uint8_t threshold, size_t len);
+
+/**
+ * Scan gallery slots [begin, end) for the closest template to probe,
+ * stopping early at the first one within stop_distance
+ * @return Index of the best slot, or end if none is comparable
+ */
+size_t fp_xiaomi_gallery_scan(const struct fp_xiaomi_gallery *gallery,
+                              const fp_xiaomi_template_t *probe,
+                              size_t begin, size_t end,
+                              uint32_t stop_distance, uint32_t *distance);
+
+/**
+ * Scan a whole gallery on the matcher thread pool (single-threaded for
+ * small galleries); same contract as fp_xiaomi_gallery_scan()
+ */
+size_t fp_xiaomi_pool_scan(const struct fp_xiaomi_gallery *gallery,
+                           const fp_xiaomi_template_t *probe,
+                           uint32_t stop_distance, uint32_t *distance);
+
+/**
+ * Join the matcher threads; the pool restarts on next use
+ */
+void fp_xiaomi_pool_shutdown(void);
+
+/**
+ * Pin the portable preprocessing kernels (scalar true) or go back to the
+ * best ones the CPU supports. For self-tests comparing the two; must not
+ * race with fp_xiaomi_preprocess_image().
+ * @return Name of the kernels now in use
+ */
+const char *fp_xiaomi_preprocess_force_scalar(bool scalar);
+
+struct fp_device_info;
+struct fp_frame_ring;
+struct fp_xiaomi_recorder;
+struct fp_xiaomi_replay;
+
+/**
+ * CLOCK_MONOTONIC in nanoseconds
+ */
+uint64_t fp_xiaomi_monotonic_ns(void);
+
+/**
+ * Start a trace file for a device described by info
+ * @return Recorder or NULL with errno set
+ */
+struct fp_xiaomi_recorder *fp_xiaomi_recorder_open(const char *path,
+                                                   const struct fp_device_info *info);
+
+/**
+ * Append one completed driver call; ring is the mapped frame ring, if any.
+ * Preserves errno.
+ */
+void fp_xiaomi_recorder_add(struct fp_xiaomi_recorder *rec, unsigned long request,
+                            const void *arg, int ret, int err, uint64_t start_ns,
+                            const struct fp_frame_ring *ring);
+
+/**
+ * Flush and close a trace
+ * @return FP_XIAOMI_SUCCESS, or FP_XIAOMI_ERROR_DEVICE if any write failed
+ */
+int fp_xiaomi_recorder_close(struct fp_xiaomi_recorder *rec);
+
+/**
+ * Load a trace for replay; realtime keeps each call's recorded duration
+ * @return Replay or NULL with errno set
+ */
+struct fp_xiaomi_replay *fp_xiaomi_replay_load(const char *path, bool realtime);
+
+/**
+ * Device information recorded in the trace header
+ */
+const struct fp_device_info *fp_xiaomi_replay_info(const struct fp_xiaomi_replay *replay);
+
+/**
+ * Map an empty frame ring for replayed captures to be published into
+ * @return The mapping (release with munmap), or MAP_FAILED
+ */
+struct fp_frame_ring *fp_xiaomi_replay_map_ring(void);
+
+/**
+ * Serve a driver call from the trace, with ioctl() return conventions;
+ * ring-only captures are published into ring
+ */
+int fp_xiaomi_replay_ioctl(struct fp_xiaomi_replay *replay, unsigned long request,
+                           void *arg, struct fp_frame_ring *ring);
+
+/**
+ * Release a loaded trace
+ */
+void fp_xiaomi_replay_free(struct fp_xiaomi_replay *replay);
+
+#endif /* _LIBFP_XIAOMI_PRIVATE_H */
@@ -0,0 +1,589 @@
+/**
+ * @file libfp_xiaomi_replay.c
+ * @brief Driver call recording and replay for libfp_xiaomi
+ * @author Project contributors
+ * @version 1.0.0
+ *
+ * A trace is a header holding the device information, followed by one
+ * record per FP_IOC_* call: the call's outcome and duration, the ioctl
+ * argument as the driver left it, and the bytes the driver wrote behind
+ * its pointers (image, template, batch responses, or the frame ring
+ * slot it published). Everything user space ever sees of the sensor's
+ * bulk traffic passes through one of those, so serving the records back
+ * reproduces a session without the hardware.
+ *
+ * Replay keeps one cursor per request type and wraps around at the end,
+ * so a short recording can drive an arbitrarily long benchmark. Traces
+ * hold native structs and are only portable between hosts of the same
+ * ABI.
+ *
+ * @copyright GPL v2 License
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "libfp_xiaomi.h"
+#include "libfp_xiaomi_private.h"
+#include "fp_xiaomi_driver.h"
+
+#define TRACE_MAGIC           "FPXTRACE"
+#define TRACE_VERSION         1
+
+/* Record flags */
+#define TRACE_RECORD_RING     0x01    /* Capture published to the frame ring */
+
+/* Distinct (request, flags) pairs a replay can serve */
+#define REPLAY_MAX_STREAMS    32
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    struct fp_device_info info;
+};
+
+/*
+ * Followed by arg_size argument bytes, then data_size payload bytes, so
+ * records after the first are not aligned in the file: copy the header
+ * out with replay_record() rather than dereferencing it in place.
+ */
+struct trace_record {
+    uint32_t request;
+    uint32_t flags;
+    int32_t ret;
+    int32_t err;
+    uint32_t arg_size;
+    uint32_t data_size;
+    uint64_t offset_ns;     /* Call start, relative to the start of recording */
+    uint64_t duration_ns;
+};
+
+struct fp_xiaomi_recorder {
+    FILE *file;
+    pthread_mutex_t lock;
+    uint64_t start_ns;
+    bool failed;
+};
+
+struct replay_stream {
+    uint32_t request;
+    uint32_t flags;
+    size_t count;
+    size_t next;
+    const uint8_t **records;    /* Record headers inside the trace buffer */
+};
+
+struct fp_xiaomi_replay {
+    uint8_t *buffer;
+    struct fp_device_info info;
+    bool realtime;
+    pthread_mutex_t lock;
+    size_t stream_count;
+    struct replay_stream streams[REPLAY_MAX_STREAMS];
+};
+
+uint64_t fp_xiaomi_monotonic_ns(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Frame sequence if it is still unread, as slot header plus frame bytes */
+static const struct fp_frame_slot *ring_frame(const struct fp_frame_ring *ring, uint32_t sequence)
+{
+    uint32_t producer = __atomic_load_n(&ring->producer, __ATOMIC_ACQUIRE);
+    uint32_t consumer = ring->consumer;
+    
+    if (sequence - consumer >= producer - consumer) {
+        return NULL;
+    }
+    
+    return (const struct fp_frame_slot *)((const uint8_t *)ring + ring->slot_offset +
+                                          (sequence % ring->slot_count) * ring->slot_stride);
+}
+
+/* Bytes the driver wrote behind the argument's pointers */
+static const void *record_payload(unsigned long request, const void *arg,
+                                  const struct fp_frame_ring *ring, uint32_t *size)
+{
+    const struct fp_image_data *image = arg;
+    const struct fp_template_data *tmpl = arg;
+    const struct fp_batch *batch = arg;
+    const struct fp_frame_slot *slot;
+    
+    *size = 0;
+    
+    switch (request) {
+    case FP_IOC_CAPTURE_IMAGE:
+        if (image->data) {
+            *size = image->size < FP_XIAOMI_MAX_IMAGE_SIZE ? image->size : FP_XIAOMI_MAX_IMAGE_SIZE;
+            return image->data;
+        }
+        slot = ring ? ring_frame(ring, image->sequence) : NULL;
+        if (slot && sizeof(*slot) + slot->size <= ring->slot_stride) {
+            *size = sizeof(*slot) + slot->size;
+        }
+        return slot;
+    
+    case FP_IOC_ENROLL_COMPLETE:
+    case FP_IOC_LOAD_TEMPLATE:
+        if (tmpl->data) {
+            *size = tmpl->size < FP_XIAOMI_MAX_TEMPLATE_SIZE ? tmpl->size : FP_XIAOMI_MAX_TEMPLATE_SIZE;
+        }
+        return tmpl->data;
+    
+    case FP_IOC_SUBMIT_BATCH:
+        *size = batch->responses_len;
+        return (const void *)(uintptr_t)batch->responses;
+    
+    default:
+        return NULL;
+    }
+}
+
+struct fp_xiaomi_recorder *fp_xiaomi_recorder_open(const char *path,
+                                                   const struct fp_device_info *info)
+{
+    struct fp_xiaomi_recorder *rec;
+    struct trace_header header;
+    
+    rec = calloc(1, sizeof(*rec));
+    if (!rec) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    rec->file = fopen(path, "wb");
+    if (!rec->file) {
+        free(rec);
+        return NULL;
+    }
+    
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.header_size = sizeof(header);
+    header.info = *info;
+    
+    if (fwrite(&header, sizeof(header), 1, rec->file) != 1 ||
+        pthread_mutex_init(&rec->lock, NULL) != 0) {
+        fclose(rec->file);
+        free(rec);
+        errno = EIO;
+        return NULL;
+    }
+    
+    rec->start_ns = fp_xiaomi_monotonic_ns();
+    return rec;
+}
+
+void fp_xiaomi_recorder_add(struct fp_xiaomi_recorder *rec, unsigned long request,
+                            const void *arg, int ret, int err, uint64_t start_ns,
+                            const struct fp_frame_ring *ring)
+{
+    struct trace_record record;
+    const void *payload = NULL;
+    int saved_errno = errno;
+    
+    memset(&record, 0, sizeof(record));
+    record.request = (uint32_t)request;
+    record.ret = ret;
+    record.err = ret < 0 ? err : 0;
+    record.arg_size = arg ? _IOC_SIZE(request) : 0;
+    record.offset_ns = start_ns - rec->start_ns;
+    record.duration_ns = fp_xiaomi_monotonic_ns() - start_ns;
+    
+    if (request == FP_IOC_CAPTURE_IMAGE && !((const struct fp_image_data *)arg)->data) {
+        record.flags |= TRACE_RECORD_RING;
+    }
+    if (ret >= 0 && arg) {
+        payload = record_payload(request, arg, ring, &record.data_size);
+    }
+    if (!payload) {
+        record.data_size = 0;
+    }
+    
+    pthread_mutex_lock(&rec->lock);
+    if (!rec->failed &&
+        (fwrite(&record, sizeof(record), 1, rec->file) != 1 ||
+         (record.arg_size && fwrite(arg, record.arg_size, 1, rec->file) != 1) ||
+         (record.data_size && fwrite(payload, record.data_size, 1, rec->file) != 1))) {
+        rec->failed = true;
+    }
+    pthread_mutex_unlock(&rec->lock);
+    
+    errno = saved_errno;
+}
+
+int fp_xiaomi_recorder_close(struct fp_xiaomi_recorder *rec)
+{
+    bool failed;
+    
+    if (!rec) {
+        return FP_XIAOMI_SUCCESS;
+    }
+    
+    failed = rec->failed;
+    if (fclose(rec->file) != 0) {
+        failed = true;
+    }
+    pthread_mutex_destroy(&rec->lock);
+    free(rec);
+    
+    return failed ? FP_XIAOMI_ERROR_DEVICE : FP_XIAOMI_SUCCESS;
+}
+
+static struct replay_stream *replay_stream(struct fp_xiaomi_replay *replay,
+                                           uint32_t request, uint32_t flags)
+{
+    size_t i;
+    
+    for (i = 0; i < replay->stream_count; i++) {
+        if (replay->streams[i].request == request && replay->streams[i].flags == flags) {
+            return &replay->streams[i];
+        }
+    }
+    
+    return NULL;
+}
+
+static void replay_record(const uint8_t *raw, struct trace_record *record)
+{
+    memcpy(record, raw, sizeof(*record));
+}
+
+/* Walk the records; with index set, also file each one under its stream */
+static int replay_scan(struct fp_xiaomi_replay *replay, size_t size, bool index)
+{
+    struct trace_record record;
+    struct replay_stream *stream;
+    const uint8_t *raw;
+    size_t offset = sizeof(struct trace_header);
+    
+    while (offset < size) {
+        if (size - offset < sizeof(record)) {
+            return -1;
+        }
+        raw = replay->buffer + offset;
+        replay_record(raw, &record);
+        offset += sizeof(record);
+    
+        if ((uint64_t)record.arg_size + record.data_size > size - offset ||
+            record.arg_size != _IOC_SIZE(record.request)) {
+            return -1;
+        }
+        offset += record.arg_size + record.data_size;
+    
+        stream = replay_stream(replay, record.request, record.flags);
+        if (!stream) {
+            if (index || replay->stream_count == REPLAY_MAX_STREAMS) {
+                return -1;
+            }
+            stream = &replay->streams[replay->stream_count++];
+            stream->request = record.request;
+            stream->flags = record.flags;
+        }
+    
+        if (index) {
+            stream->records[stream->next++] = raw;
+        } else {
+            stream->count++;
+        }
+    }
+    
+    return 0;
+}
+
+struct fp_xiaomi_replay *fp_xiaomi_replay_load(const char *path, bool realtime)
+{
+    struct fp_xiaomi_replay *replay;
+    struct trace_header header;
+    FILE *file;
+    long size;
+    size_t i;
+    
+    replay = calloc(1, sizeof(*replay));
+    if (!replay) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    file = fopen(path, "rb");
+    if (!file) {
+        free(replay);
+        return NULL;
+    }
+    
+    if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < (long)sizeof(header) ||
+        fseek(file, 0, SEEK_SET) != 0) {
+        goto error_format;
+    }
+    
+    replay->buffer = malloc(size);
+    if (!replay->buffer) {
+        fclose(file);
+        free(replay);
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    if (fread(replay->buffer, size, 1, file) != 1) {
+        goto error_format;
+    }
+    
+    memcpy(&header, replay->buffer, sizeof(header));
+    if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TRACE_VERSION || header.header_size != sizeof(header)) {
+        goto error_format;
+    }
+    
+    /* Count per stream first, then index into exactly sized arrays */
+    if (replay_scan(replay, size, false) != 0) {
+        goto error_format;
+    }
+    for (i = 0; i < replay->stream_count; i++) {
+        replay->streams[i].records = calloc(replay->streams[i].count,
+                                            sizeof(*replay->streams[i].records));
+        if (!replay->streams[i].records) {
+            goto error_format;
+        }
+    }
+    replay_scan(replay, size, true);
+    for (i = 0; i < replay->stream_count; i++) {
+        replay->streams[i].next = 0;
+    }
+    
+    fclose(file);
+    
+    pthread_mutex_init(&replay->lock, NULL);
+    replay->info = header.info;
+    replay->realtime = realtime;
+    return replay;
+    
+error_format:
+    fclose(file);
+    for (i = 0; i < replay->stream_count; i++) {
+        free(replay->streams[i].records);
+    }
+    free(replay->buffer);
+    free(replay);
+    errno = EINVAL;
+    return NULL;
+}
+
+const struct fp_device_info *fp_xiaomi_replay_info(const struct fp_xiaomi_replay *replay)
+{
+    return &replay->info;
+}
+
+struct fp_frame_ring *fp_xiaomi_replay_map_ring(void)
+{
+    struct fp_frame_ring *ring;
+    
+    ring = mmap(NULL, FP_RING_MAP_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    
+    ring->magic = FP_RING_MAGIC;
+    ring->version = FP_RING_VERSION;
+    ring->slot_count = FP_RING_SLOT_COUNT;
+    ring->slot_stride = FP_RING_SLOT_STRIDE;
+    ring->slot_offset = FP_RING_HEADER_SIZE;
+    return ring;
+}
+
+/* Publish a recorded frame the way the driver would; caller holds replay->lock */
+static int replay_publish(struct fp_frame_ring *ring, const uint8_t *data, uint32_t size)
+{
+    struct fp_frame_slot *slot;
+    uint32_t producer = ring->producer;
+    
+    if (producer - __atomic_load_n(&ring->consumer, __ATOMIC_ACQUIRE) >= ring->slot_count) {
+        return -ENOBUFS;
+    }
+    if (size < sizeof(*slot) || size > ring->slot_stride) {
+        return -EPROTO;
+    }
+    
+    slot = (struct fp_frame_slot *)((uint8_t *)ring + ring->slot_offset +
+                                    (producer % ring->slot_count) * ring->slot_stride);
+    memcpy(slot, data, size);
+    slot->sequence = producer;
+    
+    __atomic_store_n(&ring->producer, producer + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Copy the recorded argument back, keeping the caller's own buffers and
+ * never writing more into them than the size they came with
+ */
+static int replay_copy_out(unsigned long request, void *arg, const struct trace_record *record,
+                           const uint8_t *raw, struct fp_frame_ring *ring)
+{
+    const uint8_t *recorded = raw + sizeof(*record);
+    const uint8_t *data = recorded + record->arg_size;
+    struct fp_image_data *image = arg;
+    struct fp_template_data *tmpl = arg;
+    struct fp_batch *batch = arg;
+    uint8_t *buffer;
+    uint64_t responses;
+    uint32_t capacity;
+    
+    switch (request) {
+    case FP_IOC_CAPTURE_IMAGE:
+        buffer = image->data;
+        if (!buffer) {
+            if (!ring) {
+                return -EINVAL;
+            }
+            if (record->ret >= 0) {
+                image->sequence = ring->producer;
+                return replay_publish(ring, data, record->data_size);
+            }
+            return 0;
+        }
+        capacity = image->size;
+        memcpy(image, recorded, sizeof(*image));
+        image->data = buffer;
+        if (image->size > record->data_size) {
+            image->size = record->data_size;
+        }
+        if (capacity && image->size > capacity) {
+            image->size = capacity;
+        }
+        memcpy(buffer, data, image->size);
+        return 0;
+    
+    case FP_IOC_ENROLL_COMPLETE:
+    case FP_IOC_LOAD_TEMPLATE:
+        buffer = tmpl->data;
+        capacity = tmpl->size;
+        memcpy(tmpl, recorded, sizeof(*tmpl));
+        tmpl->data = buffer;
+        if (tmpl->size > record->data_size) {
+            tmpl->size = record->data_size;
+        }
+        if (capacity && tmpl->size > capacity) {
+            tmpl->size = capacity;
+        }
+        if (buffer) {
+            memcpy(buffer, data, tmpl->size);
+        }
+        return 0;
+    
+    case FP_IOC_SUBMIT_BATCH:
+        capacity = batch->responses_len;
+        responses = batch->responses;
+        memcpy(batch, recorded, sizeof(*batch));
+        batch->commands = 0;
+        batch->responses = responses;
+        batch->responses_len = record->data_size < capacity ? record->data_size : capacity;
+        memcpy((void *)(uintptr_t)responses, data, batch->responses_len);
+        return 0;
+    
+    default:
+        if (_IOC_DIR(request) & _IOC_READ) {
+            memcpy(arg, recorded, record->arg_size);
+        }
+        return 0;
+    }
+}
+
+int fp_xiaomi_replay_ioctl(struct fp_xiaomi_replay *replay, unsigned long request,
+                           void *arg, struct fp_frame_ring *ring)
+{
+    struct trace_record record;
+    struct replay_stream *stream;
+    struct timespec deadline;
+    const uint8_t *raw;
+    uint64_t start_ns = fp_xiaomi_monotonic_ns();
+    uint64_t end_ns;
+    uint32_t flags = 0;
+    int ret;
+    
+    if (request == FP_IOC_GET_DEVICE_INFO) {
+        memcpy(arg, &replay->info, sizeof(replay->info));
+        return 0;
+    }
+    if (request == FP_IOC_GET_FINGER_EVENT) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (request == FP_IOC_CANCEL || request == FP_IOC_PREARM) {
+        return 0;
+    }
+    /* Streamed frames come from the driver, not an ioctl, so none are recorded */
+    if (request == FP_IOC_STREAM_START || request == FP_IOC_STREAM_STOP) {
+        errno = ENOTTY;
+        return -1;
+    }
+    
+    if (request == FP_IOC_CAPTURE_IMAGE && !((struct fp_image_data *)arg)->data) {
+        flags |= TRACE_RECORD_RING;
+    }
+    
+    pthread_mutex_lock(&replay->lock);
+    
+    stream = replay_stream(replay, (uint32_t)request, flags);
+    if (!stream) {
+        pthread_mutex_unlock(&replay->lock);
+        errno = ENOTTY;
+        return -1;
+    }
+    
+    raw = stream->records[stream->next];
+    replay_record(raw, &record);
+    stream->next = (stream->next + 1) % stream->count;
+    
+    ret = replay_copy_out(request, arg, &record, raw, ring);
+    
+    pthread_mutex_unlock(&replay->lock);
+    
+    if (replay->realtime) {
+        end_ns = start_ns + record.duration_ns;
+        deadline.tv_sec = (time_t)(end_ns / 1000000000ULL);
+        deadline.tv_nsec = (long)(end_ns % 1000000000ULL);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+        }
+    }
+    
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    if (record.ret < 0) {
+        errno = record.err;
+    }
+    return record.ret;
+}
+
+void fp_xiaomi_replay_free(struct fp_xiaomi_replay *replay)
+{
+    size_t i;
+    
+    if (!replay) {
+        return;
+    }
+    
+    for (i = 0; i < replay->stream_count; i++) {
+        free(replay->streams[i].records);
+    }
+    pthread_mutex_destroy(&replay->lock);
+    free(replay->buffer);
+    free(replay);
+}